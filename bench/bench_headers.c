@@ -0,0 +1,166 @@
+/*! @file
+	Microbenchmark for the big-endian fields of a MIDI file, over a synthetic,
+	header-heavy corpus built in memory: thousands of tiny MTrk chunks, each
+	holding a tempo, a time signature and an SMPTE offset meta event.
+
+	Compares the nibble loop parse_hex_size used to be against
+	midi_bytes_be32, then times index_midi_chunks and the meta decoders.
+
+	Usage: ./bench_headers [number of chunks]
+*/
+
+#include <portable.h>
+#include <stdint.h>
+
+#include "midi_bytes.h"
+#include "midi_parse.h"
+#include "midi_reader.h"
+#include "debug.h"
+
+#define BENCH_REPEAT 200
+#define BENCH_CHUNKS 20000
+
+/*	delta FF 51 03 tt tt tt, delta FF 58 04 nn dd cc bb, delta FF 54 05 hr mn se fr ff,
+	delta FF 2F 00	*/
+static const unsigned char track_body[] =
+{
+	0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,
+	0x00, 0xFF, 0x58, 0x04, 0x06, 0x03, 0x18, 0x08,
+	0x00, 0xFF, 0x54, 0x05, 0x61, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0xFF, 0x2F, 0x00
+};
+
+/*	Offsets of the meta payloads within track_body.	*/
+#define TEMPO_OFFSET 4
+#define TIME_SIGNATURE_OFFSET 11
+#define SMPTE_OFFSET 19
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/*	What parse_hex_size did before midi_bytes.h: one shift per nibble.	*/
+static int nibble_size(const unsigned char * header, int size)
+{
+	int block_size = 0;
+	for (int nibble_pos = 0; nibble_pos < (size * 2); nibble_pos++)
+	{
+		unsigned char nibble = (nibble_pos % 2 == 0) ?
+			(header[(nibble_pos / 2)] >> 4) : (header[(nibble_pos / 2)] & 0x0F);
+		block_size += (nibble << (4 * (7 - nibble_pos)));
+	}
+	return block_size;
+}
+
+static unsigned char * build_corpus(int chunks, size_t * size)
+{
+	*size = 14 + (size_t) chunks * (8 + sizeof(track_body));
+	unsigned char * data = malloc(*size);
+	if (data == NULL)
+	{
+		return NULL;
+	}
+
+	static const unsigned char mthd[14] = {'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 0, 0x01, 0xE0};
+	memcpy(data, mthd, sizeof(mthd));
+	data[10] = (chunks >> 8) & 0xFF;
+	data[11] = chunks & 0xFF;
+
+	unsigned char * pos = data + sizeof(mthd);
+	for (int cntr = 0; cntr < chunks; cntr++)
+	{
+		memcpy(pos, "MTrk", 4);
+		pos[4] = 0;
+		pos[5] = 0;
+		pos[6] = 0;
+		pos[7] = sizeof(track_body);
+		memcpy(pos + 8, track_body, sizeof(track_body));
+		pos += 8 + sizeof(track_body);
+	}
+	return data;
+}
+
+static void report(const char * label, double elapsed, long items, size_t bytes, unsigned long check)
+{
+	printf("%-22s %8ld items %8.2f ns/item %10.2f MB/s   (check %lu)\n",
+		label, items, elapsed / items, bytes / elapsed * 1e3, check);
+}
+
+int main(int argc, char * argv[])
+{
+	/*	index_midi_chunks logs every file it indexes; keep that out of the timings.	*/
+	log_level = LOG_LEVEL_WARN;
+
+	int chunks = (argc > 1) ? atoi(argv[1]) : BENCH_CHUNKS;
+	chunks = (chunks > 0 && chunks <= 0xFFFF) ? chunks : BENCH_CHUNKS;
+
+	size_t size;
+	unsigned char * data = build_corpus(chunks, &size);
+	if (data == NULL)
+	{
+		fprintf(stderr, "Couldn't allocate the corpus\n");
+		return 1;
+	}
+	printf("Corpus: %d chunks, %zu bytes\n", chunks, size);
+
+	/*	The check sums keep the compiler from discarding the work.	*/
+	unsigned long check = 0;
+	double start = now_ns();
+	for (int rep = 0; rep < BENCH_REPEAT; rep++)
+	{
+		for (size_t pos = 14; pos < size; pos += 8 + sizeof(track_body))
+		{
+			check += nibble_size(&data[pos + 4], 4);
+		}
+	}
+	report("nibble loop", (now_ns() - start) / BENCH_REPEAT, chunks, (size_t) chunks * 8, check / BENCH_REPEAT);
+
+	check = 0;
+	start = now_ns();
+	for (int rep = 0; rep < BENCH_REPEAT; rep++)
+	{
+		for (size_t pos = 14; pos < size; pos += 8 + sizeof(track_body))
+		{
+			check += midi_bytes_be32(&data[pos + 4]);
+		}
+	}
+	report("midi_bytes_be32", (now_ns() - start) / BENCH_REPEAT, chunks, (size_t) chunks * 8, check / BENCH_REPEAT);
+
+	check = 0;
+	start = now_ns();
+	for (int rep = 0; rep < BENCH_REPEAT; rep++)
+	{
+		struct MIDIFile midiFile = {0};
+		if (index_midi_chunks(data, size, &midiFile) > 0)
+		{
+			check += midiFile.num_blocks;
+		}
+		free(midiFile.blockArr);
+	}
+	report("index_midi_chunks", (now_ns() - start) / BENCH_REPEAT, chunks + 1, size, check / BENCH_REPEAT);
+
+	check = 0;
+	start = now_ns();
+	for (int rep = 0; rep < BENCH_REPEAT; rep++)
+	{
+		for (size_t pos = 22; pos < size; pos += 8 + sizeof(track_body))
+		{
+			uint32_t usec;
+			struct MIDITimeSignature timeSignature;
+			struct MIDISMPTEOffset offset;
+			check += midi_parse_tempo(&data[pos + TEMPO_OFFSET], 3, &usec) ? usec : 0;
+			check += midi_parse_timeSignature(&data[pos + TIME_SIGNATURE_OFFSET], 4, &timeSignature) ?
+				timeSignature.denominator : 0;
+			check += midi_parse_smpteOffset(&data[pos + SMPTE_OFFSET], 5, &offset) ?
+				(unsigned long) offset.frames_per_second : 0;
+		}
+	}
+	report("meta decoders", (now_ns() - start) / BENCH_REPEAT, (long) chunks * 3, (size_t) chunks * 12,
+		check / BENCH_REPEAT);
+
+	free(data);
+	return 0;
+}
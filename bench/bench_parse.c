@@ -0,0 +1,135 @@
+/*! @file
+	Microbenchmark comparing midi_parse_getEvent against the running-status
+	aware midi_parse_getEventStateful and the bounds-checked
+	midi_parse_nextEvent, over every MTrk of the given files.
+
+	Usage: ./bench_parse file.midi [file.midi ...]
+*/
+
+#include <portable.h>
+#include <stdint.h>
+
+#include "midi_reader.h"
+#include "midi_parse.h"
+
+#define BENCH_REPEAT 2000
+
+/*	Large enough for any sysex in the sample files.	*/
+static unsigned char event_buffer[1 << 16];
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/*	Walks a track the way the playback loop used to: delta-time, then event,
+	until an event can't be decoded. Returns the number of events, and the
+	number of bytes covered through *covered.	*/
+static long walk_plain(struct MIDIBlock * block, long * covered)
+{
+	long events = 0;
+	int pos = 0;
+	while (pos < block->n_data_size)
+	{
+		int delta;
+		int delta_bytes = midi_parse_varSize(&block->data[pos], &delta);
+		if (delta_bytes == 0) break;
+		pos += delta_bytes;
+
+		int event_bytes = midi_parse_getEvent(event_buffer, sizeof(event_buffer), &block->data[pos]);
+		if (event_bytes == 0) break;
+		pos += event_bytes;
+		events++;
+	}
+	*covered = pos;
+	return events;
+}
+
+static long walk_stateful(struct MIDIBlock * block, long * covered)
+{
+	struct MIDIParseState state;
+	midi_parse_initState(&state);
+
+	long events = 0;
+	int pos = 0;
+	while (pos < block->n_data_size)
+	{
+		int delta;
+		int delta_bytes = midi_parse_varSize(&block->data[pos], &delta);
+		if (delta_bytes == 0) break;
+		pos += delta_bytes;
+
+		int consumed;
+		if (midi_parse_getEventStateful(&state, event_buffer, sizeof(event_buffer),
+			&block->data[pos], &consumed) == 0) break;
+		pos += consumed;
+		events++;
+	}
+	*covered = pos;
+	return events;
+}
+
+static long walk_cursor(struct MIDIBlock * block, long * covered)
+{
+	struct MIDIEventCursor cursor;
+	struct MIDIEvent event;
+	midi_parse_initCursor(&cursor, block->data, block->n_data_size);
+
+	long events = 0;
+	while (midi_parse_nextEvent(&cursor, &event) > 0)
+	{
+		events++;
+	}
+	*covered = cursor.pos - cursor.start;
+	return events;
+}
+
+static void bench_file(struct MIDIFile * midiFile, const char * name,
+	long (*walk)(struct MIDIBlock *, long *), const char * label)
+{
+	long events = 0, covered = 0, total = 0;
+
+	double start = now_ns();
+	for (int rep = 0; rep < BENCH_REPEAT; rep++)
+	{
+		events = covered = total = 0;
+		for (int cntr = 0; cntr < midiFile->num_blocks; cntr++)
+		{
+			struct MIDIBlock * block = &(midiFile->blockArr[cntr]);
+			if (strncmp("MTrk", (char *) block->header, 4)) continue;
+
+			long block_covered;
+			events += walk(block, &block_covered);
+			covered += block_covered;
+			total += block->n_data_size;
+		}
+	}
+	double elapsed = (now_ns() - start) / BENCH_REPEAT;
+
+	printf("%-10s %-45s %8ld events %6.1f%% of bytes %8.2f ns/event %8.2f MB/s\n",
+		label, name, events, total ? 100.0 * covered / total : 0.0,
+		events ? elapsed / events : 0.0, covered ? covered / elapsed * 1e3 : 0.0);
+}
+
+int main(int argc, char * argv[])
+{
+	for (int arg = 1; arg < argc; arg++)
+	{
+		int fd = open(argv[arg], O_RDONLY);
+		if (fd < 0)
+		{
+			fprintf(stderr, "Couldn't open %s\n", argv[arg]);
+			continue;
+		}
+		struct MIDIFile midiFile = map_midi_file(fd, NULL);
+		close(fd);
+
+		bench_file(&midiFile, argv[arg], walk_plain, "getEvent");
+		bench_file(&midiFile, argv[arg], walk_stateful, "stateful");
+		bench_file(&midiFile, argv[arg], walk_cursor, "cursor");
+		unmap_midi_file(&midiFile);
+	}
+	return 0;
+}
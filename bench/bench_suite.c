@@ -0,0 +1,247 @@
+/*! @file
+	Benchmark suite: times each stage of reading a MIDI file, for every file
+	given, and reports nanoseconds per event, throughput and allocations.
+
+	load	map_midi_file(): mmap and index the chunks.
+	vlq		midi_vlq_scanTrack() over every MTrk.
+	decode	midi_parse_nextEvent() over every MTrk.
+	analyze	midi_batch_analyzeFile(): load, decode, tempo map and summary,
+			into an arena kept between runs, as a batch worker does.
+	stats	midi_stats_compute() on the decoded file, into the same arena.
+
+	Each stage is repeated until it has run for BENCH_MIN_NS, so small and
+	very large files both get stable numbers. Every malloc(), calloc() and
+	realloc() call is counted (the makefile links this program with
+	--wrap for them), as are arena allocations; both are per run of the
+	stage, once warmed up.
+
+	Usage: ./bench_suite file.midi [file.midi ...]
+*/
+
+#include <portable.h>
+#include <stdint.h>
+
+#include "midi_reader.h"
+#include "midi_parse.h"
+#include "midi_vlq.h"
+#include "midi_arena.h"
+#include "midi_batch.h"
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_stats.h"
+#include "debug.h"
+
+#define BENCH_MIN_NS 2e8
+#define BENCH_MAX_REPEAT 10000
+
+/*	Counted by the wrappers below.	*/
+static unsigned long heap_allocations;
+
+void * __real_malloc(size_t size);
+void * __real_calloc(size_t count, size_t size);
+void * __real_realloc(void * ptr, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&heap_allocations, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t count, size_t size)
+{
+	__atomic_add_fetch(&heap_allocations, 1, __ATOMIC_RELAXED);
+	return __real_calloc(count, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+	__atomic_add_fetch(&heap_allocations, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+}
+
+/*	A file being benchmarked, and the scratch space its stages need.	*/
+struct BenchFile
+{
+	const char *		path;
+	size_t				size;
+	struct MIDIFile		midiFile;		/*!	Indexed once, for the stages after load.	*/
+	long				events;			/*!	Events in every MTrk, found by the decoder.	*/
+	struct MIDITimeline	timeline;		/*!	Decoded once, for the stats stage.	*/
+	struct MIDITempoMap	tempoMap;
+
+	uint32_t *			deltas;			/*!	Output arrays of midi_vlq_scanTrack().	*/
+	uint32_t *			offsets;
+	uint32_t *			lengths;
+	int					max_events;
+
+	struct MIDIArena	arena;
+	char				result[MIDI_BATCH_RESULT_SIZE];
+};
+
+/*	Each stage returns a value that depends on all of its work, so that
+	none of it can be optimized away.	*/
+static long stage_load(struct BenchFile * bench)
+{
+	int fd = open(bench->path, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	long blocks = midiFile.num_blocks;
+	unmap_midi_file(&midiFile);
+	return blocks;
+}
+
+static long stage_vlq(struct BenchFile * bench)
+{
+	long events = 0;
+	for (int cntr = 0; cntr < bench->midiFile.num_blocks; cntr++)
+	{
+		struct MIDIBlock * block = &(bench->midiFile.blockArr[cntr]);
+		if (memcmp(block->header, "MTrk", 4))
+		{
+			continue;
+		}
+		int scanned;
+		events += midi_vlq_scanTrack(block->data, block->n_data_size, bench->deltas, bench->offsets,
+			bench->lengths, bench->max_events, &scanned);
+	}
+	return events;
+}
+
+static long stage_decode(struct BenchFile * bench)
+{
+	long events = 0;
+	for (int cntr = 0; cntr < bench->midiFile.num_blocks; cntr++)
+	{
+		struct MIDIBlock * block = &(bench->midiFile.blockArr[cntr]);
+		if (memcmp(block->header, "MTrk", 4))
+		{
+			continue;
+		}
+		struct MIDIEventCursor cursor;
+		struct MIDIEvent event;
+		midi_parse_initCursor(&cursor, block->data, block->n_data_size);
+		while (midi_parse_nextEvent(&cursor, &event) > 0)
+		{
+			events++;
+		}
+	}
+	return events;
+}
+
+static long stage_analyze(struct BenchFile * bench)
+{
+	return midi_batch_analyzeFile(bench->path, NULL, &(bench->arena), NULL, bench->result,
+		sizeof(bench->result), MIDI_STATS_NONE, NULL);
+}
+
+static long stage_stats(struct BenchFile * bench)
+{
+	struct MIDIArenaMark mark = midi_arena_mark(&(bench->arena));
+	struct MIDIStats stats;
+	midi_stats_compute(&(bench->timeline), &(bench->tempoMap), &(bench->arena), &stats);
+	long check = stats.notes + stats.max_polyphony;
+	midi_stats_free(&stats);
+	midi_arena_release(&(bench->arena), mark);
+	return check;
+}
+
+static void run_stage(struct BenchFile * bench, const char * label, long (*stage)(struct BenchFile *))
+{
+	/*	One run to warm the caches, and the arena, up.	*/
+	long check = stage(bench);
+
+	unsigned long heap_before = heap_allocations;
+	unsigned long arena_before = bench->arena.allocations;
+	long repeat = 0;
+	double start = now_ns(), elapsed;
+	do
+	{
+		check += stage(bench);
+		repeat++;
+		elapsed = now_ns() - start;
+	} while (elapsed < BENCH_MIN_NS && repeat < BENCH_MAX_REPEAT);
+	elapsed /= repeat;
+
+	printf("%-8s %-45s %9ld events %10.2f ns/event %9.2f MB/s %8.1f mallocs %8.1f arena   (check %ld)\n",
+		label, bench->path, bench->events, bench->events ? elapsed / bench->events : 0.0,
+		bench->size / elapsed * 1e3, (double) (heap_allocations - heap_before) / repeat,
+		(double) (bench->arena.allocations - arena_before) / repeat, check / (repeat + 1));
+}
+
+static void bench_file(const char * path)
+{
+	struct BenchFile bench = {0};
+	bench.path = path;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Couldn't open %s\n", path);
+		return;
+	}
+	bench.midiFile = map_midi_file(fd, NULL);
+	close(fd);
+	if (bench.midiFile.num_blocks == 0)
+	{
+		fprintf(stderr, "%s isn't a MIDI file\n", path);
+		return;
+	}
+	bench.size = bench.midiFile.map_size;
+	bench.events = stage_decode(&bench);
+
+	/*	No track holds more events than bytes.	*/
+	for (int cntr = 0; cntr < bench.midiFile.num_blocks; cntr++)
+	{
+		if (bench.midiFile.blockArr[cntr].n_data_size > bench.max_events)
+		{
+			bench.max_events = bench.midiFile.blockArr[cntr].n_data_size;
+		}
+	}
+	bench.deltas = malloc(sizeof(uint32_t) * (bench.max_events + 1));
+	bench.offsets = malloc(sizeof(uint32_t) * (bench.max_events + 1));
+	bench.lengths = malloc(sizeof(uint32_t) * (bench.max_events + 1));
+	midi_arena_init(&(bench.arena), 0);
+
+	if (bench.deltas != NULL && bench.offsets != NULL && bench.lengths != NULL &&
+		midi_timeline_compile(&(bench.midiFile), &(bench.timeline), NULL) >= 0 &&
+		midi_tempo_build(&(bench.midiFile), &(bench.timeline), &(bench.tempoMap)) >= 0)
+	{
+		run_stage(&bench, "load", stage_load);
+		run_stage(&bench, "vlq", stage_vlq);
+		run_stage(&bench, "decode", stage_decode);
+		run_stage(&bench, "analyze", stage_analyze);
+		run_stage(&bench, "stats", stage_stats);
+	}
+
+	midi_tempo_free(&(bench.tempoMap));
+	midi_timeline_free(&(bench.timeline));
+	midi_arena_free(&(bench.arena));
+	free(bench.deltas);
+	free(bench.offsets);
+	free(bench.lengths);
+	unmap_midi_file(&(bench.midiFile));
+}
+
+int main(int argc, char * argv[])
+{
+	/*	Loading a file logs it; keep that out of the timings.	*/
+	log_level = LOG_LEVEL_WARN;
+
+	for (int arg = 1; arg < argc; arg++)
+	{
+		bench_file(argv[arg]);
+	}
+	return 0;
+}
@@ -0,0 +1,254 @@
+/*! @file
+	Synthetic corpus generator: writes a well-formed format 1 MIDI file of
+	roughly the requested size, from a few kilobytes to hundreds of
+	megabytes, for the benchmarks to run on alongside the files in midi/.
+
+	The first track holds the tempo and time signature; the others hold
+	notes, controller changes and pitch bends on their own channel, and an
+	optional sysex message every so many events. --running=P makes about P%
+	of the channel events reuse the previous status byte (running status),
+	so the decoder's two paths can be weighted either way.
+
+	Usage: ./gen_corpus [--size=N[K|M]] [--tracks=N] [--running=P] [--sysex=N]
+		[--sysex-every=N] [--seed=S] output.mid
+*/
+
+#include <portable.h>
+#include <stdint.h>
+
+#define GEN_SIZE (1024 * 1024)
+#define GEN_TRACKS 8
+#define GEN_RUNNING 50
+#define GEN_SYSEX_EVERY 500
+
+static uint32_t rng_state = 0x2545F491;
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/*	Parses a size with an optional K, M or G suffix.	*/
+static uint64_t parse_size(const char * text)
+{
+	char * end;
+	uint64_t size = strtoull(text, &end, 10);
+	switch (*end)
+	{
+		case 'k': case 'K': return size << 10;
+		case 'm': case 'M': return size << 20;
+		case 'g': case 'G': return size << 30;
+	}
+	return size;
+}
+
+static void put_be32(FILE * file, uint32_t value)
+{
+	fputc(value >> 24, file);
+	fputc((value >> 16) & 0xFF, file);
+	fputc((value >> 8) & 0xFF, file);
+	fputc(value & 0xFF, file);
+}
+
+/*	Writes a variable-length quantity. Returns the number of bytes written.	*/
+static int put_vlq(FILE * file, uint32_t value)
+{
+	unsigned char bytes[4];
+	int count = 0;
+	do
+	{
+		bytes[count++] = value & 0x7F;
+		value >>= 7;
+	} while (value && count < 4);
+
+	for (int cntr = count - 1; cntr >= 0; cntr--)
+	{
+		fputc(bytes[cntr] | (cntr ? 0x80 : 0), file);
+	}
+	return count;
+}
+
+/*	Starts an MTrk chunk, with a length to be filled in by end_track().	*/
+static long begin_track(FILE * file)
+{
+	fwrite("MTrk", 1, 4, file);
+	long length_at = ftell(file);
+	put_be32(file, 0);
+	return length_at;
+}
+
+/*	Writes the end of track meta event, then goes back to fill in the
+	length of the chunk. Returns the length.	*/
+static uint32_t end_track(FILE * file, long length_at)
+{
+	fwrite("\x00\xFF\x2F\x00", 1, 4, file);
+	long end = ftell(file);
+	uint32_t length = (uint32_t) (end - length_at - 4);
+	fseek(file, length_at, SEEK_SET);
+	put_be32(file, length);
+	fseek(file, end, SEEK_SET);
+	return length;
+}
+
+struct GenOptions
+{
+	uint64_t	size;
+	int			tracks;
+	int			running;		/*!	Percentage of channel events sent with running status.	*/
+	int			sysex;			/*!	Payload size of each sysex message, or 0 for none.	*/
+	int			sysex_every;	/*!	Channel events between two sysex messages.	*/
+};
+
+/*	Writes one track of channel events on channel (track - 1) % 16, until it
+	holds about budget bytes. Returns the number of events written.	*/
+static long write_track(FILE * file, const struct GenOptions * options, int track, uint64_t budget)
+{
+	static const unsigned char kinds[] = {0x90, 0x90, 0x80, 0xB0, 0xE0};
+
+	int channel = (track - 1) % 16;
+	unsigned char status = 0;
+	long events = 0;
+	uint64_t written = 0;
+
+	while (written < budget)
+	{
+		written += put_vlq(file, (rng() % 4) ? rng() % 96 : 0);
+
+		if (options->sysex > 0 && events % options->sysex_every == options->sysex_every - 1)
+		{
+			/*	Sysex cancels running status.	*/
+			fputc(0xF0, file);
+			written += 1 + put_vlq(file, options->sysex);
+			for (int cntr = 0; cntr < options->sysex - 1; cntr++)
+			{
+				fputc(rng() & 0x7F, file);
+			}
+			fputc(0xF7, file);
+			written += options->sysex;
+			status = 0;
+			events++;
+			continue;
+		}
+
+		if (status == 0 || (int) (rng() % 100) >= options->running)
+		{
+			/*	A different status than the last one, so that the byte is needed.	*/
+			unsigned char next;
+			do
+			{
+				next = kinds[rng() % sizeof(kinds)] | channel;
+			} while (next == status && options->running < 100);
+			status = next;
+			fputc(status, file);
+			written++;
+		}
+
+		switch (status & 0xF0)
+		{
+			case 0x90:
+			case 0x80:
+				fputc(36 + rng() % 60, file);
+				fputc((status & 0xF0) == 0x90 ? 1 + rng() % 127 : 64, file);
+				break;
+			case 0xB0:
+				fputc(rng() % 120, file);
+				fputc(rng() & 0x7F, file);
+				break;
+			default:
+				fputc(rng() & 0x7F, file);
+				fputc(rng() & 0x7F, file);
+				break;
+		}
+		written += 2;
+		events++;
+	}
+	return events;
+}
+
+int main(int argc, char * argv[])
+{
+	struct GenOptions options = {GEN_SIZE, GEN_TRACKS, GEN_RUNNING, 0, GEN_SYSEX_EVERY};
+	const char * output = NULL;
+
+	for (int arg = 1; arg < argc; arg++)
+	{
+		if (!strncmp("--size=", argv[arg], 7))
+		{
+			options.size = parse_size(&argv[arg][7]);
+		}
+		else if (!strncmp("--tracks=", argv[arg], 9))
+		{
+			options.tracks = atoi(&argv[arg][9]);
+		}
+		else if (!strncmp("--running=", argv[arg], 10))
+		{
+			options.running = atoi(&argv[arg][10]);
+		}
+		else if (!strncmp("--sysex=", argv[arg], 8))
+		{
+			options.sysex = atoi(&argv[arg][8]);
+		}
+		else if (!strncmp("--sysex-every=", argv[arg], 14))
+		{
+			options.sysex_every = atoi(&argv[arg][14]);
+		}
+		else if (!strncmp("--seed=", argv[arg], 7))
+		{
+			rng_state = (uint32_t) strtoul(&argv[arg][7], NULL, 0) | 1;
+		}
+		else
+		{
+			output = argv[arg];
+		}
+	}
+
+	/*	The channel tracks, plus the tempo track, must fit in the MThd; every
+		chunk must fit in 32 bits.	*/
+	if (output == NULL || options.tracks < 1 || options.tracks > 0xFFFE ||
+		options.running < 0 || options.running > 100 || options.sysex < 0 || options.sysex_every < 1 ||
+		options.size / options.tracks > 0xF0000000u)
+	{
+		fprintf(stderr, "Usage: %s [--size=N[K|M]] [--tracks=1-65534] [--running=0-100] [--sysex=N]\n"
+			"\t[--sysex-every=N] [--seed=S] output.mid\n", argv[0]);
+		return 1;
+	}
+
+	FILE * file = fopen(output, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Couldn't create %s: %s\n", output, strerror(errno));
+		return 1;
+	}
+
+	/*	MThd: format 1, 480 ticks per quarter note.	*/
+	fwrite("MThd\x00\x00\x00\x06\x00\x01", 1, 10, file);
+	fputc((options.tracks + 1) >> 8, file);
+	fputc((options.tracks + 1) & 0xFF, file);
+	fwrite("\x01\xE0", 1, 2, file);
+
+	/*	Tempo track: 120 BPM, 4/4.	*/
+	long length_at = begin_track(file);
+	fwrite("\x00\xFF\x51\x03\x07\xA1\x20", 1, 7, file);
+	fwrite("\x00\xFF\x58\x04\x04\x02\x18\x08", 1, 8, file);
+	end_track(file, length_at);
+
+	long events = 0;
+	uint64_t budget = options.size / options.tracks;
+	for (int track = 1; track <= options.tracks; track++)
+	{
+		length_at = begin_track(file);
+		events += write_track(file, &options, track, budget);
+		end_track(file, length_at);
+	}
+
+	long size = ftell(file);
+	if (fclose(file) != 0)
+	{
+		fprintf(stderr, "Couldn't write %s: %s\n", output, strerror(errno));
+		return 1;
+	}
+	printf("%s: %ld bytes, %d tracks, %ld channel and sysex events\n", output, size, options.tracks + 1, events);
+	return 0;
+}
@@ -9,35 +9,60 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-#define ENABLE_DEBUG
-#ifdef ENABLE_DEBUG
+
+/*	Log levels, from least to most verbose.	*/
+#define LOG_LEVEL_NONE	-1
+#define LOG_LEVEL_ERROR	0
+#define LOG_LEVEL_WARN	1
+#define LOG_LEVEL_DEBUG	2
+
+/*	Minimum level compiled into the program. Calls above it expand to nothing,
+	arguments included, so a release build (make RELEASE=1) pays nothing for
+	the DEBUG() calls on the playback path.	*/
+#ifndef LOG_COMPILE_LEVEL
+	#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/*	Level in effect at runtime; messages above it are discarded. Defaults to
+	LOG_COMPILE_LEVEL.	*/
+extern int log_level;
+
+/*	Formats a message, and writes it out or queues it for the log thread.	*/
+void log_write(int level, const char * fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, tag, fmt, args...)									\
+	do {																	\
+		if ((level) <= log_level)											\
+			log_write((level), "[" tag ": %s] " fmt, __func__, ##args);	\
+	} while (0)
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_ERROR
 	/** @brief Macro for error output.*/
-	#define ERROR(fmt, args...)												\
-	    do {																\
-			fprintf(stderr, "[ERROR: %s] " fmt, __func__, ##args); 			\
-		} while (0)
+	#define ERROR(fmt, args...)		LOG_AT(LOG_LEVEL_ERROR, "ERROR", fmt, ##args)
+#else
+	#define ERROR(fmt, args...)		do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_WARN
 	/** @brief Macro for warning output.*/
-	#define WARN(fmt, args...)                                            	\
-	    do {																\
-			fprintf(stdout, "[WARNING: %s] " fmt, __func__, ##args); 		\
-	    } while (0)
+	#define WARN(fmt, args...)		LOG_AT(LOG_LEVEL_WARN, "WARNING", fmt, ##args)
+#else
+	#define WARN(fmt, args...)		do {} while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL >= LOG_LEVEL_DEBUG
 	/** @brief Macro for debug output.*/
-	#define DEBUG(fmt, args...)                                             \
-	    do {																\
-	        fprintf(stdout, "[DEBUG: %s] " fmt,  __func__, ##args);			\
-	    } while (0)
+	#define DEBUG(fmt, args...)		LOG_AT(LOG_LEVEL_DEBUG, "DEBUG", fmt, ##args)
 #else
 	/*	Stubbed functions, so that the compiler doesn't scream at us
 		when we attempt to compile our program without these defined macros.	*/
-	#define ERROR(fmt, args...)
-	#define WARN(fmt, args...)
-	#define DEBUG(fmt, args...)
+	#define DEBUG(fmt, args...)		do {} while (0)
 #endif
 
 
-
-
 int pet_log_file_init(char * filename);
+int log_async_start(void);
+void log_async_stop(void);
 
 
 #ifdef __cplusplus
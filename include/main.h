@@ -1,14 +1,48 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include "midi_batch.h"
+#include "midi_query.h"
+
 #define MAX_FILENAME_LENGTH 256
 
+/*  Most files played together: the main file and its stems    */
+#define MAX_STREAMS 16
+
+/*  A file of the mix, with where it starts and the channels it plays on    */
+struct main_stream
+{
+    const char * path;          /*  Path of a stem, or NULL for the main file   */
+    uint64_t offset_ns;         /*  When it starts, from the start of the mix   */
+    uint8_t channel_map[16];    /*  Device channel of each of its channels  */
+};
+
 struct main_params
 {
     FILE * midi_file;
     int device_file;
     unsigned char midi_filename[MAX_FILENAME_LENGTH];
     unsigned char dev_filename[MAX_FILENAME_LENGTH];
+    int running_status; /*  Boolean, whether to send running status to the device  */
+    int log_async;      /*  Boolean, whether to log through the background thread  */
+    int stream;         /*  Boolean, whether the MIDI file is read from standard input  */
+    const char * cache_dir; /*  Directory of decoded files to reuse, or NULL    */
+    int realtime;       /*  Boolean, whether to ask for SCHED_FIFO and locked memory    */
+    int alsa;           /*  Boolean, whether to play through the ALSA sequencer    */
+    const char * alsa_destination;  /*  Sequencer port to connect to, or NULL   */
+    double start_seconds;   /*  Where to start playing, in seconds from the beginning   */
+    int stats_format;   /*  MIDI_STATS_*, statistics to print instead of playing    */
+    int query_set;      /*  Boolean, whether to print the events of query instead of playing    */
+    struct MIDIQuery query; /*  Window and filters of --query, --channels and --types  */
+
+    /*  Mixing  */
+    int num_streams;                        /*  The main file, and one per --stem   */
+    struct main_stream streams[MAX_STREAMS];
+
+    /*  Batch mode  */
+    int batch;                          /*  Boolean, whether to analyze many files  */
+    int num_jobs;                       /*  Worker threads, 0 for one per CPU   */
+    struct MIDIBatchList batch_list;    /*  Files to analyze in batch mode  */
 };
 
 #endif
@@ -0,0 +1,19 @@
+/*! @file
+	Output backend for the ALSA sequencer, timed by the kernel. Only built
+	with make ALSA=1 (HAVE_ALSA); otherwise opening it fails with an error.
+*/
+#ifndef MIDI_ALSA_H
+#define MIDI_ALSA_H
+
+/*	Include headers	*/
+#include "midi_output.h"
+
+/*	Largest sysex message sent in one sequencer event; longer ones are split.	*/
+#define MIDI_ALSA_SYSEX_SIZE 4096
+
+/*
+    Function prototypes
+*/
+int midi_alsa_open(struct MIDIOutput * output, const char * destination);
+
+#endif
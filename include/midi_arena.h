@@ -0,0 +1,59 @@
+/*! @file
+	Bump allocator owning everything decoded from one MIDI file.
+*/
+#ifndef MIDI_ARENA_H
+#define MIDI_ARENA_H
+
+/*	Include headers	*/
+#include <stddef.h>
+
+/*	Default size of the blocks an arena grows by. Larger allocations get a
+	block of their own.	*/
+#define MIDI_ARENA_BLOCK_SIZE (256 * 1024)
+
+/*	Every allocation is aligned to this many bytes.	*/
+#define MIDI_ARENA_ALIGN 16
+
+/*	A block of memory obtained from malloc(). Blocks stay allocated, and
+	chained in the order they were obtained, until the arena is freed.	*/
+struct MIDIArenaBlock
+{
+	struct MIDIArenaBlock *	next;
+	size_t					size;		/*!	Bytes available in data.	*/
+	size_t					used;		/*!	Bytes of data handed out.	*/
+	unsigned char			data[] __attribute__((aligned(MIDI_ARENA_ALIGN)));
+};
+
+/*	A position in an arena, to release everything allocated after it.	*/
+struct MIDIArenaMark
+{
+	struct MIDIArenaBlock *	block;
+	size_t					used;
+	size_t					in_use;
+};
+
+struct MIDIArena
+{
+	struct MIDIArenaBlock *	first;
+	struct MIDIArenaBlock *	current;	/*!	Block allocations are made from.	*/
+	size_t					block_size;
+
+	/*	Statistics	*/
+	size_t					in_use;		/*!	Bytes handed out and not yet released.	*/
+	size_t					peak;		/*!	Highest in_use ever reached.	*/
+	size_t					reserved;	/*!	Bytes obtained from malloc(), headers included.	*/
+	unsigned long			allocations;	/*!	Number of midi_arena_alloc() calls.	*/
+};
+
+/*
+    Function prototypes
+*/
+void midi_arena_init(struct MIDIArena * arena, size_t block_size);
+void * midi_arena_alloc(struct MIDIArena * arena, size_t size);
+void * midi_arena_calloc(struct MIDIArena * arena, size_t count, size_t size);
+struct MIDIArenaMark midi_arena_mark(const struct MIDIArena * arena);
+void midi_arena_release(struct MIDIArena * arena, struct MIDIArenaMark mark);
+void midi_arena_reset(struct MIDIArena * arena);
+void midi_arena_free(struct MIDIArena * arena);
+
+#endif
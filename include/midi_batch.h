@@ -0,0 +1,35 @@
+/*! @file
+	Batch analysis of many MIDI files, spread across a thread pool.
+*/
+#ifndef MIDI_BATCH_H
+#define MIDI_BATCH_H
+
+/*	Include headers	*/
+#include <stdio.h>
+
+#include "midi_pool.h"
+#include "midi_arena.h"
+
+/*	Size of the text buffer holding the result of one file.	*/
+#define MIDI_BATCH_RESULT_SIZE 512
+
+/*	List of files to analyze.	*/
+struct MIDIBatchList
+{
+	int		num_paths;
+	int		capacity;
+	char **	paths;
+};
+
+/*
+    Function prototypes
+*/
+int midi_batch_addPath(struct MIDIBatchList * list, const char * path);
+int midi_batch_addFileList(struct MIDIBatchList * list, const char * file_list);
+int midi_batch_analyzeFile(const char * path, struct MIDIPool * pool, struct MIDIArena * arena,
+	const char * cache_dir, char * result, size_t result_size, int stats_format, char ** stats);
+int midi_batch_run(struct MIDIBatchList * list, int num_threads, const char * cache_dir, int stats_format,
+	FILE * out);
+void midi_batch_freeList(struct MIDIBatchList * list);
+
+#endif
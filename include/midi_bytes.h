@@ -0,0 +1,115 @@
+/*! @file
+	Reads the big-endian integers of a MIDI file: chunk lengths, MThd fields
+	and meta event payloads.
+
+	midi_bytes_be16/24/32 read from memory already known to be long enough;
+	each compiles to a single (unaligned) load and a byte swap. A struct
+	MIDIBytes cursor adds the bounds checks: reading past the end returns 0
+	and sets a sticky overrun flag, so a run of reads needs a single check
+	at the end.
+*/
+#ifndef MIDI_BYTES_H
+#define MIDI_BYTES_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+static inline uint16_t midi_bytes_be16(const unsigned char * data)
+{
+	uint16_t value;
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	value = __builtin_bswap16(value);
+#endif
+	return value;
+}
+
+static inline uint32_t midi_bytes_be32(const unsigned char * data)
+{
+	uint32_t value;
+	memcpy(&value, data, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+static inline uint32_t midi_bytes_be24(const unsigned char * data)
+{
+	return ((uint32_t) midi_bytes_be16(data) << 8) | data[2];
+}
+
+/*	Bounds-checked cursor over a buffer.	*/
+struct MIDIBytes
+{
+	const unsigned char *	pos;		/*!	Next byte to read.	*/
+	const unsigned char *	end;		/*!	One past the last byte.	*/
+	int						overrun;	/*!	Boolean, set once a read went past end.	*/
+};
+
+static inline void midi_bytes_init(struct MIDIBytes * bytes, const unsigned char * data, size_t size)
+{
+	bytes->pos = data;
+	bytes->end = data + size;
+	bytes->overrun = 0;
+}
+
+static inline size_t midi_bytes_remaining(const struct MIDIBytes * bytes)
+{
+	return (size_t) (bytes->end - bytes->pos);
+}
+
+/*	Checks that count more bytes can be read; if not, flags the overrun and
+	moves to the end, so every later read fails as well.	*/
+static inline int midi_bytes_have(struct MIDIBytes * bytes, size_t count)
+{
+	if (__builtin_expect(midi_bytes_remaining(bytes) < count, 0))
+	{
+		bytes->overrun = 1;
+		bytes->pos = bytes->end;
+		return 0;
+	}
+	return 1;
+}
+
+static inline uint8_t midi_bytes_readU8(struct MIDIBytes * bytes)
+{
+	return midi_bytes_have(bytes, 1) ? *(bytes->pos++) : 0;
+}
+
+static inline uint16_t midi_bytes_readBE16(struct MIDIBytes * bytes)
+{
+	if (!midi_bytes_have(bytes, 2)) return 0;
+	uint16_t value = midi_bytes_be16(bytes->pos);
+	bytes->pos += 2;
+	return value;
+}
+
+static inline uint32_t midi_bytes_readBE24(struct MIDIBytes * bytes)
+{
+	if (!midi_bytes_have(bytes, 3)) return 0;
+	uint32_t value = midi_bytes_be24(bytes->pos);
+	bytes->pos += 3;
+	return value;
+}
+
+static inline uint32_t midi_bytes_readBE32(struct MIDIBytes * bytes)
+{
+	if (!midi_bytes_have(bytes, 4)) return 0;
+	uint32_t value = midi_bytes_be32(bytes->pos);
+	bytes->pos += 4;
+	return value;
+}
+
+/*	Skips count bytes, returning where they start, or NULL if they don't fit.	*/
+static inline const unsigned char * midi_bytes_skip(struct MIDIBytes * bytes, size_t count)
+{
+	if (!midi_bytes_have(bytes, count)) return NULL;
+	const unsigned char * start = bytes->pos;
+	bytes->pos += count;
+	return start;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/*! @file
+	Binary cache of decoded MIDI files: the timeline and tempo map, written
+	out as the flat arrays they already are, and used in place after mapping
+	the cache file back in.
+*/
+#ifndef MIDI_CACHE_H
+#define MIDI_CACHE_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <stddef.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+
+/*	First bytes of every cache file.	*/
+#define MIDI_CACHE_MAGIC "MIDICACH"
+
+/*	Bumped whenever the layout below, or what the decoder produces, changes.
+	Files of any other version are ignored and rewritten.	*/
+#define MIDI_CACHE_VERSION 1
+
+/*	Written in native byte order; a cache from a machine of the other
+	endianness reads back as a different value, and is ignored.	*/
+#define MIDI_CACHE_BYTE_ORDER 0x01020304u
+
+/*	Every array in a cache file starts on a multiple of this.	*/
+#define MIDI_CACHE_ALIGN 8
+
+#define MIDI_CACHE_SUFFIX ".mcache"
+
+/*	Identifies the source file a cache was built from.	*/
+struct MIDICacheKey
+{
+	uint64_t	hash;			/*!	64-bit hash of the source file's contents.	*/
+	uint64_t	size;			/*!	Size of the source file.	*/
+	int64_t		mtime_sec;		/*!	Modification time of the source file.	*/
+	int64_t		mtime_nsec;
+};
+
+/*	Layout of a cache file: this header, num_tracks MIDICacheTracks at
+	tracks_offset, num_changes MIDITempoChanges at changes_offset, then the
+	arrays of every track. Offsets count from the start of the file.	*/
+struct MIDICacheHeader
+{
+	char				magic[8];
+	uint32_t			version;
+	uint32_t			byte_order;
+	struct MIDICacheKey	key;
+
+	/*	From the MThd.	*/
+	int32_t				format;
+	int32_t				division;
+
+	int32_t				num_tracks;
+	int32_t				num_changes;
+	int32_t				ticks_per_quarter;
+	int32_t				reserved;
+	double				ns_per_tick_smpte;
+
+	uint64_t			tracks_offset;
+	uint64_t			changes_offset;
+	uint64_t			file_size;		/*!	Size of the whole cache file.	*/
+};
+
+/*	Where the arrays of one MIDITrackEvents are in a cache file.	*/
+struct MIDICacheTrack
+{
+	int32_t		num_events;
+	int32_t		reserved;
+	uint64_t	payload_size;
+	uint64_t	tick;
+	uint64_t	status;
+	uint64_t	data1;
+	uint64_t	data2;
+	uint64_t	payload_off;
+	uint64_t	payload_len;
+	uint64_t	payload;
+};
+
+/*	An open cache file. timeline and tempoMap point straight into the
+	mapping: they are read-only, and released by midi_cache_close(), not
+	midi_timeline_free() or midi_tempo_free().	*/
+struct MIDICache
+{
+	void *							map_base;
+	size_t							map_size;
+	const struct MIDICacheHeader *	header;
+	struct MIDITimeline				timeline;
+	struct MIDITempoMap				tempoMap;
+};
+
+/*
+    Function prototypes
+*/
+int midi_cache_keyFromFd(int fd, struct MIDICacheKey * key);
+int midi_cache_path(const char * dir, const struct MIDICacheKey * key, char * path, size_t size);
+int midi_cache_write(const char * path, const struct MIDICacheKey * key, const struct MIDIFile * midiFile,
+	const struct MIDITimeline * timeline, const struct MIDITempoMap * tempoMap);
+int midi_cache_open(const char * path, const struct MIDICacheKey * key, struct MIDICache * cache);
+void midi_cache_close(struct MIDICache * cache);
+
+#endif
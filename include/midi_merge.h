@@ -0,0 +1,38 @@
+/*! @file
+	Merges the tracks of a MIDITimeline into a single stream of events,
+	ordered by absolute tick.
+*/
+#ifndef MIDI_MERGE_H
+#define MIDI_MERGE_H
+
+/*	Include headers	*/
+#include <stdint.h>
+
+#include "midi_timeline.h"
+
+/*	Heap entry: the next pending event of one track.	*/
+struct MIDIMergeEntry
+{
+	uint32_t	tick;		/*!	Absolute tick of the track's next event.	*/
+	int			track;		/*!	Index of the track within the timeline.	*/
+};
+
+struct MIDIMerge
+{
+	const struct MIDITimeline *	timeline;
+	int *						next_event;	/*!	Index of the next event within each track.	*/
+
+	int							heap_size;	/*!	Number of tracks with events left.	*/
+	struct MIDIMergeEntry *		heap;		/*!	Min-heap on (tick, track).	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_merge_init(struct MIDIMerge * merge, const struct MIDITimeline * timeline);
+void midi_merge_seek(struct MIDIMerge * merge, uint32_t tick);
+int midi_merge_peekTick(const struct MIDIMerge * merge, uint32_t * tick);
+int midi_merge_next(struct MIDIMerge * merge, int * track, int * index);
+void midi_merge_free(struct MIDIMerge * merge);
+
+#endif
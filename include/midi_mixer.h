@@ -0,0 +1,49 @@
+/*! @file
+	Mixes several decoded files into one stream of events in time order,
+	each with its own tempo map, start offset and channel mapping.
+*/
+#ifndef MIDI_MIXER_H
+#define MIDI_MIXER_H
+
+/*	Include headers	*/
+#include <stdint.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_merge.h"
+#include "midi_player.h"
+
+/*	One file of the mix.	*/
+struct MIDIMixerStream
+{
+	const struct MIDITempoMap *	tempoMap;
+	uint64_t					offset_ns;			/*!	Time of the file's tick 0 within the mix.	*/
+	uint8_t						channel_map[16];	/*!	Device channel of each of the file's channels.	*/
+	struct MIDIMerge			merge;
+	int							hint;				/*!	Tempo change in effect at the last event.	*/
+
+	/*	The stream's next event, taken off the merge ahead of time.	*/
+	int							pending;			/*!	Boolean, whether there is one.	*/
+	uint64_t					next_ns;
+	int							next_track;
+	int							next_index;
+};
+
+struct MIDIMixer
+{
+	int							num_streams;
+	int							capacity;
+	struct MIDIMixerStream *	streams;
+	struct MIDIPlayerSource *	sources;	/*!	The streams, as the player sees them.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_mixer_init(struct MIDIMixer * mixer, int capacity);
+int midi_mixer_addStream(struct MIDIMixer * mixer, const struct MIDITimeline * timeline,
+	const struct MIDITempoMap * tempoMap, uint64_t offset_ns, const uint8_t * channel_map);
+int midi_mixer_next(struct MIDIMixer * mixer, int * stream, int * track, int * index, uint64_t * ns);
+void midi_mixer_free(struct MIDIMixer * mixer);
+
+#endif
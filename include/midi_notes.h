@@ -0,0 +1,41 @@
+/*! @file
+	Notes, as opposed to events: every note on paired with the note off that
+	ends it, in a struct-of-arrays table.
+*/
+#ifndef MIDI_NOTES_H
+#define MIDI_NOTES_H
+
+/*	Include headers	*/
+#include <stdint.h>
+
+#include "midi_timeline.h"
+#include "midi_arena.h"
+
+/*	Set in flags[] for a note still held at the end of its track; it is
+	given the track's last tick as its end.	*/
+#define MIDI_NOTE_UNTERMINATED 0x01
+
+/*	Every note of a timeline, one array per field. Notes are grouped by
+	track, in track order, and sorted by start within a track.	*/
+struct MIDINoteTable
+{
+	int			num_notes;
+	uint32_t *	start;			/*!	Tick of the note on.	*/
+	uint32_t *	duration;		/*!	Ticks until the note off.	*/
+	uint8_t *	key;
+	uint8_t *	velocity;		/*!	Velocity of the note on, never 0.	*/
+	uint8_t *	channel;
+	int32_t *	track;			/*!	Index of the track, as in MIDITimeline.	*/
+	uint8_t *	flags;			/*!	MIDI_NOTE_* bits.	*/
+	int			num_unterminated;
+
+	struct MIDIArena *	arena;	/*!	Owner of every array, or NULL if they were malloc()'d.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_notes_build(const struct MIDITimeline * timeline, struct MIDIArena * arena, struct MIDINoteTable * notes);
+void midi_notes_free(struct MIDINoteTable * notes);
+
+#endif
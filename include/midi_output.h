@@ -0,0 +1,77 @@
+/*! @file
+	Batched output of MIDI events, to a device file descriptor or to any
+	other backend.
+*/
+#ifndef MIDI_OUTPUT_H
+#define MIDI_OUTPUT_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "midi_timeline.h"
+
+/*	Time to give midi_output_flushAt() for events to go out right away.	*/
+#define MIDI_OUTPUT_NOW UINT64_MAX
+
+struct MIDIOutput;
+
+/*	Where the bytes of an output go. The raw backend writes them to a file
+	descriptor when they are flushed, so the caller does the timing; a
+	timed backend is told when each flush is due instead, and can be handed
+	them ahead of time.	*/
+struct MIDIOutputBackend
+{
+	const char *	name;
+	int				timed;		/*!	Boolean, whether flushes may be handed over before they are due.	*/
+
+	/*!	Writes size bytes of complete messages, due at ns from the start of
+		the clock (or MIDI_OUTPUT_NOW). Returns 0 on success, -1 on error.	*/
+	int		(*write)(struct MIDIOutput * output, const unsigned char * bytes, size_t size, uint64_t ns);
+	/*!	Starts the backend's clock at ns, or NULL.	*/
+	int		(*start)(struct MIDIOutput * output, uint64_t ns);
+	/*!	Waits until everything written has been played, or NULL.	*/
+	int		(*drain)(struct MIDIOutput * output);
+	/*!	Releases backend_data, or NULL.	*/
+	void	(*close)(struct MIDIOutput * output);
+};
+
+struct MIDIOutput
+{
+	const struct MIDIOutputBackend *	backend;
+	void *			backend_data;		/*!	State of the backend, if it has any.	*/
+	int				fd;					/*!	Device to write to, or -1 to discard output.	*/
+	int				running_status;		/*!	Boolean, whether to compress with running status.	*/
+	unsigned char	wire_status;		/*!	Running status in effect on the wire, 0 if none.	*/
+
+	unsigned char *	buffer;				/*!	Events queued since the last flush.	*/
+	size_t			size;				/*!	Bytes used in buffer.	*/
+	size_t			capacity;			/*!	Bytes allocated for buffer.	*/
+
+	/*	Statistics	*/
+	struct timespec	start;				/*!	When the output was opened.	*/
+	unsigned long	syscalls;			/*!	Number of write() calls made.	*/
+	unsigned long	events;				/*!	Number of events queued.	*/
+	unsigned long	bytes;				/*!	Number of bytes written.	*/
+	unsigned long	bytes_saved;		/*!	Status bytes left out thanks to running status.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_output_init(struct MIDIOutput * output, int fd, int running_status);
+int midi_output_initBackend(struct MIDIOutput * output, const struct MIDIOutputBackend * backend,
+	void * backend_data, int running_status);
+int midi_output_queue(struct MIDIOutput * output, const unsigned char * event, int size);
+int midi_output_queueEvent(struct MIDIOutput * output, const struct MIDITrackEvents * events, int index);
+int midi_output_queueMapped(struct MIDIOutput * output, const struct MIDITrackEvents * events, int index,
+	const uint8_t * channel_map);
+int midi_output_start(struct MIDIOutput * output, uint64_t ns);
+int midi_output_flush(struct MIDIOutput * output);
+int midi_output_flushAt(struct MIDIOutput * output, uint64_t ns);
+int midi_output_drain(struct MIDIOutput * output);
+void midi_output_report(const struct MIDIOutput * output);
+void midi_output_free(struct MIDIOutput * output);
+
+#endif
@@ -2,6 +2,9 @@
 #ifndef MIDI_PARSE_H
 #define MIDI_PARSE_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 /*
 Function: midi_parse_eventSize
 Parameters:
@@ -14,7 +17,8 @@ Description:
     from location byte_seq, for up to four bytes as per MIDI spec.
 Returns:
     An int representing how many bytes were read. It will be 0
-    if there was an error.
+    if there was an error. Up to four bytes are read whatever the size of the
+    buffer; midi_vlq_decode takes the number of bytes available.
 */
 int midi_parse_varSize(unsigned char * byte_seq, int * size);
 
@@ -38,6 +42,162 @@ unsigned char * midi_printBytes(unsigned char * byte_seq, int bytes);
 
 int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char * data);
 
+/*
+    Total size of a channel event in bytes, including its status byte,
+    indexed by (status >> 4). Zero for anything that isn't a channel status.
+*/
+extern const unsigned char midi_parse_channelSize[16];
+
+/*
+Struct: MIDIParseState
+Description:
+    Per-track decoder state carried between calls to
+    midi_parse_getEventStateful, so that running status can be expanded.
+*/
+struct MIDIParseState
+{
+    unsigned char running_status;   /*! Last channel status seen, 0 if none. */
+};
+
+void midi_parse_initState(struct MIDIParseState * state);
+
+/*
+Function: midi_parse_getEventStateful
+Parameters:
+    struct MIDIParseState * state
+        Decoder state of the track that byte_seq belongs to
+    unsigned char * buffer
+        Where to write the complete (expanded) MIDI event
+    int buffer_size
+        The size of the buffer
+    unsigned char * byte_seq
+        Raw event bytes, starting right after the delta-time
+    int * bytes_consumed
+        Where to return how many bytes of byte_seq the event took up
+Description:
+    Same as midi_parse_getEvent, but a data byte in the status position is
+    decoded with the running status of the track, and the status byte is
+    restored in buffer. Sysex and meta events cancel running status.
+Returns:
+    The size of the event written to buffer, or 0 if there was an error.
+*/
+int midi_parse_getEventStateful(struct MIDIParseState * state, unsigned char * buffer,
+    int buffer_size, unsigned char * byte_seq, int * bytes_consumed);
+
+/*
+    Longest an event header can be: a 4-byte delta-time, FF, the meta type
+    and a 4-byte length. midi_parse_nextEvent reads this many bytes without
+    checking them one by one.
+*/
+#define MIDI_PARSE_HEADER_MAX 10
+
+/*
+Struct: MIDIEvent
+Description:
+    An event decoded by midi_parse_nextEvent. For sysex and meta events,
+    payload points into the track, and is always length bytes long.
+*/
+struct MIDIEvent
+{
+    uint32_t                delta;      /*! Ticks since the previous event. */
+    unsigned char           status;     /*! Status byte (running status expanded), 0xF0, 0xF7 or 0xFF. */
+    unsigned char           data1;      /*! First data byte, or the meta type for meta events. */
+    unsigned char           data2;      /*! Second data byte, or 0 if the event doesn't have one. */
+    const unsigned char *   payload;    /*! Sysex/meta payload, NULL for channel events. */
+    uint32_t                length;     /*! Length of the payload. */
+};
+
+/*
+Struct: MIDIEventCursor
+Description:
+    Position within the raw bytes of an MTrk, and the decoder state of the
+    track. Nothing at or past end is ever read.
+*/
+struct MIDIEventCursor
+{
+    const unsigned char *   start;
+    const unsigned char *   pos;            /*! Start of the next event. */
+    const unsigned char *   end;            /*! One past the last byte of the track. */
+    unsigned char           running_status;
+    const char *            error;          /*! Why decoding stopped, or NULL. */
+};
+
+void midi_parse_initCursor(struct MIDIEventCursor * cursor, const unsigned char * data, size_t size);
+
+/*
+Function: midi_parse_nextEvent
+Parameters:
+    struct MIDIEventCursor * cursor
+        Cursor over the track, moved past the event on success
+    struct MIDIEvent * event
+        Where to write the decoded event
+Description:
+    Decodes the next event of a track, delta-time included. The event header
+    is decoded with a single bounds check, hoisted in front of it, and the
+    payload with a second one; only the last few bytes of a track take the
+    slower path. Running status is expanded.
+Returns:
+    1 if an event was decoded, 0 at the end of the track, or -1 if the next
+    event is malformed or runs past the end (see cursor->error; cursor->pos
+    is left at the start of the event).
+*/
+int midi_parse_nextEvent(struct MIDIEventCursor * cursor, struct MIDIEvent * event);
+
+/*
+    Meta event types (FF <type> <length> <data>) with a decoder below.
+*/
+#define MIDI_META_TEMPO             0x51
+#define MIDI_META_SMPTE_OFFSET      0x54
+#define MIDI_META_TIME_SIGNATURE    0x58
+
+/*
+Struct: MIDITimeSignature
+Description:
+    Decoded payload of a time signature meta event.
+*/
+struct MIDITimeSignature
+{
+    uint8_t     numerator;
+    uint16_t    denominator;        /*! The note value itself (4 for x/4), not its log2. */
+    uint8_t     clocks_per_click;   /*! MIDI clocks per metronome click. */
+    uint8_t     notated_32nds;      /*! Notated 32nd notes per quarter note. */
+};
+
+/*
+Struct: MIDISMPTEOffset
+Description:
+    Decoded payload of an SMPTE offset meta event.
+*/
+struct MIDISMPTEOffset
+{
+    float       frames_per_second;  /*! 24, 25, 29.97 (30 drop-frame) or 30. */
+    uint8_t     hours;
+    uint8_t     minutes;
+    uint8_t     seconds;
+    uint8_t     frames;
+    uint8_t     subframes;          /*! Hundredths of a frame. */
+};
+
+/*
+Functions: midi_parse_tempo, midi_parse_timeSignature, midi_parse_smpteOffset
+Parameters:
+    const unsigned char * payload
+        Payload of the meta event, right after its length
+    uint32_t length
+        Length of the payload; nothing past it is read
+Description:
+    Decode the payloads of the FF 51, FF 58 and FF 54 meta events.
+Returns:
+    1 on success, or 0 if the payload doesn't have the length the event calls
+    for (3, 4 and 5 bytes), or is invalid.
+*/
+int midi_parse_tempo(const unsigned char * payload, uint32_t length, uint32_t * usec_per_quarter);
+int midi_parse_timeSignature(const unsigned char * payload, uint32_t length,
+    struct MIDITimeSignature * timeSignature);
+int midi_parse_smpteOffset(const unsigned char * payload, uint32_t length, struct MIDISMPTEOffset * offset);
+
+
+
 
 
 
@@ -0,0 +1,85 @@
+/*! @file
+	Real-time playback: a thread that only waits for deadlines and writes
+	to the device, fed by the decoding side through a lock-free ring of
+	timestamped events, from one timeline or several.
+*/
+#ifndef MIDI_PLAYER_H
+#define MIDI_PLAYER_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <pthread.h>
+
+#include "midi_timeline.h"
+#include "midi_sched.h"
+#include "midi_output.h"
+#include "midi_seek.h"
+
+/*	Number of events the decoding side may run ahead; a power of two.	*/
+#define MIDI_PLAYER_RING_SIZE 4096
+
+/*	An event written later than this after its deadline is a miss.	*/
+#define MIDI_PLAYER_MISS_NS 1000000
+
+/*	Priority of the output thread with SCHED_FIFO.	*/
+#define MIDI_PLAYER_PRIORITY 50
+
+/*	A timeline played, and the channels its events go out on.	*/
+struct MIDIPlayerSource
+{
+	const struct MIDITimeline *	timeline;
+	const uint8_t *				channel_map;	/*!	Device channel of each channel, or NULL to keep them.	*/
+};
+
+/*	An event of one of the timelines, with the time it is due.	*/
+struct MIDIPlayerEvent
+{
+	uint64_t	ns;			/*!	Time from tick 0, in nanoseconds.	*/
+	uint16_t	source;		/*!	Index of the timeline within the sources.	*/
+	int32_t		track;		/*!	As wide as the timeline's track count, which nothing caps.	*/
+	int32_t		index;
+};
+
+struct MIDIPlayer
+{
+	/*	The ring. head is only written by the decoding side, tail only by the
+		output thread; each sits on its own cache line.	*/
+	struct MIDIPlayerEvent *	ring;
+	unsigned long				head __attribute__((aligned(64)));	/*!	Next slot to fill.	*/
+	unsigned long				tail __attribute__((aligned(64)));	/*!	Next slot to play.	*/
+	int							finished __attribute__((aligned(64)));	/*!	No more events will be pushed.	*/
+
+	const struct MIDIPlayerSource *	sources;
+	int							num_sources;
+	struct MIDIPlayerSource		single;		/*!	The only source, for midi_player_start().	*/
+	const struct MIDIScheduler *	scheduler;
+	struct MIDIOutput *			output;
+	struct MIDISeekState *		live;		/*!	Updated with every event written, or NULL.	*/
+	pthread_t					thread;
+	int							realtime;	/*!	Boolean, whether the thread got SCHED_FIFO.	*/
+	int							locked;		/*!	Boolean, whether memory was locked with mlockall().	*/
+
+	/*	Statistics, written by the output thread only	*/
+	unsigned long				events;		/*!	Events taken off the ring.	*/
+	unsigned long				flushes;	/*!	Deadlines written to the device.	*/
+	unsigned long				misses;		/*!	Deadlines written more than MIDI_PLAYER_MISS_NS late.	*/
+	unsigned long				underruns;	/*!	Times the ring ran dry before the end.	*/
+	uint64_t					max_late_ns;	/*!	Latest a deadline was written.	*/
+	unsigned long				depth_sum;	/*!	Sum of the ring depth at every deadline.	*/
+	unsigned long				depth_max;
+};
+
+/*
+    Function prototypes
+*/
+int midi_player_start(struct MIDIPlayer * player, const struct MIDITimeline * timeline,
+	const struct MIDIScheduler * scheduler, struct MIDIOutput * output, struct MIDISeekState * live, int realtime);
+int midi_player_startSources(struct MIDIPlayer * player, const struct MIDIPlayerSource * sources, int num_sources,
+	const struct MIDIScheduler * scheduler, struct MIDIOutput * output, int realtime);
+void midi_player_push(struct MIDIPlayer * player, uint64_t ns, int track, int index);
+void midi_player_pushFrom(struct MIDIPlayer * player, int source, uint64_t ns, int track, int index);
+void midi_player_finish(struct MIDIPlayer * player);
+void midi_player_report(const struct MIDIPlayer * player);
+void midi_player_free(struct MIDIPlayer * player);
+
+#endif
@@ -0,0 +1,51 @@
+/*! @file
+	Work-stealing thread pool.
+*/
+#ifndef MIDI_POOL_H
+#define MIDI_POOL_H
+
+/*	Include headers	*/
+#include <pthread.h>
+
+/*	A unit of work.	*/
+struct MIDIPoolTask
+{
+	void	(*fn)(void * arg);
+	void *	arg;
+	int *	group;		/*!	Counter of the group the task belongs to.	*/
+};
+
+/*	Double-ended queue of tasks owned by one worker. The owner pushes and pops
+	at the bottom; other workers steal from the top.	*/
+struct MIDIPoolDeque
+{
+	pthread_mutex_t			lock;
+	struct MIDIPoolTask *	tasks;		/*!	Ring buffer of capacity entries.	*/
+	int						capacity;
+	int						top;		/*!	Index of the oldest task.	*/
+	int						count;		/*!	Number of tasks queued.	*/
+};
+
+struct MIDIPool
+{
+	int						num_threads;
+	pthread_t *				threads;
+	struct MIDIPoolDeque *	deques;		/*!	One per worker.	*/
+
+	pthread_mutex_t			lock;		/*!	Protects changed and shutdown.	*/
+	pthread_cond_t			changed;	/*!	Signalled when tasks are queued or a group finishes.	*/
+	int						queued;		/*!	Tasks queued across all deques.	*/
+	int						shutdown;
+	unsigned int			next_deque;	/*!	Round-robin target for outside submissions.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_pool_init(struct MIDIPool * pool, int num_threads);
+void midi_pool_submit(struct MIDIPool * pool, int * group, void (*fn)(void *), void * arg);
+void midi_pool_wait(struct MIDIPool * pool, int * group);
+int midi_pool_workerIndex(void);
+void midi_pool_destroy(struct MIDIPool * pool);
+
+#endif
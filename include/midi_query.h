@@ -0,0 +1,69 @@
+/*! @file
+	Time-window queries over the merged events of a file: every event in a
+	range of time, on some channels, of some types.
+*/
+#ifndef MIDI_QUERY_H
+#define MIDI_QUERY_H
+
+/*	Include headers	*/
+#include <stdint.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_arena.h"
+
+/*	Events are summarized in blocks of this many; a power of two.	*/
+#define MIDI_QUERY_BLOCK 64
+
+/*	Filters matching everything. Channel n is bit n of channels; type t
+	(the upper status nibble, 8 to F) is bit t - 8 of types, where F covers
+	sysex and meta events.	*/
+#define MIDI_QUERY_ALL_CHANNELS 0xFFFF
+#define MIDI_QUERY_ALL_TYPES 0xFF
+
+/*	Every event of a timeline, merged in time order, one array per field,
+	with a summary of each block of MIDI_QUERY_BLOCK events: the channels
+	and the types found in it, so that a filtered query skips the blocks
+	with nothing for it.	*/
+struct MIDIQueryIndex
+{
+	int			num_events;
+	uint64_t *	ns;				/*!	Time of each event from tick 0, ascending.	*/
+	int32_t *	track;			/*!	Track of each event within the timeline.	*/
+	int32_t *	index;			/*!	Index of each event within its track.	*/
+	uint8_t *	status;			/*!	Copy of the status byte, for filtering.	*/
+
+	int			num_blocks;
+	uint16_t *	block_channels;	/*!	Channels with an event in each block.	*/
+	uint8_t *	block_types;	/*!	Types of event in each block.	*/
+
+	struct MIDIArena *	arena;	/*!	Owner of every array, or NULL if they were malloc()'d.	*/
+};
+
+struct MIDIQuery
+{
+	uint64_t	from_ns;		/*!	First time included.	*/
+	uint64_t	to_ns;			/*!	First time past the window.	*/
+	uint16_t	channels;		/*!	Channels wanted; unless all are, sysex and meta events are left out.	*/
+	uint8_t		types;			/*!	Types wanted.	*/
+};
+
+/*	Position of a query within an index.	*/
+struct MIDIQueryCursor
+{
+	const struct MIDIQueryIndex *	queryIndex;
+	struct MIDIQuery				query;
+	int								position;	/*!	Next event to look at.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_query_build(const struct MIDITimeline * timeline, const struct MIDITempoMap * tempoMap,
+	struct MIDIArena * arena, struct MIDIQueryIndex * queryIndex);
+void midi_query_start(const struct MIDIQueryIndex * queryIndex, const struct MIDIQuery * query,
+	struct MIDIQueryCursor * cursor);
+int midi_query_next(struct MIDIQueryCursor * cursor, int * position);
+void midi_query_free(struct MIDIQueryIndex * queryIndex);
+
+#endif
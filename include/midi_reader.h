@@ -4,6 +4,10 @@
 
 /*	Include headers	*/
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "midi_arena.h"
 
 // Debug #define commands
 #define DEBUG_MIDI_READER_PRINT_BLOCK_DATA
@@ -15,6 +19,7 @@ struct MIDIBlock
 									is in ASCII (for example, 'MTrk' or 'MThd')	*/
     int 			n_data_size;	/*!	Size of data array, in bytes.	*/
     unsigned char * data;           /*! Pointer to the raw data (which is of a variable size) */
+    uint32_t		offset;			/*!	Offset of the data within the file, in bytes.	*/
 
 	/*	Status indicators for the program	*/
     uint8_t bActive : 1;      // Boolean representation of whether playing is complete
@@ -22,17 +27,22 @@ struct MIDIBlock
     int 	nCurrentPos;     // Current position in the bytes (aka, byte offset)
 };
 
-/*  Node struct for our simple linked-list implementation.  */
-struct MIDIBlockNode
-{
-	struct Node * nextNode;
-	struct MIDIBlock midiBlock;
-};
-
 struct MIDIFile
 {
 	int num_blocks;
 	struct MIDIBlock * blockArr;
+
+	/*	Decoded from the MThd chunk	*/
+	int				format;			/*!	0, 1 or 2.	*/
+	int				num_tracks;		/*!	Number of MTrk chunks announced.	*/
+	int				division;		/*!	Raw division field: ticks per quarter note,
+									or SMPTE timing if the top bit is set.	*/
+
+	/*	Backing storage, when the blocks are views into a file mapping	*/
+	unsigned char *	map_base;		/*!	Base address of the mapping, or NULL if each
+									block owns its own data array.	*/
+	size_t			map_size;		/*!	Size of the mapping, in bytes.	*/
+	struct MIDIArena *	arena;		/*!	Owner of blockArr, or NULL if it was malloc()'d.	*/
 };
 
 
@@ -48,12 +58,13 @@ struct MIDIFile
 /*
     Function prototypes
 */
-struct MIDIBlockNode * alloc_midi_file(FILE * midi_file);
 int test_file_if_midi(FILE * file);
 int grab_midi_blocks(FILE * file, struct MIDIBlock ** midiBlocks, int * size);
 int freeBlocks(struct MIDIBlock ** midiBlocks, int number_of_blocks);
 void process_bytes(unsigned char * byteString, int number_of_bytes);
 int parse_hex_size(unsigned char * header, int size);
-struct MIDIFile convert_ll_to_MIDIFile(struct MIDIBlockNode * list);
+int index_midi_chunks(const unsigned char * data, size_t size, struct MIDIFile * midiFile);
+struct MIDIFile map_midi_file(int fd, struct MIDIArena * arena);
+void unmap_midi_file(struct MIDIFile * midiFile);
 
 #endif
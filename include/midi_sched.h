@@ -0,0 +1,29 @@
+/*! @file
+	Sleeps until MIDI events are due, using absolute monotonic deadlines.
+*/
+#ifndef MIDI_SCHED_H
+#define MIDI_SCHED_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <time.h>
+
+#include "midi_tempo.h"
+
+struct MIDIScheduler
+{
+	struct timespec					start;		/*!	CLOCK_MONOTONIC time of tick 0.	*/
+	const struct MIDITempoMap *		tempoMap;	/*!	Converts ticks into nanoseconds.	*/
+	int								hint;		/*!	Tempo change in effect at the last tick.	*/
+};
+
+/*
+    Function prototypes
+*/
+void midi_sched_start(struct MIDIScheduler * scheduler, const struct MIDITempoMap * tempoMap);
+void midi_sched_startAt(struct MIDIScheduler * scheduler, const struct MIDITempoMap * tempoMap, uint64_t ns);
+void midi_sched_deadline(struct MIDIScheduler * scheduler, uint32_t tick, struct timespec * deadline);
+void midi_sched_deadlineNs(const struct MIDIScheduler * scheduler, uint64_t ns, struct timespec * deadline);
+int midi_sched_waitForTick(struct MIDIScheduler * scheduler, uint32_t tick);
+
+#endif
@@ -0,0 +1,72 @@
+/*! @file
+	Checkpoint index over the tracks of a MIDITimeline, for jumping to any
+	point of a file with the channel state (notes, controllers, program and
+	pitch bend) it would have had by playing up to there.
+*/
+#ifndef MIDI_SEEK_H
+#define MIDI_SEEK_H
+
+/*	Include headers	*/
+#include <stdint.h>
+
+#include "midi_timeline.h"
+#include "midi_output.h"
+
+/*	Default number of events between two checkpoints of a track: the most a
+	seek has to roll forward.	*/
+#define MIDI_SEEK_INTERVAL 1024
+
+/*	Value of a controller, program or pitch bend that was never set.	*/
+#define MIDI_SEEK_UNSET 0xFF
+#define MIDI_SEEK_BEND_UNSET 0xFFFF
+
+/*	What has been sent to one channel so far. Along with each value is when
+	it was last set (or reset), as its tick + 1, or 0 if it never was: the
+	states of several tracks are merged by keeping the latest.	*/
+struct MIDIChannelState
+{
+	uint8_t		controller[128];	/*!	Last value of each controller, or MIDI_SEEK_UNSET.	*/
+	uint8_t		program;			/*!	Last program change, or MIDI_SEEK_UNSET.	*/
+	uint16_t	pitch_bend;			/*!	Last 14-bit pitch bend, or MIDI_SEEK_BEND_UNSET.	*/
+	uint32_t	notes[4];			/*!	Bit set of the keys held down.	*/
+
+	uint32_t	controller_set[128];
+	uint32_t	program_set;
+	uint32_t	pitch_bend_set;
+};
+
+struct MIDISeekState
+{
+	struct MIDIChannelState	channel[16];
+};
+
+/*	Checkpoints of one track: checkpoint k is the state just before event
+	k * interval.	*/
+struct MIDISeekTrack
+{
+	int						num_checkpoints;
+	struct MIDISeekState *	checkpoints;
+};
+
+struct MIDISeekIndex
+{
+	int						interval;
+	int						num_tracks;
+	struct MIDISeekTrack *	tracks;
+};
+
+/*
+    Function prototypes
+*/
+void midi_seek_initState(struct MIDISeekState * state);
+void midi_seek_apply(struct MIDISeekState * state, const struct MIDITrackEvents * events, int index);
+int midi_seek_build(const struct MIDITimeline * timeline, int interval, struct MIDISeekIndex * seekIndex);
+int midi_seek_trackStateAt(const struct MIDISeekIndex * seekIndex, const struct MIDITimeline * timeline,
+	int track, uint32_t tick, struct MIDISeekState * state);
+void midi_seek_stateAt(const struct MIDISeekIndex * seekIndex, const struct MIDITimeline * timeline,
+	uint32_t tick, struct MIDISeekState * state);
+int midi_seek_jump(const struct MIDISeekIndex * seekIndex, const struct MIDITimeline * timeline,
+	struct MIDISeekState * live, uint32_t tick, struct MIDIOutput * output);
+void midi_seek_free(struct MIDISeekIndex * seekIndex);
+
+#endif
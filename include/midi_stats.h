@@ -0,0 +1,72 @@
+/*! @file
+	Statistics over the decoded events of a MIDI file: pitch, velocity and
+	controller histograms per channel, note durations, polyphony and event
+	density, written out as CSV or JSON.
+*/
+#ifndef MIDI_STATS_H
+#define MIDI_STATS_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <stdio.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_arena.h"
+
+/*	Output formats.	*/
+#define MIDI_STATS_NONE	0
+#define MIDI_STATS_CSV	1
+#define MIDI_STATS_JSON	2
+
+/*	Note durations are counted in power-of-two buckets of milliseconds:
+	bucket k holds [2^k, 2^(k+1)) ms, with everything shorter in bucket 0
+	and everything longer in the last one.	*/
+#define MIDI_STATS_DURATION_BUCKETS 16
+
+/*	Density is counted for the first day of a file at most; channel events
+	any later are counted in the last second.	*/
+#define MIDI_STATS_MAX_SECONDS (24 * 60 * 60)
+
+struct MIDIStats
+{
+	/*	Totals	*/
+	uint64_t	events;
+	uint64_t	channel_events;			/*!	Events with a status below F0.	*/
+	uint32_t	by_type[16];			/*!	Events per upper status nibble; F is sysex and meta.	*/
+	double		duration;				/*!	Time of the last event, in seconds.	*/
+
+	/*	Per channel	*/
+	uint32_t	pitch[16][128];			/*!	Note ons per key.	*/
+	uint32_t	velocity[16][128];		/*!	Note ons per velocity.	*/
+	uint32_t	controller[16][128];	/*!	Control changes per controller number.	*/
+
+	/*	Notes	*/
+	uint64_t	notes;					/*!	Note ons, velocity 0 excluded.	*/
+	uint64_t	unterminated;			/*!	Notes still held at the end of their track.	*/
+	uint32_t	note_duration[MIDI_STATS_DURATION_BUCKETS];
+	uint64_t	duration_sum_ns;
+	uint64_t	duration_max_ns;
+	int			max_polyphony;			/*!	Most notes sounding at once, across all tracks.	*/
+	double		avg_polyphony;			/*!	Notes sounding on average, while any is.	*/
+
+	/*	Channel events in each second of the file	*/
+	int			num_seconds;			/*!	Up to MIDI_STATS_MAX_SECONDS.	*/
+	uint32_t *	per_second;
+	uint32_t	peak_density;
+	double		avg_density;
+
+	struct MIDIArena *	arena;			/*!	Owner of per_second, or NULL if it was malloc()'d.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_stats_parseFormat(const char * name);
+int midi_stats_compute(const struct MIDITimeline * timeline, const struct MIDITempoMap * tempoMap,
+	struct MIDIArena * arena, struct MIDIStats * stats);
+void midi_stats_writeHeader(FILE * out, int format);
+void midi_stats_write(FILE * out, int format, const char * path, const struct MIDIStats * stats);
+void midi_stats_free(struct MIDIStats * stats);
+
+#endif
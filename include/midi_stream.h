@@ -0,0 +1,80 @@
+/*! @file
+	Push-style, incremental parser for Standard MIDI Files arriving in pieces
+	(pipes, sockets, standard input), with a fixed memory footprint.
+*/
+#ifndef MIDI_STREAM_H
+#define MIDI_STREAM_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <stddef.h>
+
+/*	Size of the buffer sysex and meta payloads are collected in. Longer
+	payloads are handed to the callback in pieces of at most this size.	*/
+#define MIDI_STREAM_PAYLOAD_SIZE 4096
+
+/*	An event, as handed to the callback. For channel events, payload is NULL.
+	For sysex and meta events, the callback is called once per piece of the
+	payload; the last piece is the one where payload_offset + payload_len
+	equals length.	*/
+struct MIDIStreamEvent
+{
+	int						track;			/*!	Index of the MTrk the event belongs to.	*/
+	uint32_t				delta;			/*!	Ticks since the previous event of the track.	*/
+	uint32_t				tick;			/*!	Absolute tick, from the start of the track.	*/
+	unsigned char			status;			/*!	Status byte (running status expanded), 0xF0, 0xF7 or 0xFF.	*/
+	unsigned char			data1;			/*!	First data byte, or the meta type for meta events.	*/
+	unsigned char			data2;			/*!	Second data byte, or 0 if the event doesn't have one.	*/
+	const unsigned char *	payload;		/*!	This piece of the sysex/meta payload.	*/
+	uint32_t				payload_len;	/*!	Number of bytes in this piece.	*/
+	uint32_t				payload_offset;	/*!	Offset of this piece within the whole payload.	*/
+	uint32_t				length;			/*!	Length of the whole payload.	*/
+};
+
+typedef void (*midi_stream_callback)(void * ctx, const struct MIDIStreamEvent * event);
+
+struct MIDIStream
+{
+	int						state;			/*!	What the next byte is expected to be.	*/
+	const char *			error;			/*!	Why parsing stopped, or NULL.	*/
+
+	/*	Decoded from the MThd.	*/
+	int						format;
+	int						num_tracks;		/*!	Number of MTrk chunks the MThd announces.	*/
+	int						division;		/*!	Raw division field: ticks per quarter, or SMPTE if negative.	*/
+
+	/*	Chunk being read.	*/
+	unsigned char			chunk_header[8];
+	int						header_fill;	/*!	Bytes of chunk_header received so far.	*/
+	unsigned char			mthd[6];
+	uint32_t				chunk_size;		/*!	Length of the current chunk.	*/
+	uint32_t				chunk_left;		/*!	Bytes of the current chunk not yet received.	*/
+	int						chunks_seen;
+	int						tracks_seen;
+
+	/*	Event being read.	*/
+	uint32_t				vlq;			/*!	Variable-length quantity decoded so far.	*/
+	int						vlq_bytes;		/*!	Number of bytes in vlq.	*/
+	unsigned char			running_status;
+	int						data_needed;	/*!	Data bytes of the current channel event.	*/
+	int						data_fill;
+	struct MIDIStreamEvent	event;
+	unsigned char			payload[MIDI_STREAM_PAYLOAD_SIZE];
+	uint32_t				payload_fill;	/*!	Bytes of the current piece in payload.	*/
+
+	/*	Statistics	*/
+	uint64_t				bytes;			/*!	Number of bytes pushed.	*/
+	unsigned long			events;			/*!	Number of complete events.	*/
+
+	midi_stream_callback	callback;
+	void *					ctx;
+};
+
+/*
+    Function prototypes
+*/
+void midi_stream_init(struct MIDIStream * stream, midi_stream_callback callback, void * ctx);
+int midi_stream_push(struct MIDIStream * stream, const unsigned char * data, size_t size);
+int midi_stream_finish(struct MIDIStream * stream);
+
+#endif
@@ -0,0 +1,48 @@
+/*! @file
+	Tempo map of a MIDI file, for converting between ticks, wall-clock time
+	and SMPTE timecode.
+*/
+#ifndef MIDI_TEMPO_H
+#define MIDI_TEMPO_H
+
+/*	Include headers	*/
+#include <stdint.h>
+
+#include "midi_reader.h"
+#include "midi_parse.h"
+#include "midi_timeline.h"
+
+/*	Tempo in effect until the first FF 51 event: 120 BPM.	*/
+#define MIDI_DEFAULT_TEMPO 500000
+
+/*	A single tempo change (FF 51 03 tt tt tt), with the time it takes effect.	*/
+struct MIDITempoChange
+{
+	uint32_t	tick;				/*!	Absolute tick of the change.	*/
+	uint32_t	usec_per_quarter;	/*!	New tempo, in microseconds per quarter note.	*/
+	uint64_t	ns;					/*!	Time of the change, in nanoseconds from tick 0.	*/
+};
+
+struct MIDITempoMap
+{
+	int		ticks_per_quarter;		/*!	From the MThd division, 0 for SMPTE timing.	*/
+	double	ns_per_tick_smpte;		/*!	Fixed tick length for SMPTE timing, else 0.	*/
+
+	int							num_changes;	/*!	Always at least one (tick 0).	*/
+	struct MIDITempoChange *	changes;		/*!	Sorted by tick.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_tempo_build(struct MIDIFile * midiFile, struct MIDITimeline * timeline,
+	struct MIDITempoMap * tempoMap);
+int midi_tempo_init(struct MIDITempoMap * tempoMap, int division);
+int midi_tempo_append(struct MIDITempoMap * tempoMap, uint32_t tick, uint32_t usec_per_quarter);
+uint64_t midi_tempo_tickToNs(const struct MIDITempoMap * tempoMap, int * hint, uint32_t tick);
+uint32_t midi_tempo_nsToTick(const struct MIDITempoMap * tempoMap, uint64_t ns);
+void midi_tempo_nsToSmpte(uint64_t ns, float frames_per_second, struct MIDISMPTEOffset * smpte);
+uint64_t midi_tempo_smpteToNs(const struct MIDISMPTEOffset * smpte);
+void midi_tempo_free(struct MIDITempoMap * tempoMap);
+
+#endif
@@ -0,0 +1,60 @@
+/*! @file
+	Pre-decoded, struct-of-arrays representation of every MTrk in a MIDIFile.
+*/
+#ifndef MIDI_TIMELINE_H
+#define MIDI_TIMELINE_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <stddef.h>
+
+#include "midi_reader.h"
+#include "midi_pool.h"
+#include "midi_arena.h"
+
+/*	Files with fewer MTrk bytes than this are decoded on the calling thread;
+	handing them out to a pool costs more than it saves.	*/
+#define MIDI_TIMELINE_PARALLEL_MIN_BYTES (256 * 1024)
+
+/*	Value stored in status[] for meta events (FF <type> <length> <data>).	*/
+#define MIDI_STATUS_META 0xFF
+
+/*	The decoded events of a single MTrk, one array per field. Event i of the
+	track is (tick[i], status[i], data1[i], data2[i], payload_off[i], payload_len[i]).	*/
+struct MIDITrackEvents
+{
+	int			num_events;		/*!	Number of decoded events.	*/
+	uint32_t *	tick;			/*!	Absolute tick of each event, from the start of the track.	*/
+	uint8_t *	status;			/*!	Status byte (0x80-0xEF, 0xF0, 0xF7 or MIDI_STATUS_META).	*/
+	uint8_t *	data1;			/*!	First data byte, or the meta type for meta events.	*/
+	uint8_t *	data2;			/*!	Second data byte, or 0 if the event doesn't have one.	*/
+	uint32_t *	payload_off;	/*!	Offset of the sysex/meta payload within payload.	*/
+	uint32_t *	payload_len;	/*!	Length of the sysex/meta payload, 0 for channel events.	*/
+
+	unsigned char *	payload;		/*!	Side buffer holding every sysex and meta payload.	*/
+	size_t			payload_size;	/*!	Number of bytes used in payload.	*/
+};
+
+struct MIDITimeline
+{
+	int							num_tracks;
+	struct MIDITrackEvents *	tracks;
+	struct MIDIArena *			arena;		/*!	Owner of every array, or NULL if they were malloc()'d.	*/
+};
+
+/*
+    Function prototypes
+*/
+int midi_timeline_compile(struct MIDIFile * midiFile, struct MIDITimeline * timeline,
+	struct MIDIArena * arena);
+int midi_timeline_compileParallel(struct MIDIFile * midiFile, struct MIDITimeline * timeline,
+	struct MIDIPool * pool, struct MIDIArena * arena);
+int midi_timeline_compileTrack(struct MIDIBlock * midiBlock, struct MIDITrackEvents * events);
+int midi_timeline_compileTrackArena(struct MIDIBlock * midiBlock, struct MIDITrackEvents * events,
+	struct MIDIArena * arena);
+int midi_timeline_findTick(const struct MIDITrackEvents * events, uint32_t tick);
+const char * midi_timeline_typeName(uint8_t status);
+int midi_timeline_parseType(const char * name);
+void midi_timeline_free(struct MIDITimeline * timeline);
+
+#endif
@@ -0,0 +1,109 @@
+/*! @file
+	Fast variable-length quantity (VLQ) decoding, for delta-times and
+	sysex/meta lengths.
+*/
+#ifndef MIDI_VLQ_H
+#define MIDI_VLQ_H
+
+/*	Include headers	*/
+#include <stdint.h>
+#include <string.h>
+
+#include "midi_bytes.h"
+
+/*	Packs the 7-bit groups of a len-byte VLQ, held in the top of w, together.	*/
+static inline uint32_t midi_vlq_compact(uint32_t w, int len)
+{
+	w >>= 8 * (4 - len);
+	return (w & 0x7F) | ((w >> 1) & 0x3F80) | ((w >> 2) & 0x1FC000) | ((w >> 3) & 0xFE00000);
+}
+
+/*	Reads the four bytes at p as a big-endian word. Bytes past avail read as
+	0x80, i.e. "more to come", so a VLQ cut short by the end of the buffer
+	decodes as an error instead of reading past it.	*/
+static inline uint32_t midi_vlq_loadWord(const unsigned char * p, int avail)
+{
+	if (avail >= 4)
+	{
+		return midi_bytes_be32(p);
+	}
+
+	unsigned char tmp[4] = {0x80, 0x80, 0x80, 0x80};
+	if (avail > 0)
+	{
+		memcpy(tmp, p, avail);
+	}
+	return midi_bytes_be32(tmp);
+}
+
+/*	Decodes the VLQ at p in one load, the length coming from the first byte
+	with bit 7 clear. Returns its length, or 0 (leaving *value alone) if it
+	isn't terminated within four bytes, or within avail. With avail a
+	constant of 4 or more, this inlines down to the load and a few masks.	*/
+static inline int midi_vlq_read(const unsigned char * p, int avail, uint32_t * value)
+{
+	uint32_t w = midi_vlq_loadWord(p, avail);
+
+	/*	Bit 7 of every byte that ends the quantity.	*/
+	uint32_t terminators = ~w & 0x80808080u;
+	if (terminators == 0)
+	{
+		return 0;
+	}
+
+	int len = (__builtin_clz(terminators) >> 3) + 1;
+	*value = midi_vlq_compact(w, len);
+	return len;
+}
+
+/*
+Function: midi_vlq_decode
+Parameters:
+    const unsigned char * byte_seq
+        The starting sequence of the variable length quantity
+    int avail
+        How many bytes may be read from byte_seq
+    int * size
+        Where to return the decoded value
+Description:
+    Drop-in replacement for midi_parse_varSize: same results, including the
+    four byte limit, but decoded without a per-byte loop and never reading
+    past byte_seq[avail - 1].
+Returns:
+    The number of bytes read, or 0 if there was an error (and *size is 0).
+*/
+int midi_vlq_decode(const unsigned char * byte_seq, int avail, int * size);
+
+/*
+Function: midi_vlq_scanTrack
+Parameters:
+    const unsigned char * data
+        Raw MTrk data
+    int size
+        Size of data, in bytes
+    uint32_t * deltas
+        Where to write the delta-time of each event
+    uint32_t * offsets
+        Where to write the offset of each event (just past its delta-time)
+    uint32_t * lengths
+        Where to write the number of bytes each event takes up in data
+    int max_events
+        Capacity of the three output arrays
+    int * bytes_scanned
+        Where to return how many bytes of data were walked
+Description:
+    Walks an entire track in one pass, emitting every delta-time and event
+    boundary. Continuation bits are located up front with a vector scan
+    (SSE2, or AVX2 when compiled with it), so each VLQ is then decoded
+    from a bitmap instead of byte by byte. Running status is followed.
+    Timeline compilation doesn't use it: it has to decode every event anyway,
+    and midi_parse_nextEvent() counts a track as fast as this walks it.
+Returns:
+    The number of events emitted. The walk stops early at an event that
+    can't be decoded, or once max_events is reached.
+*/
+int midi_vlq_scanTrack(const unsigned char * data, int size,
+    uint32_t * deltas, uint32_t * offsets, uint32_t * lengths,
+    int max_events, int * bytes_scanned);
+
+#endif
@@ -0,0 +1,239 @@
+/*! @file
+	Log output for the ERROR(), WARN() and DEBUG() macros.
+
+	By default a message is written synchronously to stderr (errors) or stdout.
+	After log_async_start(), messages are instead formatted into a lock-free
+	ring buffer and written out by a background thread, so a log line never
+	blocks the thread that produced it. When the ring is full, messages are
+	dropped and counted rather than waited on.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "debug.h"
+
+/*	Number of slots in the ring; must be a power of two.	*/
+#define LOG_RING_SIZE	1024
+
+/*	Longest message kept, including the terminator. Longer ones are cut short.	*/
+#define LOG_RECORD_SIZE	256
+
+int log_level = LOG_COMPILE_LEVEL;
+
+/*	Log file set with pet_log_file_init(), or NULL for stdout/stderr.	*/
+static FILE * log_file = NULL;
+
+/*	A queued message. seq tells producers and the consumer whose turn the
+	slot is: it equals the enqueue position while the slot is free, and that
+	position plus one once its message is ready.	*/
+struct LogRecord
+{
+	unsigned long	seq;
+	int				level;
+	char			text[LOG_RECORD_SIZE];
+};
+
+static struct LogRecord log_ring[LOG_RING_SIZE];
+static unsigned long log_enqueue_pos;
+static unsigned long log_dequeue_pos;
+static unsigned long log_dropped;
+
+static int log_async;
+static int log_thread_running;
+static pthread_t log_thread;
+
+static FILE * stream_for(int level)
+{
+	if (log_file != NULL)
+	{
+		return log_file;
+	}
+	return (level == LOG_LEVEL_ERROR) ? stderr : stdout;
+}
+
+/*	Claims a free slot, or returns NULL if the ring is full. Any number of
+	threads may call this at once.	*/
+static struct LogRecord * ring_claim(unsigned long * claimed)
+{
+	unsigned long pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+
+	while (1)
+	{
+		struct LogRecord * record = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		long diff = (long) __atomic_load_n(&(record->seq), __ATOMIC_ACQUIRE) - (long) pos;
+
+		if (diff == 0)
+		{
+			if (__atomic_compare_exchange_n(&log_enqueue_pos, &pos, pos + 1, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				*claimed = pos;
+				return record;
+			}
+			/*	Lost the race; pos now holds the current position.	*/
+		}
+		else if (diff < 0)
+		{
+			return NULL;
+		}
+		else
+		{
+			pos = __atomic_load_n(&log_enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/*	Writes out every ready message. Only the log thread calls this.	*/
+static int ring_drain(void)
+{
+	int drained = 0;
+
+	while (1)
+	{
+		struct LogRecord * record = &log_ring[log_dequeue_pos & (LOG_RING_SIZE - 1)];
+		if (__atomic_load_n(&(record->seq), __ATOMIC_ACQUIRE) != log_dequeue_pos + 1)
+		{
+			break;
+		}
+
+		fputs(record->text, stream_for(record->level));
+		__atomic_store_n(&(record->seq), log_dequeue_pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+		log_dequeue_pos++;
+		drained++;
+	}
+
+	if (drained)
+	{
+		fflush(stdout);
+		fflush(stderr);
+		if (log_file != NULL) fflush(log_file);
+	}
+	return drained;
+}
+
+static void * log_thread_main(void * arg)
+{
+	const struct timespec idle = {0, 1000000};	/*	1 ms	*/
+
+	while (__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE))
+	{
+		if (!ring_drain())
+		{
+			nanosleep(&idle, NULL);
+		}
+	}
+	ring_drain();
+	return NULL;
+}
+
+/*!	\brief Writes a log message, or queues it if asynchronous logging is on.
+
+	@param level level of the message, one of LOG_LEVEL_*
+	@param fmt printf-style format string
+*/
+void log_write(int level, const char * fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+
+	if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+	{
+		vfprintf(stream_for(level), fmt, args);
+		va_end(args);
+		return;
+	}
+
+	unsigned long pos;
+	struct LogRecord * record = ring_claim(&pos);
+	if (record == NULL)
+	{
+		__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+		va_end(args);
+		return;
+	}
+
+	record->level = level;
+	vsnprintf(record->text, LOG_RECORD_SIZE, fmt, args);
+	__atomic_store_n(&(record->seq), pos + 1, __ATOMIC_RELEASE);
+	va_end(args);
+}
+
+/*!	\brief Sends all log output to a file instead of stdout and stderr.
+
+	@param filename path of the log file; it is truncated
+	@return 0 on success, -1 if the file couldn't be opened.
+*/
+int pet_log_file_init(char * filename)
+{
+	FILE * file = fopen(filename, "w");
+	if (file == NULL)
+	{
+		return -1;
+	}
+	log_file = file;
+	return 0;
+}
+
+/*!	\brief Starts the background log thread; from now on messages are queued.
+
+	The thread is also stopped at exit(), or on returning from main(), so
+	that messages still queued then are written out rather than lost.
+
+	@return 0 on success, or an error number from pthread_create().
+*/
+int log_async_start(void)
+{
+	static int stop_at_exit = 0;
+
+	if (log_thread_running)
+	{
+		return 0;
+	}
+	if (!stop_at_exit)
+	{
+		stop_at_exit = (atexit(log_async_stop) == 0);
+	}
+
+	for (unsigned long cntr = 0; cntr < LOG_RING_SIZE; cntr++)
+	{
+		log_ring[cntr].seq = cntr;
+	}
+	log_enqueue_pos = log_dequeue_pos = 0;
+
+	log_thread_running = 1;
+	int ret = pthread_create(&log_thread, NULL, log_thread_main, NULL);
+	if (ret != 0)
+	{
+		log_thread_running = 0;
+		return ret;
+	}
+	__atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*!	\brief Stops the background log thread, after writing out everything queued.
+
+	Must not race with other threads still logging.
+*/
+void log_async_stop(void)
+{
+	if (!log_thread_running)
+	{
+		return;
+	}
+
+	__atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_thread_running, 0, __ATOMIC_RELEASE);
+	pthread_join(log_thread, NULL);
+
+	if (log_dropped)
+	{
+		fprintf(stream_for(LOG_LEVEL_WARN), "[WARNING: %s] %lu log message(s) dropped, the log ring was full.\n",
+			__func__, log_dropped);
+		log_dropped = 0;
+	}
+}
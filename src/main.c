@@ -9,6 +9,21 @@
 #include "main.h"
 #include "midi_reader.h"
 #include "midi_parse.h"
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_sched.h"
+#include "midi_merge.h"
+#include "midi_output.h"
+#include "midi_pool.h"
+#include "midi_stream.h"
+#include "midi_arena.h"
+#include "midi_cache.h"
+#include "midi_seek.h"
+#include "midi_player.h"
+#include "midi_stats.h"
+#include "midi_query.h"
+#include "midi_mixer.h"
+#include "midi_alsa.h"
 #include "debug.h"
 
 /**/
@@ -24,9 +39,136 @@ struct MIDIBlockStatus
     int currentPos;     // Current position in the bytes (aka, byte offset)
 };
 
-/*  Function prototypes     */
-int isPlaying(struct MIDIFile midiFile);
-int updateDeltaTimePos(struct MIDIBlock * midiBlock);
+/*!
+    \brief Parses a time given as [[hh:]mm:]ss[.fff].
+
+    @param text time to parse
+    @param ns where to store the time, in nanoseconds
+    @return 1 on success, 0 if the time isn't valid.
+*/
+static int parse_time(const char * text, uint64_t * ns)
+{
+    double seconds = 0;
+    char * end;
+    do
+    {
+        /*  Each field before a colon counts sixty of the next.  */
+        double field = strtod(text, &end);
+        if (end == text || field < 0)
+        {
+            return 0;
+        }
+        seconds = seconds * 60 + field;
+        text = end + 1;
+    } while (*end == ':');
+
+    *ns = (uint64_t) (seconds * 1e9 + 0.5);
+    return *end == '\0';
+}
+
+/*!
+    \brief Parses the window of --query=FROM-TO into a query. Either end may
+    be left out, for the start or the end of the file.
+
+    @param text window to parse
+    @param query query whose window to set
+    @return 1 on success, 0 if the window isn't valid or ends before it starts.
+*/
+static int parse_window(const char * text, struct MIDIQuery * query)
+{
+    char from[64];
+    const char * dash = strchr(text, '-');
+    if (dash == NULL || (size_t) (dash - text) >= sizeof(from))
+    {
+        return 0;
+    }
+    memcpy(from, text, dash - text);
+    from[dash - text] = '\0';
+
+    query->from_ns = 0;
+    query->to_ns = UINT64_MAX;
+    return (from[0] == '\0' || parse_time(from, &(query->from_ns))) &&
+        (dash[1] == '\0' || parse_time(&(dash[1]), &(query->to_ns))) && query->from_ns < query->to_ns;
+}
+
+/*!
+    \brief Parses a comma-separated list of channels (1 to 16) or of event
+    type names into a query filter.
+
+    @param text list to parse
+    @param types non-zero for type names, zero for channels
+    @param mask where to store the bit of every item listed
+    @return 1 on success, 0 if an item isn't valid.
+*/
+static int parse_filter(const char * text, int types, unsigned * mask)
+{
+    char item[32];
+    *mask = 0;
+    while (*text != '\0')
+    {
+        size_t length = strcspn(text, ",");
+        if (length == 0 || length >= sizeof(item))
+        {
+            return 0;
+        }
+        memcpy(item, text, length);
+        item[length] = '\0';
+        text += length + (text[length] == ',');
+
+        int bit = types ? midi_timeline_parseType(item) - 8 : atoi(item) - 1;
+        if (bit < 0 || bit >= (types ? 8 : 16))
+        {
+            ERROR("Unknown %s: %s\n", types ? "event type" : "channel", item);
+            return 0;
+        }
+        *mask |= 1u << bit;
+    }
+    return *mask != 0;
+}
+
+/*!
+    \brief Parses a comma-separated list of FROM:TO channel pairs (1 to 16)
+    into a channel map. Channels not listed are kept.
+
+    @param text list to parse
+    @param channel_map map to update
+    @return 1 on success, 0 if a pair isn't valid.
+*/
+static int parse_remap(const char * text, uint8_t * channel_map)
+{
+    while (*text != '\0')
+    {
+        int from, to, length;
+        if (sscanf(text, "%d:%d%n", &from, &to, &length) != 2 || from < 1 || from > 16 || to < 1 || to > 16)
+        {
+            return 0;
+        }
+        channel_map[from - 1] = to - 1;
+        text += length;
+        if (*text == ',')
+        {
+            text++;
+        }
+        else if (*text != '\0')
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*  Whether a channel map leaves every channel where it is.    */
+static int is_identity(const uint8_t * channel_map)
+{
+    for (int channel = 0; channel < 16; channel++)
+    {
+        if (channel_map[channel] != channel)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
 
 /*!
     Handles all arguments passed into the program. Success means that the
@@ -56,6 +198,26 @@ int parse_args(int argc, char * argv[], struct main_params * params)
     /*  Default initialization values   */
     params->midi_file = NULL;
     params->device_file = -1;
+    params->running_status = 0;
+    params->log_async = 0;
+    params->batch = 0;
+    params->num_jobs = 0;
+    params->stream = 0;
+    params->cache_dir = NULL;
+    params->start_seconds = 0;
+    params->stats_format = MIDI_STATS_NONE;
+    params->query_set = 0;
+    params->num_streams = 1;
+    memset(params->streams, 0, sizeof(params->streams));
+    for (int channel = 0; channel < 16; channel++)
+    {
+        params->streams[0].channel_map[channel] = channel;
+    }
+    params->query = (struct MIDIQuery) {0, UINT64_MAX, MIDI_QUERY_ALL_CHANNELS, MIDI_QUERY_ALL_TYPES};
+    params->realtime = 0;
+    params->alsa = 0;
+    params->alsa_destination = NULL;
+    memset(&(params->batch_list), 0, sizeof(params->batch_list));
     memset(params->midi_filename, 0, MAX_FILENAME_LENGTH);
     memset(params->dev_filename, 0, MAX_FILENAME_LENGTH);
 
@@ -71,17 +233,174 @@ int parse_args(int argc, char * argv[], struct main_params * params)
             params->device_file = open(&(argv[cntr][10]), O_WRONLY, 0);
 
             /*  Store the filename of the device    */
-            strncpy( &(params->dev_filename[0]), &(argv[cntr][10]), MAX_FILENAME_LENGTH);
+            snprintf((char *) params->dev_filename, MAX_FILENAME_LENGTH, "%s", &(argv[cntr][10]));
             DEBUG("The resulting FD number was: %d\n", params->device_file);
         }
+        else if (!strncmp("--loglevel=", argv[cntr], 11))
+        {
+            /*  Verbosity at runtime; levels compiled out stay out.  */
+            const char * level = &(argv[cntr][11]);
+            char * end;
+            long number = strtol(level, &end, 10);
+            if (!strcmp(level, "none") || !strcmp(level, "error") || !strcmp(level, "warn") ||
+                !strcmp(level, "debug"))
+            {
+                log_level = !strcmp(level, "none") ? LOG_LEVEL_NONE :
+                            !strcmp(level, "error") ? LOG_LEVEL_ERROR :
+                            !strcmp(level, "warn") ? LOG_LEVEL_WARN : LOG_LEVEL_DEBUG;
+            }
+            else if (*level != '\0' && *end == '\0' && number >= LOG_LEVEL_NONE && number <= LOG_LEVEL_DEBUG)
+            {
+                log_level = (int) number;
+            }
+            else
+            {
+                ERROR("Unknown log level: %s\n", level);
+                ret = 0;
+            }
+        }
+        else if (!strncmp("--logfile=", argv[cntr], 10))
+        {
+            if (pet_log_file_init(&(argv[cntr][10])) != 0)
+            {
+                ERROR("Couldn't open the following log file: %s\n", &(argv[cntr][10]));
+            }
+        }
+        else if (!strcmp("--runningstatus", argv[cntr]))
+        {
+            /*  Leave out repeated status bytes on the wire.    */
+            params->running_status = 1;
+        }
+        else if (!strcmp("--logasync", argv[cntr]))
+        {
+            /*  Hand log lines to a background thread, off the playback path.   */
+            params->log_async = 1;
+        }
+        else if (!strcmp("--batch", argv[cntr]))
+        {
+            /*  Every argument after this that isn't an option is a file or
+                directory to analyze.   */
+            params->batch = 1;
+        }
+        else if (!strncmp("--jobs=", argv[cntr], 7))
+        {
+            params->num_jobs = atoi(&(argv[cntr][7]));
+        }
+        else if (!strncmp("--cache=", argv[cntr], 8))
+        {
+            /*  Directory to keep decoded files in, to skip parsing them next time.  */
+            params->cache_dir = &(argv[cntr][8]);
+        }
+        else if (!strcmp("--realtime", argv[cntr]))
+        {
+            /*  SCHED_FIFO and locked memory for the output thread, if allowed.  */
+            params->realtime = 1;
+        }
+        else if (!strcmp("--alsa", argv[cntr]) || !strncmp("--alsa=", argv[cntr], 7))
+        {
+            /*  Hand events to the ALSA sequencer ahead of time, and let it
+                do the timing. Optionally connected to a port.   */
+            params->alsa = 1;
+            params->alsa_destination = argv[cntr][6] ? &(argv[cntr][7]) : NULL;
+        }
+        else if (!strncmp("--start=", argv[cntr], 8))
+        {
+            /*  Seconds into the file to start playing from.    */
+            params->start_seconds = atof(&(argv[cntr][8]));
+        }
+        else if (!strncmp("--stats=", argv[cntr], 8))
+        {
+            /*  Print statistics, as csv or json, instead of playing.   */
+            params->stats_format = midi_stats_parseFormat(&(argv[cntr][8]));
+            if (params->stats_format == MIDI_STATS_NONE)
+            {
+                ERROR("Unknown statistics format: %s\n", &(argv[cntr][8]));
+                ret = 0;
+            }
+        }
+        else if (!strncmp("--query=", argv[cntr], 8))
+        {
+            /*  Print the events in a window of time instead of playing.   */
+            params->query_set = 1;
+            if (!parse_window(&(argv[cntr][8]), &(params->query)))
+            {
+                ERROR("Invalid query window: %s\n", &(argv[cntr][8]));
+                ret = 0;
+            }
+        }
+        else if (!strncmp("--channels=", argv[cntr], 11) || !strncmp("--types=", argv[cntr], 8))
+        {
+            /*  Filters for --query.    */
+            int types = (argv[cntr][2] == 't');
+            unsigned mask;
+            if (!parse_filter(strchr(argv[cntr], '=') + 1, types, &mask))
+            {
+                ret = 0;
+            }
+            else if (types)
+            {
+                params->query.types = mask;
+            }
+            else
+            {
+                params->query.channels = mask;
+            }
+        }
+        else if (!strncmp("--stem=", argv[cntr], 7))
+        {
+            /*  Another file to play along with the main one.  */
+            if (params->num_streams == MAX_STREAMS)
+            {
+                ERROR("Too many stems, at most %d files can be played together.\n", MAX_STREAMS);
+                ret = 0;
+            }
+            else
+            {
+                struct main_stream * stream = &(params->streams[params->num_streams++]);
+                stream->path = &(argv[cntr][7]);
+                for (int channel = 0; channel < 16; channel++)
+                {
+                    stream->channel_map[channel] = channel;
+                }
+            }
+        }
+        else if (!strncmp("--offset=", argv[cntr], 9))
+        {
+            /*  When the last stem (or the main file, before any) starts.  */
+            if (!parse_time(&(argv[cntr][9]), &(params->streams[params->num_streams - 1].offset_ns)))
+            {
+                ERROR("Invalid offset: %s\n", &(argv[cntr][9]));
+                ret = 0;
+            }
+        }
+        else if (!strncmp("--remap=", argv[cntr], 8))
+        {
+            /*  Channels of the last stem (or the main file, before any) to move.  */
+            if (!parse_remap(&(argv[cntr][8]), params->streams[params->num_streams - 1].channel_map))
+            {
+                ERROR("Invalid channel map: %s\n", &(argv[cntr][8]));
+                ret = 0;
+            }
+        }
+        else if (!strncmp("--filelist=", argv[cntr], 11))
+        {
+            /*  A file (or - for stdin) listing one path per line. Implies --batch.  */
+            params->batch = 1;
+            midi_batch_addFileList(&(params->batch_list), &(argv[cntr][11]));
+        }
+        else if (params->batch)
+        {
+            midi_batch_addPath(&(params->batch_list), argv[cntr]);
+        }
         else if (cntr == (argc-1))
         {
             /*  In an ideal situation, this would be the file itself.   */
             DEBUG("Opening the following MIDI file: %s\n", argv[cntr]);
-            params->midi_file = fopen(argv[cntr], "rb");
+            params->stream = !strcmp("-", argv[cntr]);
+            params->midi_file = params->stream ? stdin : fopen(argv[cntr], "rb");
 
             /*  Store the filename of the MIDI file.    */
-            strncpy( &(params->midi_filename[0]), &(argv[cntr][0]), MAX_FILENAME_LENGTH);
+            snprintf((char *) params->midi_filename, MAX_FILENAME_LENGTH, "%s", argv[cntr]);
             DEBUG("Opening the file was %s.\n", (params->midi_file == NULL) ? "unsuccessful--an error occurred" : "successful");
         }
         cntr++;
@@ -92,6 +411,576 @@ int parse_args(int argc, char * argv[], struct main_params * params)
 }
 
 
+/*!
+    \brief Opens the output chosen on the command line: the ALSA sequencer
+    with --alsa, else the device of --mididev=, if any.
+
+    @param params parsed arguments
+    @param output output to open
+    @return 1 on success, 0 on failure.
+*/
+static int open_output(struct main_params * params, struct MIDIOutput * output)
+{
+    if (params->alsa)
+    {
+        return midi_alsa_open(output, params->alsa_destination);
+    }
+    return midi_output_init(output, params->device_file, params->running_status);
+}
+
+/*  Size of the slices read from a streamed MIDI file.   */
+#define STREAM_READ_SIZE 4096
+
+/*  State of a MIDI file played and analyzed while it is still arriving.    */
+struct StreamPlayback
+{
+    struct MIDIStream       stream;
+    struct MIDITempoMap     tempoMap;
+    struct MIDIScheduler    scheduler;
+    struct MIDIOutput       output;
+    int                     live;       /*  Boolean, whether events are played as they arrive  */
+    uint32_t                due_tick;   /*  Tick of the events queued for output   */
+    int                     hint;       /*  Tempo change of due_tick, for a timed output    */
+
+    /*  Analysis    */
+    uint32_t                end_tick;   /*  Tick of the latest event seen, in any track    */
+    long                    events;
+    long                    notes;
+};
+
+/*  Hands what is queued to the output: right away, once the device is
+    due it, or ahead of time to a timed backend, which waits itself.   */
+static void stream_flush(struct StreamPlayback * playback)
+{
+    if (playback->output.size == 0)
+    {
+        return;
+    }
+    if (playback->output.backend->timed)
+    {
+        midi_output_flushAt(&(playback->output),
+            midi_tempo_tickToNs(&(playback->tempoMap), &(playback->hint), playback->due_tick));
+    }
+    else
+    {
+        midi_output_flush(&(playback->output));
+    }
+}
+
+static void stream_event(void * ctx, const struct MIDIStreamEvent * event)
+{
+    struct StreamPlayback * playback = ctx;
+
+    if (playback->tempoMap.changes == NULL)
+    {
+        /*  First event: the MThd is complete, so the clock can start.  */
+        if (midi_tempo_init(&(playback->tempoMap), playback->stream.division) < 0)
+        {
+            exit(-1);
+        }
+        midi_sched_start(&(playback->scheduler), &(playback->tempoMap));
+        midi_output_start(&(playback->output), 0);
+
+        /*  Only a format 0 file has every event in time order; the tracks of
+            other formats can only be merged once they have all arrived.    */
+        playback->live = (playback->stream.format == 0);
+        if (!playback->live)
+        {
+            WARN("Format %d streams are analyzed, but not played.\n", playback->stream.format);
+        }
+    }
+
+    playback->end_tick = (event->tick > playback->end_tick) ? event->tick : playback->end_tick;
+
+    /*  Sysex and meta payloads may arrive in pieces; count the event once.   */
+    if (event->payload_offset == 0)
+    {
+        playback->events++;
+        playback->notes += ((event->status >> 4) == 0x9 && event->data2 > 0);
+    }
+
+    /*  Tempo changes of every track apply to the whole file, as in
+        midi_tempo_build(); those of a later track are slotted in.  */
+    uint32_t usec_per_quarter;
+    if (event->status == MIDI_STATUS_META && event->data1 == MIDI_META_TEMPO &&
+        event->payload_len == event->length && midi_parse_tempo(event->payload, event->payload_len, &usec_per_quarter))
+    {
+        midi_tempo_append(&(playback->tempoMap), event->tick, usec_per_quarter);
+    }
+
+    if (!playback->live || event->status == MIDI_STATUS_META)
+    {
+        return;
+    }
+
+    /*  Write out what is queued, and wait, whenever time moves on.  */
+    if (event->tick != playback->due_tick)
+    {
+        stream_flush(playback);
+        if (!playback->output.backend->timed)
+        {
+            midi_sched_waitForTick(&(playback->scheduler), event->tick);
+        }
+        playback->due_tick = event->tick;
+    }
+
+    if (event->status < 0xF0)
+    {
+        unsigned char bytes[3] = {event->status, event->data1, event->data2};
+        midi_output_queue(&(playback->output), bytes, midi_parse_channelSize[event->status >> 4]);
+    }
+    else if (event->payload_len == event->length)
+    {
+        /*  Sysex: an F0 message carries its own leading F0 on the wire, while an
+            F7 "escape" sends the payload as-is.  */
+        unsigned char bytes[MIDI_STREAM_PAYLOAD_SIZE + 1];
+        int lead = (event->status == 0xF0);
+        bytes[0] = 0xF0;
+        memcpy(&bytes[lead], event->payload, event->payload_len);
+        midi_output_queue(&(playback->output), bytes, event->payload_len + lead);
+    }
+    else if (event->payload_offset == 0)
+    {
+        WARN("Sysex of %u bytes at tick %u is too long to stream, skipped.\n", event->length, event->tick);
+    }
+}
+
+/*!
+    Plays and analyzes a MIDI file while it is being read, one slice at a
+    time, so it can come from a pipe and playback starts with the first
+    complete event. Prints the same summary line as batch mode.
+
+    @param params pointer to the program arguments
+    @return 0 on success, or -1 if the stream was malformed.
+*/
+static int play_stream(struct main_params * params)
+{
+    struct StreamPlayback * playback = calloc(1, sizeof(struct StreamPlayback));
+    if (playback == NULL)
+    {
+        ERROR("Allocation failed for the stream.\n");
+        return -1;
+    }
+    midi_stream_init(&(playback->stream), stream_event, playback);
+    if (!open_output(params, &(playback->output)))
+    {
+        exit(-1);
+    }
+
+    unsigned char slice[STREAM_READ_SIZE];
+    ssize_t bytes_read;
+    int ret = 0;
+    while ((bytes_read = read(fileno(params->midi_file), slice, sizeof(slice))) != 0)
+    {
+        if (bytes_read < 0)
+        {
+            if (errno == EINTR) continue;
+            ERROR("Couldn't read %s: %s\n", params->midi_filename, strerror(errno));
+            ret = -1;
+            break;
+        }
+        if (midi_stream_push(&(playback->stream), slice, bytes_read) < 0)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    if (ret == 0)
+    {
+        ret = midi_stream_finish(&(playback->stream));
+    }
+    stream_flush(playback);
+    midi_output_drain(&(playback->output));
+
+    /*  Worked out at the end, once every tempo change has arrived.  */
+    int hint = 0;
+    uint64_t duration = playback->tempoMap.changes ?
+        midi_tempo_tickToNs(&(playback->tempoMap), &hint, playback->end_tick) : 0;
+
+    if (ret == 0)
+    {
+        printf("%s: OK tracks=%d events=%ld notes=%ld tempo_changes=%d duration=%.3fs\n",
+            params->midi_filename, playback->stream.tracks_seen, playback->events, playback->notes,
+            playback->tempoMap.num_changes, duration / 1e9);
+    }
+    else
+    {
+        printf("%s: FAILED (%s)\n", params->midi_filename,
+            playback->stream.error ? playback->stream.error : strerror(errno));
+    }
+
+    if (params->device_file >= 0 || params->alsa)
+    {
+        midi_output_report(&(playback->output));
+    }
+    midi_output_free(&(playback->output));
+    midi_tempo_free(&(playback->tempoMap));
+    free(playback);
+    return ret;
+}
+
+/*	Maps a MIDI file, decodes its tracks and builds its tempo map. Returns 1
+	on success, 0 on failure.	*/
+static int decode_file(struct main_params * params, struct MIDIArena * arena, struct MIDIFile * midiFile,
+	struct MIDITimeline * timeline, struct MIDITempoMap * tempoMap)
+{
+	/*	Given a MIDI file, map it into memory. The blocks are views into the
+		mapping, so nothing is copied.	*/
+	*midiFile = map_midi_file(fileno(params->midi_file), arena);
+
+	/*	At this point, we no longer need to keep the MIDI file open. We can close it now!
+		The mapping stays valid after the descriptor is closed.	*/
+	fclose(params->midi_file);
+
+	if (midiFile->num_blocks == 0)
+	{
+		ERROR("Couldn't load any blocks from the following MIDI file: %s\n", params->midi_filename);
+		return 0;
+	}
+
+	/*	Statistics go to standard output on their own.	*/
+	for (int cntr = 0; params->stats_format == MIDI_STATS_NONE && !params->query_set && cntr < midiFile->num_blocks;
+		cntr++)
+	{
+		printf("ARR_BLOCK #%d:\n"
+			"\tHeader: %.4s\n"
+			"\tSize: %d\n"
+			"\n",
+			cntr,
+			midiFile->blockArr[cntr].header,
+			midiFile->blockArr[cntr].n_data_size);
+	}
+
+	/*	Decode every MTrk exactly once. Playback walks the resulting arrays,
+		so there's no byte parsing left on the hot path. Large files are
+		decoded one track per thread; the pool is gone before playback starts.	*/
+	struct MIDIPool pool;
+	int have_pool = midi_pool_init(&pool, params->num_jobs) > 1;
+	if (!have_pool && pool.num_threads)
+	{
+		midi_pool_destroy(&pool);
+	}
+
+	int compiled = midi_timeline_compileParallel(midiFile, timeline, have_pool ? &pool : NULL, arena);
+	if (have_pool)
+	{
+		midi_pool_destroy(&pool);
+	}
+	if (compiled < 0)
+	{
+		ERROR("Couldn't decode the tracks of the following MIDI file: %s\n", params->midi_filename);
+		unmap_midi_file(midiFile);
+		return 0;
+	}
+
+	for (int cntr = 0; cntr < timeline->num_tracks; cntr++)
+	{
+		DEBUG("Track #%d has %d events that can be played.\n", cntr, timeline->tracks[cntr].num_events);
+	}
+	DEBUG("Decoded into %zu bytes (%zu reserved) with %lu allocations.\n",
+		arena->peak, arena->reserved, arena->allocations);
+
+	/*	Build the tempo map, to convert ticks into time.	*/
+	if (midi_tempo_build(midiFile, timeline, tempoMap) < 0)
+	{
+		ERROR("Couldn't build the tempo map of the following MIDI file: %s\n", params->midi_filename);
+		return 0;
+	}
+	return 1;
+}
+
+/*!
+    \brief With a timed backend, hands over what was queued for the previous
+    deadline once an event is due later.
+
+    @param output output with a timed backend
+    @param ns time the next event is due
+    @param due time the events queued so far are due; updated
+*/
+static void flush_before(struct MIDIOutput * output, uint64_t ns, uint64_t * due)
+{
+	if (ns != *due)
+	{
+		midi_output_flushAt(output, *due);
+		*due = ns;
+	}
+}
+
+/*!
+    \brief Plays a decoded file to the device, from --start= on.
+
+    @param params parsed arguments
+    @param timeline compiled tracks of the file
+    @param tempoMap tempo map of the file
+*/
+static void play_timeline(struct main_params * params, const struct MIDITimeline * timeline,
+	const struct MIDITempoMap * tempoMap)
+{
+	/*	Playback starts at tick 0, or wherever --start= asked for.	*/
+	uint64_t startNs = (params->start_seconds > 0) ? (uint64_t) (params->start_seconds * 1e9) : 0;
+
+	/*	Events due at the same time are written to the device together.	*/
+	struct MIDIOutput output;
+	if (!open_output(params, &output))
+	{
+		exit(-1);
+	}
+
+	/*	Merge the tracks into one stream of events, ordered by tick.	*/
+	struct MIDIMerge merge;
+	if (!midi_merge_init(&merge, timeline))
+	{
+		exit(-1);
+	}
+
+	/*	What the device has been sent, so that a jump knows what to undo.	*/
+	struct MIDISeekState live;
+	midi_seek_initState(&live);
+
+	/*	Seeking goes straight to the first event due at or after the start
+		time in every track, without replaying anything before it; the
+		checkpoint index brings the channels to the state they would be in.	*/
+	struct MIDISeekIndex seekIndex = {0};
+	if (startNs > 0 && midi_seek_build(timeline, 0, &seekIndex) >= 0)
+	{
+		uint32_t startTick = midi_tempo_nsToTick(tempoMap, startNs);
+		int hint = 0;
+		startTick += (midi_tempo_tickToNs(tempoMap, &hint, startTick) < startNs && startTick < UINT32_MAX);
+		midi_merge_seek(&merge, startTick);
+		midi_seek_jump(&seekIndex, timeline, &live, startTick, &output);
+		midi_output_flush(&output);
+
+		struct MIDISMPTEOffset smpte;
+		midi_tempo_nsToSmpte(startNs, 30, &smpte);
+		DEBUG("Starting at %02d:%02d:%02d:%02d, tick %u.\n",
+			smpte.hours, smpte.minutes, smpte.seconds, smpte.frames, startTick);
+	}
+
+	int track, index, hint = 0;
+	if (output.backend->timed)
+	{
+		/*	The backend does the timing: hand everything over as fast as it
+			takes it, a deadline at a time, and wait for the end.	*/
+		midi_output_start(&output, startNs);
+		uint64_t due = startNs;
+		while (midi_merge_next(&merge, &track, &index))
+		{
+			flush_before(&output, midi_tempo_tickToNs(tempoMap, &hint, timeline->tracks[track].tick[index]), &due);
+			midi_output_queueEvent(&output, &(timeline->tracks[track]), index);
+			midi_seek_apply(&live, &(timeline->tracks[track]), index);
+		}
+		midi_output_flushAt(&output, due);
+		midi_output_drain(&output);
+		midi_output_report(&output);
+	}
+	else
+	{
+		/*	The output thread waits for deadlines and writes to the device;
+			this thread merges the tracks and times the events, ahead of it.	*/
+		struct MIDIScheduler scheduler;
+		struct MIDIPlayer player;
+		if (!midi_player_start(&player, timeline, &scheduler, &output, &live, params->realtime))
+		{
+			exit(-1);
+		}
+
+		/*	Start the clock only now, after locking memory and starting the
+			thread. The output thread reads it after the first push.	*/
+		midi_sched_startAt(&scheduler, tempoMap, startNs);
+
+		while (midi_merge_next(&merge, &track, &index))
+		{
+			uint64_t ns = midi_tempo_tickToNs(tempoMap, &hint, timeline->tracks[track].tick[index]);
+			midi_player_push(&player, ns, track, index);
+		}
+		midi_player_finish(&player);
+
+		if (params->device_file >= 0)
+		{
+			midi_output_report(&output);
+			midi_player_report(&player);
+		}
+		midi_player_free(&player);
+	}
+
+	midi_seek_free(&seekIndex);
+	midi_output_free(&output);
+	midi_merge_free(&merge);
+}
+
+/*!
+    \brief Loads and decodes a stem given with --stem=.
+
+    @param path path of the stem
+    @param arena arena to decode into
+    @param midiFile where to map the file
+    @param timeline where to decode its tracks
+    @param tempoMap where to build its tempo map
+    @return 1 on success, 0 if the stem couldn't be loaded.
+*/
+static int load_stem(const char * path, struct MIDIArena * arena, struct MIDIFile * midiFile,
+	struct MIDITimeline * timeline, struct MIDITempoMap * tempoMap)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		ERROR("Couldn't open the following stem: %s\n", path);
+		return 0;
+	}
+	*midiFile = map_midi_file(fd, arena);
+	close(fd);
+
+	if (midiFile->num_blocks == 0 || midi_timeline_compile(midiFile, timeline, arena) < 0)
+	{
+		ERROR("Couldn't decode the following stem: %s\n", path);
+		unmap_midi_file(midiFile);
+		return 0;
+	}
+	if (midi_tempo_build(midiFile, timeline, tempoMap) < 0)
+	{
+		ERROR("Couldn't build the tempo map of the following stem: %s\n", path);
+		midi_timeline_free(timeline);
+		unmap_midi_file(midiFile);
+		return 0;
+	}
+	return 1;
+}
+
+/*!
+    \brief Plays the main file along with its stems, each from its own
+    offset and on its own channels, through one scheduler and one output
+    thread.
+
+    @param params parsed arguments
+    @param timeline compiled tracks of the main file
+    @param tempoMap tempo map of the main file
+    @param arena arena to decode the stems into
+*/
+static void play_mix(struct main_params * params, const struct MIDITimeline * timeline,
+	const struct MIDITempoMap * tempoMap, struct MIDIArena * arena)
+{
+	struct MIDIFile stemFiles[MAX_STREAMS];
+	struct MIDITimeline stemTimelines[MAX_STREAMS];
+	struct MIDITempoMap stemTempoMaps[MAX_STREAMS];
+	int loaded[MAX_STREAMS] = {0};
+
+	struct MIDIMixer mixer;
+	if (!midi_mixer_init(&mixer, params->num_streams))
+	{
+		exit(-1);
+	}
+	midi_mixer_addStream(&mixer, timeline, tempoMap, params->streams[0].offset_ns, params->streams[0].channel_map);
+	for (int stem = 1; stem < params->num_streams; stem++)
+	{
+		const struct main_stream * stream = &(params->streams[stem]);
+		loaded[stem] = load_stem(stream->path, arena, &(stemFiles[stem]), &(stemTimelines[stem]),
+			&(stemTempoMaps[stem]));
+		if (loaded[stem])
+		{
+			midi_mixer_addStream(&mixer, &(stemTimelines[stem]), &(stemTempoMaps[stem]), stream->offset_ns,
+				stream->channel_map);
+		}
+	}
+	DEBUG("Mixing %d of %d files.\n", mixer.num_streams, params->num_streams);
+
+	if (params->start_seconds > 0)
+	{
+		WARN("--start isn't supported along with --stem, playing from the beginning.\n");
+	}
+
+	struct MIDIOutput output;
+	if (!open_output(params, &output))
+	{
+		exit(-1);
+	}
+
+	/*	Every stream is timed in nanoseconds from the start of the mix, so
+		one clock serves them all.	*/
+	int stream, track, index;
+	uint64_t ns;
+	if (output.backend->timed)
+	{
+		midi_output_start(&output, 0);
+		uint64_t due = 0;
+		while (midi_mixer_next(&mixer, &stream, &track, &index, &ns))
+		{
+			flush_before(&output, ns, &due);
+			midi_output_queueMapped(&output, &(mixer.sources[stream].timeline->tracks[track]), index,
+				mixer.sources[stream].channel_map);
+		}
+		midi_output_flushAt(&output, due);
+		midi_output_drain(&output);
+		midi_output_report(&output);
+	}
+	else
+	{
+		struct MIDIScheduler scheduler;
+		struct MIDIPlayer player;
+		if (!midi_player_startSources(&player, mixer.sources, mixer.num_streams, &scheduler, &output,
+			params->realtime))
+		{
+			exit(-1);
+		}
+		midi_sched_start(&scheduler, tempoMap);
+
+		while (midi_mixer_next(&mixer, &stream, &track, &index, &ns))
+		{
+			midi_player_pushFrom(&player, stream, ns, track, index);
+		}
+		midi_player_finish(&player);
+
+		if (params->device_file >= 0)
+		{
+			midi_output_report(&output);
+			midi_player_report(&player);
+		}
+		midi_player_free(&player);
+	}
+	midi_output_free(&output);
+	midi_mixer_free(&mixer);
+	for (int stem = 1; stem < params->num_streams; stem++)
+	{
+		if (loaded[stem])
+		{
+			midi_tempo_free(&(stemTempoMaps[stem]));
+			midi_timeline_free(&(stemTimelines[stem]));
+			unmap_midi_file(&(stemFiles[stem]));
+		}
+	}
+}
+
+/*!
+    \brief Prints the events a query finds, as CSV.
+
+    @param queryIndex index of the file
+    @param timeline compiled tracks the index refers to
+    @param query window and filters
+*/
+static void print_query(const struct MIDIQueryIndex * queryIndex, const struct MIDITimeline * timeline,
+	const struct MIDIQuery * query)
+{
+	struct MIDIQueryCursor cursor;
+	int position;
+	midi_query_start(queryIndex, query, &cursor);
+
+	printf("time_s,track,channel,type,data1,data2\n");
+	while (midi_query_next(&cursor, &position))
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[queryIndex->track[position]]);
+		int index = queryIndex->index[position];
+		uint8_t status = events->status[index];
+
+		/*	Channels are numbered from 1, as on instruments.	*/
+		char channel[4] = "";
+		if (status < 0xF0)
+		{
+			snprintf(channel, sizeof(channel), "%d", (status & 0x0F) + 1);
+		}
+		printf("%.6f,%d,%s,%s,%d,%d\n", queryIndex->ns[position] / 1e9, queryIndex->track[position], channel,
+			midi_timeline_typeName(status), events->data1[index], events->data2[index]);
+	}
+}
+
 /*!
    \brief Main entry point for the application.
 
@@ -141,9 +1030,33 @@ int main(int argc, char * argv[])
         we have enough arguments to successfully run the program.   */
     if (!parse_args(argc, argv, &params))
     {
-        /*	Processing the arguments failed. Something weird happened.	*/
+        /*	Processing the arguments failed. Rather than carry on with
+            defaults (unfiltered output, for a mistyped --query), stop here.	*/
         printf("Invalid arguments. Expected the following:\n"
-                "./%s [--mididev=*dev/midi*] *file*.midi", argv[0]);
+                "./%s [--mididev=*dev/midi*|--alsa[=*client:port*]] [--runningstatus] [--realtime]\n"
+                "\t[--loglevel=none|error|warn|debug] [--logfile=*file*] [--logasync] [--cache=*dir*]\n"
+                "\t[--start=*seconds*] [--stats=csv|json]\n"
+                "\t[--query=[*from*]-[*to*] [--channels=*n*,...] [--types=*type*,...]]\n"
+                "\t[--offset=*time*] [--remap=*from*:*to*,...] [--stem=*file* [--offset=*time*] [--remap=...]]...\n"
+                "\t*file*.midi|-\n"
+                "./%s [options] --batch [--jobs=*n*] [--filelist=*list*] *file or directory*...\n",
+                argv[0], argv[0]);
+        return -1;
+    }
+
+    if (params.log_async && log_async_start() != 0)
+    {
+        ERROR("Couldn't start the log thread, logging synchronously.\n");
+    }
+
+    if (params.batch)
+    {
+        /*  Analyze every file given, across all cores, instead of playing one.    */
+        int failures = midi_batch_run(&(params.batch_list), params.num_jobs, params.cache_dir,
+            params.stats_format, stdout);
+        midi_batch_freeList(&(params.batch_list));
+        log_async_stop();
+        return (failures == 0) ? 0 : 1;
     }
 
     /*	Arguments have been saved into the params structure.
@@ -154,195 +1067,93 @@ int main(int argc, char * argv[])
   		return -1;
   	}
 
+    if (params.stream)
+    {
+        /*  Standard input can't be mapped; parse it as it arrives instead.   */
+        int ret = play_stream(&params);
+        log_async_stop();
+        return ret;
+    }
+
 	/*	MIDI file has been successfully loaded, ready to analyze.	*/
     DEBUG("File %s is ready to be analyzed.\n", params.midi_filename);
 
-	/*	Given a MIDI file, begin to load it into memory.	*/
-	struct MIDIBlockNode * list = alloc_midi_file(params.midi_file);
-
-	/*	Convert the linked list into an array	*/
-	struct MIDIFile midiFile = convert_ll_to_MIDIFile(list);
-
-	/*	At this point, we no longer need to keep the MIDI file open. We can close it now!	*/
-	fclose(params.midi_file);
-
-	for (int cntr = 0; cntr < midiFile.num_blocks; cntr++)
+	/*	Everything decoded from the file lives in one arena, released at the end.	*/
+	struct MIDIArena arena;
+	midi_arena_init(&arena, 0);
+
+	/*	With --cache, a file decoded before is mapped back in, ready to play.	*/
+	struct MIDICacheKey cacheKey;
+	struct MIDICache cache;
+	char cachePath[4096];
+	int useCache = params.cache_dir != NULL && midi_cache_keyFromFd(fileno(params.midi_file), &cacheKey) &&
+		midi_cache_path(params.cache_dir, &cacheKey, cachePath, sizeof(cachePath));
+	int cached = useCache && midi_cache_open(cachePath, &cacheKey, &cache);
+
+	struct MIDIFile midiFile = {0};
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	if (cached)
 	{
-		printf("ARR_BLOCK #%d:\n"
-			"\tHeader: %.4s\n"
-			"\tSize: %d\n"
-			"\n",
-			cntr,
-			midiFile.blockArr[cntr].header,
-			midiFile.blockArr[cntr].n_data_size);
+		DEBUG("Loaded %d decoded tracks from %s.\n", cache.timeline.num_tracks, cachePath);
+		fclose(params.midi_file);
+		timeline = cache.timeline;
+		tempoMap = cache.tempoMap;
+	}
+	else if (!decode_file(&params, &arena, &midiFile, &timeline, &tempoMap))
+	{
+		return -1;
+	}
+	else if (useCache)
+	{
+		midi_cache_write(cachePath, &cacheKey, &midiFile, &timeline, &tempoMap);
 	}
 
-	for (int cntr = 0; cntr < midiFile.num_blocks; cntr++)
+	if (params.stats_format != MIDI_STATS_NONE)
 	{
-		if (!strncmp("MTrk", midiFile.blockArr[cntr].header, 4))
-		{
-			DEBUG("Block #%d is a MTrk that can be played.\n", cntr);
-			midiFile.blockArr[cntr].bActive = 1;
-			midiFile.blockArr[cntr].nCurrentPos = 0;
-			updateDeltaTimePos( &(midiFile.blockArr[cntr]));
-		}
-		else
+		/*	Statistics instead of playback.	*/
+		struct MIDIStats stats;
+		if (midi_stats_compute(&timeline, &tempoMap, &arena, &stats))
 		{
-			DEBUG("Block #%d of type %.4s cannot be played.\n", cntr, midiFile.blockArr[cntr].header);
-			midiFile.blockArr[cntr].bActive = 0;
+			midi_stats_writeHeader(stdout, params.stats_format);
+			midi_stats_write(stdout, params.stats_format, (const char *) params.midi_filename, &stats);
 		}
-
+		midi_stats_free(&stats);
 	}
-
-	#define EVENT_BUFFER_SIZE 32
-	unsigned char dev_buffer[EVENT_BUFFER_SIZE];
-
-	while(isPlaying(midiFile))
+	else if (params.query_set)
 	{
-		/*	Initialize the timer.	*/
-		clock_t startTime = clock();
-
-		int block_iter = 0;
-		for (block_iter = 0; block_iter < midiFile.num_blocks; block_iter++)
+		/*	The events of a window of time instead of playback.	*/
+		struct MIDIQueryIndex queryIndex;
+		if (midi_query_build(&timeline, &tempoMap, &arena, &queryIndex) >= 0)
 		{
-			/*	Grab the current MIDIBlock from the array.	*/
-			struct MIDIBlock * currentBlock = &(midiFile.blockArr[block_iter]);
-
-			printf("BLOCK #%d, BYTES at POSITION [%d-%d): ", block_iter, currentBlock->nCurrentPos, currentBlock->nCurrentPos+16);
-			for (int i = 0; i < 15; i++)
-			{
-				printf("%02x ", currentBlock->data[currentBlock->nCurrentPos + i]);
-			}
-			printf("\n");
-			if (currentBlock->bActive)
-			{
-				/*	This is an active track	*/
-				//DEBUG("This is an active track.\n");
-
-				/*	Continuously play notes until we hit something that asks
-					for a delay	*/
-				while (currentBlock->bActive && currentBlock->nDeltaTicks <= 0)
-				{
-					DEBUG("Clearing buffer.\n");
-					/* Clear the buffer */
-					memset(dev_buffer, 0, sizeof(dev_buffer));
-
-					/*	Parse the next event, and then determine if there's anything else left to parse.	*/
-					DEBUG("Getting event.\n");
-					int bytes_read = midi_parse_getEvent(dev_buffer, EVENT_BUFFER_SIZE, &(currentBlock->data[currentBlock->nCurrentPos]) );
-					DEBUG("Read %d bytes for event.\n", bytes_read);
-
-					currentBlock->nCurrentPos += bytes_read;
-					currentBlock->bActive = (currentBlock->nCurrentPos < currentBlock->n_data_size);
-					if (!currentBlock->bActive) break;
-
-
-					/*	Write the next event to the device, if it exists	*/
-					if (params.device_file > 0)
-					{
-						DEBUG("Playing note on device %d, %d bytes...\n", params.device_file, bytes_read);
-
-						write(params.device_file, &(dev_buffer[0]), bytes_read);
-					}
-
-					if (updateDeltaTimePos(currentBlock) == 0)
-					{
-						WARN("Block #%d appears to be corrupt, or something weird happened-- will no longer play from this point on.\n", block_iter);
-						currentBlock->bActive = 0;
-						break;
-					}
-
-
-				}
-				currentBlock->nDeltaTicks--;
-			}
-			else
-			{
-				DEBUG("--> Track is INACTIVE.\n");
-			}
+			print_query(&queryIndex, &timeline, &(params.query));
 		}
-
-		while ( (double) (clock() - startTime) < 10);
+		midi_query_free(&queryIndex);
+	}
+	else if (params.num_streams > 1 || params.streams[0].offset_ns > 0 ||
+		!is_identity(params.streams[0].channel_map))
+	{
+		/*	Stems, a start offset or moved channels go through the mixer.	*/
+		play_mix(&params, &timeline, &tempoMap, &arena);
+	}
+	else
+	{
+		play_timeline(&params, &timeline, &tempoMap);
 	}
 
-
-
-
-
-
-
+	if (cached)
+	{
+		midi_cache_close(&cache);
+	}
+	else
+	{
+		midi_tempo_free(&tempoMap);
+		midi_timeline_free(&timeline);
+		unmap_midi_file(&midiFile);
+	}
+	midi_arena_free(&arena);
+	log_async_stop();
 
     return 0;
 
 }
-
-
-
-
-
-
-
-/*!
-   \brief Given a MIDI file, informs caller whether it is still playing or not.
-
-   @param midiFile a struct MIDIFile to check if it is playing
-   @return an integer representing how many blocks are still playing
-*/
-int isPlaying(struct MIDIFile midiFile)
-{
-    int isPlaying = 0;
-    int incr = 0;
-    for (; incr < midiFile.num_blocks; incr++)
-    {
-        isPlaying += midiFile.blockArr[incr].bActive;
-    }
-
-    return isPlaying;
-}
-
-/*
-    Function: int MIDIBlockStatus_updateDeltaTime(struct MIDIBlockStatus * midi_block_status)
-    Description:
-        Updates the delta-time, based on the currentPos of the block passed.
-        Returns the number of bytes read for the time-- should throw an error if
-        the file limit has been reached.
-*/
-/*! \brief Updates the time delta for the next note within a MIDIBlock
-	@param midiBlock pointer to a MIDIBlock structure
-	@return number of bytes that were read
-*/
-
-int updateDeltaTimePos(struct MIDIBlock * midiBlock)
-{
-	/*	See if we've reached the end of the file. If so, just return zero	*/
-    if (midiBlock->nCurrentPos >= midiBlock->n_data_size)
-    {
-		/*	End of the block has been reached-- we can't do any more updates.	*/
-        return 0;
-    }
-
-    // Grab the initial delta-time of the next block.
-    int deltaDeltaTime = 0;
-
-	int deltaDeltaBytes = midi_parse_varSize(
-		&(midiBlock->data[midiBlock->nCurrentPos]),
-		&deltaDeltaTime);
-
-	DEBUG("Read %d bytes to calculate delta ticks time of %d.\n", deltaDeltaBytes, deltaDeltaTime);
-    // If bytes were actually read from the file, report back the time delay
-	//	to the block.
-    if (deltaDeltaBytes)
-    {
-        midiBlock->nDeltaTicks += deltaDeltaTime;
-		midiBlock->nCurrentPos += deltaDeltaBytes;
-    }
-    else
-    {
-        // Something weird happened, and we should return 0.
-		DEBUG("WEIRDNESS HAPPENED");
-        return 0;
-    }
-
-    // Return the number of bytes that was read.
-    return deltaDeltaBytes;
-}
@@ -0,0 +1,244 @@
+/*! @file
+	Output through the ALSA sequencer. The output gets its own sequencer
+	client, port and queue; every flush is turned into sequencer events
+	scheduled on the queue at the real time it is due, and the kernel sends
+	each at its time. The whole file can therefore be handed over as fast
+	as the sequencer takes it: midi_output_flushAt() only blocks once the
+	kernel's pool of pending events is full.
+
+	The raw bytes queued on the output are turned into events by ALSA's own
+	MIDI encoder, so that everything else is shared with the raw backend.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_output.h"
+#include "midi_alsa.h"
+#include "debug.h"
+
+#ifdef HAVE_ALSA
+
+#include <alsa/asoundlib.h>
+
+struct AlsaOutput
+{
+	snd_seq_t *				seq;
+	int						port;		/*!	Our port, the events' source.	*/
+	int						queue;
+	snd_midi_event_t *		encoder;	/*!	Turns raw bytes into sequencer events.	*/
+	uint64_t				start_ns;	/*!	Time the queue started at.	*/
+};
+
+static int alsa_write(struct MIDIOutput * output, const unsigned char * bytes, size_t size, uint64_t ns)
+{
+	struct AlsaOutput * alsa = output->backend_data;
+
+	snd_seq_real_time_t time = {0, 0};
+	if (ns != MIDI_OUTPUT_NOW)
+	{
+		uint64_t offset = (ns > alsa->start_ns) ? ns - alsa->start_ns : 0;
+		time.tv_sec = offset / 1000000000ull;
+		time.tv_nsec = offset % 1000000000ull;
+	}
+
+	size_t pos = 0;
+	while (pos < size)
+	{
+		snd_seq_event_t event;
+		snd_seq_ev_clear(&event);
+		long used = snd_midi_event_encode(alsa->encoder, &(bytes[pos]), size - pos, &event);
+		if (used <= 0)
+		{
+			ERROR("Couldn't encode %zu bytes for the sequencer.\n", size - pos);
+			return -1;
+		}
+		pos += used;
+		if (event.type == SND_SEQ_EVENT_NONE)
+		{
+			/*	Part of a message, completed by the next bytes.	*/
+			continue;
+		}
+
+		snd_seq_ev_set_source(&event, alsa->port);
+		snd_seq_ev_set_subs(&event);
+		if (ns == MIDI_OUTPUT_NOW)
+		{
+			snd_seq_ev_set_direct(&event);
+		}
+		else
+		{
+			snd_seq_ev_schedule_real(&event, alsa->queue, 0, &time);
+		}
+
+		/*	Blocks while the kernel has no room for more events.	*/
+		int err = snd_seq_event_output(alsa->seq, &event);
+		if (err < 0)
+		{
+			ERROR("Couldn't send an event to the sequencer: %s\n", snd_strerror(err));
+			return -1;
+		}
+	}
+	output->bytes += size;
+
+	/*	Events due now can't wait for the buffer to fill.	*/
+	if (ns == MIDI_OUTPUT_NOW)
+	{
+		output->syscalls++;
+		snd_seq_drain_output(alsa->seq);
+	}
+	return 0;
+}
+
+static int alsa_start(struct MIDIOutput * output, uint64_t ns)
+{
+	struct AlsaOutput * alsa = output->backend_data;
+	alsa->start_ns = ns;
+
+	int err = snd_seq_start_queue(alsa->seq, alsa->queue, NULL);
+	if (err < 0)
+	{
+		ERROR("Couldn't start the sequencer queue: %s\n", snd_strerror(err));
+		return -1;
+	}
+	output->syscalls++;
+	snd_seq_drain_output(alsa->seq);
+	return 0;
+}
+
+static int alsa_drain(struct MIDIOutput * output)
+{
+	struct AlsaOutput * alsa = output->backend_data;
+
+	output->syscalls++;
+	int err = snd_seq_drain_output(alsa->seq);
+	if (err >= 0)
+	{
+		/*	Returns once the queue has sent everything it was given.	*/
+		err = snd_seq_sync_output_queue(alsa->seq);
+	}
+	if (err < 0)
+	{
+		ERROR("Couldn't drain the sequencer: %s\n", snd_strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static void alsa_close(struct MIDIOutput * output)
+{
+	struct AlsaOutput * alsa = output->backend_data;
+	if (alsa == NULL)
+	{
+		return;
+	}
+
+	if (alsa->encoder != NULL)
+	{
+		snd_midi_event_free(alsa->encoder);
+	}
+	if (alsa->queue >= 0)
+	{
+		snd_seq_free_queue(alsa->seq, alsa->queue);
+	}
+	snd_seq_close(alsa->seq);
+	free(alsa);
+	output->backend_data = NULL;
+}
+
+static const struct MIDIOutputBackend alsa_backend =
+{
+	.name = "alsa",
+	.timed = 1,
+	.write = alsa_write,
+	.start = alsa_start,
+	.drain = alsa_drain,
+	.close = alsa_close
+};
+
+/*!	\brief Opens an output on the ALSA sequencer.
+
+	@param output pointer to the output to initialize
+	@param destination sequencer port to connect to, as a client:port
+		address or client name (see aconnect -o), or NULL to connect none;
+		other clients may still subscribe to the output's port
+	@return 1 on success, 0 if the sequencer couldn't be opened.
+*/
+int midi_alsa_open(struct MIDIOutput * output, const char * destination)
+{
+	struct AlsaOutput * alsa = calloc(1, sizeof(struct AlsaOutput));
+	if (alsa == NULL)
+	{
+		ERROR("Allocation failed for the sequencer output.\n");
+		return 0;
+	}
+	alsa->queue = -1;
+
+	int err = snd_seq_open(&(alsa->seq), "default", SND_SEQ_OPEN_OUTPUT, 0);
+	if (err < 0)
+	{
+		ERROR("Couldn't open the ALSA sequencer: %s\n", snd_strerror(err));
+		free(alsa);
+		return 0;
+	}
+	snd_seq_set_client_name(alsa->seq, "midianalysis");
+
+	/*	From here on, the output owns alsa, and frees it on failure.	*/
+	if (!midi_output_initBackend(output, &alsa_backend, alsa, 0))
+	{
+		alsa_close(output);
+		return 0;
+	}
+
+	const char * failed = NULL;
+	snd_seq_addr_t address;
+	if ((alsa->port = snd_seq_create_simple_port(alsa->seq, "midianalysis",
+		SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+		SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION)) < 0)
+	{
+		err = alsa->port;
+		failed = "create a port";
+	}
+	else if ((alsa->queue = snd_seq_alloc_named_queue(alsa->seq, "midianalysis")) < 0)
+	{
+		err = alsa->queue;
+		failed = "allocate a queue";
+	}
+	else if ((err = snd_midi_event_new(MIDI_ALSA_SYSEX_SIZE, &(alsa->encoder))) < 0)
+	{
+		alsa->encoder = NULL;
+		failed = "create a MIDI encoder";
+	}
+	else if (destination != NULL && (err = snd_seq_parse_address(alsa->seq, &address, destination)) < 0)
+	{
+		failed = "find the destination port";
+	}
+	else if (destination != NULL && (err = snd_seq_connect_to(alsa->seq, alsa->port, address.client,
+		address.port)) < 0)
+	{
+		failed = "connect to the destination port";
+	}
+
+	if (failed != NULL)
+	{
+		ERROR("Couldn't %s on the ALSA sequencer: %s\n", failed, snd_strerror(err));
+		midi_output_free(output);
+		return 0;
+	}
+
+	DEBUG("Sequencer output on port %d:%d, queue %d.\n", snd_seq_client_id(alsa->seq), alsa->port, alsa->queue);
+	return 1;
+}
+
+#else
+
+int midi_alsa_open(struct MIDIOutput * output, const char * destination)
+{
+	(void) output;
+	ERROR("Built without ALSA; rebuild with make ALSA=1 to play to %s.\n",
+		destination ? destination : "the sequencer");
+	return 0;
+}
+
+#endif
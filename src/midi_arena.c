@@ -0,0 +1,185 @@
+/*! @file
+	Bump allocator. Memory is handed out from large blocks by moving a
+	pointer forward, and given back all at once, by moving it back: to a mark
+	(midi_arena_release) or to the very beginning (midi_arena_reset). Neither
+	frees anything, so an arena reused across files only ever calls malloc()
+	when a file needs more than any file before it did.
+
+	Marks nest: whatever is allocated after a mark must be released before
+	anything allocated before it. That is exactly the order in which a pool
+	thread, helping out while it waits, runs and finishes nested tasks.
+
+	An arena is not thread-safe; give each thread its own.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_arena.h"
+#include "debug.h"
+
+static size_t align_up(size_t size)
+{
+	return (size + MIDI_ARENA_ALIGN - 1) & ~(size_t) (MIDI_ARENA_ALIGN - 1);
+}
+
+/*	Allocates a block with room for at least size bytes, and chains it
+	after the last one.	*/
+static struct MIDIArenaBlock * add_block(struct MIDIArena * arena, struct MIDIArenaBlock * last, size_t size)
+{
+	size_t data_size = (size > arena->block_size) ? size : arena->block_size;
+	struct MIDIArenaBlock * block = malloc(sizeof(struct MIDIArenaBlock) + data_size);
+	if (block == NULL)
+	{
+		ERROR("Allocation failed for an arena block of %zu bytes.\n", data_size);
+		return NULL;
+	}
+	block->next = NULL;
+	block->size = data_size;
+	block->used = 0;
+	arena->reserved += sizeof(struct MIDIArenaBlock) + data_size;
+
+	if (last == NULL)
+	{
+		arena->first = block;
+	}
+	else
+	{
+		last->next = block;
+	}
+	return block;
+}
+
+/*!	\brief Initializes an empty arena. Nothing is allocated until it is used.
+
+	@param arena pointer to the arena to initialize
+	@param block_size size of the blocks to grow by, or 0 for MIDI_ARENA_BLOCK_SIZE
+*/
+void midi_arena_init(struct MIDIArena * arena, size_t block_size)
+{
+	memset(arena, 0, sizeof(struct MIDIArena));
+	arena->block_size = block_size ? align_up(block_size) : MIDI_ARENA_BLOCK_SIZE;
+}
+
+/*!	\brief Allocates memory that lives until the arena is released past it.
+
+	@param arena pointer to the arena
+	@param size number of bytes wanted
+	@return MIDI_ARENA_ALIGN-aligned memory, or NULL if an allocation failed.
+*/
+void * midi_arena_alloc(struct MIDIArena * arena, size_t size)
+{
+	size = align_up(size ? size : 1);
+	struct MIDIArenaBlock * block = arena->current;
+
+	/*	Move on to the next block with room, reusing blocks left over from
+		before the last release.	*/
+	while (block == NULL || block->size - block->used < size)
+	{
+		if (block != NULL && block->next != NULL)
+		{
+			block = block->next;
+			block->used = 0;
+			if (block->size >= size)
+			{
+				break;
+			}
+			continue;
+		}
+		if ((block = add_block(arena, block, size)) == NULL)
+		{
+			return NULL;
+		}
+		break;
+	}
+	arena->current = block;
+
+	void * ptr = &(block->data[block->used]);
+	block->used += size;
+	arena->in_use += size;
+	arena->peak = (arena->in_use > arena->peak) ? arena->in_use : arena->peak;
+	arena->allocations++;
+	return ptr;
+}
+
+/*!	\brief Allocates zeroed memory for an array.
+
+	@param arena pointer to the arena
+	@param count number of elements
+	@param size size of each element
+	@return zeroed memory, or NULL if an allocation failed.
+*/
+void * midi_arena_calloc(struct MIDIArena * arena, size_t count, size_t size)
+{
+	if (size && count > SIZE_MAX / size)
+	{
+		return NULL;
+	}
+	void * ptr = midi_arena_alloc(arena, count * size);
+	if (ptr != NULL)
+	{
+		memset(ptr, 0, count * size);
+	}
+	return ptr;
+}
+
+/*!	\brief Remembers the current position of an arena.
+
+	@param arena pointer to the arena
+	@return mark to pass to midi_arena_release()
+*/
+struct MIDIArenaMark midi_arena_mark(const struct MIDIArena * arena)
+{
+	struct MIDIArenaMark mark = {arena->current, arena->current ? arena->current->used : 0, arena->in_use};
+	return mark;
+}
+
+/*!	\brief Releases everything allocated since a mark, in constant time.
+
+	The memory stays with the arena, to be handed out again.
+
+	@param arena pointer to the arena
+	@param mark position returned by midi_arena_mark()
+*/
+void midi_arena_release(struct MIDIArena * arena, struct MIDIArenaMark mark)
+{
+	if (mark.block == NULL)
+	{
+		midi_arena_reset(arena);
+		return;
+	}
+	arena->current = mark.block;
+	arena->current->used = mark.used;
+	arena->in_use = mark.in_use;
+}
+
+/*!	\brief Releases everything allocated from an arena, in constant time.
+
+	@param arena pointer to the arena
+*/
+void midi_arena_reset(struct MIDIArena * arena)
+{
+	arena->current = arena->first;
+	if (arena->current != NULL)
+	{
+		arena->current->used = 0;
+	}
+	arena->in_use = 0;
+}
+
+/*!	\brief Returns every block of an arena to the system.
+
+	@param arena pointer to the arena; it is zeroed afterwards.
+*/
+void midi_arena_free(struct MIDIArena * arena)
+{
+	struct MIDIArenaBlock * block = arena->first;
+	while (block != NULL)
+	{
+		struct MIDIArenaBlock * next = block->next;
+		free(block);
+		block = next;
+	}
+	memset(arena, 0, sizeof(struct MIDIArena));
+}
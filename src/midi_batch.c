@@ -0,0 +1,486 @@
+/*! @file
+	Batch mode: load, decode and analyze many MIDI files at once, one pool
+	task per file. Results are printed in the order the files were given,
+	as soon as every file before them has finished, and a file that fails
+	is reported without stopping the rest of the batch.
+
+	With a statistics format, each file's statistics are printed instead of
+	its summary line, so that the output is one CSV or JSON Lines document
+	for the whole corpus; failures then go to stderr.
+*/
+
+#include <portable.h>
+#include <dirent.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "midi_reader.h"
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_pool.h"
+#include "midi_arena.h"
+#include "midi_cache.h"
+#include "midi_stats.h"
+#include "midi_batch.h"
+#include "debug.h"
+
+/*	Result of one file, filled in by whichever worker analyzed it.	*/
+struct BatchResult
+{
+	const char *	path;
+	int				ok;
+	int				done;
+	char			text[MIDI_BATCH_RESULT_SIZE];
+	char *			stats;		/*!	Statistics written for the file, or NULL.	*/
+};
+
+/*	State shared between the workers and the thread printing results.	*/
+struct BatchState
+{
+	struct BatchResult *	results;
+	struct MIDIArena *		arenas;		/*!	One per worker, reused from file to file.	*/
+	const char *			cache_dir;	/*!	Directory of cached files, or NULL.	*/
+	int						stats_format;	/*!	MIDI_STATS_*, what to print for each file.	*/
+	pthread_mutex_t			lock;
+	pthread_cond_t			finished;	/*!	Signalled whenever a result is done.	*/
+};
+
+struct BatchTask
+{
+	struct MIDIPool *		pool;
+	struct BatchState *		state;
+	struct BatchResult *	result;
+};
+
+/*	Directories are searched for files with these extensions.	*/
+static int has_midi_extension(const char * name)
+{
+	const char * dot = strrchr(name, '.');
+	return dot != NULL && (!strcasecmp(dot, ".mid") || !strcasecmp(dot, ".midi"));
+}
+
+static int compare_names(const void * a, const void * b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static int append_path(struct MIDIBatchList * list, const char * path)
+{
+	if (list->num_paths == list->capacity)
+	{
+		int capacity = list->capacity ? list->capacity * 2 : 64;
+		char ** paths = realloc(list->paths, sizeof(char *) * capacity);
+		if (paths == NULL)
+		{
+			ERROR("Allocation failed for a list of %d files.\n", capacity);
+			return 0;
+		}
+		list->paths = paths;
+		list->capacity = capacity;
+	}
+
+	if ((list->paths[list->num_paths] = strdup(path)) == NULL)
+	{
+		ERROR("Allocation failed for the path %s.\n", path);
+		return 0;
+	}
+	list->num_paths++;
+	return 1;
+}
+
+/*!	\brief Adds a file, or every MIDI file found under a directory, to a batch.
+
+	Directory entries are added in name order, so a batch always runs, and
+	prints, in the same order.
+
+	@param list pointer to the list of files
+	@param path file or directory to add
+	@return number of files added.
+*/
+int midi_batch_addPath(struct MIDIBatchList * list, const char * path)
+{
+	struct stat path_stat;
+	if (stat(path, &path_stat) != 0 || !S_ISDIR(path_stat.st_mode))
+	{
+		/*	Missing files are added anyway, and reported as failures.	*/
+		return append_path(list, path);
+	}
+
+	DIR * dir = opendir(path);
+	if (dir == NULL)
+	{
+		WARN("Couldn't open the directory %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	/*	Gather the entries first, so that they can be sorted.	*/
+	struct MIDIBatchList entries = {0};
+	struct dirent * entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_name[0] == '.')
+		{
+			continue;
+		}
+
+		char child[4096];
+		snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+		append_path(&entries, child);
+	}
+	closedir(dir);
+
+	qsort(entries.paths, entries.num_paths, sizeof(char *), compare_names);
+
+	int added = 0;
+	for (int cntr = 0; cntr < entries.num_paths; cntr++)
+	{
+		struct stat child_stat;
+		if (stat(entries.paths[cntr], &child_stat) != 0)
+		{
+			continue;
+		}
+		if (S_ISDIR(child_stat.st_mode))
+		{
+			added += midi_batch_addPath(list, entries.paths[cntr]);
+		}
+		else if (has_midi_extension(entries.paths[cntr]))
+		{
+			added += append_path(list, entries.paths[cntr]);
+		}
+	}
+
+	midi_batch_freeList(&entries);
+	return added;
+}
+
+/*!	\brief Adds every path listed in a file (one per line) to a batch.
+
+	@param list pointer to the list of files
+	@param file_list path of the file list, or "-" for standard input
+	@return number of files added, or -1 if the list couldn't be read.
+*/
+int midi_batch_addFileList(struct MIDIBatchList * list, const char * file_list)
+{
+	FILE * file = strcmp(file_list, "-") ? fopen(file_list, "r") : stdin;
+	if (file == NULL)
+	{
+		ERROR("Couldn't open the file list %s: %s\n", file_list, strerror(errno));
+		return -1;
+	}
+
+	int added = 0;
+	char * line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	while ((length = getline(&line, &line_size, file)) > 0)
+	{
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+		{
+			line[--length] = '\0';
+		}
+		if (length > 0)
+		{
+			added += midi_batch_addPath(list, line);
+		}
+	}
+
+	free(line);
+	if (file != stdin)
+	{
+		fclose(file);
+	}
+	return added;
+}
+
+/*	Writes the one-line result for a decoded file.	*/
+static void summarize(const char * path, const struct MIDITimeline * timeline,
+	const struct MIDITempoMap * tempoMap, char * result, size_t result_size)
+{
+	long events = 0, notes = 0;
+	uint32_t last_tick = 0;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		const struct MIDITrackEvents * trackEvents = &(timeline->tracks[track]);
+		events += trackEvents->num_events;
+		for (int index = 0; index < trackEvents->num_events; index++)
+		{
+			notes += ((trackEvents->status[index] >> 4) == 0x9 && trackEvents->data2[index] > 0);
+		}
+		if (trackEvents->num_events > 0 && trackEvents->tick[trackEvents->num_events - 1] > last_tick)
+		{
+			last_tick = trackEvents->tick[trackEvents->num_events - 1];
+		}
+	}
+
+	int hint = 0;
+	double duration = midi_tempo_tickToNs(tempoMap, &hint, last_tick) / 1e9;
+
+	snprintf(result, result_size, "%s: OK tracks=%d events=%ld notes=%ld tempo_changes=%d duration=%.3fs\n",
+		path, timeline->num_tracks, events, notes, tempoMap->num_changes, duration);
+}
+
+/*	Writes the statistics of a decoded file into a new buffer.	*/
+static void write_stats(const char * path, const struct MIDITimeline * timeline,
+	const struct MIDITempoMap * tempoMap, struct MIDIArena * arena, int stats_format, char ** stats)
+{
+	struct MIDIArenaMark mark;
+	if (arena != NULL)
+	{
+		mark = midi_arena_mark(arena);
+	}
+
+	struct MIDIStats fileStats;
+	size_t size;
+	FILE * out;
+	if (midi_stats_compute(timeline, tempoMap, arena, &fileStats) && (out = open_memstream(stats, &size)) != NULL)
+	{
+		midi_stats_write(out, stats_format, path, &fileStats);
+		fclose(out);
+	}
+	midi_stats_free(&fileStats);
+
+	if (arena != NULL)
+	{
+		midi_arena_release(arena, mark);
+	}
+}
+
+/*!	\brief Loads, decodes and analyzes a single file.
+
+	@param path path of the MIDI file
+	@param pool pool to decode large files' tracks on, or NULL
+	@param arena arena to allocate from, or NULL to use malloc(); everything
+		allocated is released before returning, and the memory kept for reuse
+	@param cache_dir directory of decoded files to reuse and add to, or NULL
+	@param result where to write the one-line result for this file
+	@param result_size size of result, in bytes
+	@param stats_format MIDI_STATS_CSV or MIDI_STATS_JSON to compute the
+		statistics of the file too, or MIDI_STATS_NONE
+	@param stats where to store the statistics, written out in a buffer
+		the caller must free(); left alone if not computed
+	@return 1 on success, 0 if the file couldn't be analyzed.
+*/
+int midi_batch_analyzeFile(const char * path, struct MIDIPool * pool, struct MIDIArena * arena,
+	const char * cache_dir, char * result, size_t result_size, int stats_format, char ** stats)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		snprintf(result, result_size, "%s: FAILED (%s)\n", path, strerror(errno));
+		return 0;
+	}
+
+	/*	A current cache file skips the parsing altogether.	*/
+	struct MIDICacheKey key;
+	char cache_path[4096];
+	int use_cache = cache_dir != NULL && midi_cache_keyFromFd(fd, &key) &&
+		midi_cache_path(cache_dir, &key, cache_path, sizeof(cache_path));
+	if (use_cache)
+	{
+		struct MIDICache cache;
+		if (midi_cache_open(cache_path, &key, &cache))
+		{
+			close(fd);
+			summarize(path, &(cache.timeline), &(cache.tempoMap), result, result_size);
+			if (stats_format != MIDI_STATS_NONE)
+			{
+				write_stats(path, &(cache.timeline), &(cache.tempoMap), arena, stats_format, stats);
+			}
+			midi_cache_close(&cache);
+			return 1;
+		}
+	}
+
+	struct MIDIArenaMark mark;
+	if (arena != NULL)
+	{
+		mark = midi_arena_mark(arena);
+	}
+
+	struct MIDIFile midiFile = map_midi_file(fd, arena);
+	close(fd);
+
+	struct MIDITimeline timeline = {0};
+	struct MIDITempoMap tempoMap = {0};
+	int ok = 0;
+
+	if (midiFile.num_blocks == 0)
+	{
+		snprintf(result, result_size, "%s: FAILED (not a MIDI file)\n", path);
+	}
+	else if (midi_timeline_compileParallel(&midiFile, &timeline, pool, arena) < 0)
+	{
+		snprintf(result, result_size, "%s: FAILED (couldn't decode the tracks)\n", path);
+	}
+	else if (midi_tempo_build(&midiFile, &timeline, &tempoMap) < 0)
+	{
+		snprintf(result, result_size, "%s: FAILED (couldn't build the tempo map)\n", path);
+	}
+	else
+	{
+		summarize(path, &timeline, &tempoMap, result, result_size);
+		if (stats_format != MIDI_STATS_NONE)
+		{
+			write_stats(path, &timeline, &tempoMap, arena, stats_format, stats);
+		}
+		if (use_cache)
+		{
+			midi_cache_write(cache_path, &key, &midiFile, &timeline, &tempoMap);
+		}
+		ok = 1;
+	}
+
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+	if (arena != NULL)
+	{
+		midi_arena_release(arena, mark);
+	}
+	return ok;
+}
+
+static void batch_task(void * arg)
+{
+	struct BatchTask * task = arg;
+	struct BatchResult * result = task->result;
+
+	/*	A worker's arena is only ever touched by that worker. Files it picks
+		up while waiting on its own tasks nest on top, and are released first.	*/
+	int worker = midi_pool_workerIndex();
+	struct MIDIArena * arena = (worker >= 0) ? &(task->state->arenas[worker]) : NULL;
+
+	result->ok = midi_batch_analyzeFile(result->path, task->pool, arena, task->state->cache_dir,
+		result->text, sizeof(result->text), task->state->stats_format, &(result->stats));
+
+	pthread_mutex_lock(&(task->state->lock));
+	result->done = 1;
+	pthread_cond_broadcast(&(task->state->finished));
+	pthread_mutex_unlock(&(task->state->lock));
+}
+
+/*!	\brief Analyzes every file of a batch across a pool of threads.
+
+	@param list pointer to the list of files
+	@param num_threads number of worker threads; below 1 means one per CPU
+	@param cache_dir directory of decoded files to reuse and add to, or NULL
+	@param stats_format MIDI_STATS_CSV or MIDI_STATS_JSON to print statistics
+		instead of result lines, or MIDI_STATS_NONE
+	@param out where to print one result line per file, in list order
+	@return number of files that failed, or -1 if the batch couldn't start.
+*/
+int midi_batch_run(struct MIDIBatchList * list, int num_threads, const char * cache_dir, int stats_format,
+	FILE * out)
+{
+	struct BatchState state;
+	state.cache_dir = cache_dir;
+	state.stats_format = stats_format;
+	struct BatchTask * tasks = calloc(list->num_paths ? list->num_paths : 1, sizeof(struct BatchTask));
+	state.results = calloc(list->num_paths ? list->num_paths : 1, sizeof(struct BatchResult));
+	if (tasks == NULL || state.results == NULL)
+	{
+		ERROR("Allocation failed for a batch of %d files.\n", list->num_paths);
+		free(tasks);
+		free(state.results);
+		return -1;
+	}
+	pthread_mutex_init(&(state.lock), NULL);
+	pthread_cond_init(&(state.finished), NULL);
+
+	struct MIDIPool pool;
+	if (!midi_pool_init(&pool, num_threads))
+	{
+		free(tasks);
+		free(state.results);
+		return -1;
+	}
+	DEBUG("Analyzing %d files on %d threads.\n", list->num_paths, pool.num_threads);
+
+	state.arenas = calloc(pool.num_threads, sizeof(struct MIDIArena));
+	if (state.arenas == NULL)
+	{
+		ERROR("Allocation failed for %d arenas.\n", pool.num_threads);
+		exit(-1);
+	}
+	for (int cntr = 0; cntr < pool.num_threads; cntr++)
+	{
+		midi_arena_init(&(state.arenas[cntr]), 0);
+	}
+
+	int group = 0;
+	for (int cntr = 0; cntr < list->num_paths; cntr++)
+	{
+		state.results[cntr].path = list->paths[cntr];
+		tasks[cntr].pool = &pool;
+		tasks[cntr].state = &state;
+		tasks[cntr].result = &(state.results[cntr]);
+		midi_pool_submit(&pool, &group, batch_task, &(tasks[cntr]));
+	}
+
+	/*	Print each result as soon as it and everything before it is done.	*/
+	int failures = 0;
+	midi_stats_writeHeader(out, stats_format);
+	for (int cntr = 0; cntr < list->num_paths; cntr++)
+	{
+		pthread_mutex_lock(&(state.lock));
+		while (!state.results[cntr].done)
+		{
+			pthread_cond_wait(&(state.finished), &(state.lock));
+		}
+		pthread_mutex_unlock(&(state.lock));
+
+		if (stats_format == MIDI_STATS_NONE)
+		{
+			fputs(state.results[cntr].text, out);
+		}
+		else if (!state.results[cntr].ok)
+		{
+			fputs(state.results[cntr].text, stderr);
+		}
+		else if (state.results[cntr].stats != NULL)
+		{
+			fputs(state.results[cntr].stats, out);
+		}
+		free(state.results[cntr].stats);
+		failures += !state.results[cntr].ok;
+	}
+	fflush(out);
+
+	midi_pool_wait(&pool, &group);
+
+	/*	What one worker needed at most is what each worker should be given.	*/
+	size_t peak = 0, reserved = 0;
+	unsigned long allocations = 0;
+	for (int cntr = 0; cntr < pool.num_threads; cntr++)
+	{
+		peak = (state.arenas[cntr].peak > peak) ? state.arenas[cntr].peak : peak;
+		reserved += state.arenas[cntr].reserved;
+		allocations += state.arenas[cntr].allocations;
+		midi_arena_free(&(state.arenas[cntr]));
+	}
+	fprintf(stderr, "Memory: peak of %zu KiB on a worker, %zu KiB reserved by %d worker(s), %lu allocations.\n",
+		(peak + 1023) / 1024, (reserved + 1023) / 1024, pool.num_threads, allocations);
+	midi_pool_destroy(&pool);
+	free(state.arenas);
+
+	pthread_cond_destroy(&(state.finished));
+	pthread_mutex_destroy(&(state.lock));
+	free(tasks);
+	free(state.results);
+	return failures;
+}
+
+/*!	\brief Releases a list of files.
+
+	@param list pointer to the list; it is zeroed afterwards.
+*/
+void midi_batch_freeList(struct MIDIBatchList * list)
+{
+	for (int cntr = 0; cntr < list->num_paths; cntr++)
+	{
+		free(list->paths[cntr]);
+	}
+	free(list->paths);
+	memset(list, 0, sizeof(struct MIDIBatchList));
+}
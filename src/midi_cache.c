@@ -0,0 +1,359 @@
+/*! @file
+	Binary cache of decoded MIDI files.
+
+	A cache file is the timeline and tempo map of one MIDI file, laid out as
+	the same flat arrays they are in memory, each aligned to MIDI_CACHE_ALIGN.
+	Opening one is an mmap() and a few header checks; the arrays are then
+	used in place, with nothing parsed or copied.
+
+	Caches are named after the hash of the source file's contents, and record
+	its size and modification time as well: a cache is only used if all three
+	still match. The cache directory is trusted not to be tampered with; the
+	header is checked, so a stale or truncated file is simply a miss, but the
+	events inside aren't validated again.
+*/
+
+#include <portable.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "midi_reader.h"
+#include "midi_cache.h"
+#include "debug.h"
+
+/*	Multipliers of the mixing steps of MurmurHash3's 64-bit variant.	*/
+#define HASH_K1 0x87C37B91114253D5ull
+#define HASH_K2 0x4CF5AD432745937Full
+
+static uint64_t align_up(uint64_t offset)
+{
+	return (offset + MIDI_CACHE_ALIGN - 1) & ~(uint64_t) (MIDI_CACHE_ALIGN - 1);
+}
+
+static inline uint64_t rotl64(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hash_word(uint64_t hash, uint64_t word)
+{
+	word = rotl64(word * HASH_K1, 31) * HASH_K2;
+	return rotl64(hash ^ word, 27) * 5 + 0x52DCE729;
+}
+
+/*	Hashes a buffer eight bytes at a time, ending with MurmurHash3's final
+	avalanche. Words are read in native byte order, like the rest of a cache.	*/
+static uint64_t hash_bytes(const unsigned char * data, size_t size)
+{
+	uint64_t hash = size;
+	size_t cntr = 0;
+	for (; cntr + 8 <= size; cntr += 8)
+	{
+		uint64_t word;
+		memcpy(&word, &data[cntr], 8);
+		hash = hash_word(hash, word);
+	}
+	if (cntr < size)
+	{
+		uint64_t word = 0;
+		memcpy(&word, &data[cntr], size - cntr);
+		hash = hash_word(hash, word);
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDull;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/*!	\brief Identifies a source file by the hash of its contents, its size and
+	its modification time.
+
+	@param fd descriptor of the open source file
+	@param key where to write the key
+	@return 1 on success, 0 if the file couldn't be read.
+*/
+int midi_cache_keyFromFd(int fd, struct MIDICacheKey * key)
+{
+	struct stat file_stat;
+	memset(key, 0, sizeof(struct MIDICacheKey));
+	if (fstat(fd, &file_stat) != 0)
+	{
+		ERROR("Couldn't stat the file: %s\n", strerror(errno));
+		return 0;
+	}
+	key->size = (uint64_t) file_stat.st_size;
+	key->mtime_sec = (int64_t) file_stat.st_mtim.tv_sec;
+	key->mtime_nsec = (int64_t) file_stat.st_mtim.tv_nsec;
+	key->hash = hash_bytes(NULL, 0);
+
+	if (key->size == 0)
+	{
+		return 1;
+	}
+
+	const unsigned char * data = mmap(NULL, key->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+	{
+		ERROR("Couldn't map the file to hash it: %s\n", strerror(errno));
+		return 0;
+	}
+	key->hash = hash_bytes(data, key->size);
+	munmap((void *) data, key->size);
+	return 1;
+}
+
+/*!	\brief Builds the path of the cache file for a source file.
+
+	@param dir cache directory
+	@param key key of the source file
+	@param path where to write the path
+	@param size size of path, in bytes
+	@return 1 on success, 0 if path is too small.
+*/
+int midi_cache_path(const char * dir, const struct MIDICacheKey * key, char * path, size_t size)
+{
+	int length = snprintf(path, size, "%s/%016llx" MIDI_CACHE_SUFFIX, dir, (unsigned long long) key->hash);
+	return length > 0 && (size_t) length < size;
+}
+
+/*	Writes count bytes at the current offset, padded to MIDI_CACHE_ALIGN.	*/
+static int write_array(FILE * file, const void * data, size_t count)
+{
+	static const unsigned char padding[MIDI_CACHE_ALIGN] = {0};
+	size_t pad = align_up(count) - count;
+	return (count == 0 || fwrite(data, count, 1, file) == 1) &&
+		(pad == 0 || fwrite(padding, pad, 1, file) == 1);
+}
+
+/*!	\brief Writes the decoded form of a MIDI file to a cache file.
+
+	The file is written under a temporary name and renamed into place, so a
+	cache file is either complete or absent, even with several writers.
+
+	@param path path of the cache file, from midi_cache_path()
+	@param key key of the source file
+	@param midiFile the source file, for its MThd fields
+	@param timeline timeline decoded from it
+	@param tempoMap tempo map built from it
+	@return 1 on success, 0 on failure.
+*/
+int midi_cache_write(const char * path, const struct MIDICacheKey * key, const struct MIDIFile * midiFile,
+	const struct MIDITimeline * timeline, const struct MIDITempoMap * tempoMap)
+{
+	struct MIDICacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MIDI_CACHE_MAGIC, sizeof(header.magic));
+	header.version = MIDI_CACHE_VERSION;
+	header.byte_order = MIDI_CACHE_BYTE_ORDER;
+	header.key = *key;
+	header.format = midiFile->format;
+	header.division = midiFile->division;
+	header.num_tracks = timeline->num_tracks;
+	header.num_changes = tempoMap->num_changes;
+	header.ticks_per_quarter = tempoMap->ticks_per_quarter;
+	header.ns_per_tick_smpte = tempoMap->ns_per_tick_smpte;
+
+	/*	Lay everything out first, so the header can go first.	*/
+	uint64_t offset = align_up(sizeof(header));
+	header.tracks_offset = offset;
+	offset = align_up(offset + sizeof(struct MIDICacheTrack) * timeline->num_tracks);
+	header.changes_offset = offset;
+	offset = align_up(offset + sizeof(struct MIDITempoChange) * tempoMap->num_changes);
+
+	struct MIDICacheTrack * tracks = calloc(timeline->num_tracks ? timeline->num_tracks : 1,
+		sizeof(struct MIDICacheTrack));
+	if (tracks == NULL)
+	{
+		ERROR("Allocation failed for %d cached tracks.\n", timeline->num_tracks);
+		return 0;
+	}
+	for (int cntr = 0; cntr < timeline->num_tracks; cntr++)
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[cntr]);
+		uint64_t n = events->num_events;
+		tracks[cntr].num_events = events->num_events;
+		tracks[cntr].payload_size = events->payload_size;
+		tracks[cntr].tick = offset;
+		offset = align_up(offset + sizeof(uint32_t) * n);
+		tracks[cntr].status = offset;
+		offset = align_up(offset + n);
+		tracks[cntr].data1 = offset;
+		offset = align_up(offset + n);
+		tracks[cntr].data2 = offset;
+		offset = align_up(offset + n);
+		tracks[cntr].payload_off = offset;
+		offset = align_up(offset + sizeof(uint32_t) * n);
+		tracks[cntr].payload_len = offset;
+		offset = align_up(offset + sizeof(uint32_t) * n);
+		tracks[cntr].payload = offset;
+		offset = align_up(offset + events->payload_size);
+	}
+	header.file_size = offset;
+
+	/*	A unique name, as batch workers may be writing the same file.	*/
+	char tmp_path[4096];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp_path);
+	FILE * file = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+	if (file == NULL)
+	{
+		WARN("Couldn't create the cache file %s: %s\n", tmp_path, strerror(errno));
+		if (fd >= 0)
+		{
+			close(fd);
+			unlink(tmp_path);
+		}
+		free(tracks);
+		return 0;
+	}
+
+	int ok = write_array(file, &header, sizeof(header)) &&
+		write_array(file, tracks, sizeof(struct MIDICacheTrack) * timeline->num_tracks) &&
+		write_array(file, tempoMap->changes, sizeof(struct MIDITempoChange) * tempoMap->num_changes);
+	for (int cntr = 0; ok && cntr < timeline->num_tracks; cntr++)
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[cntr]);
+		size_t n = events->num_events;
+		ok = write_array(file, events->tick, sizeof(uint32_t) * n) &&
+			write_array(file, events->status, n) &&
+			write_array(file, events->data1, n) &&
+			write_array(file, events->data2, n) &&
+			write_array(file, events->payload_off, sizeof(uint32_t) * n) &&
+			write_array(file, events->payload_len, sizeof(uint32_t) * n) &&
+			write_array(file, events->payload, events->payload_size);
+	}
+	free(tracks);
+
+	if (fclose(file) != 0 || !ok || rename(tmp_path, path) != 0)
+	{
+		WARN("Couldn't write the cache file %s: %s\n", path, strerror(errno));
+		unlink(tmp_path);
+		return 0;
+	}
+	DEBUG("Cached %d tracks in %llu bytes.\n", timeline->num_tracks, (unsigned long long) header.file_size);
+	return 1;
+}
+
+/*	Checks that an array of count elements of the given size lies within the
+	mapping, aligned, and returns where it is.	*/
+static void * map_array(const struct MIDICache * cache, uint64_t offset, uint64_t count, size_t size)
+{
+	if (offset % MIDI_CACHE_ALIGN || offset > cache->map_size ||
+		(size && count > (cache->map_size - offset) / size))
+	{
+		return NULL;
+	}
+	return (unsigned char *) cache->map_base + offset;
+}
+
+/*!	\brief Opens a cache file, if it is current for the source file.
+
+	Nothing is parsed: the arrays of the timeline and tempo map point into
+	the mapped file. The only allocation is the array of track descriptors.
+
+	@param path path of the cache file, from midi_cache_path()
+	@param key key of the source file, from midi_cache_keyFromFd()
+	@param cache where to open the cache
+	@return 1 on a hit, 0 if there is no usable cache file (the cache is
+		zeroed then).
+*/
+int midi_cache_open(const char * path, const struct MIDICacheKey * key, struct MIDICache * cache)
+{
+	memset(cache, 0, sizeof(struct MIDICache));
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return 0;
+	}
+
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || (size_t) file_stat.st_size < sizeof(struct MIDICacheHeader))
+	{
+		close(fd);
+		return 0;
+	}
+	cache->map_size = (size_t) file_stat.st_size;
+	cache->map_base = mmap(NULL, cache->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->map_base == MAP_FAILED)
+	{
+		memset(cache, 0, sizeof(struct MIDICache));
+		return 0;
+	}
+
+	const struct MIDICacheHeader * header = cache->header = cache->map_base;
+	if (memcmp(header->magic, MIDI_CACHE_MAGIC, sizeof(header->magic)) ||
+		header->version != MIDI_CACHE_VERSION || header->byte_order != MIDI_CACHE_BYTE_ORDER ||
+		header->file_size != cache->map_size || header->num_tracks < 0 || header->num_changes < 1)
+	{
+		DEBUG("%s isn't a cache file of this version.\n", path);
+		goto miss;
+	}
+	if (header->key.hash != key->hash || header->key.size != key->size ||
+		header->key.mtime_sec != key->mtime_sec || header->key.mtime_nsec != key->mtime_nsec)
+	{
+		DEBUG("%s was built from another version of the file.\n", path);
+		goto miss;
+	}
+
+	const struct MIDICacheTrack * tracks = map_array(cache, header->tracks_offset, header->num_tracks,
+		sizeof(struct MIDICacheTrack));
+	cache->tempoMap.changes = map_array(cache, header->changes_offset, header->num_changes,
+		sizeof(struct MIDITempoChange));
+	cache->timeline.tracks = calloc(header->num_tracks ? header->num_tracks : 1, sizeof(struct MIDITrackEvents));
+	if (tracks == NULL || cache->tempoMap.changes == NULL || cache->timeline.tracks == NULL)
+	{
+		goto miss;
+	}
+	cache->tempoMap.num_changes = header->num_changes;
+	cache->tempoMap.ticks_per_quarter = header->ticks_per_quarter;
+	cache->tempoMap.ns_per_tick_smpte = header->ns_per_tick_smpte;
+
+	for (int cntr = 0; cntr < header->num_tracks; cntr++)
+	{
+		const struct MIDICacheTrack * track = &tracks[cntr];
+		struct MIDITrackEvents * events = &(cache->timeline.tracks[cntr]);
+		uint64_t n = (track->num_events >= 0) ? (uint64_t) track->num_events : UINT64_MAX;
+
+		events->num_events = track->num_events;
+		events->payload_size = track->payload_size;
+		events->tick = map_array(cache, track->tick, n, sizeof(uint32_t));
+		events->status = map_array(cache, track->status, n, 1);
+		events->data1 = map_array(cache, track->data1, n, 1);
+		events->data2 = map_array(cache, track->data2, n, 1);
+		events->payload_off = map_array(cache, track->payload_off, n, sizeof(uint32_t));
+		events->payload_len = map_array(cache, track->payload_len, n, sizeof(uint32_t));
+		events->payload = map_array(cache, track->payload, track->payload_size, 1);
+		if (!(events->tick && events->status && events->data1 && events->data2 &&
+			events->payload_off && events->payload_len && events->payload))
+		{
+			WARN("%s is corrupt: track %d lies outside the file.\n", path, cntr);
+			goto miss;
+		}
+	}
+	cache->timeline.num_tracks = header->num_tracks;
+	return 1;
+
+miss:
+	midi_cache_close(cache);
+	return 0;
+}
+
+/*!	\brief Unmaps a cache file.
+
+	@param cache pointer to the cache; it is zeroed afterwards.
+*/
+void midi_cache_close(struct MIDICache * cache)
+{
+	free(cache->timeline.tracks);
+	if (cache->map_base != NULL)
+	{
+		munmap(cache->map_base, cache->map_size);
+	}
+	memset(cache, 0, sizeof(struct MIDICache));
+}
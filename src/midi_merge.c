@@ -0,0 +1,166 @@
+/*! @file
+	k-way merge of the tracks of a MIDITimeline, using a min-heap keyed on the
+	tick of each track's next event. Finding the next event costs O(log tracks)
+	no matter how many tracks are idle, and playback can jump straight to the
+	next event time instead of visiting every tick.
+
+	Ties are broken on the track index, so events at the same tick come out
+	track by track, in the same order the tracks appear in the file.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_timeline.h"
+#include "midi_merge.h"
+#include "debug.h"
+
+/*	Returns non-zero if heap entry a has to come out before b.	*/
+static inline int entry_before(const struct MIDIMergeEntry * a, const struct MIDIMergeEntry * b)
+{
+	return (a->tick < b->tick) || (a->tick == b->tick && a->track < b->track);
+}
+
+static void sift_down(struct MIDIMergeEntry * heap, int size, int pos)
+{
+	struct MIDIMergeEntry entry = heap[pos];
+
+	while (1)
+	{
+		int child = 2 * pos + 1;
+		if (child >= size)
+		{
+			break;
+		}
+		if (child + 1 < size && entry_before(&heap[child + 1], &heap[child]))
+		{
+			child++;
+		}
+		if (!entry_before(&heap[child], &entry))
+		{
+			break;
+		}
+		heap[pos] = heap[child];
+		pos = child;
+	}
+	heap[pos] = entry;
+}
+
+/*!	\brief Starts a merge over every track of a timeline.
+
+	@param merge pointer to the merge state to initialize
+	@param timeline compiled tracks to merge; must outlive the merge
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_merge_init(struct MIDIMerge * merge, const struct MIDITimeline * timeline)
+{
+	int num_tracks = timeline->num_tracks ? timeline->num_tracks : 1;
+
+	memset(merge, 0, sizeof(struct MIDIMerge));
+	merge->timeline = timeline;
+	merge->next_event = calloc(num_tracks, sizeof(int));
+	merge->heap = malloc(sizeof(struct MIDIMergeEntry) * num_tracks);
+	if (merge->next_event == NULL || merge->heap == NULL)
+	{
+		ERROR("Allocation failed for merging %d tracks.\n", timeline->num_tracks);
+		midi_merge_free(merge);
+		return 0;
+	}
+
+	midi_merge_seek(merge, 0);
+	return 1;
+}
+
+/*!	\brief Restarts the merge at a tick, skipping every event before it.
+
+	Each track's first event at or after tick is found with a binary search,
+	so seeking costs O(tracks * log events), wherever tick is.
+
+	@param merge pointer to the merge state
+	@param tick absolute tick of the first event to return next
+*/
+void midi_merge_seek(struct MIDIMerge * merge, uint32_t tick)
+{
+	const struct MIDITimeline * timeline = merge->timeline;
+
+	merge->heap_size = 0;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[track]);
+		int index = midi_timeline_findTick(events, tick);
+		merge->next_event[track] = index;
+		if (index < events->num_events)
+		{
+			merge->heap[merge->heap_size].tick = events->tick[index];
+			merge->heap[merge->heap_size].track = track;
+			merge->heap_size++;
+		}
+	}
+
+	for (int pos = merge->heap_size / 2 - 1; pos >= 0; pos--)
+	{
+		sift_down(merge->heap, merge->heap_size, pos);
+	}
+}
+
+/*!	\brief Looks at the tick of the next event, without consuming it.
+
+	@param merge pointer to the merge state
+	@param tick where to write the tick of the next event
+	@return 1 if there is a next event, 0 once every track has finished.
+*/
+int midi_merge_peekTick(const struct MIDIMerge * merge, uint32_t * tick)
+{
+	if (merge->heap_size == 0)
+	{
+		return 0;
+	}
+	*tick = merge->heap[0].tick;
+	return 1;
+}
+
+/*!	\brief Consumes the next event, in (tick, track) order.
+
+	@param merge pointer to the merge state
+	@param track where to write the track of the event
+	@param index where to write the index of the event within its track
+	@return 1 if an event was returned, 0 once every track has finished.
+*/
+int midi_merge_next(struct MIDIMerge * merge, int * track, int * index)
+{
+	if (merge->heap_size == 0)
+	{
+		return 0;
+	}
+
+	struct MIDIMergeEntry * top = &(merge->heap[0]);
+	const struct MIDITrackEvents * events = &(merge->timeline->tracks[top->track]);
+
+	*track = top->track;
+	*index = merge->next_event[top->track]++;
+
+	if (merge->next_event[top->track] < events->num_events)
+	{
+		/*	The track stays in the heap, keyed on its following event.	*/
+		top->tick = events->tick[merge->next_event[top->track]];
+	}
+	else
+	{
+		/*	The track is finished: replace it with the last entry.	*/
+		*top = merge->heap[--merge->heap_size];
+	}
+	sift_down(merge->heap, merge->heap_size, 0);
+
+	return 1;
+}
+
+/*!	\brief Releases the memory held by a merge.
+
+	@param merge pointer to the merge state; it is zeroed afterwards.
+*/
+void midi_merge_free(struct MIDIMerge * merge)
+{
+	free(merge->next_event);
+	free(merge->heap);
+	memset(merge, 0, sizeof(struct MIDIMerge));
+}
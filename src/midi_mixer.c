@@ -0,0 +1,140 @@
+/*! @file
+	Mixes files for playback on one scheduler and one output thread.
+
+	Every stream keeps its own merge of its tracks and its own tempo map,
+	and always has its next event timed and waiting. The mix takes the
+	earliest of those, stream order breaking ties, so that events come out
+	in the order they are due across every file. Mixes are a handful of
+	stems at most, so the earliest is found by looking at each.
+
+	The streams are also laid out as player sources, so that the output
+	thread can send each file's events on its own channels.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_merge.h"
+#include "midi_player.h"
+#include "midi_mixer.h"
+#include "debug.h"
+
+/*	Takes the stream's next event off its merge, and times it.	*/
+static void advance(struct MIDIMixerStream * stream, const struct MIDITimeline * timeline)
+{
+	stream->pending = midi_merge_next(&(stream->merge), &(stream->next_track), &(stream->next_index));
+	if (stream->pending)
+	{
+		uint32_t tick = timeline->tracks[stream->next_track].tick[stream->next_index];
+		stream->next_ns = stream->offset_ns + midi_tempo_tickToNs(stream->tempoMap, &(stream->hint), tick);
+	}
+}
+
+/*!	\brief Initializes an empty mix.
+
+	@param mixer pointer to the mixer
+	@param capacity most streams that will be added, up to 65536
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_mixer_init(struct MIDIMixer * mixer, int capacity)
+{
+	memset(mixer, 0, sizeof(struct MIDIMixer));
+	mixer->streams = calloc(capacity ? capacity : 1, sizeof(struct MIDIMixerStream));
+	mixer->sources = calloc(capacity ? capacity : 1, sizeof(struct MIDIPlayerSource));
+	if (mixer->streams == NULL || mixer->sources == NULL)
+	{
+		ERROR("Allocation failed for a mix of %d streams.\n", capacity);
+		midi_mixer_free(mixer);
+		return 0;
+	}
+	mixer->capacity = capacity;
+	return 1;
+}
+
+/*!	\brief Adds a file to a mix.
+
+	@param mixer pointer to the mixer
+	@param timeline compiled tracks of the file; must outlive the mixer
+	@param tempoMap tempo map of the file; must outlive the mixer
+	@param offset_ns when the file starts, from the start of the mix
+	@param channel_map channel (0-15) to play each of the file's channels
+		on, or NULL to keep them
+	@return index of the stream, or -1 if the mix is full or an allocation failed.
+*/
+int midi_mixer_addStream(struct MIDIMixer * mixer, const struct MIDITimeline * timeline,
+	const struct MIDITempoMap * tempoMap, uint64_t offset_ns, const uint8_t * channel_map)
+{
+	if (mixer->num_streams == mixer->capacity)
+	{
+		ERROR("The mix is already full, with %d streams.\n", mixer->capacity);
+		return -1;
+	}
+
+	struct MIDIMixerStream * stream = &(mixer->streams[mixer->num_streams]);
+	if (!midi_merge_init(&(stream->merge), timeline))
+	{
+		return -1;
+	}
+	stream->tempoMap = tempoMap;
+	stream->offset_ns = offset_ns;
+	for (int channel = 0; channel < 16; channel++)
+	{
+		stream->channel_map[channel] = channel_map ? (channel_map[channel] & 0x0F) : channel;
+	}
+	advance(stream, timeline);
+
+	mixer->sources[mixer->num_streams].timeline = timeline;
+	mixer->sources[mixer->num_streams].channel_map = stream->channel_map;
+	return mixer->num_streams++;
+}
+
+/*!	\brief Gives the next event of the mix.
+
+	@param mixer pointer to the mixer
+	@param stream where to store the stream of the event
+	@param track where to store the track of the event within its timeline
+	@param index where to store the index of the event within its track
+	@param ns where to store the time the event is due within the mix
+	@return 1 if an event was returned, 0 once every stream is exhausted.
+*/
+int midi_mixer_next(struct MIDIMixer * mixer, int * stream, int * track, int * index, uint64_t * ns)
+{
+	int earliest = -1;
+	for (int cntr = 0; cntr < mixer->num_streams; cntr++)
+	{
+		const struct MIDIMixerStream * candidate = &(mixer->streams[cntr]);
+		if (candidate->pending && (earliest < 0 || candidate->next_ns < mixer->streams[earliest].next_ns))
+		{
+			earliest = cntr;
+		}
+	}
+	if (earliest < 0)
+	{
+		return 0;
+	}
+
+	struct MIDIMixerStream * next = &(mixer->streams[earliest]);
+	*stream = earliest;
+	*track = next->next_track;
+	*index = next->next_index;
+	*ns = next->next_ns;
+	advance(next, mixer->sources[earliest].timeline);
+	return 1;
+}
+
+/*!	\brief Releases the memory held by a mix.
+
+	@param mixer pointer to the mixer; it is zeroed afterwards.
+*/
+void midi_mixer_free(struct MIDIMixer * mixer)
+{
+	for (int cntr = 0; cntr < mixer->num_streams; cntr++)
+	{
+		midi_merge_free(&(mixer->streams[cntr].merge));
+	}
+	free(mixer->streams);
+	free(mixer->sources);
+	memset(mixer, 0, sizeof(struct MIDIMixer));
+}
@@ -0,0 +1,151 @@
+/*! @file
+	Pairs note ons with note offs, per track, channel and key.
+
+	A note on with velocity 0 is a note off, as the MIDI specification has
+	it. A note struck again while it is still held ends the earlier one
+	there, so that overlapping notes on one key never nest. Notes still held
+	when their track ends are closed at its last event and flagged.
+
+	Each track is walked once against a fixed 16 x 128 table of held notes,
+	which holds the row of each note in the table being built. Rows are
+	taken in the order notes start, and the columns are sized beforehand by
+	counting the note ons, so there is nothing allocated per note.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_timeline.h"
+#include "midi_arena.h"
+#include "midi_notes.h"
+#include "debug.h"
+
+/*	Marks a key of the held-note table as free.	*/
+#define NOT_HELD -1
+
+static void * notes_alloc(struct MIDIArena * arena, size_t count, size_t size)
+{
+	return arena ? midi_arena_alloc(arena, count * size) : malloc(count ? count * size : 1);
+}
+
+static int is_note_on(const struct MIDITrackEvents * events, int index)
+{
+	return (events->status[index] >> 4) == 0x9 && events->data2[index] != 0;
+}
+
+/*	Pairs the notes of one track, appending them to the table.	*/
+static void pair_track(const struct MIDITrackEvents * events, int track, struct MIDINoteTable * notes)
+{
+	int32_t held[16][128];
+	memset(held, 0xFF, sizeof(held));	/*	NOT_HELD	*/
+
+	for (int index = 0; index < events->num_events; index++)
+	{
+		unsigned type = events->status[index] >> 4;
+		if (type != 0x8 && type != 0x9)
+		{
+			continue;
+		}
+
+		unsigned channel = events->status[index] & 0x0F, key = events->data1[index] & 0x7F;
+		uint32_t tick = events->tick[index];
+		int32_t row = held[channel][key];
+		if (row != NOT_HELD)
+		{
+			/*	A note off, or the same key struck again.	*/
+			notes->duration[row] = tick - notes->start[row];
+			held[channel][key] = NOT_HELD;
+		}
+
+		if (is_note_on(events, index))
+		{
+			row = notes->num_notes++;
+			notes->start[row] = tick;
+			notes->duration[row] = 0;
+			notes->key[row] = key;
+			notes->velocity[row] = events->data2[index];
+			notes->channel[row] = channel;
+			notes->track[row] = track;
+			notes->flags[row] = 0;
+			held[channel][key] = row;
+		}
+	}
+
+	uint32_t last_tick = events->num_events ? events->tick[events->num_events - 1] : 0;
+	for (int channel = 0; channel < 16; channel++)
+	{
+		for (int key = 0; key < 128; key++)
+		{
+			int32_t row = held[channel][key];
+			if (row != NOT_HELD)
+			{
+				notes->duration[row] = last_tick - notes->start[row];
+				notes->flags[row] |= MIDI_NOTE_UNTERMINATED;
+				notes->num_unterminated++;
+			}
+		}
+	}
+}
+
+/*!	\brief Pairs every note on of a timeline with its note off.
+
+	@param timeline compiled tracks
+	@param arena arena to allocate from, or NULL to use malloc()
+	@param notes where to write the table of notes
+	@return number of notes, or -1 if an allocation failed.
+*/
+int midi_notes_build(const struct MIDITimeline * timeline, struct MIDIArena * arena, struct MIDINoteTable * notes)
+{
+	memset(notes, 0, sizeof(struct MIDINoteTable));
+	notes->arena = arena;
+
+	size_t count = 0;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[track]);
+		for (int index = 0; index < events->num_events; index++)
+		{
+			count += is_note_on(events, index);
+		}
+	}
+
+	notes->start = notes_alloc(arena, count, sizeof(uint32_t));
+	notes->duration = notes_alloc(arena, count, sizeof(uint32_t));
+	notes->key = notes_alloc(arena, count, sizeof(uint8_t));
+	notes->velocity = notes_alloc(arena, count, sizeof(uint8_t));
+	notes->channel = notes_alloc(arena, count, sizeof(uint8_t));
+	notes->track = notes_alloc(arena, count, sizeof(int32_t));
+	notes->flags = notes_alloc(arena, count, sizeof(uint8_t));
+	if (notes->start == NULL || notes->duration == NULL || notes->key == NULL || notes->velocity == NULL ||
+		notes->channel == NULL || notes->track == NULL || notes->flags == NULL)
+	{
+		ERROR("Allocation failed for a table of %zu notes.\n", count);
+		midi_notes_free(notes);
+		return -1;
+	}
+
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		pair_track(&(timeline->tracks[track]), track, notes);
+	}
+	return notes->num_notes;
+}
+
+/*!	\brief Releases the memory held by a table of notes.
+
+	@param notes pointer to the table; it is zeroed afterwards.
+*/
+void midi_notes_free(struct MIDINoteTable * notes)
+{
+	if (notes->arena == NULL)
+	{
+		free(notes->start);
+		free(notes->duration);
+		free(notes->key);
+		free(notes->velocity);
+		free(notes->channel);
+		free(notes->track);
+		free(notes->flags);
+	}
+	memset(notes, 0, sizeof(struct MIDINoteTable));
+}
@@ -0,0 +1,330 @@
+/*! @file
+	Gathers every event due at the same deadline into one buffer, and hands it
+	to the device with a single write(). A chord or a controller sweep then
+	costs one system call instead of one per event.
+
+	Optionally, channel messages are sent with running status: a message
+	whose status matches the previous one goes out without its status byte.
+
+	What happens to a flushed buffer is up to the backend. The raw one,
+	which midi_output_init() sets up, writes it to a file descriptor there
+	and then; others, such as the ALSA sequencer in midi_alsa.c, are given
+	the time it is due along with it.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "midi_parse.h"
+#include "midi_timeline.h"
+#include "midi_output.h"
+#include "debug.h"
+
+/*	Initial size of the output buffer; it grows to fit the largest deadline.	*/
+#define MIDI_OUTPUT_INITIAL_CAPACITY 256
+
+/*	The raw backend: write() to the file descriptor, as soon as flushed.	*/
+static int raw_write(struct MIDIOutput * output, const unsigned char * bytes, size_t size, uint64_t ns)
+{
+	size_t written = 0;
+	int ret = 0;
+	(void) ns;
+
+	while (output->fd >= 0 && written < size)
+	{
+		ssize_t count = write(output->fd, &(bytes[written]), size - written);
+		output->syscalls++;
+		if (count < 0)
+		{
+			if (errno == EINTR) continue;
+			ERROR("Writing to the device failed: %s\n", strerror(errno));
+			ret = -1;
+			break;
+		}
+		written += count;
+	}
+
+	output->bytes += written;
+	return ret;
+}
+
+static const struct MIDIOutputBackend raw_backend =
+{
+	.name = "raw",
+	.timed = 0,
+	.write = raw_write
+};
+
+/*!	\brief Opens a batched output on a device.
+
+	@param output pointer to the output to initialize
+	@param fd device to write to, or -1 to discard everything
+	@param running_status boolean, whether to compress with running status
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_output_init(struct MIDIOutput * output, int fd, int running_status)
+{
+	if (!midi_output_initBackend(output, &raw_backend, NULL, running_status))
+	{
+		return 0;
+	}
+	output->fd = fd;
+	return 1;
+}
+
+/*!	\brief Opens a batched output on any backend.
+
+	@param output pointer to the output to initialize
+	@param backend where flushed events go; must outlive the output
+	@param backend_data state of the backend, released by its close()
+	@param running_status boolean, whether to compress with running status
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_output_initBackend(struct MIDIOutput * output, const struct MIDIOutputBackend * backend,
+	void * backend_data, int running_status)
+{
+	memset(output, 0, sizeof(struct MIDIOutput));
+	output->backend = backend;
+	output->backend_data = backend_data;
+	output->fd = -1;
+	output->running_status = running_status;
+	clock_gettime(CLOCK_MONOTONIC, &(output->start));
+
+	output->buffer = malloc(MIDI_OUTPUT_INITIAL_CAPACITY);
+	if (output->buffer == NULL)
+	{
+		ERROR("Allocation failed for the output buffer.\n");
+		return 0;
+	}
+	output->capacity = MIDI_OUTPUT_INITIAL_CAPACITY;
+	return 1;
+}
+
+/*	Makes room for extra more bytes. Returns 0 if an allocation failed.	*/
+static int reserve(struct MIDIOutput * output, size_t extra)
+{
+	if (output->size + extra <= output->capacity)
+	{
+		return 1;
+	}
+
+	size_t capacity = output->capacity;
+	while (capacity < output->size + extra)
+	{
+		capacity *= 2;
+	}
+
+	unsigned char * buffer = realloc(output->buffer, capacity);
+	if (buffer == NULL)
+	{
+		ERROR("Allocation failed for %zu bytes of output.\n", capacity);
+		return 0;
+	}
+	output->buffer = buffer;
+	output->capacity = capacity;
+	return 1;
+}
+
+/*	Appends a status byte, unless running status makes it redundant.	*/
+static inline void put_status(struct MIDIOutput * output, unsigned char status)
+{
+	if (status < 0xF0)
+	{
+		if (output->running_status && status == output->wire_status)
+		{
+			output->bytes_saved++;
+			return;
+		}
+		output->wire_status = status;
+	}
+	else if (status < 0xF8)
+	{
+		/*	System common and sysex messages cancel running status;
+			real-time messages (F8-FF) leave it alone.	*/
+		output->wire_status = 0;
+	}
+	output->buffer[output->size++] = status;
+}
+
+/*!	\brief Queues raw bytes of a complete MIDI message.
+
+	@param output pointer to the output
+	@param event the message, starting with its status byte
+	@param size size of the message, in bytes
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_output_queue(struct MIDIOutput * output, const unsigned char * event, int size)
+{
+	if (size <= 0)
+	{
+		return 1;
+	}
+	if (!reserve(output, size))
+	{
+		return 0;
+	}
+
+	put_status(output, event[0]);
+	memcpy(&(output->buffer[output->size]), &event[1], size - 1);
+	output->size += size - 1;
+	output->events++;
+	return 1;
+}
+
+/*!	\brief Queues an event of a compiled track. Meta events are skipped.
+
+	@param output pointer to the output
+	@param events pointer to the compiled track
+	@param index index of the event within the track
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_output_queueEvent(struct MIDIOutput * output, const struct MIDITrackEvents * events, int index)
+{
+	return midi_output_queueMapped(output, events, index, NULL);
+}
+
+/*!	\brief Queues an event of a compiled track on another channel. Meta
+	events are skipped.
+
+	@param output pointer to the output
+	@param events pointer to the compiled track
+	@param index index of the event within the track
+	@param channel_map channel (0-15) to send each of the track's channels
+		on, or NULL to keep them
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_output_queueMapped(struct MIDIOutput * output, const struct MIDITrackEvents * events, int index,
+	const uint8_t * channel_map)
+{
+	unsigned char status = events->status[index];
+
+	if (status < 0xF0)
+	{
+		if (channel_map != NULL)
+		{
+			status = (status & 0xF0) | (channel_map[status & 0x0F] & 0x0F);
+		}
+		int size = midi_parse_channelSize[status >> 4];
+		if (!reserve(output, size))
+		{
+			return 0;
+		}
+		put_status(output, status);
+		output->buffer[output->size++] = events->data1[index];
+		if (size == 3)
+		{
+			output->buffer[output->size++] = events->data2[index];
+		}
+	}
+	else if (status == MIDI_STATUS_META)
+	{
+		return 1;
+	}
+	else
+	{
+		/*	Sysex: an F0 message carries its own leading F0 on the wire, while an
+			F7 "escape" sends the payload as-is.	*/
+		uint32_t len = events->payload_len[index];
+		if (!reserve(output, len + 1))
+		{
+			return 0;
+		}
+		if (status == 0xF0)
+		{
+			put_status(output, 0xF0);
+		}
+		else
+		{
+			output->wire_status = 0;
+		}
+		memcpy(&(output->buffer[output->size]), &(events->payload[events->payload_off[index]]), len);
+		output->size += len;
+	}
+
+	output->events++;
+	return 1;
+}
+
+/*!	\brief Starts the clock of a timed backend. Flushes are then due from
+	ns on; those due before go out right away.
+
+	@param output pointer to the output
+	@param ns time the clock starts from, in nanoseconds
+	@return 0 on success, -1 if the backend reported an error.
+*/
+int midi_output_start(struct MIDIOutput * output, uint64_t ns)
+{
+	return output->backend->start ? output->backend->start(output, ns) : 0;
+}
+
+/*!	\brief Writes everything queued to the device, in as few calls as possible.
+
+	@param output pointer to the output
+	@return 0 on success, -1 if the device reported an error.
+*/
+int midi_output_flush(struct MIDIOutput * output)
+{
+	return midi_output_flushAt(output, MIDI_OUTPUT_NOW);
+}
+
+/*!	\brief Hands everything queued to the backend, due at a given time.
+
+	Only a timed backend makes use of the time; the raw one writes
+	straight away, so the caller has to wait for the deadline first.
+
+	@param output pointer to the output
+	@param ns time the events are due from the start of the clock, in
+		nanoseconds, or MIDI_OUTPUT_NOW
+	@return 0 on success, -1 if the backend reported an error.
+*/
+int midi_output_flushAt(struct MIDIOutput * output, uint64_t ns)
+{
+	int ret = (output->size > 0) ? output->backend->write(output, output->buffer, output->size, ns) : 0;
+	output->size = 0;
+	return ret;
+}
+
+/*!	\brief Waits until everything handed to the backend has been played.
+
+	@param output pointer to the output
+	@return 0 on success, -1 if the backend reported an error.
+*/
+int midi_output_drain(struct MIDIOutput * output)
+{
+	return output->backend->drain ? output->backend->drain(output) : 0;
+}
+
+/*!	\brief Prints how many events, bytes and system calls the output has made.
+
+	@param output pointer to the output
+*/
+void midi_output_report(const struct MIDIOutput * output)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = (now.tv_sec - output->start.tv_sec) +
+		(now.tv_nsec - output->start.tv_nsec) / 1e9;
+
+	printf("Output: %lu events, %lu bytes (%lu saved by running status), "
+		"%lu write() calls in %.2f s (%.1f syscalls/s)\n",
+		output->events, output->bytes, output->bytes_saved,
+		output->syscalls, seconds, seconds > 0 ? output->syscalls / seconds : 0.0);
+}
+
+/*!	\brief Releases the memory held by an output, and closes its backend.
+	Does not close a raw output's file descriptor.
+
+	@param output pointer to the output; it is zeroed afterwards.
+*/
+void midi_output_free(struct MIDIOutput * output)
+{
+	if (output->backend != NULL && output->backend->close != NULL)
+	{
+		output->backend->close(output);
+	}
+	free(output->buffer);
+	memset(output, 0, sizeof(struct MIDIOutput));
+}
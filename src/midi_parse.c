@@ -4,6 +4,8 @@
 	themselves, the size of the individual blocks, etc.
 */
 #include "midi_parse.h"
+#include "midi_bytes.h"
+#include "midi_vlq.h"
 #include <stdio.h>
 #include <string.h>
 
@@ -61,9 +63,13 @@ int midi_parse_varSize(unsigned char * byte_seq, int * size)
 /**
  *	Walks through a given buffer to find the size of the next MIDI event.
  *	@param buffer An unsigned char buffer to write the MIDI event to.
- *	@param buffer_size The size of the buffer.
+ *	@param buffer_size The size of the buffer; an event that doesn't fit is an error.
  *	@param byte_seq A pointer to the raw byte sequence that contains the MIDI events.
  *	@return An integer representing how many bytes were written to the buffer; the size of the MIDI event in bytes.
+ *		0 on error.
+ *
+ *	byte_seq isn't bounds checked: for data that may be malformed, use
+ *	midi_parse_nextEvent() instead.
  *
  */
 int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char * byte_seq)
@@ -84,6 +90,10 @@ int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char *
         case 0xE:
             /*	Pitch Bend, 3 bytes long	*/
             byte_cntr += 3;
+            if (byte_cntr > buffer_size)
+            {
+                return 0;
+            }
             memcpy(buffer, byte_seq, byte_cntr);
             break;
 
@@ -94,6 +104,10 @@ int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char *
         case 0xD:
         	/*	Channel Key Pressure, 2 bytes long	*/
             byte_cntr += 2;
+            if (byte_cntr > buffer_size)
+            {
+                return 0;
+            }
             memcpy(buffer, byte_seq, byte_cntr);
             break;
 
@@ -112,12 +126,17 @@ int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char *
                     if (sizeOfSYSEX)
                     {
                         byte_cntr += byte_cntr_SYSEXsize + sizeOfSYSEX;
-                        if (byte_seq[byte_cntr] == 0xF0)
+                        if (byte_cntr > buffer_size)
+                        {
+                            /*  Doesn't fit in the caller's buffer.  */
+                            return 0;
+                        }
+                        if (byte_seq[0] == 0xF0)
                         {
                             // F0 Sysex Event -- Buffer Prep
                             memcpy(buffer, byte_seq, byte_cntr);
                         }
-                        else if (byte_seq[byte_cntr] == 0xF7)
+                        else if (byte_seq[0] == 0xF7)
                         {
                             // F7 Sysex Event -- Buffer Prep
                             memcpy(buffer+1, byte_seq, byte_cntr-1);
@@ -149,6 +168,10 @@ int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char *
 					if (byte_cntr_EVNTsize)
 					{
 						byte_cntr += (byte_cntr_EVNTsize + sizeOfEVNT);
+						if (byte_cntr > buffer_size)
+						{
+							return 0;
+						}
 						memcpy(buffer, byte_seq, byte_cntr);
 					}
 					else
@@ -166,6 +189,211 @@ int midi_parse_getEvent(unsigned char * buffer, int buffer_size, unsigned char *
     return byte_cntr;
 }
 
+/*	Total size of a channel event, status byte included, by (status >> 4).	*/
+const unsigned char midi_parse_channelSize[16] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0,		/*	0x0-0x7: data bytes, not a status	*/
+	3, 3, 3, 3, 2, 2, 3, 0		/*	0x8-0xF	*/
+};
+
+/*!	\brief Resets the decoder state of a track, before its first event.
+
+	@param state pointer to the decoder state to reset
+*/
+void midi_parse_initState(struct MIDIParseState * state)
+{
+	state->running_status = 0;
+}
+
+/*!	\brief Decodes the next MIDI event of a track, expanding running status.
+
+	Channel events are the overwhelmingly common case, so they are decoded with
+	a single table lookup and no switch: whether the status byte is present is
+	just bit 7 of the first byte. Everything from 0xF0 up is handed to
+	midi_parse_getEvent() unchanged.
+
+	@param state decoder state of the track
+	@param buffer An unsigned char buffer to write the expanded MIDI event to.
+	@param buffer_size The size of the buffer, at least 3 bytes.
+	@param byte_seq A pointer to the raw byte sequence that contains the MIDI events.
+	@param bytes_consumed Where to return how many bytes of byte_seq were used.
+	@return The size of the event written to buffer, or 0 if there was an error.
+*/
+int midi_parse_getEventStateful(struct MIDIParseState * state, unsigned char * buffer,
+	int buffer_size, unsigned char * byte_seq, int * bytes_consumed)
+{
+	unsigned char first = byte_seq[0];
+
+	if (first < 0xF0)
+	{
+		/*	1 if the status byte is present, 0 for running status.	*/
+		int has_status = first >> 7;
+		unsigned char status = has_status ? first : state->running_status;
+		int size = midi_parse_channelSize[status >> 4];
+
+		if (size == 0 || buffer_size < 3)
+		{
+			/*	Data byte with no running status in effect.	*/
+			*bytes_consumed = 0;
+			return 0;
+		}
+
+		buffer[0] = status;
+		buffer[1] = byte_seq[has_status];
+		buffer[2] = (size == 3) ? byte_seq[has_status + 1] : 0;
+
+		state->running_status = status;
+		*bytes_consumed = size - 1 + has_status;
+		return size;
+	}
+
+	/*	Sysex and meta events cancel running status.	*/
+	state->running_status = 0;
+	*bytes_consumed = midi_parse_getEvent(buffer, buffer_size, byte_seq);
+	return *bytes_consumed;
+}
+
+/*!	\brief Points a cursor at the first event of a track.
+
+	@param cursor pointer to the cursor to initialize
+	@param data raw MTrk data
+	@param size size of data, in bytes
+*/
+void midi_parse_initCursor(struct MIDIEventCursor * cursor, const unsigned char * data, size_t size)
+{
+	cursor->start = data;
+	cursor->pos = data;
+	cursor->end = data + size;
+	cursor->running_status = 0;
+	cursor->error = NULL;
+}
+
+/*	Decodes the header of an event (everything but a sysex/meta payload) from
+	p, reading at most MIDI_PARSE_HEADER_MAX bytes without checking them.
+	Returns the length of the header, or 0 with *error and *bad (the offset of
+	the offending byte) set.	*/
+static inline int decode_header(const unsigned char * p, unsigned char running_status, struct MIDIEvent * event,
+	const char ** error, int * bad)
+{
+	int pos = midi_vlq_read(p, MIDI_PARSE_HEADER_MAX, &(event->delta));
+	if (pos == 0)
+	{
+		*error = "A delta-time is longer than four bytes.";
+		*bad = 3;
+		return 0;
+	}
+	event->data1 = 0;
+	event->data2 = 0;
+	event->payload = NULL;
+	event->length = 0;
+
+	unsigned char first = p[pos];
+	if (first < 0xF0)
+	{
+		/*	Channel event; a data byte in the status position means running status.	*/
+		int has_status = first >> 7;
+		unsigned char status = has_status ? first : running_status;
+		int size = midi_parse_channelSize[status >> 4];
+		if (size == 0)
+		{
+			*error = "A data byte arrived with no running status in effect.";
+			*bad = pos;
+			return 0;
+		}
+		pos += has_status;
+		event->status = status;
+		event->data1 = p[pos];
+		event->data2 = (size == 3) ? p[pos + 1] : 0;
+		return pos + size - 1;
+	}
+
+	if (first == 0xF0 || first == 0xF7 || first == 0xFF)
+	{
+		/*	Sysex (F0/F7 <length> <data>) or meta (FF <type> <length> <data>).	*/
+		event->status = first;
+		if (first == 0xFF)
+		{
+			event->data1 = p[++pos];
+		}
+		pos++;
+		int length_bytes = midi_vlq_read(&p[pos], 4, &(event->length));	/*	pos is 6 at most.	*/
+		if (length_bytes == 0)
+		{
+			*error = "A sysex or meta length is longer than four bytes.";
+			*bad = pos + 3;
+			return 0;
+		}
+		return pos + length_bytes;
+	}
+
+	*error = "Unexpected status byte in a track.";
+	*bad = pos;
+	return 0;
+}
+
+/*!	\brief Decodes the next event of a track, never reading past its end.
+
+	Away from the end of the track, the header is decoded straight from the
+	track after a single check that MIDI_PARSE_HEADER_MAX bytes remain. The
+	last few events are decoded from a zero-padded copy instead, and then
+	checked against what was actually there.
+
+	@param cursor cursor over the track, moved past the event on success
+	@param event where to write the decoded event
+	@return 1 if an event was decoded, 0 at the end of the track, or -1 if the
+		next event is malformed (see cursor->error).
+*/
+int midi_parse_nextEvent(struct MIDIEventCursor * cursor, struct MIDIEvent * event)
+{
+	const unsigned char * pos = cursor->pos;
+	size_t avail = (size_t) (cursor->end - pos);
+	const char * error = NULL;
+	int bad = 0;
+	int len;
+
+	if (avail == 0)
+	{
+		return 0;
+	}
+
+	/*	The one bounds check of the header.	*/
+	const unsigned char * header = pos;
+	unsigned char tail[MIDI_PARSE_HEADER_MAX];
+	if (__builtin_expect(avail < MIDI_PARSE_HEADER_MAX, 0))
+	{
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, pos, avail);
+		header = tail;
+	}
+
+	len = decode_header(header, cursor->running_status, event, &error, &bad);
+	if (header == tail && ((len == 0 && (size_t) bad >= avail) || (size_t) len > avail))
+	{
+		len = 0;
+		error = "An event runs past the end of its track.";
+	}
+
+	if (len == 0)
+	{
+		cursor->error = error;
+		return -1;
+	}
+
+	if (event->status >= 0xF0)
+	{
+		if (event->length > avail - len)
+		{
+			cursor->error = "A sysex or meta event runs past the end of its track.";
+			return -1;
+		}
+		event->payload = pos + len;
+	}
+
+	/*	Sysex and meta events cancel running status.	*/
+	cursor->running_status = (event->status < 0xF0) ? event->status : 0;
+	cursor->pos = pos + len + event->length;
+	return 1;
+}
 
 int midi_parse_eventType(unsigned char * byte_seq, unsigned char * buffer)
 {
@@ -228,7 +456,8 @@ int midi_parse_eventType(unsigned char * byte_seq, unsigned char * buffer)
                     // Copyright Notice
                 case 0x03:
                     printf("Sequence Track Name--Variable Length");
-                    byte_cnt += midi_parse_varSize(&byte_seq[++byte_cnt], &byte_size);
+                    byte_cnt++;
+                    byte_cnt += midi_parse_varSize(&byte_seq[byte_cnt], &byte_size);
                     byte_cnt += byte_size;
                     break;
                     // Sequence/Track Name
@@ -244,7 +473,8 @@ int midi_parse_eventType(unsigned char * byte_seq, unsigned char * buffer)
                     // Text?
                     // Variable length
                     printf("TEXT-- but I don't know how to handle it. Skipping for now...");
-                    byte_cnt += midi_parse_varSize(&byte_seq[++byte_cnt], &byte_size);
+                    byte_cnt++;
+                    byte_cnt += midi_parse_varSize(&byte_seq[byte_cnt], &byte_size);
                     byte_cnt += byte_size;
                     break;
                 case 0x20:
@@ -328,12 +558,14 @@ int midi_parse_eventType(unsigned char * byte_seq, unsigned char * buffer)
 }
 unsigned char * midi_printBytes(unsigned char * byte_seq, int bytes)
 {
-    int bytesToSave = 64;
-    unsigned char retBytes[bytesToSave];
+    /*  Static, so that it outlives the call; each call overwrites it.  */
+    static unsigned char retBytes[64];
+    int bytesToSave = sizeof(retBytes);
     unsigned char * retBytesPtr = retBytes;
+    retBytes[0] = '\0';
 
     int ctr = 0;
-    for (; ctr < bytes; ctr++)
+    for (; ctr < bytes && bytesToSave > 3; ctr++)
     {
         int bytesWritten = snprintf((char *)retBytesPtr, bytesToSave, "%02x ", byte_seq[ctr]);
         retBytesPtr += bytesWritten;
@@ -343,3 +575,67 @@ unsigned char * midi_printBytes(unsigned char * byte_seq, int bytes)
     return retBytes;
 
 }
+
+/*!	\brief Decodes the payload of a set tempo meta event (FF 51 03 tt tt tt).
+
+	@param payload the payload, after the length
+	@param length length of the payload
+	@param usec_per_quarter where to write the tempo, in microseconds per quarter note
+	@return 1 on success, 0 if the payload isn't exactly the length the event calls for.
+*/
+int midi_parse_tempo(const unsigned char * payload, uint32_t length, uint32_t * usec_per_quarter)
+{
+	struct MIDIBytes bytes;
+	midi_bytes_init(&bytes, payload, length);
+	*usec_per_quarter = midi_bytes_readBE24(&bytes);
+	return !bytes.overrun && !midi_bytes_remaining(&bytes);
+}
+
+/*!	\brief Decodes the payload of a time signature meta event (FF 58 04 nn dd cc bb).
+
+	@param payload the payload, after the length
+	@param length length of the payload
+	@param timeSignature where to write the time signature
+	@return 1 on success, 0 if the payload isn't exactly 4 bytes or the denominator is out of range.
+*/
+int midi_parse_timeSignature(const unsigned char * payload, uint32_t length,
+	struct MIDITimeSignature * timeSignature)
+{
+	struct MIDIBytes bytes;
+	midi_bytes_init(&bytes, payload, length);
+	timeSignature->numerator = midi_bytes_readU8(&bytes);
+	uint8_t denominator_log2 = midi_bytes_readU8(&bytes);
+	timeSignature->clocks_per_click = midi_bytes_readU8(&bytes);
+	timeSignature->notated_32nds = midi_bytes_readU8(&bytes);
+
+	if (bytes.overrun || midi_bytes_remaining(&bytes) || denominator_log2 > 15)
+	{
+		return 0;
+	}
+	timeSignature->denominator = 1u << denominator_log2;
+	return 1;
+}
+
+/*!	\brief Decodes the payload of an SMPTE offset meta event (FF 54 05 hr mn se fr ff).
+
+	@param payload the payload, after the length
+	@param length length of the payload
+	@param offset where to write the offset
+	@return 1 on success, 0 if the payload isn't exactly the length the event calls for.
+*/
+int midi_parse_smpteOffset(const unsigned char * payload, uint32_t length, struct MIDISMPTEOffset * offset)
+{
+	/*	Bits 5-6 of the hours byte select the frame rate.	*/
+	static const float frame_rates[4] = {24, 25, 29.97f, 30};
+
+	struct MIDIBytes bytes;
+	midi_bytes_init(&bytes, payload, length);
+	uint8_t hours = midi_bytes_readU8(&bytes);
+	offset->frames_per_second = frame_rates[(hours >> 5) & 0x3];
+	offset->hours = hours & 0x1F;
+	offset->minutes = midi_bytes_readU8(&bytes);
+	offset->seconds = midi_bytes_readU8(&bytes);
+	offset->frames = midi_bytes_readU8(&bytes);
+	offset->subframes = midi_bytes_readU8(&bytes);
+	return !bytes.overrun && !midi_bytes_remaining(&bytes);
+}
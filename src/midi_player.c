@@ -0,0 +1,276 @@
+/*! @file
+	Splits playback in two. The decoding side (merging the tracks and
+	converting ticks into time) pushes timestamped events into a
+	single-producer, single-consumer ring, and stays up to
+	MIDI_PLAYER_RING_SIZE events ahead. The output thread only sleeps until
+	the next deadline, writes every event due by then, and goes back to
+	sleep: no decoding, no allocation once warmed up, and no logging.
+
+	With realtime set, the output thread runs under SCHED_FIFO and all
+	memory is locked, so that neither the scheduler nor paging gets between
+	a deadline and the write. Either may be refused (both usually need
+	privileges); playback then carries on without it, with a warning.
+*/
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "midi_player.h"
+#include "debug.h"
+
+#define RING_MASK (MIDI_PLAYER_RING_SIZE - 1)
+
+static int64_t ns_between(const struct timespec * from, const struct timespec * to)
+{
+	return (int64_t) (to->tv_sec - from->tv_sec) * 1000000000 + (to->tv_nsec - from->tv_nsec);
+}
+
+static void * player_main(void * arg)
+{
+	struct MIDIPlayer * player = arg;
+	const struct timespec idle = {0, 200000};	/*	0.2 ms	*/
+	unsigned long tail = player->tail;
+	int dry = 1;	/*	Waiting for the first event isn't an underrun.	*/
+
+	while (1)
+	{
+		unsigned long head = __atomic_load_n(&(player->head), __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			/*	finished is set after the last push, so head is final once it is.	*/
+			if (__atomic_load_n(&(player->finished), __ATOMIC_ACQUIRE) &&
+				__atomic_load_n(&(player->head), __ATOMIC_ACQUIRE) == tail)
+			{
+				break;
+			}
+			/*	Counted once per dry spell, not once per poll.	*/
+			player->underruns += !dry;
+			dry = 1;
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		dry = 0;
+
+		unsigned long depth = head - tail;
+		player->depth_sum += depth;
+		player->depth_max = (depth > player->depth_max) ? depth : player->depth_max;
+
+		uint64_t due = player->ring[tail & RING_MASK].ns;
+		struct timespec deadline;
+		midi_sched_deadlineNs(player->scheduler, due, &deadline);
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+
+		/*	Everything due by now that is already in the ring goes out together.	*/
+		do
+		{
+			const struct MIDIPlayerEvent * event = &(player->ring[tail & RING_MASK]);
+			const struct MIDIPlayerSource * source = &(player->sources[event->source]);
+			const struct MIDITrackEvents * events = &(source->timeline->tracks[event->track]);
+			midi_output_queueMapped(player->output, events, event->index, source->channel_map);
+			if (player->live != NULL)
+			{
+				midi_seek_apply(player->live, events, event->index);
+			}
+			tail++;
+			player->events++;
+		} while (tail != __atomic_load_n(&(player->head), __ATOMIC_ACQUIRE) &&
+			player->ring[tail & RING_MASK].ns <= due);
+		__atomic_store_n(&(player->tail), tail, __ATOMIC_RELEASE);
+
+		midi_output_flush(player->output);
+		player->flushes++;
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		int64_t late = ns_between(&deadline, &now);
+		if (late > MIDI_PLAYER_MISS_NS)
+		{
+			player->misses++;
+		}
+		if (late > 0 && (uint64_t) late > player->max_late_ns)
+		{
+			player->max_late_ns = late;
+		}
+	}
+	return NULL;
+}
+
+static int start_thread(struct MIDIPlayer * player, int realtime)
+{
+	player->ring = malloc(sizeof(struct MIDIPlayerEvent) * MIDI_PLAYER_RING_SIZE);
+	if (player->ring == NULL)
+	{
+		ERROR("Allocation failed for the playback ring.\n");
+		return 0;
+	}
+
+	int ret = -1;
+	if (realtime)
+	{
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+		{
+			player->locked = 1;
+		}
+		else
+		{
+			WARN("Couldn't lock memory, playing without: %s\n", strerror(errno));
+		}
+
+		pthread_attr_t attr;
+		struct sched_param param = {.sched_priority = MIDI_PLAYER_PRIORITY};
+		pthread_attr_init(&attr);
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+		pthread_attr_setschedparam(&attr, &param);
+		ret = pthread_create(&(player->thread), &attr, player_main, player);
+		pthread_attr_destroy(&attr);
+
+		if (ret == 0)
+		{
+			player->realtime = 1;
+		}
+		else
+		{
+			WARN("Couldn't get SCHED_FIFO for playback, playing without: %s\n", strerror(ret));
+		}
+	}
+
+	if (ret != 0 && (ret = pthread_create(&(player->thread), NULL, player_main, player)) != 0)
+	{
+		ERROR("Couldn't start the playback thread: %s\n", strerror(ret));
+		midi_player_free(player);
+		return 0;
+	}
+	return 1;
+}
+
+/*!	\brief Starts the output thread, ready for events to be pushed.
+
+	@param player pointer to the player to start
+	@param timeline compiled tracks the events refer to; must outlive the player
+	@param scheduler started scheduler giving the time of tick 0
+	@param output output to write to; only the output thread touches it until
+		midi_player_finish() returns
+	@param live state updated with every event written, or NULL
+	@param realtime non-zero to run the output thread under SCHED_FIFO with
+		memory locked, if allowed
+	@return 1 on success, 0 if the thread couldn't be started.
+*/
+int midi_player_start(struct MIDIPlayer * player, const struct MIDITimeline * timeline,
+	const struct MIDIScheduler * scheduler, struct MIDIOutput * output, struct MIDISeekState * live, int realtime)
+{
+	memset(player, 0, sizeof(struct MIDIPlayer));
+	player->single.timeline = timeline;
+	player->sources = &(player->single);
+	player->num_sources = 1;
+	player->scheduler = scheduler;
+	player->output = output;
+	player->live = live;
+	return start_thread(player, realtime);
+}
+
+/*!	\brief Starts the output thread for events from several timelines,
+	pushed with midi_player_pushFrom().
+
+	@param player pointer to the player to start
+	@param sources timelines the events refer to, and the channels each
+		plays on; must outlive the player
+	@param num_sources number of sources, up to 65536
+	@param scheduler started scheduler giving the time of tick 0
+	@param output output to write to; only the output thread touches it until
+		midi_player_finish() returns
+	@param realtime non-zero to run the output thread under SCHED_FIFO with
+		memory locked, if allowed
+	@return 1 on success, 0 if the thread couldn't be started.
+*/
+int midi_player_startSources(struct MIDIPlayer * player, const struct MIDIPlayerSource * sources, int num_sources,
+	const struct MIDIScheduler * scheduler, struct MIDIOutput * output, int realtime)
+{
+	memset(player, 0, sizeof(struct MIDIPlayer));
+	player->sources = sources;
+	player->num_sources = num_sources;
+	player->scheduler = scheduler;
+	player->output = output;
+	return start_thread(player, realtime);
+}
+
+/*!	\brief Hands the next event to the output thread.
+
+	Events must be pushed in the order they are due. Waits while the ring is
+	full, which is how the decoding side is kept only so far ahead.
+
+	@param player pointer to a started player
+	@param ns time the event is due, from tick 0, in nanoseconds
+	@param track track of the event within the timeline
+	@param index index of the event within its track
+*/
+void midi_player_push(struct MIDIPlayer * player, uint64_t ns, int track, int index)
+{
+	midi_player_pushFrom(player, 0, ns, track, index);
+}
+
+/*!	\brief Hands the next event of one of the sources to the output thread.
+
+	@param player pointer to a started player
+	@param source index of the event's timeline within the sources
+	@param ns time the event is due, from tick 0, in nanoseconds
+	@param track track of the event within the timeline
+	@param index index of the event within its track
+*/
+void midi_player_pushFrom(struct MIDIPlayer * player, int source, uint64_t ns, int track, int index)
+{
+	const struct timespec idle = {0, 1000000};	/*	1 ms	*/
+	unsigned long head = player->head;
+
+	while (head - __atomic_load_n(&(player->tail), __ATOMIC_ACQUIRE) == MIDI_PLAYER_RING_SIZE)
+	{
+		nanosleep(&idle, NULL);
+	}
+
+	player->ring[head & RING_MASK] = (struct MIDIPlayerEvent) {ns, source, track, index};
+	__atomic_store_n(&(player->head), head + 1, __ATOMIC_RELEASE);
+}
+
+/*!	\brief Waits until every event pushed has been written, and stops the
+	output thread.
+
+	@param player pointer to a started player
+*/
+void midi_player_finish(struct MIDIPlayer * player)
+{
+	__atomic_store_n(&(player->finished), 1, __ATOMIC_RELEASE);
+	pthread_join(player->thread, NULL);
+}
+
+/*!	\brief Prints the deadlines missed and how full the ring ran.
+
+	@param player pointer to a finished player
+*/
+void midi_player_report(const struct MIDIPlayer * player)
+{
+	printf("Player: %lu events at %lu deadlines, %lu missed by over %.1f ms (latest %.3f ms), "
+		"ring depth %.1f average, %lu max of %d, %lu underrun(s)%s%s\n",
+		player->events, player->flushes, player->misses, MIDI_PLAYER_MISS_NS / 1e6, player->max_late_ns / 1e6,
+		player->flushes ? (double) player->depth_sum / player->flushes : 0.0, player->depth_max,
+		MIDI_PLAYER_RING_SIZE, player->underruns, player->realtime ? ", SCHED_FIFO" : "",
+		player->locked ? ", memory locked" : "");
+}
+
+/*!	\brief Releases the memory held by a finished player.
+
+	@param player pointer to the player; it is zeroed afterwards.
+*/
+void midi_player_free(struct MIDIPlayer * player)
+{
+	if (player->locked)
+	{
+		munlockall();
+	}
+	free(player->ring);
+	memset(player, 0, sizeof(struct MIDIPlayer));
+}
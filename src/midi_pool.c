@@ -0,0 +1,314 @@
+/*! @file
+	Work-stealing thread pool. Every worker has its own deque of tasks: it
+	works through its own deque newest-first, and once that is empty, steals
+	the oldest task from another worker. A thread waiting on a group of tasks
+	runs queued tasks while it waits, so tasks may submit and wait on tasks of
+	their own without tying up a worker.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "midi_pool.h"
+#include "debug.h"
+
+/*	Initial number of tasks each deque can hold; deques grow as needed.	*/
+#define MIDI_POOL_DEQUE_CAPACITY 64
+
+/*	Index of the worker running on this thread, -1 outside of the pool.	*/
+static __thread int worker_index = -1;
+
+struct WorkerStart
+{
+	struct MIDIPool *	pool;
+	int					index;
+};
+
+static int deque_push(struct MIDIPoolDeque * deque, struct MIDIPoolTask task)
+{
+	pthread_mutex_lock(&(deque->lock));
+
+	if (deque->count == deque->capacity)
+	{
+		int capacity = deque->capacity * 2;
+		struct MIDIPoolTask * tasks = malloc(sizeof(struct MIDIPoolTask) * capacity);
+		if (tasks == NULL)
+		{
+			pthread_mutex_unlock(&(deque->lock));
+			return 0;
+		}
+		for (int cntr = 0; cntr < deque->count; cntr++)
+		{
+			tasks[cntr] = deque->tasks[(deque->top + cntr) % deque->capacity];
+		}
+		free(deque->tasks);
+		deque->tasks = tasks;
+		deque->capacity = capacity;
+		deque->top = 0;
+	}
+
+	deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+	deque->count++;
+
+	pthread_mutex_unlock(&(deque->lock));
+	return 1;
+}
+
+/*	Takes the newest task (the owner's end) or the oldest one (a thief's end).	*/
+static int deque_take(struct MIDIPoolDeque * deque, int newest, struct MIDIPoolTask * task)
+{
+	int found = 0;
+	pthread_mutex_lock(&(deque->lock));
+
+	if (deque->count > 0)
+	{
+		if (newest)
+		{
+			*task = deque->tasks[(deque->top + deque->count - 1) % deque->capacity];
+		}
+		else
+		{
+			*task = deque->tasks[deque->top];
+			deque->top = (deque->top + 1) % deque->capacity;
+		}
+		deque->count--;
+		found = 1;
+	}
+
+	pthread_mutex_unlock(&(deque->lock));
+	return found;
+}
+
+/*	Finds a task for the calling thread: its own newest, or anyone's oldest.	*/
+static int find_task(struct MIDIPool * pool, struct MIDIPoolTask * task)
+{
+	int self = worker_index;
+
+	if (self >= 0 && deque_take(&(pool->deques[self]), 1, task))
+	{
+		__atomic_fetch_sub(&(pool->queued), 1, __ATOMIC_ACQ_REL);
+		return 1;
+	}
+
+	int start = (self >= 0) ? self + 1 : 0;
+	for (int cntr = 0; cntr < pool->num_threads; cntr++)
+	{
+		int victim = (start + cntr) % pool->num_threads;
+		if (victim != self && deque_take(&(pool->deques[victim]), 0, task))
+		{
+			__atomic_fetch_sub(&(pool->queued), 1, __ATOMIC_ACQ_REL);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void run_task(struct MIDIPool * pool, struct MIDIPoolTask * task)
+{
+	task->fn(task->arg);
+
+	if (__atomic_sub_fetch(task->group, 1, __ATOMIC_ACQ_REL) == 0)
+	{
+		pthread_mutex_lock(&(pool->lock));
+		pthread_cond_broadcast(&(pool->changed));
+		pthread_mutex_unlock(&(pool->lock));
+	}
+}
+
+static void * worker_main(void * arg)
+{
+	struct WorkerStart start = *(struct WorkerStart *) arg;
+	struct MIDIPool * pool = start.pool;
+	free(arg);
+
+	worker_index = start.index;
+
+	while (1)
+	{
+		struct MIDIPoolTask task;
+		if (find_task(pool, &task))
+		{
+			run_task(pool, &task);
+			continue;
+		}
+
+		pthread_mutex_lock(&(pool->lock));
+		while (!pool->shutdown && __atomic_load_n(&(pool->queued), __ATOMIC_ACQUIRE) <= 0)
+		{
+			pthread_cond_wait(&(pool->changed), &(pool->lock));
+		}
+		int shutdown = pool->shutdown;
+		pthread_mutex_unlock(&(pool->lock));
+
+		if (shutdown)
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*!	\brief Starts a pool of worker threads.
+
+	@param pool pointer to the pool to start
+	@param num_threads number of workers; values below 1 mean one per online CPU
+	@return number of workers started, or 0 on failure.
+*/
+int midi_pool_init(struct MIDIPool * pool, int num_threads)
+{
+	memset(pool, 0, sizeof(struct MIDIPool));
+
+	if (num_threads < 1)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads = (cpus > 0) ? (int) cpus : 1;
+	}
+
+	pool->threads = calloc(num_threads, sizeof(pthread_t));
+	pool->deques = calloc(num_threads, sizeof(struct MIDIPoolDeque));
+	if (pool->threads == NULL || pool->deques == NULL)
+	{
+		ERROR("Allocation failed for %d workers.\n", num_threads);
+		free(pool->threads);
+		free(pool->deques);
+		return 0;
+	}
+
+	pthread_mutex_init(&(pool->lock), NULL);
+	pthread_cond_init(&(pool->changed), NULL);
+	pool->num_threads = num_threads;
+
+	for (int cntr = 0; cntr < num_threads; cntr++)
+	{
+		struct MIDIPoolDeque * deque = &(pool->deques[cntr]);
+		pthread_mutex_init(&(deque->lock), NULL);
+		deque->tasks = malloc(sizeof(struct MIDIPoolTask) * MIDI_POOL_DEQUE_CAPACITY);
+		deque->capacity = MIDI_POOL_DEQUE_CAPACITY;
+		if (deque->tasks == NULL)
+		{
+			ERROR("Allocation failed for the deque of worker %d.\n", cntr);
+			exit(-1);
+		}
+	}
+
+	for (int cntr = 0; cntr < num_threads; cntr++)
+	{
+		struct WorkerStart * start = malloc(sizeof(struct WorkerStart));
+		if (start == NULL)
+		{
+			ERROR("Allocation failed for worker %d.\n", cntr);
+			exit(-1);
+		}
+		start->pool = pool;
+		start->index = cntr;
+
+		if (pthread_create(&(pool->threads[cntr]), NULL, worker_main, start) != 0)
+		{
+			ERROR("Couldn't start worker %d.\n", cntr);
+			free(start);
+			exit(-1);
+		}
+	}
+
+	return pool->num_threads;
+}
+
+/*!	\brief Queues a task.
+
+	From a worker, the task goes on that worker's own deque; from any other
+	thread, the deques are filled round-robin.
+
+	@param pool pointer to the pool
+	@param group counter of pending tasks, incremented now and decremented
+		when the task finishes; wait on it with midi_pool_wait()
+	@param fn function to run
+	@param arg argument passed to fn
+*/
+void midi_pool_submit(struct MIDIPool * pool, int * group, void (*fn)(void *), void * arg)
+{
+	struct MIDIPoolTask task = {fn, arg, group};
+	int target = worker_index;
+
+	if (target < 0)
+	{
+		target = __atomic_fetch_add(&(pool->next_deque), 1, __ATOMIC_RELAXED) % pool->num_threads;
+	}
+
+	__atomic_fetch_add(group, 1, __ATOMIC_ACQ_REL);
+	if (!deque_push(&(pool->deques[target]), task))
+	{
+		/*	Out of memory: run it right here instead.	*/
+		run_task(pool, &task);
+		return;
+	}
+
+	pthread_mutex_lock(&(pool->lock));
+	__atomic_fetch_add(&(pool->queued), 1, __ATOMIC_ACQ_REL);
+	pthread_cond_broadcast(&(pool->changed));
+	pthread_mutex_unlock(&(pool->lock));
+}
+
+/*!	\brief Waits until every task of a group has finished, helping out meanwhile.
+
+	@param pool pointer to the pool
+	@param group counter passed to midi_pool_submit()
+*/
+void midi_pool_wait(struct MIDIPool * pool, int * group)
+{
+	while (__atomic_load_n(group, __ATOMIC_ACQUIRE) > 0)
+	{
+		struct MIDIPoolTask task;
+		if (find_task(pool, &task))
+		{
+			run_task(pool, &task);
+			continue;
+		}
+
+		pthread_mutex_lock(&(pool->lock));
+		while (__atomic_load_n(group, __ATOMIC_ACQUIRE) > 0 &&
+			__atomic_load_n(&(pool->queued), __ATOMIC_ACQUIRE) <= 0)
+		{
+			pthread_cond_wait(&(pool->changed), &(pool->lock));
+		}
+		pthread_mutex_unlock(&(pool->lock));
+	}
+}
+
+/*!	\brief Returns the index of the worker running the calling thread.
+
+	@return index within [0, num_threads), or -1 outside of the pool.
+*/
+int midi_pool_workerIndex(void)
+{
+	return worker_index;
+}
+
+/*!	\brief Stops every worker and releases the pool. Queued tasks are dropped.
+
+	@param pool pointer to the pool; it is zeroed afterwards.
+*/
+void midi_pool_destroy(struct MIDIPool * pool)
+{
+	pthread_mutex_lock(&(pool->lock));
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&(pool->changed));
+	pthread_mutex_unlock(&(pool->lock));
+
+	for (int cntr = 0; cntr < pool->num_threads; cntr++)
+	{
+		pthread_join(pool->threads[cntr], NULL);
+	}
+	for (int cntr = 0; cntr < pool->num_threads; cntr++)
+	{
+		pthread_mutex_destroy(&(pool->deques[cntr].lock));
+		free(pool->deques[cntr].tasks);
+	}
+
+	pthread_cond_destroy(&(pool->changed));
+	pthread_mutex_destroy(&(pool->lock));
+	free(pool->threads);
+	free(pool->deques);
+	memset(pool, 0, sizeof(struct MIDIPool));
+}
@@ -0,0 +1,189 @@
+/*! @file
+	The index behind time-window queries. The tracks are merged once, and
+	every event gets its time, so that a query starts with a binary search
+	instead of decoding from the top of the file.
+
+	Events are then read in blocks of MIDI_QUERY_BLOCK. Each block keeps a
+	bitmap of the channels and one of the types of event it holds, and a
+	block that has neither a channel nor a type the query wants is skipped
+	without looking at its events. Asking for a sparse channel or type
+	therefore costs about one check per block, plus the events returned.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_merge.h"
+#include "midi_arena.h"
+#include "midi_query.h"
+#include "debug.h"
+
+static void * query_alloc(struct MIDIArena * arena, size_t count, size_t size)
+{
+	return arena ? midi_arena_calloc(arena, count, size) : calloc(count ? count : 1, size);
+}
+
+/*	Channel bit of an event, 0 for sysex and meta events.	*/
+static uint16_t channel_bit(uint8_t status)
+{
+	return (status < 0xF0) ? (1u << (status & 0x0F)) : 0;
+}
+
+static uint8_t type_bit(uint8_t status)
+{
+	return 1u << ((status >> 4) - 8);
+}
+
+/*	Whether an event, or a block summarized by its bitmaps, has anything
+	for a query.	*/
+static int wanted(const struct MIDIQuery * query, uint16_t channels, uint8_t types)
+{
+	return (types & query->types) &&
+		(query->channels == MIDI_QUERY_ALL_CHANNELS || (channels & query->channels));
+}
+
+/*!	\brief Builds the query index of a decoded file.
+
+	@param timeline compiled tracks; must outlive the index
+	@param tempoMap tempo map of the file, for times
+	@param arena arena to allocate from, or NULL to use malloc()
+	@param queryIndex where to write the index
+	@return number of events indexed, or -1 if an allocation failed.
+*/
+int midi_query_build(const struct MIDITimeline * timeline, const struct MIDITempoMap * tempoMap,
+	struct MIDIArena * arena, struct MIDIQueryIndex * queryIndex)
+{
+	memset(queryIndex, 0, sizeof(struct MIDIQueryIndex));
+	queryIndex->arena = arena;
+
+	size_t num_events = 0;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		num_events += timeline->tracks[track].num_events;
+	}
+	int num_blocks = (num_events + MIDI_QUERY_BLOCK - 1) / MIDI_QUERY_BLOCK;
+
+	queryIndex->ns = query_alloc(arena, num_events, sizeof(uint64_t));
+	queryIndex->track = query_alloc(arena, num_events, sizeof(int32_t));
+	queryIndex->index = query_alloc(arena, num_events, sizeof(int32_t));
+	queryIndex->status = query_alloc(arena, num_events, sizeof(uint8_t));
+	queryIndex->block_channels = query_alloc(arena, num_blocks, sizeof(uint16_t));
+	queryIndex->block_types = query_alloc(arena, num_blocks, sizeof(uint8_t));
+
+	struct MIDIMerge merge;
+	if (queryIndex->ns == NULL || queryIndex->track == NULL || queryIndex->index == NULL ||
+		queryIndex->status == NULL || queryIndex->block_channels == NULL || queryIndex->block_types == NULL ||
+		!midi_merge_init(&merge, timeline))
+	{
+		ERROR("Allocation failed for the query index of %zu events.\n", num_events);
+		midi_query_free(queryIndex);
+		return -1;
+	}
+	queryIndex->num_blocks = num_blocks;
+
+	int track, index, hint = 0, position = 0;
+	while (midi_merge_next(&merge, &track, &index))
+	{
+		uint8_t status = timeline->tracks[track].status[index];
+		queryIndex->ns[position] = midi_tempo_tickToNs(tempoMap, &hint, timeline->tracks[track].tick[index]);
+		queryIndex->track[position] = track;
+		queryIndex->index[position] = index;
+		queryIndex->status[position] = status;
+
+		int block = position / MIDI_QUERY_BLOCK;
+		queryIndex->block_channels[block] |= channel_bit(status);
+		queryIndex->block_types[block] |= type_bit(status);
+		position++;
+	}
+	midi_merge_free(&merge);
+
+	queryIndex->num_events = position;
+	return position;
+}
+
+/*!	\brief Starts a query.
+
+	@param queryIndex index to query
+	@param query window and filters; copied into the cursor
+	@param cursor where to keep the position of the query
+*/
+void midi_query_start(const struct MIDIQueryIndex * queryIndex, const struct MIDIQuery * query,
+	struct MIDIQueryCursor * cursor)
+{
+	cursor->queryIndex = queryIndex;
+	cursor->query = *query;
+
+	/*	First event at or after the start of the window.	*/
+	int low = 0, high = queryIndex->num_events;
+	while (low < high)
+	{
+		int mid = low + (high - low) / 2;
+		if (queryIndex->ns[mid] < query->from_ns)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	cursor->position = low;
+}
+
+/*!	\brief Finds the next event a query asked for.
+
+	@param cursor cursor from midi_query_start()
+	@param position where to store the position of the event within the
+		index; its track and index within the track are track[position]
+		and index[position]
+	@return 1 if an event was found, 0 at the end of the window.
+*/
+int midi_query_next(struct MIDIQueryCursor * cursor, int * position)
+{
+	const struct MIDIQueryIndex * queryIndex = cursor->queryIndex;
+	const struct MIDIQuery * query = &(cursor->query);
+	int cntr = cursor->position;
+
+	while (cntr < queryIndex->num_events && queryIndex->ns[cntr] < query->to_ns)
+	{
+		/*	Whole blocks with nothing wanted are stepped over.	*/
+		int block = cntr / MIDI_QUERY_BLOCK;
+		if (!wanted(query, queryIndex->block_channels[block], queryIndex->block_types[block]))
+		{
+			cntr = (block + 1) * MIDI_QUERY_BLOCK;
+			continue;
+		}
+
+		uint8_t status = queryIndex->status[cntr];
+		if (wanted(query, channel_bit(status), type_bit(status)))
+		{
+			*position = cntr;
+			cursor->position = cntr + 1;
+			return 1;
+		}
+		cntr++;
+	}
+
+	cursor->position = cntr;
+	return 0;
+}
+
+/*!	\brief Releases the memory held by a query index.
+
+	@param queryIndex pointer to the index; it is zeroed afterwards.
+*/
+void midi_query_free(struct MIDIQueryIndex * queryIndex)
+{
+	if (queryIndex->arena == NULL)
+	{
+		free(queryIndex->ns);
+		free(queryIndex->track);
+		free(queryIndex->index);
+		free(queryIndex->status);
+		free(queryIndex->block_channels);
+		free(queryIndex->block_types);
+	}
+	memset(queryIndex, 0, sizeof(struct MIDIQueryIndex));
+}
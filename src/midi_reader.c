@@ -8,158 +8,223 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "midi_parse.h"
 #include "midi_reader.h"
+#include "midi_arena.h"
+#include "midi_bytes.h"
 #include "debug.h"
 
-/*! \brief Loads the MIDI file into memory.
+/*	Initial size of the block array; it doubles whenever it fills up.	*/
+#define MIDI_READER_INITIAL_BLOCKS 8
 
-	@param midi_file FILE pointer to a MIDI file.
-	@return A pointer to a linked list of struct MIDIBlockNodes (which contain MIDIBlocks).
-*/
-struct MIDIBlockNode * alloc_midi_file(FILE * midi_file)
+/*	Grows the block array of a MIDIFile being indexed.	*/
+static int grow_blocks(struct MIDIFile * midiFile, int * capacity)
 {
-	int block_num = 0;	/*	Keep track of which block we're on!	*/
+	int new_capacity = *capacity ? *capacity * 2 : MIDI_READER_INITIAL_BLOCKS;
+	struct MIDIBlock * blocks;
+
+	if (midiFile->arena != NULL)
+	{
+		/*	The old array stays in the arena; it's small, and freed with the rest.	*/
+		blocks = midi_arena_alloc(midiFile->arena, sizeof(struct MIDIBlock) * new_capacity);
+		if (blocks != NULL && midiFile->num_blocks)
+		{
+			memcpy(blocks, midiFile->blockArr, sizeof(struct MIDIBlock) * midiFile->num_blocks);
+		}
+	}
+	else
+	{
+		blocks = realloc(midiFile->blockArr, sizeof(struct MIDIBlock) * new_capacity);
+	}
 
-	/*  Grab the original/current file position.    */
-	long midi_file_originalPosition = ftell(midi_file);
+	if (blocks == NULL)
+	{
+		ERROR("Allocation failed for an array of %d blocks.\n", new_capacity);
+		return 0;
+	}
+	midiFile->blockArr = blocks;
+	*capacity = new_capacity;
+	return 1;
+}
 
-	/*  Determine the size of the file by seeking to the end, and then go to the beginning. */
-	fseek(midi_file, 0, SEEK_END);
-	long file_size = ftell(midi_file);
-	fseek(midi_file, 0, SEEK_SET);
+/*!	\brief Indexes the chunks of a MIDI file held in memory, in a single pass.
 
-	/*  The idea is that we're going to create an 'internal' linked list of
-		MIDIBlock structs as we go. Then, convert it to an array of MIDIBlocks
-		after we seek through the entirety of the file.
+	Every chunk header is read exactly once, straight into the block array;
+	each block points at its data in place. The MThd chunk is validated, and
+	its format, track count and division are decoded into midiFile. A chunk
+	claiming more bytes than the file holds rejects the whole file, rather
+	than being read misaligned. A few stray bytes after the last chunk, too
+	short to be a chunk header, are ignored.
 
-		Since these are effectively pointers (notably within the struct MIDIBlock),
-		this is a fairy inexpensive operation to do, and it allows us to do some
-		more manipulation as we go along.   */
+	@param data contents of the file
+	@param size size of the file, in bytes
+	@param midiFile MIDIFile to fill in; its arena, if any, must already be set
+	@return number of chunks, or -1 if the file isn't a valid MIDI file. On
+		failure, num_blocks is 0 and nothing needs to be released.
+*/
+int index_midi_chunks(const unsigned char * data, size_t size, struct MIDIFile * midiFile)
+{
+	int capacity = 0;
+	struct MIDIBytes bytes;
+	midi_bytes_init(&bytes, data, size);
 
-	/*	Create an initial starting node for the linked list.	*/
-	struct MIDIBlockNode * p_initialNode = (struct MIDIBlockNode *) malloc(sizeof(struct MIDIBlockNode));
+	midiFile->num_blocks = 0;
+	midiFile->blockArr = NULL;
 
-	if (p_initialNode == NULL)
+	if (size < 14 || memcmp(data, "MThd", 4))
 	{
-		ERROR("Allocation failed for node representing block %d.\n", block_num);
-		exit(-1);
+		ERROR("The file doesn't start with an MThd chunk.\n");
+		return -1;
 	}
-	memset(p_initialNode, 0, sizeof(struct MIDIBlockNode));
-
-	/*	Create a pointer to the current node.	*/
-	struct MIDIBlockNode * p_currentNode = p_initialNode;
 
-	/*	Begin to walk through the file	*/
-	while (ftell(midi_file) < file_size)
+	while (midi_bytes_remaining(&bytes) >= 8)
 	{
-		/*	Create a header buffer to read into	*/
-		unsigned char buffer[8];
-		memset(buffer, 0, sizeof(buffer));
+		const unsigned char * type = midi_bytes_skip(&bytes, 4);
+		uint32_t length = midi_bytes_readBE32(&bytes);
+		const unsigned char * chunk = midi_bytes_skip(&bytes, length);
 
-		/*	Read the first 8 bytes of the file.	*/
-		int bytes_read;
-		if ((bytes_read = fread(&buffer[0], 1, 8, midi_file)) != 8)
+		if (chunk == NULL)
 		{
-			/*  If for whatever reason we didn't read all eight bytes, there's a
-				chance that we're misaligned with the contents of the file.
-				Although we're not reading garbage, it's simply not useful to us
-				because the blocks aren't lined up with where we expect blocks. */
-
-			WARN("Attempted to read 8 bytes from file, read %d bytes."
-				" Data may be misaligned!\n", bytes_read);
-			continue;
+			ERROR("Chunk %d (%.4s) claims %u bytes, but only %zu remain.\n",
+				midiFile->num_blocks, (const char *) type, length, (size_t) (data + size - type - 8));
+			goto fail;
 		}
-
-		/*	Update the information fields in the MIDIBlock struct	*/
-
-		/*	Update block size	*/
-		p_currentNode->midiBlock.n_data_size = parse_hex_size(&buffer[4], 4);
-
-		/*	Update header	*/
-		strncpy( (char *) (p_currentNode->midiBlock).header, (char *) buffer, 4);
-
-		/*	Based on the block size, dynamically allocate byte storage,
-			and then attempt to read in the amount of bytes necessary
-			for this file.	*/
-		p_currentNode->midiBlock.data = malloc(p_currentNode->midiBlock.n_data_size);
-		if (p_currentNode->midiBlock.n_data_size !=
-			(bytes_read = fread((p_currentNode->midiBlock).data, 1, p_currentNode->midiBlock.n_data_size, midi_file) ))
+		if (midiFile->num_blocks == capacity && !grow_blocks(midiFile, &capacity))
 		{
-			WARN("Attempted to read %d bytes from file, read %d bytes."
-				" Data may be misaligned!\n", p_currentNode->midiBlock.n_data_size, bytes_read);
+			goto fail;
 		}
 
-		/*	TODO: Do we need to update the status variables here?	*/
+		struct MIDIBlock * block = &(midiFile->blockArr[midiFile->num_blocks++]);
+		memset(block, 0, sizeof(struct MIDIBlock));
+		memcpy(block->header, type, 4);
+		block->offset = (uint32_t) (chunk - data);
+		block->n_data_size = (int) length;
+		block->data = (unsigned char *) chunk;
+	}
 
+	if (midi_bytes_remaining(&bytes))
+	{
+		WARN("Ignoring %zu stray byte(s) after the last chunk.\n", midi_bytes_remaining(&bytes));
+	}
 
-		/*	We're finished with this block. Prepare for the next block.	*/
-		block_num++;
+	/*	MThd data: <format:2> <ntracks:2> <division:2>	*/
+	struct MIDIBytes mthd;
+	midi_bytes_init(&mthd, midiFile->blockArr[0].data, midiFile->blockArr[0].n_data_size);
+	midiFile->format = midi_bytes_readBE16(&mthd);
+	midiFile->num_tracks = midi_bytes_readBE16(&mthd);
+	midiFile->division = midi_bytes_readBE16(&mthd);
 
-		if (ftell(midi_file) < file_size)
-		{
-			if ( (p_currentNode->nextNode = malloc(sizeof(struct MIDIBlockNode))) == NULL)
-			{
-				ERROR("Couldn't allocate memory for the next node. Failure status.\n");
-				exit(-1);
-			}
-			memset(p_currentNode->nextNode, 0, sizeof(struct MIDIBlockNode));
-			p_currentNode = p_currentNode->nextNode;	/*	Upon successful allocation, move on.	*/
-		}
+	if (mthd.overrun)
+	{
+		ERROR("The MThd chunk is %d bytes long, expected at least 6.\n", midiFile->blockArr[0].n_data_size);
+		goto fail;
+	}
+	if (midiFile->format > 2)
+	{
+		ERROR("Unknown MIDI file format %d.\n", midiFile->format);
+		goto fail;
+	}
+	if (midiFile->division == 0)
+	{
+		ERROR("The MThd division is 0.\n");
+		goto fail;
 	}
 
-	/*	The end result of this while-loop is a linked-list containing allocated
-		data structures for the entirety of the MIDI file.
+	int mtrk_chunks = 0;
+	for (int cntr = 1; cntr < midiFile->num_blocks; cntr++)
+	{
+		mtrk_chunks += !memcmp(midiFile->blockArr[cntr].header, "MTrk", 4);
+	}
+	if (mtrk_chunks != midiFile->num_tracks)
+	{
+		WARN("The MThd announces %d tracks, but the file holds %d.\n", midiFile->num_tracks, mtrk_chunks);
+	}
 
-		Return the very first, initial node to the linked list. This will allow all parts of
-		the file to be accessed.	*/
-	fseek(midi_file, midi_file_originalPosition, SEEK_SET);
+	DEBUG("Format %d, %d tracks, division %04X, %d chunks.\n",
+		midiFile->format, midiFile->num_tracks, midiFile->division, midiFile->num_blocks);
+	return midiFile->num_blocks;
 
-	return p_initialNode;
+fail:
+	if (midiFile->arena == NULL)
+	{
+		free(midiFile->blockArr);
+	}
+	midiFile->blockArr = NULL;
+	midiFile->num_blocks = 0;
+	return -1;
 }
 
-/*!	\brief Converts a MIDIBlockNode-based linked list into a fixed-sized array.
+/*!	\brief Maps the MIDI file into memory, without copying any of its blocks.
 
-	Converts a MIDIBlockNode-based linked list into a fixed-sized array. It will
-	also appropriately deallocate the link list provided.
+	Maps the entire file read-only with a single mmap() call, and then indexes
+	the chunk headers in place with index_midi_chunks(). Every MIDIBlock.data
+	pointer in the returned structure is a view into the mapping, so the only
+	allocation made is the block array itself. Release the result with
+	unmap_midi_file(), not freeBlocks().
 
-	@param list pointer to the first node of the linked list containing the MIDIBlock
+	@param fd File descriptor of an open, seekable MIDI file.
+	@param arena arena to allocate the block array from, or NULL to use malloc()
+	@return A struct MIDIFile; num_blocks will be 0 if the file couldn't be mapped,
+		or isn't a valid MIDI file.
 */
-struct MIDIFile convert_ll_to_MIDIFile(struct MIDIBlockNode * list)
+struct MIDIFile map_midi_file(int fd, struct MIDIArena * arena)
 {
-	DEBUG("Initialize the return structure.\n");
-	/*	Return value, we will modify this!	*/
 	struct MIDIFile ret = {0};
+	ret.arena = arena;
 
-	/*	In order to grab the number of elements within the list, we need to run
-		through it at least once, to calculate how big the array needs to be	*/
-	struct MIDIBlockNode * iter = list;
-	ret.num_blocks = 0;
-
-	while(iter != NULL)
+	/*	Determine the size of the file, without seeking.	*/
+	struct stat file_stat;
+	if (fstat(fd, &file_stat) != 0 || file_stat.st_size < 8)
 	{
-		ret.num_blocks += 1;
-		iter = iter->nextNode;
+		ERROR("Couldn't determine the size of the file, or it is too small.\n");
+		return ret;
 	}
-	DEBUG("There are %d blocks in this list.\n", ret.num_blocks);
-	ret.blockArr = malloc(sizeof(struct MIDIBlock) * ret.num_blocks);
-
-	/*	Now that the array is allocated, we can run through and actually move
-		the elements into place	*/
-	iter = list;
-	for (int cntr = 0; cntr < ret.num_blocks; cntr++)
+	size_t file_size = (size_t) file_stat.st_size;
+
+	/*	Small files are the common case, so ask for the pages up front
+		instead of faulting them in one at a time.	*/
+	int map_flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+	map_flags |= MAP_POPULATE;
+#endif
+	unsigned char * base = mmap(NULL, file_size, PROT_READ, map_flags, fd, 0);
+	if (base == MAP_FAILED)
 	{
-		struct MIDIBlockNode * prev = iter;
-		iter = iter->nextNode;
+		ERROR("Couldn't map the file into memory: %s\n", strerror(errno));
+		return ret;
+	}
 
-		memcpy(&(ret.blockArr[cntr]), &(prev->midiBlock), sizeof(struct MIDIBlock));
-		free(prev);
+	if (index_midi_chunks(base, file_size, &ret) < 0)
+	{
+		munmap(base, file_size);
+		return ret;
 	}
 
+	ret.map_base = base;
+	ret.map_size = file_size;
 	return ret;
 }
 
+/*!	\brief Releases a struct MIDIFile returned by map_midi_file().
+
+	@param midiFile pointer to the MIDIFile to release; it is zeroed afterwards.
+*/
+void unmap_midi_file(struct MIDIFile * midiFile)
+{
+	if (midiFile->arena == NULL)
+	{
+		free(midiFile->blockArr);
+	}
+	if (midiFile->map_base != NULL)
+	{
+		munmap(midiFile->map_base, midiFile->map_size);
+	}
+	memset(midiFile, 0, sizeof(struct MIDIFile));
+}
+
 
 
 
@@ -238,7 +303,11 @@ void process_bytes(unsigned char * byte_seq, int num_bytes)
 
         //printf("MIDI Event:\n\tdelta-time:%d\n", delta_time);
         unsigned char buffer[3]  = {'\0','\0','\0'};
-        // Now, find the event itself.
+        // Now, find the event itself. Only channel events go to the device,
+        // and only as many bytes as they actually take up.
+        int event_start = byte_cnt;
+        int event_size = (byte_seq[event_start] >= 0x80 && byte_seq[event_start] < 0xF0) ?
+            midi_parse_channelSize[byte_seq[event_start] >> 4] : 0;
         int event_type_bytes_read = midi_parse_eventType(&byte_seq[byte_cnt], buffer);
         if (event_type_bytes_read)
         {
@@ -254,7 +323,8 @@ void process_bytes(unsigned char * byte_seq, int num_bytes)
                 for (; tst < 500000; tst++);
             firstOne = 1;
         }
-        write(fd, buffer, 3);
+        if (fd >= 0 && event_size)
+            write(fd, &byte_seq[event_start], event_size);
         last_delta_time = delta_time;
     }
 }
@@ -267,41 +337,34 @@ int test_file_if_midi(FILE * file)
     char mthd_indicator[4];                                                     // Now, we should read the first four bytes of the file and see if it matches
     int bytes_read = fread(&mthd_indicator[0], 1, 4, file);                     // with the following: MThd.
 
-    returnStatus = (strncmp("MThd", mthd_indicator, 4) == 0) ? 1 : 0;           // We'll go ahead and compare the first four bytes of the file to what should be
+    returnStatus = (bytes_read == 4 && strncmp("MThd", mthd_indicator, 4) == 0) ? 1 : 0;           // We'll go ahead and compare the first four bytes of the file to what should be
     fseek(file, origFilePosition, SEEK_SET);
     return returnStatus;
 }
 
 /*!
-    Given a char array representing a hexadecimal number,
-	convert it to an integer.
+    Given a char array holding a big-endian number, such as the length of a
+	chunk, convert it to an integer.
 
-    @param header A character array, representing a hexadecimal number
+    @param header A character array, most significant byte first
+    @param size Number of bytes in the number (at most 4)
     @return An integer representing the number of bytes that the block is, past
         the header.
 */
 int parse_hex_size(unsigned char * header, int size)
 {
-    /*  Counter for the block size  */
-    int block_size = 0;
-
-    /*  Iterator for each nibble within the size.   */
-    for (int nibble_pos = 0; nibble_pos < (size*2); nibble_pos++)
-    {
-        /*	00 00 00 00 FF FF FF FF
-        	Remember... each  ^ is a nibble, or half of a byte.	*/
-        unsigned char nibble = (nibble_pos % 2 == 0) ?
-            (header[(nibble_pos/2)] >> 4) :		/*	Upper nibble	*/
-            (header[(nibble_pos/2)] & 0x0F);	/*	Lower nibble	*/
-
-		/*	Since each position in hex represents the power of 16... convert it to decimal,
-			based on it's representation and position within the number string.	*/
-		block_size += (nibble << (4 * (7-nibble_pos) ) );
-    }
+	if (size == 4)
+	{
+		return (int) midi_bytes_be32(header);
+	}
 
-	/*	Return the final, calculated block size.	*/
-	DEBUG("Calculated size of the header is: %d\n", block_size);
-    return block_size;
+	/*	Most significant byte first.	*/
+	uint32_t value = 0;
+	for (int cntr = 0; cntr < size && cntr < 4; cntr++)
+	{
+		value = (value << 8) | header[cntr];
+	}
+	return (int) value;
 }
 
 
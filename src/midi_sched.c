@@ -0,0 +1,93 @@
+/*! @file
+	Turns ticks into absolute CLOCK_MONOTONIC deadlines and sleeps until they
+	are due. Sleeping on an absolute deadline means neither oversleeping nor
+	the time spent writing events accumulates into drift.
+*/
+
+#include <errno.h>
+#include <time.h>
+
+#include "midi_tempo.h"
+#include "midi_sched.h"
+#include "debug.h"
+
+/*!	\brief Starts a scheduler, with tick 0 due right now.
+
+	@param scheduler pointer to the scheduler to start
+	@param tempoMap tempo map used to convert ticks; must outlive the scheduler
+*/
+void midi_sched_start(struct MIDIScheduler * scheduler, const struct MIDITempoMap * tempoMap)
+{
+	clock_gettime(CLOCK_MONOTONIC, &(scheduler->start));
+	scheduler->tempoMap = tempoMap;
+	scheduler->hint = 0;
+}
+
+/*!	\brief Starts a scheduler part of the way into a file.
+
+	@param scheduler pointer to the scheduler to start
+	@param tempoMap tempo map used to convert ticks; must outlive the scheduler
+	@param ns time into the file, from tick 0, that is due right now
+*/
+void midi_sched_startAt(struct MIDIScheduler * scheduler, const struct MIDITempoMap * tempoMap, uint64_t ns)
+{
+	midi_sched_start(scheduler, tempoMap);
+
+	/*	Tick 0 happened ns ago.	*/
+	time_t sec = (time_t) (ns / 1000000000ull);
+	long nsec = (long) (ns % 1000000000ull);
+	scheduler->start.tv_sec -= sec;
+	scheduler->start.tv_nsec -= nsec;
+	if (scheduler->start.tv_nsec < 0)
+	{
+		scheduler->start.tv_sec--;
+		scheduler->start.tv_nsec += 1000000000L;
+	}
+}
+
+/*!	\brief Computes the absolute deadline of a tick.
+
+	@param scheduler pointer to a started scheduler
+	@param tick absolute tick
+	@param deadline where to write the CLOCK_MONOTONIC time the tick is due
+*/
+void midi_sched_deadline(struct MIDIScheduler * scheduler, uint32_t tick, struct timespec * deadline)
+{
+	midi_sched_deadlineNs(scheduler, midi_tempo_tickToNs(scheduler->tempoMap, &(scheduler->hint), tick), deadline);
+}
+
+/*!	\brief Computes the absolute deadline of a time already converted from ticks.
+
+	@param scheduler pointer to a started scheduler
+	@param ns time from tick 0, in nanoseconds
+	@param deadline where to write the CLOCK_MONOTONIC time it is due
+*/
+void midi_sched_deadlineNs(const struct MIDIScheduler * scheduler, uint64_t ns, struct timespec * deadline)
+{
+	ns += scheduler->start.tv_nsec;
+	deadline->tv_sec = scheduler->start.tv_sec + (time_t) (ns / 1000000000ull);
+	deadline->tv_nsec = (long) (ns % 1000000000ull);
+}
+
+/*!	\brief Sleeps until a tick is due.
+
+	Returns immediately if the tick is already in the past.
+
+	@param scheduler pointer to a started scheduler
+	@param tick absolute tick to wait for
+	@return 0 on success, or an error number from clock_nanosleep().
+*/
+int midi_sched_waitForTick(struct MIDIScheduler * scheduler, uint32_t tick)
+{
+	struct timespec deadline;
+	midi_sched_deadline(scheduler, tick, &deadline);
+
+	int ret;
+	while ((ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR);
+
+	if (ret != 0)
+	{
+		ERROR("clock_nanosleep() failed with error %d.\n", ret);
+	}
+	return ret;
+}
@@ -0,0 +1,369 @@
+/*! @file
+	Builds a checkpoint index over every track of a timeline, and uses it to
+	seek. Events are already random access once compiled, so all a seek has
+	to reconstruct is the channel state at the destination: the nearest
+	checkpoint before it is copied, then at most interval - 1 events are
+	rolled forward on top.
+
+	On a jump, the notes still sounding are turned off, and every channel
+	involved is reset, then brought to the state it has at the destination.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_timeline.h"
+#include "midi_output.h"
+#include "midi_seek.h"
+#include "debug.h"
+
+/*	Controllers from here on are channel mode messages, not values to keep.	*/
+#define CONTROLLER_ALL_SOUND_OFF		120
+#define CONTROLLER_RESET_ALL			121
+#define CONTROLLER_ALL_NOTES_OFF		123
+#define CONTROLLER_BANK_SELECT			0
+#define CONTROLLER_BANK_SELECT_LSB		32
+
+static int channel_used(const struct MIDIChannelState * channel)
+{
+	if (channel->program != MIDI_SEEK_UNSET || channel->pitch_bend != MIDI_SEEK_BEND_UNSET ||
+		channel->notes[0] | channel->notes[1] | channel->notes[2] | channel->notes[3])
+	{
+		return 1;
+	}
+	for (int cntr = 0; cntr < CONTROLLER_ALL_SOUND_OFF; cntr++)
+	{
+		if (channel->controller[cntr] != MIDI_SEEK_UNSET)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int queue3(struct MIDIOutput * output, unsigned char status, unsigned char data1, unsigned char data2)
+{
+	unsigned char event[3] = {status, data1, data2};
+	return midi_output_queue(output, event, (status >> 4) == 0xC ? 2 : 3);
+}
+
+/*!	\brief Sets a state to that of a device nothing has been sent to.
+
+	@param state pointer to the state to initialize
+*/
+void midi_seek_initState(struct MIDISeekState * state)
+{
+	memset(state, 0, sizeof(struct MIDISeekState));
+	for (int cntr = 0; cntr < 16; cntr++)
+	{
+		memset(state->channel[cntr].controller, MIDI_SEEK_UNSET, 128);
+		state->channel[cntr].program = MIDI_SEEK_UNSET;
+		state->channel[cntr].pitch_bend = MIDI_SEEK_BEND_UNSET;
+	}
+}
+
+/*!	\brief Updates a state with one event of a compiled track.
+
+	Called for every event played, so it only looks at the status byte of
+	anything that isn't a channel event.
+
+	@param state pointer to the state to update
+	@param events pointer to the compiled track
+	@param index index of the event within the track
+*/
+void midi_seek_apply(struct MIDISeekState * state, const struct MIDITrackEvents * events, int index)
+{
+	unsigned char status = events->status[index];
+	if (status >= 0xF0)
+	{
+		return;
+	}
+
+	struct MIDIChannelState * channel = &(state->channel[status & 0x0F]);
+	unsigned char data1 = events->data1[index] & 0x7F;
+	unsigned char data2 = events->data2[index] & 0x7F;
+	uint32_t tick = events->tick[index];
+	uint32_t set = (tick < UINT32_MAX) ? tick + 1 : UINT32_MAX;
+
+	switch (status >> 4)
+	{
+		case 0x9:
+			if (data2 > 0)
+			{
+				channel->notes[data1 >> 5] |= 1u << (data1 & 31);
+				break;
+			}
+			/*	Velocity 0 is a note off.	*/
+		case 0x8:
+			channel->notes[data1 >> 5] &= ~(1u << (data1 & 31));
+			break;
+
+		case 0xB:
+			if (data1 < CONTROLLER_ALL_SOUND_OFF)
+			{
+				channel->controller[data1] = data2;
+				channel->controller_set[data1] = set;
+			}
+			else if (data1 == CONTROLLER_RESET_ALL)
+			{
+				/*	A reset is kept as a change, so that it overrides values
+					another track set earlier.	*/
+				memset(channel->controller, MIDI_SEEK_UNSET, 128);
+				channel->pitch_bend = MIDI_SEEK_BEND_UNSET;
+				for (int controller = 0; controller < CONTROLLER_ALL_SOUND_OFF; controller++)
+				{
+					channel->controller_set[controller] = set;
+				}
+				channel->pitch_bend_set = set;
+			}
+			else if (data1 == CONTROLLER_ALL_SOUND_OFF || data1 >= CONTROLLER_ALL_NOTES_OFF)
+			{
+				/*	All notes off, and the omni/mono/poly modes that imply it.	*/
+				memset(channel->notes, 0, sizeof(channel->notes));
+			}
+			break;
+
+		case 0xC:
+			channel->program = data1;
+			channel->program_set = set;
+			break;
+
+		case 0xE:
+			channel->pitch_bend = data1 | (data2 << 7);
+			channel->pitch_bend_set = set;
+			break;
+	}
+}
+
+/*!	\brief Builds the checkpoint index of every track of a timeline.
+
+	@param timeline compiled tracks; must outlive the index
+	@param interval events between two checkpoints, or 0 for MIDI_SEEK_INTERVAL
+	@param seekIndex pointer to the index to fill in
+	@return number of checkpoints across all tracks, or -1 if an allocation failed.
+*/
+int midi_seek_build(const struct MIDITimeline * timeline, int interval, struct MIDISeekIndex * seekIndex)
+{
+	memset(seekIndex, 0, sizeof(struct MIDISeekIndex));
+	seekIndex->interval = (interval > 0) ? interval : MIDI_SEEK_INTERVAL;
+	seekIndex->tracks = calloc(timeline->num_tracks ? timeline->num_tracks : 1, sizeof(struct MIDISeekTrack));
+	if (seekIndex->tracks == NULL)
+	{
+		ERROR("Allocation failed for the seek index of %d tracks.\n", timeline->num_tracks);
+		return -1;
+	}
+	seekIndex->num_tracks = timeline->num_tracks;
+
+	int total = 0;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[track]);
+		struct MIDISeekTrack * seekTrack = &(seekIndex->tracks[track]);
+
+		/*	Checkpoint 0, before the first event, is always there.	*/
+		int count = 1 + (events->num_events > 0 ? (events->num_events - 1) / seekIndex->interval : 0);
+		seekTrack->checkpoints = malloc(sizeof(struct MIDISeekState) * count);
+		if (seekTrack->checkpoints == NULL)
+		{
+			ERROR("Allocation failed for %d checkpoints of track %d.\n", count, track);
+			midi_seek_free(seekIndex);
+			return -1;
+		}
+		seekTrack->num_checkpoints = count;
+
+		struct MIDISeekState state;
+		midi_seek_initState(&state);
+		for (int index = 0; index < events->num_events; index++)
+		{
+			if (index % seekIndex->interval == 0)
+			{
+				seekTrack->checkpoints[index / seekIndex->interval] = state;
+			}
+			midi_seek_apply(&state, events, index);
+		}
+		if (events->num_events == 0)
+		{
+			seekTrack->checkpoints[0] = state;
+		}
+		total += count;
+	}
+
+	DEBUG("Seek index: %d checkpoint(s), one every %d events, %zu bytes.\n", total, seekIndex->interval,
+		total * sizeof(struct MIDISeekState));
+	return total;
+}
+
+/*!	\brief Finds the state of one track just before a tick.
+
+	@param seekIndex index built over timeline
+	@param timeline compiled tracks
+	@param track index of the track
+	@param tick absolute tick to seek to
+	@param state where to write the state left by every event before tick
+	@return index of the track's first event at or after tick.
+*/
+int midi_seek_trackStateAt(const struct MIDISeekIndex * seekIndex, const struct MIDITimeline * timeline,
+	int track, uint32_t tick, struct MIDISeekState * state)
+{
+	const struct MIDITrackEvents * events = &(timeline->tracks[track]);
+	int target = midi_timeline_findTick(events, tick);
+
+	int checkpoint = target / seekIndex->interval;
+	if (checkpoint >= seekIndex->tracks[track].num_checkpoints)
+	{
+		checkpoint = seekIndex->tracks[track].num_checkpoints - 1;
+	}
+	*state = seekIndex->tracks[track].checkpoints[checkpoint];
+
+	for (int index = checkpoint * seekIndex->interval; index < target; index++)
+	{
+		midi_seek_apply(state, events, index);
+	}
+	return target;
+}
+
+/*!	\brief Finds the state of the device just before a tick, across all tracks.
+
+	Where tracks set the same controller, program or pitch bend of a channel,
+	the value set last is kept. Between changes on the same tick, the later
+	track's is kept, as the tracks are merged in that order for playback.
+	Notes held in any track are held.
+
+	@param seekIndex index built over timeline
+	@param timeline compiled tracks
+	@param tick absolute tick to seek to
+	@param state where to write the combined state
+*/
+void midi_seek_stateAt(const struct MIDISeekIndex * seekIndex, const struct MIDITimeline * timeline,
+	uint32_t tick, struct MIDISeekState * state)
+{
+	midi_seek_initState(state);
+
+	struct MIDISeekState trackState;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		midi_seek_trackStateAt(seekIndex, timeline, track, tick, &trackState);
+		for (int cntr = 0; cntr < 16; cntr++)
+		{
+			struct MIDIChannelState * to = &(state->channel[cntr]);
+			const struct MIDIChannelState * from = &(trackState.channel[cntr]);
+
+			for (int controller = 0; controller < 128; controller++)
+			{
+				if (from->controller_set[controller] != 0 &&
+					from->controller_set[controller] >= to->controller_set[controller])
+				{
+					to->controller[controller] = from->controller[controller];
+					to->controller_set[controller] = from->controller_set[controller];
+				}
+			}
+			if (from->program_set != 0 && from->program_set >= to->program_set)
+			{
+				to->program = from->program;
+				to->program_set = from->program_set;
+			}
+			if (from->pitch_bend_set != 0 && from->pitch_bend_set >= to->pitch_bend_set)
+			{
+				to->pitch_bend = from->pitch_bend;
+				to->pitch_bend_set = from->pitch_bend_set;
+			}
+			for (int word = 0; word < 4; word++)
+			{
+				to->notes[word] |= from->notes[word];
+			}
+		}
+	}
+}
+
+/*!	\brief Queues everything a device needs to jump to a tick.
+
+	Every note held in *live is turned off. Then each channel used before or
+	after the jump gets a Reset All Controllers, followed by the bank, program,
+	controllers and pitch bend it has at tick. Notes held across tick aren't
+	struck again: they start with their next note on, as in any sequencer.
+
+	@param seekIndex index built over timeline
+	@param timeline compiled tracks
+	@param live state of the device before the jump; on return, the state
+		after it
+	@param tick absolute tick playback continues from
+	@param output output to queue the events on; flushing is up to the caller
+	@return 1 on success, 0 if the output couldn't queue everything.
+*/
+int midi_seek_jump(const struct MIDISeekIndex * seekIndex, const struct MIDITimeline * timeline,
+	struct MIDISeekState * live, uint32_t tick, struct MIDIOutput * output)
+{
+	struct MIDISeekState target;
+	midi_seek_stateAt(seekIndex, timeline, tick, &target);
+
+	int ok = 1;
+	for (int cntr = 0; cntr < 16; cntr++)
+	{
+		struct MIDIChannelState * from = &(live->channel[cntr]);
+		struct MIDIChannelState * to = &(target.channel[cntr]);
+
+		for (int key = 0; key < 128; key++)
+		{
+			if (from->notes[key >> 5] & (1u << (key & 31)))
+			{
+				ok &= queue3(output, 0x80 | cntr, key, 0x40);
+			}
+		}
+
+		if (!channel_used(from) && !channel_used(to))
+		{
+			continue;
+		}
+		ok &= queue3(output, 0xB0 | cntr, CONTROLLER_RESET_ALL, 0);
+
+		/*	The bank has to be selected before the program change that uses it.	*/
+		if (to->controller[CONTROLLER_BANK_SELECT] != MIDI_SEEK_UNSET)
+		{
+			ok &= queue3(output, 0xB0 | cntr, CONTROLLER_BANK_SELECT, to->controller[CONTROLLER_BANK_SELECT]);
+		}
+		if (to->controller[CONTROLLER_BANK_SELECT_LSB] != MIDI_SEEK_UNSET)
+		{
+			ok &= queue3(output, 0xB0 | cntr, CONTROLLER_BANK_SELECT_LSB,
+				to->controller[CONTROLLER_BANK_SELECT_LSB]);
+		}
+		if (to->program != MIDI_SEEK_UNSET)
+		{
+			ok &= queue3(output, 0xC0 | cntr, to->program, 0);
+		}
+		for (int controller = 0; controller < CONTROLLER_ALL_SOUND_OFF; controller++)
+		{
+			if (to->controller[controller] != MIDI_SEEK_UNSET && controller != CONTROLLER_BANK_SELECT &&
+				controller != CONTROLLER_BANK_SELECT_LSB)
+			{
+				ok &= queue3(output, 0xB0 | cntr, controller, to->controller[controller]);
+			}
+		}
+		if (to->pitch_bend != MIDI_SEEK_BEND_UNSET)
+		{
+			ok &= queue3(output, 0xE0 | cntr, to->pitch_bend & 0x7F, to->pitch_bend >> 7);
+		}
+
+		/*	Nothing is sounding once the jump is done.	*/
+		memset(to->notes, 0, sizeof(to->notes));
+	}
+
+	*live = target;
+	return ok;
+}
+
+/*!	\brief Releases the memory held by a seek index.
+
+	@param seekIndex pointer to the index; it is zeroed afterwards.
+*/
+void midi_seek_free(struct MIDISeekIndex * seekIndex)
+{
+	if (seekIndex->tracks != NULL)
+	{
+		for (int track = 0; track < seekIndex->num_tracks; track++)
+		{
+			free(seekIndex->tracks[track].checkpoints);
+		}
+		free(seekIndex->tracks);
+	}
+	memset(seekIndex, 0, sizeof(struct MIDISeekIndex));
+}
@@ -0,0 +1,444 @@
+/*! @file
+	Computes the statistics of a decoded file straight from the packed
+	columns of its timeline, in two passes per track.
+
+	The first is the counting kernel: status, data1 and data2 are read side
+	by side and every histogram is updated unconditionally, with the
+	conditions folded into the increments instead of branches, so its cost
+	doesn't depend on the mix of events. The second puts times on the
+	events, for density. Durations come from the table of notes, and
+	polyphony from sweeping its sorted starts and ends.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_arena.h"
+#include "midi_notes.h"
+#include "midi_stats.h"
+#include "debug.h"
+
+static void * stats_calloc(struct MIDIArena * arena, size_t count, size_t size)
+{
+	return arena ? midi_arena_calloc(arena, count, size) : calloc(count ? count : 1, size);
+}
+
+static int compare_u64(const void * a, const void * b)
+{
+	uint64_t lhs = *(const uint64_t *) a, rhs = *(const uint64_t *) b;
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+/*	The counting kernel. Returns the number of note ons.	*/
+static uint64_t count_track(const struct MIDITrackEvents * events, struct MIDIStats * stats)
+{
+	const uint8_t * status = events->status;
+	const uint8_t * data1 = events->data1;
+	const uint8_t * data2 = events->data2;
+	uint64_t notes = 0;
+
+	for (int index = 0; index < events->num_events; index++)
+	{
+		unsigned s = status[index], type = s >> 4, channel = s & 0x0F;
+		unsigned d1 = data1[index] & 0x7F, d2 = data2[index] & 0x7F;
+		unsigned on = (type == 0x9) & (d2 != 0);
+
+		stats->pitch[channel][d1] += on;
+		stats->velocity[channel][d2] += on;
+		stats->controller[channel][d1] += (type == 0xB);
+		stats->by_type[type]++;
+		notes += on;
+	}
+	return notes;
+}
+
+/*	Times of every note that sounds, for the polyphony sweep.	*/
+struct NoteTimes
+{
+	uint64_t *	starts;
+	uint64_t *	ends;
+	uint64_t	num_notes;
+};
+
+/*	Second pass: channel events in each second.	*/
+static void time_track(const struct MIDITrackEvents * events, const struct MIDITempoMap * tempoMap,
+	struct MIDIStats * stats)
+{
+	int hint = 0;
+	for (int index = 0; index < events->num_events; index++)
+	{
+		if (events->status[index] < 0xF0)
+		{
+			uint64_t second = midi_tempo_tickToNs(tempoMap, &hint, events->tick[index]) / 1000000000ull;
+			stats->per_second[(second < (uint64_t) stats->num_seconds) ? second : stats->num_seconds - 1]++;
+		}
+	}
+}
+
+/*	Note durations, in time rather than ticks. Notes come track by track,
+	sorted by start within a track, so both hints mostly hit.	*/
+static void time_notes(const struct MIDINoteTable * notes, const struct MIDITempoMap * tempoMap,
+	struct NoteTimes * times, struct MIDIStats * stats)
+{
+	int start_hint = 0, end_hint = 0;
+	for (int row = 0; row < notes->num_notes; row++)
+	{
+		if (row > 0 && notes->track[row] != notes->track[row - 1])
+		{
+			start_hint = end_hint = 0;
+		}
+		uint64_t start = midi_tempo_tickToNs(tempoMap, &start_hint, notes->start[row]);
+		uint64_t end = midi_tempo_tickToNs(tempoMap, &end_hint, notes->start[row] + notes->duration[row]);
+		uint64_t length = end - start;
+
+		uint64_t ms = length / 1000000;
+		int bucket = ms ? 63 - __builtin_clzll(ms) : 0;
+		stats->note_duration[(bucket < MIDI_STATS_DURATION_BUCKETS) ? bucket : MIDI_STATS_DURATION_BUCKETS - 1]++;
+		stats->duration_sum_ns += length;
+		stats->duration_max_ns = (length > stats->duration_max_ns) ? length : stats->duration_max_ns;
+
+		/*	Notes that never sound play no part in polyphony.	*/
+		if (length > 0)
+		{
+			times->starts[times->num_notes] = start;
+			times->ends[times->num_notes] = end;
+			times->num_notes++;
+		}
+	}
+	stats->unterminated = notes->num_unterminated;
+}
+
+/*	Sweeps the sorted note starts and ends for the highest and average
+	number of notes sounding at once.	*/
+static void sweep_polyphony(struct NoteTimes * times, struct MIDIStats * stats)
+{
+	uint64_t n = times->num_notes;
+	qsort(times->starts, n, sizeof(uint64_t), compare_u64);
+	qsort(times->ends, n, sizeof(uint64_t), compare_u64);
+
+	uint64_t start = 0, end = 0, sounding_since = 0, sounding_ns = 0;
+	int count = 0;
+	while (end < n)
+	{
+		/*	On a tie, the note ending goes first: it doesn't overlap the next.	*/
+		if (start < n && times->starts[start] < times->ends[end])
+		{
+			if (count++ == 0)
+			{
+				sounding_since = times->starts[start];
+			}
+			stats->max_polyphony = (count > stats->max_polyphony) ? count : stats->max_polyphony;
+			start++;
+		}
+		else
+		{
+			if (--count == 0)
+			{
+				sounding_ns += times->ends[end] - sounding_since;
+			}
+			end++;
+		}
+	}
+
+	/*	Total note time over the time any note sounds.	*/
+	stats->avg_polyphony = sounding_ns ? (double) stats->duration_sum_ns / sounding_ns : 0;
+}
+
+/*!	\brief Parses the name of an output format.
+
+	@param name "csv" or "json"
+	@return MIDI_STATS_CSV, MIDI_STATS_JSON, or MIDI_STATS_NONE if unknown.
+*/
+int midi_stats_parseFormat(const char * name)
+{
+	return !strcmp(name, "csv") ? MIDI_STATS_CSV : !strcmp(name, "json") ? MIDI_STATS_JSON : MIDI_STATS_NONE;
+}
+
+/*!	\brief Computes the statistics of a decoded file.
+
+	@param timeline compiled tracks
+	@param tempoMap tempo map of the file, for times
+	@param arena arena to allocate from, or NULL to use malloc(); scratch
+		space is released before returning
+	@param stats where to write the statistics
+	@return 1 on success, 0 if an allocation failed.
+*/
+int midi_stats_compute(const struct MIDITimeline * timeline, const struct MIDITempoMap * tempoMap,
+	struct MIDIArena * arena, struct MIDIStats * stats)
+{
+	memset(stats, 0, sizeof(struct MIDIStats));
+	stats->arena = arena;
+
+	uint32_t last_tick = 0;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		const struct MIDITrackEvents * events = &(timeline->tracks[track]);
+		stats->notes += count_track(events, stats);
+		stats->events += events->num_events;
+		if (events->num_events > 0 && events->tick[events->num_events - 1] > last_tick)
+		{
+			last_tick = events->tick[events->num_events - 1];
+		}
+	}
+	stats->channel_events = stats->events - stats->by_type[0xF];
+
+	int hint = 0;
+	uint64_t last_ns = midi_tempo_tickToNs(tempoMap, &hint, last_tick);
+	stats->duration = last_ns / 1e9;
+	uint64_t seconds = last_ns / 1000000000ull + 1;
+	stats->num_seconds = (seconds < MIDI_STATS_MAX_SECONDS) ? (int) seconds : MIDI_STATS_MAX_SECONDS;
+	stats->per_second = stats_calloc(arena, stats->num_seconds, sizeof(uint32_t));
+
+	struct MIDIArenaMark mark;
+	if (arena != NULL)
+	{
+		mark = midi_arena_mark(arena);
+	}
+	struct MIDINoteTable notes = {0};
+	struct NoteTimes times = {0};
+	int ok = stats->per_second != NULL && midi_notes_build(timeline, arena, &notes) >= 0;
+	if (ok)
+	{
+		times.starts = stats_calloc(arena, notes.num_notes, sizeof(uint64_t));
+		times.ends = stats_calloc(arena, notes.num_notes, sizeof(uint64_t));
+		ok = times.starts != NULL && times.ends != NULL;
+	}
+
+	if (ok)
+	{
+		for (int track = 0; track < timeline->num_tracks; track++)
+		{
+			time_track(&(timeline->tracks[track]), tempoMap, stats);
+		}
+		time_notes(&notes, tempoMap, &times, stats);
+		sweep_polyphony(&times, stats);
+
+		for (int second = 0; second < stats->num_seconds; second++)
+		{
+			stats->peak_density = (stats->per_second[second] > stats->peak_density) ?
+				stats->per_second[second] : stats->peak_density;
+		}
+		stats->avg_density = stats->channel_events / ((stats->duration > 1) ? stats->duration : 1);
+	}
+	else
+	{
+		ERROR("Allocation failed for the statistics of %llu notes.\n", (unsigned long long) stats->notes);
+	}
+
+	if (arena != NULL)
+	{
+		midi_arena_release(arena, mark);
+	}
+	else
+	{
+		free(times.starts);
+		free(times.ends);
+		midi_notes_free(&notes);
+	}
+	return ok;
+}
+
+/*	Writes a string as a JSON string, or as a CSV field if csv is set.	*/
+static void write_string(FILE * out, const char * text, int csv)
+{
+	fputc('"', out);
+	for (const unsigned char * pos = (const unsigned char *) text; *pos; pos++)
+	{
+		if (csv)
+		{
+			if (*pos == '"')
+			{
+				fputc('"', out);
+			}
+			fputc(*pos, out);
+		}
+		else if (*pos == '"' || *pos == '\\')
+		{
+			fprintf(out, "\\%c", *pos);
+		}
+		else if (*pos < 0x20)
+		{
+			fprintf(out, "\\u%04x", *pos);
+		}
+		else
+		{
+			fputc(*pos, out);
+		}
+	}
+	fputc('"', out);
+}
+
+static void write_csv(FILE * out, const char * path, const struct MIDIStats * stats)
+{
+#define ROW(section, channel, key_fmt, key, value_fmt, value)		\
+	do {															\
+		write_string(out, path, 1);									\
+		fprintf(out, "," section ",%s," key_fmt "," value_fmt "\n",	\
+			channel, key, value);									\
+	} while (0)
+
+	char channel[4];
+	ROW("summary", "", "%s", "events", "%llu", (unsigned long long) stats->events);
+	ROW("summary", "", "%s", "channel_events", "%llu", (unsigned long long) stats->channel_events);
+	ROW("summary", "", "%s", "notes", "%llu", (unsigned long long) stats->notes);
+	ROW("summary", "", "%s", "unterminated_notes", "%llu", (unsigned long long) stats->unterminated);
+	ROW("summary", "", "%s", "duration_s", "%.3f", stats->duration);
+	ROW("summary", "", "%s", "max_polyphony", "%d", stats->max_polyphony);
+	ROW("summary", "", "%s", "avg_polyphony", "%.3f", stats->avg_polyphony);
+	ROW("summary", "", "%s", "peak_density", "%u", stats->peak_density);
+	ROW("summary", "", "%s", "avg_density", "%.3f", stats->avg_density);
+	ROW("summary", "", "%s", "mean_note_ms", "%.3f", stats->notes ? stats->duration_sum_ns / 1e6 / stats->notes : 0.0);
+	ROW("summary", "", "%s", "max_note_ms", "%.3f", stats->duration_max_ns / 1e6);
+
+	for (int type = 0; type < 8; type++)
+	{
+		ROW("type", "", "%s", midi_timeline_typeName((type + 8) << 4), "%u", stats->by_type[type + 8]);
+	}
+	for (int ch = 0; ch < 16; ch++)
+	{
+		snprintf(channel, sizeof(channel), "%d", ch);
+		for (int key = 0; key < 128; key++)
+		{
+			if (stats->pitch[ch][key]) ROW("pitch", channel, "%d", key, "%u", stats->pitch[ch][key]);
+		}
+		for (int key = 0; key < 128; key++)
+		{
+			if (stats->velocity[ch][key]) ROW("velocity", channel, "%d", key, "%u", stats->velocity[ch][key]);
+		}
+		for (int key = 0; key < 128; key++)
+		{
+			if (stats->controller[ch][key]) ROW("controller", channel, "%d", key, "%u", stats->controller[ch][key]);
+		}
+	}
+	for (int bucket = 0; bucket < MIDI_STATS_DURATION_BUCKETS; bucket++)
+	{
+		ROW("note_duration_ms", "", "%d", bucket ? 1 << bucket : 0, "%u", stats->note_duration[bucket]);
+	}
+	for (int second = 0; second < stats->num_seconds; second++)
+	{
+		ROW("density", "", "%d", second, "%u", stats->per_second[second]);
+	}
+#undef ROW
+}
+
+/*	Writes the non-zero entries of a histogram as a JSON object.	*/
+static void write_json_histogram(FILE * out, const char * name, const uint32_t * counts)
+{
+	fprintf(out, ",\"%s\":{", name);
+	const char * separator = "";
+	for (int key = 0; key < 128; key++)
+	{
+		if (counts[key])
+		{
+			fprintf(out, "%s\"%d\":%u", separator, key, counts[key]);
+			separator = ",";
+		}
+	}
+	fputc('}', out);
+}
+
+static void write_json(FILE * out, const char * path, const struct MIDIStats * stats)
+{
+	fputs("{\"file\":", out);
+	write_string(out, path, 0);
+	fprintf(out, ",\"events\":%llu,\"channel_events\":%llu,\"notes\":%llu,\"unterminated_notes\":%llu,"
+		"\"duration_s\":%.3f,\"max_polyphony\":%d,\"avg_polyphony\":%.3f,\"peak_density\":%u,"
+		"\"avg_density\":%.3f,\"mean_note_ms\":%.3f,\"max_note_ms\":%.3f",
+		(unsigned long long) stats->events, (unsigned long long) stats->channel_events,
+		(unsigned long long) stats->notes, (unsigned long long) stats->unterminated, stats->duration,
+		stats->max_polyphony, stats->avg_polyphony, stats->peak_density, stats->avg_density,
+		stats->notes ? stats->duration_sum_ns / 1e6 / stats->notes : 0.0, stats->duration_max_ns / 1e6);
+
+	fputs(",\"types\":{", out);
+	for (int type = 0; type < 8; type++)
+	{
+		fprintf(out, "%s\"%s\":%u", type ? "," : "", midi_timeline_typeName((type + 8) << 4),
+			stats->by_type[type + 8]);
+	}
+	fputc('}', out);
+
+	/*	Only the channels that were used.	*/
+	fputs(",\"channels\":[", out);
+	const char * separator = "";
+	for (int ch = 0; ch < 16; ch++)
+	{
+		uint64_t used = 0;
+		for (int key = 0; key < 128; key++)
+		{
+			used += stats->pitch[ch][key] + stats->controller[ch][key];
+		}
+		if (!used)
+		{
+			continue;
+		}
+		fprintf(out, "%s{\"channel\":%d", separator, ch);
+		write_json_histogram(out, "pitch", stats->pitch[ch]);
+		write_json_histogram(out, "velocity", stats->velocity[ch]);
+		write_json_histogram(out, "controller", stats->controller[ch]);
+		fputc('}', out);
+		separator = ",";
+	}
+	fputs("],\"note_duration_ms\":{", out);
+	for (int bucket = 0; bucket < MIDI_STATS_DURATION_BUCKETS; bucket++)
+	{
+		fprintf(out, "%s\"%d\":%u", bucket ? "," : "", bucket ? 1 << bucket : 0, stats->note_duration[bucket]);
+	}
+	fputs("},\"density\":[", out);
+	for (int second = 0; second < stats->num_seconds; second++)
+	{
+		fprintf(out, "%s%u", second ? "," : "", stats->per_second[second]);
+	}
+	fputs("]}\n", out);
+}
+
+/*!	\brief Writes what comes before the statistics of the first file.
+
+	@param out where to write
+	@param format MIDI_STATS_CSV or MIDI_STATS_JSON
+*/
+void midi_stats_writeHeader(FILE * out, int format)
+{
+	if (format == MIDI_STATS_CSV)
+	{
+		fputs("file,section,channel,key,value\n", out);
+	}
+}
+
+/*!	\brief Writes the statistics of one file.
+
+	CSV comes in long form, one value per row: file, section, channel (if
+	any), key and value; histograms only list their non-zero entries. JSON
+	is one object per file, on a single line, so that a corpus makes a JSON
+	Lines file.
+
+	@param out where to write
+	@param format MIDI_STATS_CSV or MIDI_STATS_JSON
+	@param path name of the file, as it should appear in the output
+	@param stats statistics computed by midi_stats_compute()
+*/
+void midi_stats_write(FILE * out, int format, const char * path, const struct MIDIStats * stats)
+{
+	if (format == MIDI_STATS_CSV)
+	{
+		write_csv(out, path, stats);
+	}
+	else if (format == MIDI_STATS_JSON)
+	{
+		write_json(out, path, stats);
+	}
+}
+
+/*!	\brief Releases the memory held by statistics.
+
+	@param stats pointer to the statistics; they are zeroed afterwards.
+*/
+void midi_stats_free(struct MIDIStats * stats)
+{
+	if (stats->arena == NULL)
+	{
+		free(stats->per_second);
+	}
+	memset(stats, 0, sizeof(struct MIDIStats));
+}
@@ -0,0 +1,382 @@
+/*! @file
+	Incremental MIDI parser. Bytes are pushed in slices of any size, down to
+	one byte at a time, and every event is handed to a callback as soon as
+	its last byte arrives. All of the state needed to resume in the middle of
+	a chunk header, a delta-time, a channel event or a sysex/meta payload
+	lives in struct MIDIStream, so memory use doesn't depend on the size of
+	the file.
+*/
+
+#include <string.h>
+
+#include "midi_parse.h"
+#include "midi_bytes.h"
+#include "midi_stream.h"
+#include "debug.h"
+
+enum
+{
+	STREAM_CHUNK_HEADER,	/*	"MThd"/"MTrk"/... and a 32-bit length	*/
+	STREAM_MTHD,			/*	Body of the MThd	*/
+	STREAM_SKIP,			/*	Body of a chunk we don't know	*/
+
+	/*	Within an MTrk	*/
+	STREAM_DELTA,
+	STREAM_STATUS,
+	STREAM_DATA,
+	STREAM_META_TYPE,
+	STREAM_LENGTH,			/*	Length of a sysex or meta payload	*/
+	STREAM_PAYLOAD,
+
+	STREAM_ERROR
+};
+
+static int stream_fail(struct MIDIStream * stream, const char * error)
+{
+	WARN("Stopped parsing after %llu bytes: %s\n", (unsigned long long) stream->bytes, error);
+	stream->error = error;
+	stream->state = STREAM_ERROR;
+	return -1;
+}
+
+/*	Finishes an event, and moves on to the next one or the next chunk.	*/
+static void end_event(struct MIDIStream * stream)
+{
+	stream->events++;
+	stream->state = stream->chunk_left ? STREAM_DELTA : STREAM_CHUNK_HEADER;
+}
+
+/*	Hands the payload collected so far to the callback.	*/
+static void emit_piece(struct MIDIStream * stream)
+{
+	struct MIDIStreamEvent * event = &(stream->event);
+	event->payload = stream->payload;
+	event->payload_len = stream->payload_fill;
+	stream->callback(stream->ctx, event);
+
+	event->payload_offset += stream->payload_fill;
+	stream->payload_fill = 0;
+	if (event->payload_offset == event->length)
+	{
+		end_event(stream);
+	}
+}
+
+static int start_chunk(struct MIDIStream * stream)
+{
+	const unsigned char * header = stream->chunk_header;
+	stream->chunk_left = midi_bytes_be32(&header[4]);
+	stream->chunk_size = stream->chunk_left;
+	stream->header_fill = 0;
+
+	if (stream->chunks_seen++ == 0)
+	{
+		if (memcmp(header, "MThd", 4) || stream->chunk_left < 6)
+		{
+			return stream_fail(stream, "The stream doesn't start with an MThd chunk.");
+		}
+		stream->state = STREAM_MTHD;
+		return 0;
+	}
+
+	if (memcmp(header, "MTrk", 4))
+	{
+		DEBUG("Skipping a %.4s chunk of %u bytes.\n", (char *) header, stream->chunk_left);
+		stream->state = stream->chunk_left ? STREAM_SKIP : STREAM_CHUNK_HEADER;
+		return 0;
+	}
+
+	memset(&(stream->event), 0, sizeof(struct MIDIStreamEvent));
+	stream->event.track = stream->tracks_seen++;
+	stream->running_status = 0;
+	stream->vlq = 0;
+	stream->vlq_bytes = 0;
+	stream->state = stream->chunk_left ? STREAM_DELTA : STREAM_CHUNK_HEADER;
+	return 0;
+}
+
+/*	Adds a byte to a variable-length quantity. Returns 1 once it is complete,
+	0 if more bytes are needed, and -1 if it's longer than four bytes.	*/
+static int vlq_push(struct MIDIStream * stream, unsigned char byte)
+{
+	stream->vlq = (stream->vlq << 7) | (byte & 0x7F);
+	stream->vlq_bytes++;
+	if (!(byte & 0x80))
+	{
+		stream->vlq_bytes = 0;
+		return 1;
+	}
+	return (stream->vlq_bytes == 4) ? -1 : 0;
+}
+
+/*!	\brief Initializes a stream, ready for the first byte of a MIDI file.
+
+	@param stream pointer to the stream to initialize
+	@param callback function called with every event, as soon as it is complete
+	@param ctx argument passed to callback
+*/
+void midi_stream_init(struct MIDIStream * stream, midi_stream_callback callback, void * ctx)
+{
+	memset(stream, 0, sizeof(struct MIDIStream));
+	stream->state = STREAM_CHUNK_HEADER;
+	stream->callback = callback;
+	stream->ctx = ctx;
+}
+
+/*!	\brief Parses the next slice of a MIDI file.
+
+	Every event completed by this slice is handed to the callback before
+	returning. The slice may end anywhere, even in the middle of an event.
+
+	@param stream pointer to an initialized stream
+	@param data next bytes of the file
+	@param size number of bytes in data
+	@return 0 on success, or -1 if the stream is malformed (see stream->error).
+*/
+int midi_stream_push(struct MIDIStream * stream, const unsigned char * data, size_t size)
+{
+	struct MIDIStreamEvent * event = &(stream->event);
+	size_t pos = 0;
+
+	if (stream->state == STREAM_ERROR)
+	{
+		return -1;
+	}
+
+	while (pos < size)
+	{
+		size_t avail = size - pos;
+
+		if (stream->state == STREAM_CHUNK_HEADER)
+		{
+			size_t n = 8 - stream->header_fill;
+			n = (n < avail) ? n : avail;
+			memcpy(&(stream->chunk_header[stream->header_fill]), &data[pos], n);
+			stream->header_fill += n;
+			stream->bytes += n;
+			pos += n;
+			if (stream->header_fill == 8 && start_chunk(stream) < 0)
+			{
+				return -1;
+			}
+			continue;
+		}
+
+		/*	Everything else is bounded by the length of its chunk.	*/
+		if (stream->chunk_left == 0)
+		{
+			return stream_fail(stream, "An event runs past the end of its track.");
+		}
+		avail = (avail < stream->chunk_left) ? avail : stream->chunk_left;
+
+		if (stream->state == STREAM_MTHD || stream->state == STREAM_SKIP)
+		{
+			if (stream->state == STREAM_MTHD)
+			{
+				/*	Only the first six bytes mean anything; the rest is skipped.	*/
+				size_t done = stream->chunk_size - stream->chunk_left;
+				for (size_t cntr = 0; cntr < avail && done + cntr < 6; cntr++)
+				{
+					stream->mthd[done + cntr] = data[pos + cntr];
+				}
+			}
+			stream->chunk_left -= avail;
+			stream->bytes += avail;
+			pos += avail;
+
+			if (stream->chunk_left == 0)
+			{
+				if (stream->state == STREAM_MTHD)
+				{
+					stream->format = midi_bytes_be16(&(stream->mthd[0]));
+					stream->num_tracks = midi_bytes_be16(&(stream->mthd[2]));
+					stream->division = (int16_t) midi_bytes_be16(&(stream->mthd[4]));
+					DEBUG("Format %d, %d tracks, division %d.\n",
+						stream->format, stream->num_tracks, stream->division);
+				}
+				stream->state = STREAM_CHUNK_HEADER;
+			}
+			continue;
+		}
+
+		if (stream->state == STREAM_PAYLOAD)
+		{
+			/*	Copy as much of the payload as this slice and the buffer allow.	*/
+			uint32_t want = event->length - event->payload_offset - stream->payload_fill;
+			uint32_t room = MIDI_STREAM_PAYLOAD_SIZE - stream->payload_fill;
+			size_t n = (avail < want) ? avail : want;
+			n = (n < room) ? n : room;
+			memcpy(&(stream->payload[stream->payload_fill]), &data[pos], n);
+			stream->payload_fill += n;
+			stream->chunk_left -= n;
+			stream->bytes += n;
+			pos += n;
+
+			if (stream->payload_fill == MIDI_STREAM_PAYLOAD_SIZE || n == want)
+			{
+				emit_piece(stream);
+			}
+			continue;
+		}
+
+		/*	The rest of an event is read a byte at a time.	*/
+		unsigned char byte = data[pos++];
+		stream->chunk_left--;
+		stream->bytes++;
+
+		switch (stream->state)
+		{
+			case STREAM_DELTA:
+			{
+				int ret = vlq_push(stream, byte);
+				if (ret < 0)
+				{
+					return stream_fail(stream, "A delta-time is longer than four bytes.");
+				}
+				if (ret > 0)
+				{
+					event->delta = stream->vlq;
+					event->tick += stream->vlq;
+					stream->vlq = 0;
+					stream->state = STREAM_STATUS;
+				}
+				break;
+			}
+
+			case STREAM_STATUS:
+			{
+				event->data1 = 0;
+				event->data2 = 0;
+				event->payload = NULL;
+				event->payload_len = 0;
+				event->payload_offset = 0;
+				event->length = 0;
+
+				if (byte >= 0x80 && byte < 0xF0)
+				{
+					stream->running_status = byte;
+					event->status = byte;
+					stream->data_needed = midi_parse_channelSize[byte >> 4] - 1;
+					stream->data_fill = 0;
+					stream->state = STREAM_DATA;
+				}
+				else if (byte < 0x80)
+				{
+					/*	Running status: the byte is already data1.	*/
+					if (!stream->running_status)
+					{
+						return stream_fail(stream, "A data byte arrived with no running status in effect.");
+					}
+					event->status = stream->running_status;
+					event->data1 = byte;
+					stream->data_needed = midi_parse_channelSize[event->status >> 4] - 1;
+					stream->data_fill = 1;
+					if (stream->data_fill == stream->data_needed)
+					{
+						stream->callback(stream->ctx, event);
+						end_event(stream);
+					}
+					else
+					{
+						stream->state = STREAM_DATA;
+					}
+				}
+				else if (byte == 0xFF || byte == 0xF0 || byte == 0xF7)
+				{
+					/*	Sysex and meta events cancel running status.	*/
+					stream->running_status = 0;
+					event->status = byte;
+					stream->state = (byte == 0xFF) ? STREAM_META_TYPE : STREAM_LENGTH;
+				}
+				else
+				{
+					return stream_fail(stream, "Unexpected status byte in a track.");
+				}
+				break;
+			}
+
+			case STREAM_DATA:
+			{
+				if (stream->data_fill++ == 0)
+				{
+					event->data1 = byte;
+				}
+				else
+				{
+					event->data2 = byte;
+				}
+				if (stream->data_fill == stream->data_needed)
+				{
+					stream->callback(stream->ctx, event);
+					end_event(stream);
+				}
+				break;
+			}
+
+			case STREAM_META_TYPE:
+			{
+				event->data1 = byte;
+				stream->state = STREAM_LENGTH;
+				break;
+			}
+
+			case STREAM_LENGTH:
+			{
+				int ret = vlq_push(stream, byte);
+				if (ret < 0)
+				{
+					return stream_fail(stream, "A sysex or meta length is longer than four bytes.");
+				}
+				if (ret > 0)
+				{
+					event->length = stream->vlq;
+					stream->vlq = 0;
+					if (event->length > stream->chunk_left)
+					{
+						return stream_fail(stream, "A sysex or meta event runs past the end of its track.");
+					}
+					stream->payload_fill = 0;
+					if (event->length == 0)
+					{
+						emit_piece(stream);
+					}
+					else
+					{
+						stream->state = STREAM_PAYLOAD;
+					}
+				}
+				break;
+			}
+		}
+
+		if (stream->state == STREAM_ERROR)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*!	\brief Checks that the stream ended cleanly, between two chunks.
+
+	@param stream pointer to the stream
+	@return 0 if every chunk was complete, or -1 if the stream was cut short
+		or malformed (see stream->error).
+*/
+int midi_stream_finish(struct MIDIStream * stream)
+{
+	if (stream->state == STREAM_ERROR)
+	{
+		return -1;
+	}
+	if (stream->state != STREAM_CHUNK_HEADER || stream->header_fill != 0 || stream->chunks_seen == 0)
+	{
+		return stream_fail(stream, "The stream ended in the middle of a chunk.");
+	}
+	if (stream->tracks_seen != stream->num_tracks)
+	{
+		WARN("The MThd announced %d tracks, but %d arrived.\n", stream->num_tracks, stream->tracks_seen);
+	}
+	return 0;
+}
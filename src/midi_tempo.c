@@ -0,0 +1,419 @@
+/*! @file
+	Builds the tempo map of a MIDI file from the MThd division and the FF 51
+	tempo events of every track, and converts ticks into nanoseconds with it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_parse.h"
+#include "midi_reader.h"
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "debug.h"
+
+/*	Orders tempo changes by tick; ties keep their collection order, so the
+	last change at a given tick wins, as it would during playback.	*/
+static int compare_changes(const void * a, const void * b)
+{
+	const struct MIDITempoChange * lhs = a;
+	const struct MIDITempoChange * rhs = b;
+
+	if (lhs->tick != rhs->tick)
+	{
+		return (lhs->tick < rhs->tick) ? -1 : 1;
+	}
+	/*	During collection, ns holds the collection order.	*/
+	return (lhs->ns < rhs->ns) ? -1 : (lhs->ns > rhs->ns);
+}
+
+/*	Nanoseconds taken by delta ticks at the given tempo, without overflowing.	*/
+static uint64_t ticks_to_ns(const struct MIDITempoMap * tempoMap, uint64_t delta, uint32_t usec_per_quarter)
+{
+	if (tempoMap->ticks_per_quarter == 0)
+	{
+		return (uint64_t) (delta * tempoMap->ns_per_tick_smpte);
+	}
+
+	uint64_t usec_scaled = delta * usec_per_quarter;
+	uint64_t tpq = (uint64_t) tempoMap->ticks_per_quarter;
+	return (usec_scaled / tpq) * 1000 + ((usec_scaled % tpq) * 1000) / tpq;
+}
+
+/*	Sets up the tick length from the MThd division field.	*/
+static void set_division(struct MIDITempoMap * tempoMap, int division)
+{
+	division &= 0xFFFF;
+	if (division & 0x8000)
+	{
+		int fps = -(int8_t) (division >> 8);
+		int ticks_per_frame = division & 0xFF;
+		/*	-29 is 30 drop-frame, which really runs at 29.97 frames per second.	*/
+		double frames_per_second = (fps == 29) ? 29.97 : fps;
+		tempoMap->ns_per_tick_smpte = (frames_per_second > 0 && ticks_per_frame > 0) ?
+			1e9 / (frames_per_second * ticks_per_frame) : 0;
+	}
+	else
+	{
+		tempoMap->ticks_per_quarter = division;
+	}
+
+	if (tempoMap->ticks_per_quarter == 0 && tempoMap->ns_per_tick_smpte == 0)
+	{
+		WARN("Invalid division %04X, assuming 96 ticks per quarter note.\n", division);
+		tempoMap->ticks_per_quarter = 96;
+	}
+}
+
+/*!	\brief Builds the tempo map of a MIDI file.
+
+	The division comes from the MThd, as decoded by index_midi_chunks().
+	Positive values are ticks per quarter note; negative ones are SMPTE timing
+	(-frames per second in the upper byte, ticks per frame in the lower),
+	where tempo events don't apply.
+
+	@param midiFile pointer to the loaded MIDIFile, for the division
+	@param timeline pointer to the compiled tracks, for the FF 51 events
+	@param tempoMap pointer to the tempo map to fill in
+	@return number of tempo changes in the map, or -1 on failure.
+*/
+int midi_tempo_build(struct MIDIFile * midiFile, struct MIDITimeline * timeline,
+	struct MIDITempoMap * tempoMap)
+{
+	memset(tempoMap, 0, sizeof(struct MIDITempoMap));
+
+	/*	Decoded from the MThd when the file was indexed.	*/
+	int division = midiFile->division;
+	set_division(tempoMap, division);
+
+	/*	Count the tempo events, plus one for the default tempo at tick 0.	*/
+	int max_changes = 1;
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		struct MIDITrackEvents * events = &(timeline->tracks[track]);
+		for (int index = 0; index < events->num_events; index++)
+		{
+			max_changes += (events->status[index] == MIDI_STATUS_META && events->data1[index] == MIDI_META_TEMPO);
+		}
+	}
+
+	tempoMap->changes = malloc(sizeof(struct MIDITempoChange) * max_changes);
+	if (tempoMap->changes == NULL)
+	{
+		ERROR("Allocation failed for %d tempo changes.\n", max_changes);
+		return -1;
+	}
+
+	struct MIDITempoChange * changes = tempoMap->changes;
+	int n = 0;
+	changes[n++] = (struct MIDITempoChange) {0, MIDI_DEFAULT_TEMPO, 0};
+
+	for (int track = 0; track < timeline->num_tracks; track++)
+	{
+		struct MIDITrackEvents * events = &(timeline->tracks[track]);
+		for (int index = 0; index < events->num_events; index++)
+		{
+			if (events->status[index] != MIDI_STATUS_META || events->data1[index] != MIDI_META_TEMPO ||
+				!midi_parse_tempo(&(events->payload[events->payload_off[index]]), events->payload_len[index],
+					&(changes[n].usec_per_quarter)))
+			{
+				continue;
+			}
+			changes[n].tick = events->tick[index];
+			changes[n].ns = n;
+			n++;
+		}
+	}
+
+	qsort(changes, n, sizeof(struct MIDITempoChange), compare_changes);
+
+	/*	Collapse changes that land on the same tick (the default at tick 0
+		included), keeping the last one.	*/
+	int out = 0;
+	for (int in = 1; in < n; in++)
+	{
+		if (changes[in].tick != changes[out].tick)
+		{
+			out++;
+		}
+		changes[out] = changes[in];
+	}
+	tempoMap->num_changes = out + 1;
+
+	/*	Accumulate the time at which each change takes effect.	*/
+	changes[0].ns = 0;
+	for (int cntr = 1; cntr < tempoMap->num_changes; cntr++)
+	{
+		changes[cntr].ns = changes[cntr - 1].ns + ticks_to_ns(tempoMap,
+			changes[cntr].tick - changes[cntr - 1].tick, changes[cntr - 1].usec_per_quarter);
+	}
+
+	DEBUG("Division %04X, %d tempo change(s).\n", division, tempoMap->num_changes);
+	return tempoMap->num_changes;
+}
+
+/*!	\brief Starts an empty tempo map, for tempo changes that arrive one by one.
+
+	@param tempoMap pointer to the tempo map to fill in
+	@param division raw MThd division field
+	@return 0 on success, or -1 if an allocation failed.
+*/
+int midi_tempo_init(struct MIDITempoMap * tempoMap, int division)
+{
+	memset(tempoMap, 0, sizeof(struct MIDITempoMap));
+	set_division(tempoMap, division);
+
+	tempoMap->changes = malloc(sizeof(struct MIDITempoChange));
+	if (tempoMap->changes == NULL)
+	{
+		ERROR("Allocation failed for a tempo change.\n");
+		return -1;
+	}
+	tempoMap->changes[0] = (struct MIDITempoChange) {0, MIDI_DEFAULT_TEMPO, 0};
+	tempoMap->num_changes = 1;
+	return 0;
+}
+
+/*!	\brief Adds a tempo change to the map.
+
+	Changes usually arrive in tick order and go at the end. One that comes
+	before the last is put in its place, and the times of those after it are
+	worked out again, so that tracks may be added one after the other. A
+	change on the same tick as one already in the map replaces it.
+
+	@param tempoMap pointer to a tempo map started with midi_tempo_init()
+	@param tick absolute tick of the change
+	@param usec_per_quarter new tempo, in microseconds per quarter note
+	@return number of tempo changes in the map, or -1 on failure.
+*/
+int midi_tempo_append(struct MIDITempoMap * tempoMap, uint32_t tick, uint32_t usec_per_quarter)
+{
+	/*	Where the change goes: after every change at or before its tick.	*/
+	int at = tempoMap->num_changes;
+	while (tempoMap->changes[at - 1].tick > tick)
+	{
+		at--;
+	}
+
+	if (tempoMap->changes[at - 1].tick == tick)
+	{
+		at--;
+		tempoMap->changes[at].usec_per_quarter = usec_per_quarter;
+	}
+	else
+	{
+		/*	Tempo changes are rare enough to grow the array one at a time.	*/
+		struct MIDITempoChange * changes = realloc(tempoMap->changes,
+			sizeof(struct MIDITempoChange) * (tempoMap->num_changes + 1));
+		if (changes == NULL)
+		{
+			ERROR("Allocation failed for %d tempo changes.\n", tempoMap->num_changes + 1);
+			return -1;
+		}
+		tempoMap->changes = changes;
+		memmove(&(changes[at + 1]), &(changes[at]), sizeof(struct MIDITempoChange) * (tempoMap->num_changes - at));
+		changes[at] = (struct MIDITempoChange) {tick, usec_per_quarter, 0};
+		tempoMap->num_changes++;
+	}
+
+	/*	Accumulate the time at which this change, and each one after it, takes effect.	*/
+	struct MIDITempoChange * changes = tempoMap->changes;
+	for (int cntr = (at > 0) ? at : 1; cntr < tempoMap->num_changes; cntr++)
+	{
+		changes[cntr].ns = changes[cntr - 1].ns + ticks_to_ns(tempoMap,
+			changes[cntr].tick - changes[cntr - 1].tick, changes[cntr - 1].usec_per_quarter);
+	}
+	return tempoMap->num_changes;
+}
+
+/*	Index of the tempo change in effect at tick: the last one at or before it.	*/
+static int find_change(const struct MIDITempoMap * tempoMap, uint32_t tick)
+{
+	int low = 0, high = tempoMap->num_changes - 1;
+	while (low < high)
+	{
+		int mid = low + (high - low + 1) / 2;
+		if (tempoMap->changes[mid].tick <= tick)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+	return low;
+}
+
+/*!	\brief Converts an absolute tick into nanoseconds from tick 0.
+
+	Playback asks for ticks in increasing order, so the tempo change found by
+	the previous call is kept in *hint, and checked (along with the one after
+	it) before anything else. Any other tick, after a seek for instance, is
+	found with a binary search over the tempo changes.
+
+	@param tempoMap pointer to the tempo map
+	@param hint index of a tempo change to start searching from; updated
+	@param tick absolute tick to convert
+	@return time of tick, in nanoseconds
+*/
+uint64_t midi_tempo_tickToNs(const struct MIDITempoMap * tempoMap, int * hint, uint32_t tick)
+{
+	const struct MIDITempoChange * changes = tempoMap->changes;
+	int index = *hint;
+
+	if (index < 0 || index >= tempoMap->num_changes || changes[index].tick > tick)
+	{
+		index = find_change(tempoMap, tick);
+	}
+	else if (index + 1 < tempoMap->num_changes && changes[index + 1].tick <= tick)
+	{
+		index++;
+		if (index + 1 < tempoMap->num_changes && changes[index + 1].tick <= tick)
+		{
+			index = find_change(tempoMap, tick);
+		}
+	}
+	*hint = index;
+
+	return changes[index].ns +
+		ticks_to_ns(tempoMap, tick - changes[index].tick, changes[index].usec_per_quarter);
+}
+
+/*!	\brief Converts a time into the last tick at or before it.
+
+	The inverse of midi_tempo_tickToNs(): the tempo change in effect is found
+	with a binary search over the times of the changes.
+
+	@param tempoMap pointer to the tempo map
+	@param ns time from tick 0, in nanoseconds
+	@return the largest tick whose time is at most ns, or UINT32_MAX if every
+		tick is earlier.
+*/
+uint32_t midi_tempo_nsToTick(const struct MIDITempoMap * tempoMap, uint64_t ns)
+{
+	const struct MIDITempoChange * changes = tempoMap->changes;
+
+	int low = 0, high = tempoMap->num_changes - 1;
+	while (low < high)
+	{
+		int mid = low + (high - low + 1) / 2;
+		if (changes[mid].ns <= ns)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid - 1;
+		}
+	}
+
+	const struct MIDITempoChange * change = &(changes[low]);
+	uint64_t elapsed = ns - change->ns;
+	uint64_t limit = (low + 1 < tempoMap->num_changes) ? changes[low + 1].tick - 1 - change->tick :
+		UINT32_MAX - change->tick;
+
+	/*	Estimate, then correct for the rounding done by ticks_to_ns().	*/
+	uint64_t delta;
+	if (tempoMap->ticks_per_quarter == 0)
+	{
+		delta = (uint64_t) (elapsed / tempoMap->ns_per_tick_smpte);
+	}
+	else if (change->usec_per_quarter == 0)
+	{
+		delta = limit;
+	}
+	else
+	{
+		delta = (uint64_t) ((unsigned __int128) elapsed * tempoMap->ticks_per_quarter /
+			((uint64_t) change->usec_per_quarter * 1000));
+	}
+	delta = (delta < limit) ? delta : limit;
+	while (delta > 0 && ticks_to_ns(tempoMap, delta, change->usec_per_quarter) > elapsed)
+	{
+		delta--;
+	}
+	while (delta < limit && ticks_to_ns(tempoMap, delta + 1, change->usec_per_quarter) <= elapsed)
+	{
+		delta++;
+	}
+	return change->tick + (uint32_t) delta;
+}
+
+/*	Frame numbers skipped by 29.97 drop-frame timecode: 2 at the start of
+	every minute, except every tenth.	*/
+#define DROP_FRAMES_PER_10_MINUTES	17982
+#define DROP_FRAMES_PER_MINUTE		1798
+
+/*!	\brief Converts a time into SMPTE timecode.
+
+	29.97 frames per second is written as drop-frame timecode, so that the
+	timecode keeps up with the clock; the other rates count frames as is.
+
+	@param ns time, in nanoseconds
+	@param frames_per_second 24, 25, 29.97 or 30
+	@param smpte where to write the timecode; frames_per_second is set too.
+		Hours wrap around after 24.
+*/
+void midi_tempo_nsToSmpte(uint64_t ns, float frames_per_second, struct MIDISMPTEOffset * smpte)
+{
+	int drop = (frames_per_second > 29.9f && frames_per_second < 29.99f);
+	uint64_t nominal = drop ? 30 : (uint64_t) (frames_per_second + 0.5f);
+	nominal = nominal ? nominal : 30;
+
+	/*	Counted in hundredths of a frame, to keep the subframes.	*/
+	uint64_t hundredths = drop ? (uint64_t) ((unsigned __int128) ns * 2997 / 1000000000u) :
+		(uint64_t) ((unsigned __int128) ns * nominal * 100 / 1000000000u);
+	uint64_t frame = hundredths / 100;
+
+	if (drop)
+	{
+		uint64_t tens = frame / DROP_FRAMES_PER_10_MINUTES;
+		uint64_t rest = frame % DROP_FRAMES_PER_10_MINUTES;
+		frame += 18 * tens + ((rest > 1) ? 2 * ((rest - 2) / DROP_FRAMES_PER_MINUTE) : 0);
+	}
+
+	smpte->frames_per_second = frames_per_second;
+	smpte->subframes = hundredths % 100;
+	smpte->frames = frame % nominal;
+	smpte->seconds = (frame / nominal) % 60;
+	smpte->minutes = (frame / (nominal * 60)) % 60;
+	smpte->hours = (frame / (nominal * 3600)) % 24;
+}
+
+/*!	\brief Converts SMPTE timecode into a time.
+
+	The inverse of midi_tempo_nsToSmpte(), to within a hundredth of a frame.
+
+	@param smpte timecode to convert
+	@return time, in nanoseconds
+*/
+uint64_t midi_tempo_smpteToNs(const struct MIDISMPTEOffset * smpte)
+{
+	float frames_per_second = smpte->frames_per_second;
+	int drop = (frames_per_second > 29.9f && frames_per_second < 29.99f);
+	uint64_t nominal = drop ? 30 : (uint64_t) (frames_per_second + 0.5f);
+	nominal = nominal ? nominal : 30;
+
+	uint64_t minutes = 60 * (uint64_t) smpte->hours + smpte->minutes;
+	uint64_t frame = (minutes * 60 + smpte->seconds) * nominal + smpte->frames;
+	if (drop)
+	{
+		frame -= 2 * (minutes - minutes / 10);
+	}
+
+	uint64_t hundredths = frame * 100 + smpte->subframes;
+	return drop ? (uint64_t) (((unsigned __int128) hundredths * 1000000000u + 2996) / 2997) :
+		(uint64_t) (((unsigned __int128) hundredths * 1000000000u + nominal * 100 - 1) / (nominal * 100));
+}
+
+/*!	\brief Releases the memory held by a tempo map.
+
+	@param tempoMap pointer to the tempo map; it is zeroed afterwards.
+*/
+void midi_tempo_free(struct MIDITempoMap * tempoMap)
+{
+	free(tempoMap->changes);
+	memset(tempoMap, 0, sizeof(struct MIDITempoMap));
+}
@@ -0,0 +1,446 @@
+/*! @file
+	Compiles the raw MTrk blocks of a MIDIFile into flat event arrays. Decoding
+	happens exactly once per file; playback and analysis then walk the arrays
+	without touching the byte parser.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "midi_parse.h"
+#include "midi_reader.h"
+#include "midi_timeline.h"
+#include "midi_arena.h"
+#include "debug.h"
+
+/*!	\brief Allocates the arrays of a MIDITrackEvents for up to max_events events.
+
+	@return 1 on success, 0 if an allocation failed.
+*/
+static int alloc_track_events(struct MIDITrackEvents * events, int max_events, size_t max_payload)
+{
+	memset(events, 0, sizeof(struct MIDITrackEvents));
+
+	events->tick = malloc(sizeof(uint32_t) * max_events);
+	events->status = malloc(max_events);
+	events->data1 = malloc(max_events);
+	events->data2 = malloc(max_events);
+	events->payload_off = malloc(sizeof(uint32_t) * max_events);
+	events->payload_len = malloc(sizeof(uint32_t) * max_events);
+	events->payload = malloc(max_payload ? max_payload : 1);
+
+	return (events->tick && events->status && events->data1 && events->data2 &&
+		events->payload_off && events->payload_len && events->payload);
+}
+
+static void free_track_events(struct MIDITrackEvents * events)
+{
+	free(events->tick);
+	free(events->status);
+	free(events->data1);
+	free(events->data2);
+	free(events->payload_off);
+	free(events->payload_len);
+	free(events->payload);
+	memset(events, 0, sizeof(struct MIDITrackEvents));
+}
+
+/*!	\brief Shrinks the arrays of a MIDITrackEvents down to what was actually decoded.
+
+	A failed realloc() leaves the original (larger) array in place, which is
+	still valid, so failures here are simply ignored.
+*/
+static void trim_track_events(struct MIDITrackEvents * events)
+{
+	size_t n = events->num_events ? events->num_events : 1;
+	void * p;
+
+	if ((p = realloc(events->tick, sizeof(uint32_t) * n)) != NULL) events->tick = p;
+	if ((p = realloc(events->status, n)) != NULL) events->status = p;
+	if ((p = realloc(events->data1, n)) != NULL) events->data1 = p;
+	if ((p = realloc(events->data2, n)) != NULL) events->data2 = p;
+	if ((p = realloc(events->payload_off, sizeof(uint32_t) * n)) != NULL) events->payload_off = p;
+	if ((p = realloc(events->payload_len, sizeof(uint32_t) * n)) != NULL) events->payload_len = p;
+	if ((p = realloc(events->payload, events->payload_size ? events->payload_size : 1)) != NULL)
+		events->payload = p;
+}
+
+/*	Walks an MTrk block, stopping at the first event that can't be decoded.
+	With store set, the events are written to arrays already big enough to
+	hold them; without it, they're only counted. Either way, num_events and
+	payload_size are set on return.	*/
+static int decode_track(const struct MIDIBlock * midiBlock, struct MIDITrackEvents * events, int store)
+{
+	struct MIDIEventCursor cursor;
+	struct MIDIEvent event;
+	midi_parse_initCursor(&cursor, midiBlock->data, midiBlock->n_data_size);
+
+	size_t payload_size = 0;
+	uint32_t tick = 0;
+	int n = 0;
+	int ret;
+
+	while ((ret = midi_parse_nextEvent(&cursor, &event)) > 0)
+	{
+		tick += event.delta;
+		if (store)
+		{
+			events->tick[n] = tick;
+			events->status[n] = event.status;
+			events->data1[n] = event.data1;
+			events->data2[n] = event.data2;
+			events->payload_off[n] = 0;
+			events->payload_len[n] = event.length;
+			if (event.payload != NULL)
+			{
+				events->payload_off[n] = (uint32_t) payload_size;
+				memcpy(&events->payload[payload_size], event.payload, event.length);
+			}
+		}
+		payload_size += event.length;
+		n++;
+	}
+
+	if (ret < 0 && store)
+	{
+		WARN("Track truncated at offset %d: %s\n", (int) (cursor.pos - cursor.start), cursor.error);
+	}
+
+	events->num_events = n;
+	events->payload_size = payload_size;
+	return n;
+}
+
+/*!	\brief Decodes a single MTrk block into a MIDITrackEvents.
+
+	The arrays are sized once from the block size (every event takes at least
+	two bytes, so there can never be more than n_data_size/2 + 1 of them), and
+	trimmed to fit afterwards. Running status is expanded, so every event is
+	stored with its full status byte. Decoding stops at the first event that
+	can't be decoded.
+
+	@param midiBlock pointer to the MTrk block to decode
+	@param events pointer to the structure to fill in
+	@return number of events decoded, or -1 if an allocation failed.
+*/
+int midi_timeline_compileTrack(struct MIDIBlock * midiBlock, struct MIDITrackEvents * events)
+{
+	int max_events = midiBlock->n_data_size / 2 + 1;
+
+	if (!alloc_track_events(events, max_events, midiBlock->n_data_size))
+	{
+		ERROR("Allocation failed for %d events.\n", max_events);
+		free_track_events(events);
+		return -1;
+	}
+
+	int n = decode_track(midiBlock, events, 1);
+	trim_track_events(events);
+	DEBUG("Decoded %d events, %zu payload bytes.\n", n, events->payload_size);
+	return n;
+}
+
+/*	Allocates the arrays of a counted track from an arena, at their exact size.	*/
+static int arena_track_events(struct MIDITrackEvents * events, struct MIDIArena * arena)
+{
+	size_t n = events->num_events;
+
+	events->tick = midi_arena_alloc(arena, sizeof(uint32_t) * n);
+	events->status = midi_arena_alloc(arena, n);
+	events->data1 = midi_arena_alloc(arena, n);
+	events->data2 = midi_arena_alloc(arena, n);
+	events->payload_off = midi_arena_alloc(arena, sizeof(uint32_t) * n);
+	events->payload_len = midi_arena_alloc(arena, sizeof(uint32_t) * n);
+	events->payload = midi_arena_alloc(arena, events->payload_size);
+
+	if (!(events->tick && events->status && events->data1 && events->data2 &&
+		events->payload_off && events->payload_len && events->payload))
+	{
+		ERROR("Allocation failed for %zu events.\n", n);
+		return 0;
+	}
+	return 1;
+}
+
+/*!	\brief Decodes a single MTrk block into a MIDITrackEvents owned by an arena.
+
+	The block is walked twice: once to count the events and payload bytes,
+	then again to store them, so nothing is allocated that isn't used. Both
+	walks use midi_parse_nextEvent(): midi_vlq_scanTrack() is no faster at
+	counting, and a second decoder could count a malformed track differently
+	from the one that stores it.
+
+	@param midiBlock pointer to the MTrk block to decode
+	@param events pointer to the structure to fill in
+	@param arena arena to allocate the arrays from
+	@return number of events decoded, or -1 if an allocation failed.
+*/
+int midi_timeline_compileTrackArena(struct MIDIBlock * midiBlock, struct MIDITrackEvents * events,
+	struct MIDIArena * arena)
+{
+	memset(events, 0, sizeof(struct MIDITrackEvents));
+	decode_track(midiBlock, events, 0);
+	if (!arena_track_events(events, arena))
+	{
+		return -1;
+	}
+	return decode_track(midiBlock, events, 1);
+}
+
+/*	Allocates the (zeroed) track array of a timeline.	*/
+static int alloc_tracks(struct MIDITimeline * timeline, int num_tracks, struct MIDIArena * arena)
+{
+	memset(timeline, 0, sizeof(struct MIDITimeline));
+	timeline->arena = arena;
+
+	num_tracks = num_tracks ? num_tracks : 1;
+	timeline->tracks = arena ? midi_arena_calloc(arena, num_tracks, sizeof(struct MIDITrackEvents)) :
+		calloc(num_tracks, sizeof(struct MIDITrackEvents));
+	if (timeline->tracks == NULL)
+	{
+		ERROR("Allocation failed for %d tracks.\n", num_tracks);
+		return 0;
+	}
+	return 1;
+}
+
+/*!	\brief Compiles every MTrk of a MIDIFile into a MIDITimeline.
+
+	Blocks that aren't MTrk (such as MThd) are skipped, so track i of the
+	timeline is the i-th MTrk in the file.
+
+	@param midiFile pointer to the loaded MIDIFile
+	@param timeline pointer to the timeline to fill in
+	@param arena arena to allocate every array from, or NULL to use malloc()
+	@return number of tracks compiled, or -1 on failure.
+*/
+int midi_timeline_compile(struct MIDIFile * midiFile, struct MIDITimeline * timeline,
+	struct MIDIArena * arena)
+{
+	if (!alloc_tracks(timeline, midiFile->num_blocks, arena))
+	{
+		return -1;
+	}
+
+	for (int cntr = 0; cntr < midiFile->num_blocks; cntr++)
+	{
+		struct MIDIBlock * block = &(midiFile->blockArr[cntr]);
+		if (strncmp("MTrk", (char *) block->header, 4))
+		{
+			continue;
+		}
+		struct MIDITrackEvents * events = &(timeline->tracks[timeline->num_tracks]);
+		if ((arena ? midi_timeline_compileTrackArena(block, events, arena) :
+			midi_timeline_compileTrack(block, events)) < 0)
+		{
+			midi_timeline_free(timeline);
+			return -1;
+		}
+		timeline->num_tracks++;
+	}
+
+	return timeline->num_tracks;
+}
+
+/*	A track handed out to the pool by midi_timeline_compileParallel().	*/
+struct CompileTask
+{
+	struct MIDIBlock *			midiBlock;
+	struct MIDITrackEvents *	events;
+	int							store;		/*!	For arena timelines: 0 to count, 1 to store.	*/
+	int							result;
+};
+
+static void compile_task(void * arg)
+{
+	struct CompileTask * task = arg;
+	task->result = midi_timeline_compileTrack(task->midiBlock, task->events);
+}
+
+static void arena_task(void * arg)
+{
+	struct CompileTask * task = arg;
+	task->result = decode_track(task->midiBlock, task->events, task->store);
+}
+
+/*!	\brief Compiles every MTrk of a MIDIFile, one pool task per track.
+
+	Each track is decoded into its own, pre-assigned slot, so the result is
+	identical to midi_timeline_compile() no matter which thread finishes first.
+	Small files, and files with a single track, are decoded on the calling
+	thread instead. Safe to call from within a pool task.
+
+	With an arena, the tracks are counted in parallel first, then the arrays
+	are allocated on the calling thread (which owns the arena), then the
+	tracks are stored in parallel.
+
+	@param midiFile pointer to the loaded MIDIFile
+	@param timeline pointer to the timeline to fill in
+	@param pool pool to decode on, or NULL to decode on the calling thread
+	@param arena arena to allocate every array from, or NULL to use malloc()
+	@return number of tracks compiled, or -1 on failure.
+*/
+int midi_timeline_compileParallel(struct MIDIFile * midiFile, struct MIDITimeline * timeline,
+	struct MIDIPool * pool, struct MIDIArena * arena)
+{
+	int num_tracks = 0;
+	long track_bytes = 0;
+	for (int cntr = 0; cntr < midiFile->num_blocks; cntr++)
+	{
+		if (!strncmp("MTrk", (char *) midiFile->blockArr[cntr].header, 4))
+		{
+			num_tracks++;
+			track_bytes += midiFile->blockArr[cntr].n_data_size;
+		}
+	}
+
+	if (pool == NULL || num_tracks < 2 || track_bytes < MIDI_TIMELINE_PARALLEL_MIN_BYTES)
+	{
+		return midi_timeline_compile(midiFile, timeline, arena);
+	}
+
+	struct CompileTask * tasks = calloc(num_tracks, sizeof(struct CompileTask));
+	if (tasks == NULL || !alloc_tracks(timeline, num_tracks, arena))
+	{
+		ERROR("Allocation failed for %d tracks.\n", num_tracks);
+		free(tasks);
+		return -1;
+	}
+
+	int slot = 0;
+	for (int cntr = 0; cntr < midiFile->num_blocks; cntr++)
+	{
+		if (!strncmp("MTrk", (char *) midiFile->blockArr[cntr].header, 4))
+		{
+			tasks[slot].midiBlock = &(midiFile->blockArr[cntr]);
+			tasks[slot].events = &(timeline->tracks[slot]);
+			slot++;
+		}
+	}
+	timeline->num_tracks = num_tracks;
+
+	int group = 0;
+	for (int store = arena ? 0 : 1; store <= 1; store++)
+	{
+		if (arena && store)
+		{
+			for (slot = 0; slot < num_tracks; slot++)
+			{
+				if (!arena_track_events(tasks[slot].events, arena))
+				{
+					free(tasks);
+					midi_timeline_free(timeline);
+					return -1;
+				}
+			}
+		}
+
+		for (slot = 0; slot < num_tracks; slot++)
+		{
+			tasks[slot].store = store;
+			midi_pool_submit(pool, &group, arena ? arena_task : compile_task, &(tasks[slot]));
+		}
+		midi_pool_wait(pool, &group);
+	}
+
+	/*	Every slot is filled in (or zeroed on failure), so all of them can be freed.	*/
+	for (slot = 0; slot < num_tracks; slot++)
+	{
+		if (tasks[slot].result < 0)
+		{
+			free(tasks);
+			midi_timeline_free(timeline);
+			return -1;
+		}
+	}
+
+	free(tasks);
+	return timeline->num_tracks;
+}
+
+/*!	\brief Finds the first event of a compiled track at or after a tick.
+
+	Ticks never decrease within a track, so this is a binary search.
+
+	@param events pointer to the compiled track
+	@param tick absolute tick to look for
+	@return index of the first event whose tick is at least tick, or
+		events->num_events if there is none.
+*/
+int midi_timeline_findTick(const struct MIDITrackEvents * events, uint32_t tick)
+{
+	int low = 0, high = events->num_events;
+	while (low < high)
+	{
+		int mid = low + (high - low) / 2;
+		if (events->tick[mid] < tick)
+		{
+			low = mid + 1;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*	Names of the event types, by upper status nibble.	*/
+static const char * const type_names[8] =
+{
+	"note_off", "note_on", "poly_pressure", "control_change",
+	"program_change", "channel_pressure", "pitch_bend", "sysex_meta"
+};
+
+/*!	\brief Gives the name of the type of an event.
+
+	@param status status byte of the event, as stored in status[]
+	@return "note_on", "control_change", ..., or "sysex_meta" for every
+		status from F0 up.
+*/
+const char * midi_timeline_typeName(uint8_t status)
+{
+	return type_names[(status >> 4) & 0x07];
+}
+
+/*!	\brief Finds the type of event with a name.
+
+	@param name name as given by midi_timeline_typeName()
+	@return upper status nibble of the type (0x8 to 0xF), or -1 if unknown.
+*/
+int midi_timeline_parseType(const char * name)
+{
+	for (int type = 0; type < 8; type++)
+	{
+		if (!strcmp(name, type_names[type]))
+		{
+			return type + 8;
+		}
+	}
+	return -1;
+}
+
+/*!	\brief Releases all of the memory held by a MIDITimeline.
+
+	@param timeline pointer to the timeline; it is zeroed afterwards.
+*/
+void midi_timeline_free(struct MIDITimeline * timeline)
+{
+	if (timeline->arena != NULL)
+	{
+		/*	The arena owns everything, and releases it all at once.	*/
+		memset(timeline, 0, sizeof(struct MIDITimeline));
+		return;
+	}
+
+	if (timeline->tracks != NULL)
+	{
+		for (int cntr = 0; cntr < timeline->num_tracks; cntr++)
+		{
+			free_track_events(&(timeline->tracks[cntr]));
+		}
+	}
+	free(timeline->tracks);
+	memset(timeline, 0, sizeof(struct MIDITimeline));
+}
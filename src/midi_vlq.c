@@ -0,0 +1,194 @@
+/*! @file
+	Variable-length quantity decoding without a per-byte loop.
+
+	A VLQ is at most four bytes, so it always fits in one 32-bit word: the
+	length comes from the position of the first byte with bit 7 clear, and the
+	value from masking and shifting the four 7-bit groups together. For whole
+	tracks, the bytes with bit 7 clear are located 16 or 32 at a time with a
+	vector movemask, and the walk reads VLQ lengths out of that bitmap.
+*/
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "midi_parse.h"
+#include "midi_vlq.h"
+
+/*	Number of track bytes covered by one terminator bitmap refill.	*/
+#define VLQ_WINDOW 1024
+
+/*	The walk refills the bitmap once fewer than this many bytes of the window
+	remain; enough for a delta-time, a meta header and its length.	*/
+#define VLQ_WINDOW_MARGIN 16
+
+/*!	\brief Decodes a single variable length quantity.
+
+	Gives exactly the same results as midi_parse_varSize(), but without
+	looping over the bytes, and without reading past byte_seq[avail - 1].
+
+	@param byte_seq Byte sequence representing a variable length number.
+	@param avail Number of bytes that may be read from byte_seq.
+	@param size Pointer to an int, will be where the variable length size is in binary.
+	@return Integer representing the number of bytes read, 0 on error.
+*/
+int midi_vlq_decode(const unsigned char * byte_seq, int avail, int * size)
+{
+	uint32_t value = 0;
+	int len = midi_vlq_read(byte_seq, avail, &value);
+	*size = (int) value;
+	return len;
+}
+
+/*!	\brief Marks every byte of data[base, base + VLQ_WINDOW) that has bit 7 clear.
+
+	Bit (i - base) of bitmap is set when data[i] ends a VLQ. Bytes past the
+	end of the data are left clear, which reads as "more to come".
+*/
+static void scan_terminators(const unsigned char * data, int size, int base, uint64_t * bitmap)
+{
+	memset(bitmap, 0, sizeof(uint64_t) * (VLQ_WINDOW / 64 + 1));
+
+	int end = (size - base < VLQ_WINDOW) ? size : base + VLQ_WINDOW;
+	int i = base;
+
+#if defined(__AVX2__)
+	for (; i + 32 <= end; i += 32)
+	{
+		__m256i bytes = _mm256_loadu_si256((const __m256i *) &data[i]);
+		uint32_t mask = ~(uint32_t) _mm256_movemask_epi8(bytes);
+		bitmap[(i - base) >> 6] |= (uint64_t) mask << ((i - base) & 63);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; i + 16 <= end; i += 16)
+	{
+		__m128i bytes = _mm_loadu_si128((const __m128i *) &data[i]);
+		uint32_t mask = ~(uint32_t) _mm_movemask_epi8(bytes) & 0xFFFF;
+		bitmap[(i - base) >> 6] |= (uint64_t) mask << ((i - base) & 63);
+	}
+#endif
+	for (; i < end; i++)
+	{
+		bitmap[(i - base) >> 6] |= (uint64_t) !(data[i] & 0x80) << ((i - base) & 63);
+	}
+}
+
+/*	Decodes the VLQ at data[pos], taking its length from the bitmap.
+	Returns the length, or 0 if it isn't terminated within four bytes.	*/
+static inline int vlq_at(const unsigned char * data, int size, const uint64_t * bitmap,
+	int base, int pos, uint32_t * value)
+{
+	int rel = pos - base;
+	int shift = rel & 63;
+	uint64_t bits = bitmap[rel >> 6] >> shift;
+	if (shift > 60)
+	{
+		bits |= bitmap[(rel >> 6) + 1] << (64 - shift);
+	}
+
+	bits &= 0xF;
+	if (bits == 0)
+	{
+		return 0;
+	}
+
+	int len = __builtin_ctzll(bits) + 1;
+	*value = midi_vlq_compact(midi_vlq_loadWord(&data[pos], size - pos), len);
+	return len;
+}
+
+/*!	\brief Walks a whole track, emitting every delta-time and event boundary.
+
+	@param data Raw MTrk data.
+	@param size Size of data, in bytes.
+	@param deltas Where to write the delta-time of each event.
+	@param offsets Where to write the offset of each event, just past its delta-time.
+	@param lengths Where to write the number of bytes each event takes up in data.
+	@param max_events Capacity of deltas, offsets and lengths.
+	@param bytes_scanned Where to return how many bytes of data were walked.
+	@return The number of events emitted.
+*/
+int midi_vlq_scanTrack(const unsigned char * data, int size,
+	uint32_t * deltas, uint32_t * offsets, uint32_t * lengths,
+	int max_events, int * bytes_scanned)
+{
+	uint64_t bitmap[VLQ_WINDOW / 64 + 1];
+	int base = 0;
+	scan_terminators(data, size, base, bitmap);
+
+	unsigned char running_status = 0;
+	int pos = 0;
+	int n = 0;
+
+	while (pos < size && n < max_events)
+	{
+		/*	Slide the window along before the next event could run off it.	*/
+		if (pos + VLQ_WINDOW_MARGIN > base + VLQ_WINDOW && base + VLQ_WINDOW < size)
+		{
+			base = pos;
+			scan_terminators(data, size, base, bitmap);
+		}
+
+		uint32_t delta;
+		int delta_len = vlq_at(data, size, bitmap, base, pos, &delta);
+		int start = pos + delta_len;
+		if (delta_len == 0 || start >= size)
+		{
+			break;
+		}
+
+		unsigned char first = data[start];
+		int event_len;
+
+		if (first < 0xF0)
+		{
+			/*	Channel event, possibly with running status.	*/
+			int has_status = first >> 7;
+			unsigned char status = has_status ? first : running_status;
+			int event_size = midi_parse_channelSize[status >> 4];
+			if (event_size == 0)
+			{
+				break;
+			}
+			event_len = event_size - 1 + has_status;
+			running_status = status;
+		}
+		else if (first == 0xF0 || first == 0xF7 || first == 0xFF)
+		{
+			/*	Sysex (F0/F7 <length> <data>) or meta (FF <type> <length> <data>).	*/
+			int hdr = (first == 0xFF) ? 2 : 1;
+			uint32_t length;
+			int length_len = (start + hdr < size) ?
+				vlq_at(data, size, bitmap, base, start + hdr, &length) : 0;
+			if (length_len == 0)
+			{
+				break;
+			}
+			event_len = hdr + length_len + (int) length;
+			running_status = 0;
+		}
+		else
+		{
+			break;
+		}
+
+		if (event_len > size - start)
+		{
+			break;
+		}
+
+		deltas[n] = delta;
+		offsets[n] = (uint32_t) start;
+		lengths[n] = (uint32_t) event_len;
+		n++;
+		pos = start + event_len;
+	}
+
+	*bytes_scanned = pos;
+	return n;
+}
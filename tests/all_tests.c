@@ -5,10 +5,1600 @@
  *      Author: constantinoflouras
  */
 
+#include <portable.h>
+#include <stdint.h>
 
+#include "midi_reader.h"
+#include "midi_parse.h"
+#include "midi_vlq.h"
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_merge.h"
+#include "midi_pool.h"
+#include "midi_arena.h"
+#include "midi_stream.h"
+#include "midi_bytes.h"
+#include "midi_cache.h"
+#include "midi_seek.h"
+#include "midi_output.h"
+#include "midi_player.h"
+#include "midi_notes.h"
+#include "midi_stats.h"
+#include "midi_query.h"
+#include "midi_mixer.h"
 
-int main(int argc, char * argv)
+/*	Number of failed checks, reported at the end.	*/
+static int failures = 0;
+
+#define CHECK(cond, fmt, args...)											\
+	do {																	\
+		if (!(cond))														\
+		{																	\
+			fprintf(stderr, "[FAIL: %s] " fmt, __func__, ##args);			\
+			failures++;														\
+		}																	\
+	} while (0)
+
+/*	Small deterministic generator, so failures can be reproduced.	*/
+static uint32_t rng_state = 0x2545F491;
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/*	midi_vlq_decode must agree with midi_parse_varSize on every input.	*/
+static void test_vlq_decode(void)
+{
+	unsigned char seq[8];
+
+	/*	Every value encodable in one to three bytes, followed by junk.	*/
+	for (uint32_t value = 0; value < (1u << 21); value++)
+	{
+		int len = (value < 0x80) ? 1 : (value < 0x4000) ? 2 : 3;
+		for (int k = 0; k < len; k++)
+		{
+			seq[k] = ((value >> (7 * (len - 1 - k))) & 0x7F) | ((k < len - 1) ? 0x80 : 0);
+		}
+		seq[len] = rng() & 0xFF;
+
+		int expect, got;
+		int expect_bytes = midi_parse_varSize(seq, &expect);
+		int got_bytes = midi_vlq_decode(seq, sizeof(seq), &got);
+		CHECK(expect_bytes == got_bytes && expect == got && got == (int) value,
+			"value %u: varSize %d/%d, vlq %d/%d\n", value, expect_bytes, expect, got_bytes, got);
+	}
+
+	/*	Arbitrary byte sequences, including four-byte and overlong ones.	*/
+	for (int iter = 0; iter < 4000000; iter++)
+	{
+		uint32_t r = rng();
+		memcpy(seq, &r, 4);
+
+		int expect, got;
+		int expect_bytes = midi_parse_varSize(seq, &expect);
+		int got_bytes = midi_vlq_decode(seq, 4, &got);
+		CHECK(expect_bytes == got_bytes && expect == got,
+			"bytes %02X %02X %02X %02X: varSize %d/%d, vlq %d/%d\n",
+			seq[0], seq[1], seq[2], seq[3], expect_bytes, expect, got_bytes, got);
+	}
+
+	/*	A quantity cut short by the end of the buffer is an error.	*/
+	unsigned char truncated[] = {0x81, 0x80};
+	int got;
+	CHECK(midi_vlq_decode(truncated, 2, &got) == 0 && got == 0, "truncated VLQ was accepted\n");
+	CHECK(midi_vlq_decode(truncated, 0, &got) == 0, "empty buffer was accepted\n");
+}
+
+/*	The cursor must decode a track cut short anywhere without reading past the
+	cut, and every event it returns must lie within it.	*/
+static void test_cursor(void)
+{
+	static const unsigned char track[] =
+	{
+		0x00, 0x90, 0x3C, 0x40,								/*	Note on	*/
+		0x81, 0x00, 0x3E, 0x40,								/*	Running status	*/
+		0x00, 0xC0, 0x05,									/*	Program change	*/
+		0x00, 0xF0, 0x03, 0x7E, 0x7F, 0xF7,					/*	Sysex	*/
+		0x83, 0x60, 0xFF, 0x51, 0x03, 0x0F, 0x42, 0x40,		/*	Tempo	*/
+		0x00, 0xFF, 0x2F, 0x00
+	};
+	static const int ends[] = {4, 8, 11, 17, 25, 29};
+
+	for (size_t size = 0; size <= sizeof(track); size++)
+	{
+		/*	Exactly size bytes, so a sanitized build catches any overread.	*/
+		unsigned char * data = malloc(size ? size : 1);
+		memcpy(data, track, size);
+
+		struct MIDIEventCursor cursor;
+		struct MIDIEvent event;
+		midi_parse_initCursor(&cursor, data, size);
+		int n = 0, ret;
+		while ((ret = midi_parse_nextEvent(&cursor, &event)) > 0)
+		{
+			n++;
+		}
+
+		/*	Events that end within the cut are decoded, and the next one is an error.	*/
+		int expect = 0;
+		while (expect < 6 && ends[expect] <= (int) size)
+		{
+			expect++;
+		}
+		CHECK(n == expect && cursor.pos == data + (expect ? ends[expect - 1] : 0),
+			"cut at %zu: decoded %d events\n", size, n);
+		CHECK((ret == 0) == (cursor.pos == cursor.end) && (ret == 0 || cursor.error != NULL),
+			"cut at %zu: wrong end of track\n", size);
+		free(data);
+	}
+
+	/*	A data byte with no running status, and a five-byte delta-time.	*/
+	static const unsigned char bad_status[] = {0x00, 0x3C, 0x40, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+	static const unsigned char bad_delta[] = {0x81, 0x81, 0x81, 0x81, 0x00, 0x90, 0x3C, 0x40, 0, 0, 0, 0};
+	struct MIDIEventCursor cursor;
+	struct MIDIEvent event;
+	midi_parse_initCursor(&cursor, bad_status, sizeof(bad_status));
+	CHECK(midi_parse_nextEvent(&cursor, &event) < 0 && cursor.pos == bad_status, "orphan data byte accepted\n");
+	midi_parse_initCursor(&cursor, bad_delta, sizeof(bad_delta));
+	CHECK(midi_parse_nextEvent(&cursor, &event) < 0, "five-byte delta-time accepted\n");
+}
+
+/*	midi_vlq_scanTrack must find the same events as walking the track with
+	midi_parse_varSize and midi_parse_getEventStateful, and so must the cursor.	*/
+static void test_vlq_scanTrack(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	for (int cntr = 0; cntr < midiFile.num_blocks; cntr++)
+	{
+		struct MIDIBlock * block = &(midiFile.blockArr[cntr]);
+		if (strncmp("MTrk", (char *) block->header, 4)) continue;
+
+		int max_events = block->n_data_size / 2 + 1;
+		uint32_t * deltas = malloc(sizeof(uint32_t) * max_events);
+		uint32_t * offsets = malloc(sizeof(uint32_t) * max_events);
+		uint32_t * lengths = malloc(sizeof(uint32_t) * max_events);
+
+		int scanned;
+		int n = midi_vlq_scanTrack(block->data, block->n_data_size,
+			deltas, offsets, lengths, max_events, &scanned);
+		CHECK(scanned == block->n_data_size, "%s block %d: scanned %d of %d bytes\n",
+			filename, cntr, scanned, block->n_data_size);
+
+		struct MIDIParseState state;
+		midi_parse_initState(&state);
+		struct MIDIEventCursor cursor;
+		struct MIDIEvent next;
+		midi_parse_initCursor(&cursor, block->data, block->n_data_size);
+		unsigned char buffer[1 << 16];
+		int pos = 0;
+		for (int event = 0; event < n; event++)
+		{
+			int delta, consumed;
+			pos += midi_parse_varSize(&block->data[pos], &delta);
+			midi_parse_getEventStateful(&state, buffer, sizeof(buffer), &block->data[pos], &consumed);
+			CHECK(deltas[event] == (uint32_t) delta && offsets[event] == (uint32_t) pos &&
+				lengths[event] == (uint32_t) consumed,
+				"%s block %d event %d: expected %d@%d+%d, got %u@%u+%u\n", filename, cntr, event,
+				delta, pos, consumed, deltas[event], offsets[event], lengths[event]);
+			pos += consumed;
+
+			CHECK(midi_parse_nextEvent(&cursor, &next) == 1 && next.delta == (uint32_t) delta &&
+				next.status == buffer[0] && cursor.pos == &block->data[pos],
+				"%s block %d event %d: the cursor disagrees\n", filename, cntr, event);
+		}
+		CHECK(midi_parse_nextEvent(&cursor, &next) == 0, "%s block %d: the cursor didn't stop\n", filename, cntr);
+
+		free(deltas);
+		free(offsets);
+		free(lengths);
+	}
+
+	unmap_midi_file(&midiFile);
+}
+
+/*	The merged stream must contain every event exactly once, in (tick, track) order.	*/
+static void test_merge(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	struct MIDIMerge merge;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_merge_init(&merge, &timeline);
+
+	int total = 0;
+	for (int track = 0; track < timeline.num_tracks; track++)
+	{
+		total += timeline.tracks[track].num_events;
+	}
+
+	int merged = 0, track, index, prev_track = -1, prev_index = -1;
+	uint32_t prev_tick = 0;
+	while (midi_merge_next(&merge, &track, &index))
+	{
+		uint32_t tick = timeline.tracks[track].tick[index];
+		CHECK(tick > prev_tick || (tick == prev_tick && (track > prev_track ||
+			(track == prev_track && index == prev_index + 1))),
+			"%s: event %d of track %d (tick %u) out of order\n", filename, index, track, tick);
+		prev_tick = tick;
+		prev_track = track;
+		prev_index = index;
+		merged++;
+	}
+	CHECK(merged == total, "%s: merged %d of %d events\n", filename, merged, total);
+
+	/*	Seeking to a tick must pick up exactly where a full merge would be.	*/
+	uint32_t seek_tick = prev_tick / 2;
+	int skipped = 0;
+	for (track = 0; track < timeline.num_tracks; track++)
+	{
+		for (index = 0; index < timeline.tracks[track].num_events; index++)
+		{
+			skipped += (timeline.tracks[track].tick[index] < seek_tick);
+		}
+	}
+	midi_merge_seek(&merge, seek_tick);
+	merged = 0;
+	while (midi_merge_next(&merge, &track, &index))
+	{
+		CHECK(timeline.tracks[track].tick[index] >= seek_tick, "%s: event before the seek\n", filename);
+		merged++;
+	}
+	CHECK(merged == total - skipped, "%s: %d events after seeking to tick %u, expected %d\n",
+		filename, merged, seek_tick, total - skipped);
+
+	midi_merge_free(&merge);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	Collects what the streaming parser hands out, to compare with the timeline.	*/
+struct StreamTestState
+{
+	const struct MIDITimeline *	timeline;
+	const char *				filename;
+	int							track;
+	int							index;
+	uint32_t					payload_seen;
+};
+
+static void stream_test_event(void * ctx, const struct MIDIStreamEvent * event)
+{
+	struct StreamTestState * test = ctx;
+	if (event->track != test->track)
+	{
+		test->track = event->track;
+		test->index = 0;
+	}
+	if (test->track >= test->timeline->num_tracks)
+	{
+		CHECK(0, "%s: unexpected track %d\n", test->filename, test->track);
+		return;
+	}
+
+	const struct MIDITrackEvents * events = &(test->timeline->tracks[test->track]);
+	int index = test->index;
+	if (index >= events->num_events)
+	{
+		CHECK(0, "%s track %d: more events than the timeline\n", test->filename, test->track);
+		return;
+	}
+	CHECK(event->tick == events->tick[index] && event->status == events->status[index] &&
+		event->data1 == events->data1[index] && event->data2 == events->data2[index] &&
+		event->length == events->payload_len[index] &&
+		(event->payload_len == 0 || !memcmp(event->payload,
+			&(events->payload[events->payload_off[index] + event->payload_offset]), event->payload_len)),
+		"%s track %d event %d differs from the timeline\n", test->filename, test->track, index);
+
+	if (event->payload_offset + event->payload_len == event->length)
+	{
+		test->index++;
+	}
+}
+
+/*	A cache file must map back to the same timeline and tempo map, and only
+	for the exact source file it was built from.	*/
+static void test_cache(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDICacheKey key;
+	CHECK(midi_cache_keyFromFd(fd, &key), "%s: no key\n", filename);
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_tempo_build(&midiFile, &timeline, &tempoMap);
+
+	char dir[] = "/tmp/all_tests_cacheXXXXXX";
+	char path[4096];
+	CHECK(mkdtemp(dir) != NULL && midi_cache_path(dir, &key, path, sizeof(path)), "no cache directory\n");
+	CHECK(midi_cache_write(path, &key, &midiFile, &timeline, &tempoMap), "%s: write failed\n", filename);
+
+	struct MIDICache cache;
+	CHECK(midi_cache_open(path, &key, &cache), "%s: cache missed\n", filename);
+	CHECK(cache.header && cache.header->format == midiFile.format && cache.header->division == midiFile.division &&
+		cache.timeline.num_tracks == timeline.num_tracks && cache.tempoMap.num_changes == tempoMap.num_changes &&
+		!memcmp(cache.tempoMap.changes, tempoMap.changes, sizeof(struct MIDITempoChange) * tempoMap.num_changes),
+		"%s: header or tempo map differs\n", filename);
+	for (int track = 0; track < timeline.num_tracks && track < cache.timeline.num_tracks; track++)
+	{
+		struct MIDITrackEvents * a = &(timeline.tracks[track]);
+		struct MIDITrackEvents * b = &(cache.timeline.tracks[track]);
+		size_t n = a->num_events;
+		CHECK(a->num_events == b->num_events && a->payload_size == b->payload_size &&
+			!memcmp(a->tick, b->tick, sizeof(uint32_t) * n) && !memcmp(a->status, b->status, n) &&
+			!memcmp(a->data1, b->data1, n) && !memcmp(a->data2, b->data2, n) &&
+			!memcmp(a->payload_off, b->payload_off, sizeof(uint32_t) * n) &&
+			!memcmp(a->payload_len, b->payload_len, sizeof(uint32_t) * n) &&
+			!memcmp(a->payload, b->payload, a->payload_size) &&
+			(uintptr_t) b->tick % MIDI_CACHE_ALIGN == 0, "%s track %d: cached events differ\n", filename, track);
+	}
+	midi_cache_close(&cache);
+
+	/*	A touched source file, or a truncated cache, is a miss.	*/
+	struct MIDICacheKey touched = key;
+	touched.mtime_nsec++;
+	CHECK(!midi_cache_open(path, &touched, &cache) && cache.map_base == NULL, "%s: stale cache used\n", filename);
+	CHECK(truncate(path, 200) == 0 && !midi_cache_open(path, &key, &cache), "%s: truncated cache used\n", filename);
+
+	unlink(path);
+	rmdir(dir);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	Pushing a file in slices of any size must produce the same events as
+	compiling it, and a file cut short must be reported as such.	*/
+static void test_stream(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+
+	/*	The mapping is contiguous, from the MThd header to the end of the file.	*/
+	const unsigned char * bytes = midiFile.map_base;
+	size_t size = midiFile.map_size;
+
+	for (int pass = 0; pass < 3; pass++)
+	{
+		struct StreamTestState test = {&timeline, filename, -1, 0, 0};
+		struct MIDIStream stream;
+		midi_stream_init(&stream, stream_test_event, &test);
+
+		/*	One byte at a time, then random slices, then everything at once.	*/
+		size_t pos = 0;
+		while (pos < size)
+		{
+			size_t n = (pass == 0) ? 1 : (pass == 1) ? 1 + rng() % 700 : size;
+			n = (n < size - pos) ? n : size - pos;
+			CHECK(midi_stream_push(&stream, &bytes[pos], n) == 0, "%s: push failed: %s\n",
+				filename, stream.error);
+			pos += n;
+		}
+		CHECK(midi_stream_finish(&stream) == 0, "%s: finish failed: %s\n", filename, stream.error);
+		CHECK(stream.tracks_seen == timeline.num_tracks, "%s: %d tracks streamed, %d compiled\n",
+			filename, stream.tracks_seen, timeline.num_tracks);
+	}
+
+	struct StreamTestState test = {&timeline, filename, -1, 0, 0};
+	struct MIDIStream stream;
+	midi_stream_init(&stream, stream_test_event, &test);
+	midi_stream_push(&stream, bytes, size - 1);
+	CHECK(midi_stream_finish(&stream) < 0, "%s: a truncated stream was accepted\n", filename);
+
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	Pool tasks: each one bumps a counter, and the outer ones also submit and
+	wait on inner tasks of their own.	*/
+struct PoolTestArg
+{
+	struct MIDIPool *	pool;
+	int *				counter;
+};
+
+static void pool_inner_task(void * arg)
+{
+	__atomic_fetch_add(((struct PoolTestArg *) arg)->counter, 1, __ATOMIC_RELAXED);
+}
+
+static void pool_outer_task(void * arg)
+{
+	struct PoolTestArg * test = arg;
+	int group = 0;
+	for (int cntr = 0; cntr < 10; cntr++)
+	{
+		midi_pool_submit(test->pool, &group, pool_inner_task, test);
+	}
+	midi_pool_wait(test->pool, &group);
+	__atomic_fetch_add(test->counter, 1, __ATOMIC_RELAXED);
+}
+
+/*	Every task must run exactly once, nested waits included.	*/
+static void test_pool(void)
+{
+	struct MIDIPool pool;
+	midi_pool_init(&pool, 4);
+
+	int counter = 0, group = 0;
+	struct PoolTestArg arg = {&pool, &counter};
+	for (int cntr = 0; cntr < 1000; cntr++)
+	{
+		midi_pool_submit(&pool, &group, pool_outer_task, &arg);
+	}
+	midi_pool_wait(&pool, &group);
+	CHECK(counter == 11000, "expected 11000 tasks to run, %d did\n", counter);
+
+	midi_pool_destroy(&pool);
+}
+
+/*	Decoding tracks on a pool must give exactly what a serial decode gives.
+	The tracks are large enough to clear MIDI_TIMELINE_PARALLEL_MIN_BYTES.	*/
+static void test_timeline_parallel(void)
+{
+	enum { NUM_TRACKS = 5, TRACK_SIZE = 96 * 1024 };
+	unsigned char mthd[] = {0x00, 0x01, 0x00, NUM_TRACKS, 0x00, 0x60};
+	struct MIDIBlock blocks[NUM_TRACKS + 1];
+	memset(blocks, 0, sizeof(blocks));
+	memcpy(blocks[0].header, "MThd", 4);
+	blocks[0].n_data_size = sizeof(mthd);
+	blocks[0].data = mthd;
+
+	for (int track = 1; track <= NUM_TRACKS; track++)
+	{
+		unsigned char * data = malloc(TRACK_SIZE);
+		int pos = 0;
+		while (pos < TRACK_SIZE - 8)
+		{
+			/*	Random deltas, and running status every other event.	*/
+			data[pos++] = rng() & 0x7F;
+			if (pos & 1) data[pos++] = 0x90 | (track & 0x0F);
+			data[pos++] = rng() & 0x7F;
+			data[pos++] = rng() & 0x7F;
+		}
+		memcpy(&data[pos], "\x00\xFF\x2F\x00", 4);
+		memcpy(blocks[track].header, "MTrk", 4);
+		blocks[track].n_data_size = pos + 4;
+		blocks[track].data = data;
+	}
+
+	struct MIDIFile midiFile = {0};
+	midiFile.num_blocks = NUM_TRACKS + 1;
+	midiFile.blockArr = blocks;
+
+	struct MIDIPool pool;
+	midi_pool_init(&pool, 3);
+	struct MIDITimeline serial, parallel;
+	struct MIDIArena arena;
+	midi_arena_init(&arena, 0);
+	CHECK(midi_timeline_compile(&midiFile, &serial, NULL) == NUM_TRACKS, "serial decode failed\n");
+
+	/*	Plain, and with every array in an arena.	*/
+	for (int pass = 0; pass < 2; pass++)
+	{
+		struct MIDIArena * owner = pass ? &arena : NULL;
+		CHECK(midi_timeline_compileParallel(&midiFile, &parallel, &pool, owner) == NUM_TRACKS,
+			"parallel decode %d failed\n", pass);
+
+		for (int track = 0; track < serial.num_tracks && track < parallel.num_tracks; track++)
+		{
+			struct MIDITrackEvents * a = &(serial.tracks[track]);
+			struct MIDITrackEvents * b = &(parallel.tracks[track]);
+			size_t n = a->num_events;
+			CHECK(a->num_events == b->num_events && a->num_events > 0 &&
+				!memcmp(a->tick, b->tick, n * sizeof(uint32_t)) && !memcmp(a->status, b->status, n) &&
+				!memcmp(a->data1, b->data1, n) && !memcmp(a->data2, b->data2, n),
+				"track %d differs between serial and parallel decoding %d\n", track, pass);
+		}
+		midi_timeline_free(&parallel);
+	}
+	midi_pool_destroy(&pool);
+	CHECK(arena.peak > 0 && arena.peak <= arena.reserved, "arena peak %zu, reserved %zu\n",
+		arena.peak, arena.reserved);
+
+	midi_arena_free(&arena);
+	midi_timeline_free(&serial);
+	for (int track = 1; track <= NUM_TRACKS; track++)
+	{
+		free(blocks[track].data);
+	}
+}
+
+/*	Released memory must be handed out again, without asking malloc() for more,
+	and marks must nest.	*/
+static void test_arena(void)
+{
+	struct MIDIArena arena;
+	midi_arena_init(&arena, 4096);
+
+	size_t sizes[200];
+	for (int cntr = 0; cntr < 200; cntr++)
+	{
+		sizes[cntr] = 1 + rng() % 3000;
+	}
+
+	size_t reserved = 0;
+	for (int round = 0; round < 3; round++)
+	{
+		struct MIDIArenaMark mark = midi_arena_mark(&arena);
+		unsigned char * first = midi_arena_alloc(&arena, 100);
+		for (int cntr = 0; cntr < 200; cntr++)
+		{
+			unsigned char * p = midi_arena_alloc(&arena, sizes[cntr]);
+			CHECK(p != NULL && ((uintptr_t) p % MIDI_ARENA_ALIGN) == 0, "misaligned allocation\n");
+		}
+		unsigned char * big = midi_arena_alloc(&arena, 100000);
+		CHECK(big != NULL, "large allocation failed\n");
+		memset(big, 0xAA, 100000);
+
+		/*	A nested mark releases only what came after it.	*/
+		struct MIDIArenaMark inner = midi_arena_mark(&arena);
+		size_t in_use = arena.in_use;
+		midi_arena_alloc(&arena, 5000);
+		midi_arena_release(&arena, inner);
+		CHECK(arena.in_use == in_use, "nested release left %zu bytes, expected %zu\n", arena.in_use, in_use);
+
+		midi_arena_release(&arena, mark);
+		CHECK(arena.in_use == 0, "release left %zu bytes in use\n", arena.in_use);
+		CHECK(midi_arena_alloc(&arena, 100) == first, "released memory wasn't reused\n");
+		midi_arena_reset(&arena);
+
+		/*	Later rounds fit in what the first one reserved.	*/
+		CHECK(round == 0 || arena.reserved == reserved, "round %d reserved %zu more bytes\n",
+			round, arena.reserved - reserved);
+		reserved = arena.reserved;
+	}
+	CHECK(arena.peak > 0 && arena.peak <= reserved, "peak %zu, reserved %zu\n", arena.peak, reserved);
+
+	midi_arena_free(&arena);
+	CHECK(arena.first == NULL && arena.reserved == 0, "freed arena wasn't zeroed\n");
+}
+
+/*	Lays out an MThd and a single MTrk in file, and indexes them. file must
+	have room for 22 + mtrk_size bytes; release the result with unmap_midi_file().	*/
+static struct MIDIFile make_midi_file(unsigned char * file, const unsigned char * mthd,
+	const unsigned char * mtrk, int mtrk_size)
+{
+	memcpy(file, "MThd\0\0\0\6", 8);
+	memcpy(&file[8], mthd, 6);
+	memcpy(&file[14], "MTrk", 4);
+	file[18] = mtrk_size >> 24;
+	file[19] = mtrk_size >> 16;
+	file[20] = mtrk_size >> 8;
+	file[21] = mtrk_size;
+	memcpy(&file[22], mtrk, mtrk_size);
+
+	struct MIDIFile midiFile = {0};
+	CHECK(index_midi_chunks(file, 22 + mtrk_size, &midiFile) == 2, "couldn't index a valid file\n");
+	return midiFile;
+}
+
+/*	Number of tracks in make_wide_timeline(): one more than a uint16_t holds.	*/
+#define WIDE_TRACKS 65537
+
+/*	Sets a track of channel events, from one array per field.	*/
+static void set_track(struct MIDITrackEvents * events, int num_events, const uint32_t * tick,
+	const uint8_t * status, const uint8_t * data1, const uint8_t * data2)
+{
+	events->num_events = num_events;
+	events->tick = malloc(num_events * sizeof(uint32_t));
+	events->status = malloc(num_events);
+	events->data1 = malloc(num_events);
+	events->data2 = malloc(num_events);
+	events->payload_off = calloc(num_events, sizeof(uint32_t));
+	events->payload_len = calloc(num_events, sizeof(uint32_t));
+	memcpy(events->tick, tick, num_events * sizeof(uint32_t));
+	memcpy(events->status, status, num_events);
+	memcpy(events->data1, data1, num_events);
+	memcpy(events->data2, data2, num_events);
+}
+
+/*	Sets a track of one note on channel 1.	*/
+static void set_track_pair(struct MIDITrackEvents * events, uint32_t tick, uint32_t length, uint8_t key)
+{
+	const uint32_t ticks[] = {tick, tick + length};
+	const uint8_t status[] = {0x90, 0x80}, data1[] = {key, key}, data2[] = {100, 0};
+	set_track(events, 2, ticks, status, data1, data2);
+}
+
+/*	A timeline of WIDE_TRACKS tracks, all empty but the first, holding key
+	60 from tick 0 to 10, and the last, holding key 64 from tick 20 to 30.
+	Track numbers that wrap at 16 bits land on the wrong one of the two.	*/
+static void make_wide_timeline(struct MIDITimeline * timeline)
+{
+	timeline->num_tracks = WIDE_TRACKS;
+	timeline->tracks = calloc(WIDE_TRACKS, sizeof(struct MIDITrackEvents));
+	timeline->arena = NULL;
+	set_track_pair(&(timeline->tracks[0]), 0, 10, 60);
+	set_track_pair(&(timeline->tracks[WIDE_TRACKS - 1]), 20, 10, 64);
+}
+
+/*	Big-endian reads, and the meta decoders built on them, must stop at the
+	end of their buffer.	*/
+static void test_bytes(void)
+{
+	unsigned char data[] = {0x12, 0x34, 0x56, 0x78, 0x9A};
+	CHECK(midi_bytes_be16(data) == 0x1234 && midi_bytes_be24(data) == 0x123456 &&
+		midi_bytes_be32(&data[1]) == 0x3456789A, "wrong big-endian value\n");
+
+	struct MIDIBytes bytes;
+	midi_bytes_init(&bytes, data, sizeof(data));
+	CHECK(midi_bytes_readU8(&bytes) == 0x12 && midi_bytes_readBE32(&bytes) == 0x3456789A && !bytes.overrun,
+		"cursor read the wrong values\n");
+	CHECK(midi_bytes_readBE16(&bytes) == 0 && bytes.overrun, "read past the end wasn't flagged\n");
+	midi_bytes_init(&bytes, data, sizeof(data));
+	CHECK(midi_bytes_skip(&bytes, 6) == NULL && midi_bytes_readU8(&bytes) == 0 && bytes.overrun,
+		"overrun wasn't sticky\n");
+
+	uint32_t usec;
+	unsigned char tempo[] = {0x07, 0xA1, 0x20};
+	CHECK(midi_parse_tempo(tempo, 3, &usec) && usec == 500000, "tempo decoded as %u\n", usec);
+	CHECK(!midi_parse_tempo(tempo, 2, &usec) && !midi_parse_tempo(tempo, 4, &usec),
+		"tempo of the wrong length accepted\n");
+
+	struct MIDITimeSignature timeSignature;
+	unsigned char signature[] = {0x06, 0x03, 0x18, 0x08};
+	CHECK(midi_parse_timeSignature(signature, 4, &timeSignature) && timeSignature.numerator == 6 &&
+		timeSignature.denominator == 8 && timeSignature.clocks_per_click == 24 && timeSignature.notated_32nds == 8,
+		"time signature decoded as %d/%d\n", timeSignature.numerator, timeSignature.denominator);
+	CHECK(!midi_parse_timeSignature(signature, 3, &timeSignature), "short time signature accepted\n");
+
+	/*	01100001: 30 fps, hour 1.	*/
+	struct MIDISMPTEOffset offset;
+	unsigned char smpte[] = {0x61, 0x02, 0x03, 0x04, 0x05};
+	CHECK(midi_parse_smpteOffset(smpte, 5, &offset) && offset.frames_per_second == 30 && offset.hours == 1 &&
+		offset.minutes == 2 && offset.seconds == 3 && offset.frames == 4 && offset.subframes == 5,
+		"SMPTE offset decoded wrong\n");
+	smpte[0] = 0x41;
+	CHECK(midi_parse_smpteOffset(smpte, 5, &offset) && offset.frames_per_second == 29.97f, "wrong frame rate\n");
+	CHECK(!midi_parse_smpteOffset(smpte, 4, &offset), "short SMPTE offset accepted\n");
+}
+
+/*	The chunk index must decode the MThd, and reject anything it can't trust.	*/
+static void test_chunk_index(void)
+{
+	unsigned char mthd[] = {0x00, 0x01, 0x00, 0x01, 0x00, 0x60};
+	unsigned char mtrk[] = {0x00, 0xFF, 0x2F, 0x00};
+	unsigned char file[64];
+
+	struct MIDIFile midiFile = make_midi_file(file, mthd, mtrk, sizeof(mtrk));
+	CHECK(midiFile.format == 1 && midiFile.num_tracks == 1 && midiFile.division == 96,
+		"decoded format %d, %d tracks, division %d\n", midiFile.format, midiFile.num_tracks, midiFile.division);
+	CHECK(midiFile.blockArr[1].offset == 22 && midiFile.blockArr[1].n_data_size == 4 &&
+		midiFile.blockArr[1].data == &file[22], "MTrk indexed at the wrong place\n");
+	unmap_midi_file(&midiFile);
+
+	/*	Stray bytes after the last chunk are ignored.	*/
+	CHECK(index_midi_chunks(file, 22 + sizeof(mtrk) + 3, &midiFile) == 2, "stray bytes rejected the file\n");
+	unmap_midi_file(&midiFile);
+
+	/*	A chunk running past the end of the file rejects it.	*/
+	CHECK(index_midi_chunks(file, 22 + sizeof(mtrk) - 1, &midiFile) < 0 && midiFile.num_blocks == 0,
+		"truncated chunk accepted\n");
+
+	/*	So do a missing MThd, an unknown format and a zero division.	*/
+	file[0] = 'X';
+	CHECK(index_midi_chunks(file, 22 + sizeof(mtrk), &midiFile) < 0, "missing MThd accepted\n");
+	file[0] = 'M';
+	file[9] = 3;
+	CHECK(index_midi_chunks(file, 22 + sizeof(mtrk), &midiFile) < 0, "format 3 accepted\n");
+	file[9] = 1;
+	file[12] = file[13] = 0;
+	CHECK(index_midi_chunks(file, 22 + sizeof(mtrk), &midiFile) < 0, "division 0 accepted\n");
+}
+
+/*	Ticks must convert using the MThd division and every FF 51 event.	*/
+static void test_tempo_map(void)
+{
+	/*	480 ticks per quarter note.	*/
+	unsigned char mthd[] = {0x00, 0x00, 0x00, 0x01, 0x01, 0xE0};
+	unsigned char mtrk[] =
+	{
+		0x00, 0x90, 0x3C, 0x40,								/*	Note on at tick 0	*/
+		0x83, 0x60, 0xFF, 0x51, 0x03, 0x0F, 0x42, 0x40,		/*	Tick 480: 1 s per quarter	*/
+		0x83, 0x60, 0x80, 0x3C, 0x00,						/*	Note off at tick 960	*/
+		0x00, 0xFF, 0x2F, 0x00
+	};
+	unsigned char file[22 + sizeof(mtrk)];
+	struct MIDIFile midiFile = make_midi_file(file, mthd, mtrk, sizeof(mtrk));
+
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	CHECK(midi_tempo_build(&midiFile, &timeline, &tempoMap) == 2, "expected two tempo changes\n");
+
+	int hint = 0;
+	CHECK(midi_tempo_tickToNs(&tempoMap, &hint, 240) == 250000000ull, "tick 240 != 0.25 s\n");
+	CHECK(midi_tempo_tickToNs(&tempoMap, &hint, 480) == 500000000ull, "tick 480 != 0.5 s\n");
+	CHECK(midi_tempo_tickToNs(&tempoMap, &hint, 960) == 1500000000ull, "tick 960 != 1.5 s\n");
+	CHECK(midi_tempo_tickToNs(&tempoMap, &hint, 0) == 0, "going backwards didn't restart\n");
+
+	CHECK(midi_tempo_nsToTick(&tempoMap, 250000000ull) == 240, "0.25 s != tick 240\n");
+	CHECK(midi_tempo_nsToTick(&tempoMap, 1500000000ull) == 960, "1.5 s != tick 960\n");
+	CHECK(midi_tempo_nsToTick(&tempoMap, 1500000000ull - 1) == 959, "just before 1.5 s != tick 959\n");
+
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+
+	/*	Many tempo changes, visited in random order: the hint must never
+		change the result, and every tick must survive the round trip.	*/
+	midi_tempo_init(&tempoMap, 96);
+	uint32_t tick = 0;
+	for (int cntr = 0; cntr < 200; cntr++)
+	{
+		tick += 1 + rng() % 500;
+		midi_tempo_append(&tempoMap, tick, 100000 + rng() % 1000000);
+	}
+	hint = 0;
+	for (int cntr = 0; cntr < 5000; cntr++)
+	{
+		uint32_t probe = rng() % (tick + 1000);
+		int fresh = 0;
+		uint64_t ns = midi_tempo_tickToNs(&tempoMap, &hint, probe);
+		CHECK(ns == midi_tempo_tickToNs(&tempoMap, &fresh, probe), "tick %u depends on the hint\n", probe);
+		CHECK(midi_tempo_nsToTick(&tempoMap, ns) == probe, "tick %u didn't round trip\n", probe);
+	}
+	midi_tempo_free(&tempoMap);
+
+	/*	Tracks streamed one after the other hand over their tempo changes out
+		of order: the map must come out as if they had arrived sorted.	*/
+	static const uint32_t sorted[][2] = {{0, 400000}, {96, 300000}, {192, 600000}, {480, 250000}};
+	static const uint32_t shuffled[][2] = {{192, 600000}, {480, 250000}, {0, 400000}, {96, 700000}, {96, 300000}};
+	struct MIDITempoMap expected;
+	midi_tempo_init(&expected, 96);
+	midi_tempo_init(&tempoMap, 96);
+	for (int cntr = 0; cntr < 4; cntr++)
+	{
+		midi_tempo_append(&expected, sorted[cntr][0], sorted[cntr][1]);
+	}
+	for (int cntr = 0; cntr < 5; cntr++)
+	{
+		midi_tempo_append(&tempoMap, shuffled[cntr][0], shuffled[cntr][1]);
+	}
+	CHECK(tempoMap.num_changes == expected.num_changes && !memcmp(tempoMap.changes, expected.changes,
+		sizeof(struct MIDITempoChange) * expected.num_changes), "out-of-order tempo changes misplaced\n");
+	midi_tempo_free(&expected);
+	midi_tempo_free(&tempoMap);
+}
+
+static void test_smpte(void)
+{
+	struct MIDISMPTEOffset smpte;
+
+	/*	25 fps: one hour, two minutes, three seconds, four frames and a half.	*/
+	uint64_t ns = 3723000000000ull + 4 * 40000000ull + 20000000ull;
+	midi_tempo_nsToSmpte(ns, 25, &smpte);
+	CHECK(smpte.hours == 1 && smpte.minutes == 2 && smpte.seconds == 3 && smpte.frames == 4 &&
+		smpte.subframes == 50, "25 fps: got %02d:%02d:%02d:%02d.%02d\n",
+		smpte.hours, smpte.minutes, smpte.seconds, smpte.frames, smpte.subframes);
+	CHECK(midi_tempo_smpteToNs(&smpte) == ns, "25 fps didn't round trip\n");
+
+	/*	Drop-frame: frame 1800 is 00:01:00;02, frame 17982 is 00:10:00;00.	*/
+	midi_tempo_nsToSmpte(1800 * 1000000000ull / 29.97 + 1, 29.97f, &smpte);
+	CHECK(smpte.minutes == 1 && smpte.seconds == 0 && smpte.frames == 2,
+		"frame 1800: got %02d:%02d;%02d\n", smpte.minutes, smpte.seconds, smpte.frames);
+	midi_tempo_nsToSmpte(17982 * 1000000000ull / 29.97 + 1, 29.97f, &smpte);
+	CHECK(smpte.minutes == 10 && smpte.seconds == 0 && smpte.frames == 0,
+		"frame 17982: got %02d:%02d;%02d\n", smpte.minutes, smpte.seconds, smpte.frames);
+
+	static const float rates[] = {24, 25, 29.97f, 30};
+	for (int cntr = 0; cntr < 4000; cntr++)
+	{
+		float rate = rates[cntr % 4];
+		struct MIDISMPTEOffset back;
+		ns = ((uint64_t) rng() << 16) % (86400ull * 1000000000ull);
+		midi_tempo_nsToSmpte(ns, rate, &smpte);
+		midi_tempo_nsToSmpte(midi_tempo_smpteToNs(&smpte), rate, &back);
+		CHECK(midi_tempo_smpteToNs(&smpte) <= ns && smpte.hours == back.hours && smpte.minutes == back.minutes &&
+			smpte.seconds == back.seconds && smpte.frames == back.frames && smpte.subframes == back.subframes,
+			"%.2f fps: %llu ns didn't round trip\n", rate, (unsigned long long) ns);
+	}
+}
+
+static int same_state(const struct MIDISeekState * a, const struct MIDISeekState * b)
+{
+	for (int cntr = 0; cntr < 16; cntr++)
+	{
+		const struct MIDIChannelState * x = &(a->channel[cntr]);
+		const struct MIDIChannelState * y = &(b->channel[cntr]);
+		if (memcmp(x->controller, y->controller, 128) || x->program != y->program ||
+			x->pitch_bend != y->pitch_bend || memcmp(x->notes, y->notes, sizeof(x->notes)))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*	The state found through the checkpoints must be the one left by playing
+	every event up to the tick.	*/
+static void test_seek_index(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	struct MIDISeekIndex seekIndex;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	CHECK(midi_seek_build(&timeline, 37, &seekIndex) > 0, "%s: couldn't build the seek index\n", filename);
+
+	for (int track = 0; track < timeline.num_tracks; track++)
+	{
+		const struct MIDITrackEvents * events = &(timeline.tracks[track]);
+		if (events->num_events == 0)
+		{
+			continue;
+		}
+		uint32_t last = events->tick[events->num_events - 1];
+		for (int probe = 0; probe < 20; probe++)
+		{
+			uint32_t tick = rng() % (last + 2);
+			struct MIDISeekState seeked, replayed;
+			int next = midi_seek_trackStateAt(&seekIndex, &timeline, track, tick, &seeked);
+
+			midi_seek_initState(&replayed);
+			int index = 0;
+			for (; index < events->num_events && events->tick[index] < tick; index++)
+			{
+				midi_seek_apply(&replayed, events, index);
+			}
+			CHECK(next == index, "%s: track %d, tick %u: next event %d, expected %d\n",
+				filename, track, tick, next, index);
+			CHECK(same_state(&seeked, &replayed), "%s: track %d, tick %u: wrong state\n", filename, track, tick);
+		}
+	}
+
+	midi_seek_free(&seekIndex);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	A jump turns off what is sounding, then restores the destination's state.	*/
+/*	Two tracks setting the same channel: whichever set a value last wins,
+	not whichever track comes last, and a reset counts as setting.	*/
+static void test_seek_tracks(void)
+{
+	const uint32_t ticks0[] = {10, 100, 5000};
+	const uint8_t status0[] = {0xC0, 0xB0, 0xB0}, data1_0[] = {3, 10, 7}, data2_0[] = {0, 1, 100};
+	const uint32_t ticks1[] = {0, 0, 0, 100, 7000};
+	const uint8_t status1[] = {0xB0, 0xC0, 0xE0, 0xB0, 0xB0}, data1_1[] = {7, 7, 0x00, 10, 121},
+		data2_1[] = {20, 0, 0x50, 2, 0};
+
+	struct MIDITimeline timeline = {2, calloc(2, sizeof(struct MIDITrackEvents)), NULL};
+	set_track(&(timeline.tracks[0]), 3, ticks0, status0, data1_0, data2_0);
+	set_track(&(timeline.tracks[1]), 5, ticks1, status1, data1_1, data2_1);
+	struct MIDISeekIndex seekIndex;
+	midi_seek_build(&timeline, 2, &seekIndex);
+
+	struct MIDISeekState state;
+	midi_seek_stateAt(&seekIndex, &timeline, 6000, &state);
+	const struct MIDIChannelState * channel = &(state.channel[0]);
+	CHECK(channel->controller[7] == 100 && channel->controller[10] == 2 && channel->program == 3 &&
+		channel->pitch_bend == 0x50 << 7, "at tick 6000: volume %d, pan %d, program %d, bend %04X\n",
+		channel->controller[7], channel->controller[10], channel->program, channel->pitch_bend);
+	midi_seek_stateAt(&seekIndex, &timeline, 8000, &state);
+	CHECK(channel->controller[7] == MIDI_SEEK_UNSET && channel->pitch_bend == MIDI_SEEK_BEND_UNSET &&
+		channel->program == 3, "the reset at tick 7000 wasn't kept\n");
+
+	/*	The same as playing the merged tracks up to there.	*/
+	const uint32_t probes[] = {0, 1, 11, 100, 101, 5000, 5001, 7000, 7001};
+	for (int probe = 0; probe < (int) (sizeof(probes) / sizeof(probes[0])); probe++)
+	{
+		struct MIDISeekState replayed;
+		struct MIDIMerge merge;
+		int track, index;
+		midi_seek_initState(&replayed);
+		midi_merge_init(&merge, &timeline);
+		while (midi_merge_next(&merge, &track, &index) && timeline.tracks[track].tick[index] < probes[probe])
+		{
+			midi_seek_apply(&replayed, &(timeline.tracks[track]), index);
+		}
+		midi_merge_free(&merge);
+		midi_seek_stateAt(&seekIndex, &timeline, probes[probe], &state);
+		CHECK(same_state(&state, &replayed), "tick %u: wrong state\n", probes[probe]);
+	}
+
+	midi_seek_free(&seekIndex);
+	midi_timeline_free(&timeline);
+}
+
+static void test_seek_jump(void)
+{
+	unsigned char mthd[] = {0x00, 0x00, 0x00, 0x01, 0x00, 0x60};
+	unsigned char mtrk[] =
+	{
+		0x00, 0xC1, 0x05,				/*	Program 5 on channel 2	*/
+		0x00, 0xB1, 0x07, 0x50,			/*	Volume 80	*/
+		0x00, 0x91, 0x3C, 0x40,			/*	Note on	*/
+		0x60, 0x81, 0x3C, 0x00,			/*	Note off at tick 96	*/
+		0x00, 0xB1, 0x07, 0x20,			/*	Volume 32	*/
+		0x00, 0xFF, 0x2F, 0x00
+	};
+	unsigned char file[22 + sizeof(mtrk)];
+	struct MIDIFile midiFile = make_midi_file(file, mthd, mtrk, sizeof(mtrk));
+
+	struct MIDITimeline timeline;
+	struct MIDISeekIndex seekIndex;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_seek_build(&timeline, 2, &seekIndex);
+
+	/*	Play up to the note on, then jump back to tick 1.	*/
+	struct MIDISeekState live;
+	midi_seek_initState(&live);
+	for (int index = 0; index < 3; index++)
+	{
+		midi_seek_apply(&live, &(timeline.tracks[0]), index);
+	}
+
+	struct MIDIOutput output;
+	midi_output_init(&output, -1, 0);
+	CHECK(midi_seek_jump(&seekIndex, &timeline, &live, 1, &output), "the jump failed\n");
+
+	const unsigned char expected[] =
+	{
+		0x81, 0x3C, 0x40,				/*	Note off	*/
+		0xB1, 0x79, 0x00,				/*	Reset all controllers	*/
+		0xC1, 0x05,
+		0xB1, 0x07, 0x50
+	};
+	CHECK(output.size == sizeof(expected) && !memcmp(output.buffer, expected, sizeof(expected)),
+		"queued %zu bytes, expected %zu\n", output.size, sizeof(expected));
+	CHECK(live.channel[1].controller[7] == 0x50 && live.channel[1].notes[1] == 0,
+		"the live state wasn't updated\n");
+
+	/*	Jumping to the end brings the last volume, and nothing to turn off.	*/
+	output.size = 0;
+	midi_seek_jump(&seekIndex, &timeline, &live, 200, &output);
+	CHECK(output.size == 8 && output.buffer[7] == 0x20, "jump to the end queued %zu bytes\n", output.size);
+
+	midi_output_free(&output);
+	midi_seek_free(&seekIndex);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	Every event pushed comes out of the player, in order: pushed all at once
+	and already due, they wrap the ring whenever the file is large enough.	*/
+static void test_player(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_tempo_build(&midiFile, &timeline, &tempoMap);
+
+	struct MIDIScheduler scheduler;
+	struct MIDIOutput output;
+	struct MIDIMerge merge;
+	struct MIDISeekState live, expected;
+	midi_sched_start(&scheduler, &tempoMap);
+	midi_output_init(&output, -1, 0);
+	midi_merge_init(&merge, &timeline);
+	midi_seek_initState(&live);
+	midi_seek_initState(&expected);
+
+	struct MIDIPlayer player;
+	CHECK(midi_player_start(&player, &timeline, &scheduler, &output, &live, 0), "%s: couldn't start\n", filename);
+
+	unsigned long pushed = 0, channel_events = 0;
+	int track, index;
+	while (midi_merge_next(&merge, &track, &index))
+	{
+		midi_player_push(&player, 0, track, index);
+		midi_seek_apply(&expected, &(timeline.tracks[track]), index);
+		channel_events += (timeline.tracks[track].status[index] != MIDI_STATUS_META);
+		pushed++;
+	}
+	midi_player_finish(&player);
+
+	CHECK(player.events == pushed, "%s: %lu of %lu events played\n", filename, player.events, pushed);
+	CHECK(output.events == channel_events, "%s: %lu of %lu events written\n", filename, output.events, channel_events);
+	CHECK(same_state(&live, &expected), "%s: the events were played out of order\n", filename);
+	CHECK(player.depth_max <= MIDI_PLAYER_RING_SIZE, "%s: ring depth %lu\n", filename, player.depth_max);
+
+	midi_player_free(&player);
+	midi_merge_free(&merge);
+	midi_output_free(&output);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	Overlapping notes, a note struck again, velocity 0 as note off, an
+	unmatched note off, and a note left held.	*/
+static void test_notes(void)
+{
+	unsigned char mthd[] = {0x00, 0x00, 0x00, 0x01, 0x00, 0x60};
+	unsigned char mtrk[] =
+	{
+		0x00, 0x90, 0x3C, 0x64,			/*	60 on channel 1	*/
+		0x00, 0x91, 0x3C, 0x50,			/*	60 on channel 2, never released	*/
+		0x0A, 0x90, 0x40, 0x46,			/*	64, over 60	*/
+		0x0A, 0x80, 0x3C, 0x00,			/*	60 off at tick 20	*/
+		0x0A, 0x90, 0x40, 0x3C,			/*	64 again at tick 30, ending the first	*/
+		0x0A, 0x90, 0x40, 0x00,			/*	Velocity 0: 64 off at tick 40	*/
+		0x0A, 0x81, 0x3E, 0x00,			/*	Off for a note never played	*/
+		0x0A, 0xFF, 0x2F, 0x00			/*	End of track at tick 60	*/
+	};
+	unsigned char file[22 + sizeof(mtrk)];
+	struct MIDIFile midiFile = make_midi_file(file, mthd, mtrk, sizeof(mtrk));
+
+	struct MIDITimeline timeline;
+	struct MIDINoteTable notes;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	CHECK(midi_notes_build(&timeline, NULL, &notes) == 4, "found %d notes\n", notes.num_notes);
+
+	const struct
+	{
+		uint32_t start, duration;
+		uint8_t key, velocity, channel, flags;
+	} expected[] =
+	{
+		{0, 20, 60, 100, 0, 0},
+		{0, 60, 60, 80, 1, MIDI_NOTE_UNTERMINATED},
+		{10, 20, 64, 70, 0, 0},
+		{30, 10, 64, 60, 0, 0}
+	};
+	for (int row = 0; row < notes.num_notes && row < 4; row++)
+	{
+		CHECK(notes.start[row] == expected[row].start && notes.duration[row] == expected[row].duration &&
+			notes.key[row] == expected[row].key && notes.velocity[row] == expected[row].velocity &&
+			notes.channel[row] == expected[row].channel && notes.flags[row] == expected[row].flags &&
+			notes.track[row] == 0, "note %d: tick %u for %u, key %d, velocity %d, channel %d, flags %d\n",
+			row, notes.start[row], notes.duration[row], notes.key[row], notes.velocity[row],
+			notes.channel[row], notes.flags[row]);
+	}
+	CHECK(notes.num_unterminated == 1, "%d unterminated notes\n", notes.num_unterminated);
+
+	midi_notes_free(&notes);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+
+	/*	Track numbers past 65535 must come out whole.	*/
+	make_wide_timeline(&timeline);
+	CHECK(midi_notes_build(&timeline, NULL, &notes) == 2, "found %d notes\n", notes.num_notes);
+	CHECK(notes.track[0] == 0 && notes.track[1] == WIDE_TRACKS - 1 && notes.key[1] == 64,
+		"notes on tracks %d and %d\n", notes.track[0], notes.track[1]);
+	midi_notes_free(&notes);
+	midi_timeline_free(&timeline);
+}
+
+/*	Statistics of a small track, worked out by hand: at 120 bpm and 96
+	ticks per quarter, 96 ticks are half a second.	*/
+static void test_stats(void)
+{
+	unsigned char mthd[] = {0x00, 0x00, 0x00, 0x01, 0x00, 0x60};
+	unsigned char mtrk[] =
+	{
+		0x00, 0x90, 0x3C, 0x64,			/*	Note on 60	*/
+		0x00, 0x90, 0x40, 0x50,			/*	Note on 64	*/
+		0x30, 0x90, 0x3C, 0x5A,			/*	60 again at 0.25 s, ending the first	*/
+		0x30, 0x80, 0x40, 0x00,			/*	64 off at 0.5 s	*/
+		0x00, 0x90, 0x43, 0x00,			/*	Note off for a note never played	*/
+		0x00, 0xB1, 0x07, 0x32,			/*	Volume on channel 2	*/
+		0x60, 0xFF, 0x2F, 0x00			/*	End of track at 1 s, 60 still held	*/
+	};
+	unsigned char file[22 + sizeof(mtrk)];
+	struct MIDIFile midiFile = make_midi_file(file, mthd, mtrk, sizeof(mtrk));
+
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	struct MIDIStats stats;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_tempo_build(&midiFile, &timeline, &tempoMap);
+	CHECK(midi_stats_compute(&timeline, &tempoMap, NULL, &stats), "computing the statistics failed\n");
+
+	CHECK(stats.events == 7 && stats.channel_events == 6, "%llu events, %llu channel events\n",
+		(unsigned long long) stats.events, (unsigned long long) stats.channel_events);
+	CHECK(stats.by_type[0x9] == 4 && stats.by_type[0x8] == 1 && stats.by_type[0xB] == 1,
+		"wrong counts by type\n");
+	CHECK(stats.notes == 3 && stats.unterminated == 1, "%llu notes, %llu unterminated\n",
+		(unsigned long long) stats.notes, (unsigned long long) stats.unterminated);
+	CHECK(stats.pitch[0][60] == 2 && stats.pitch[0][64] == 1 && stats.pitch[0][67] == 0, "wrong pitches\n");
+	CHECK(stats.velocity[0][100] == 1 && stats.velocity[0][90] == 1 && stats.velocity[0][80] == 1,
+		"wrong velocities\n");
+	CHECK(stats.controller[1][7] == 1, "the volume change wasn't counted\n");
+
+	/*	250, 500 and 750 ms.	*/
+	CHECK(stats.note_duration[7] == 1 && stats.note_duration[8] == 1 && stats.note_duration[9] == 1,
+		"wrong note durations\n");
+	CHECK(stats.duration_sum_ns == 1500000000ull && stats.duration_max_ns == 750000000ull,
+		"note time %llu ns, longest %llu ns\n", (unsigned long long) stats.duration_sum_ns,
+		(unsigned long long) stats.duration_max_ns);
+	CHECK(stats.max_polyphony == 2 && stats.avg_polyphony > 1.499 && stats.avg_polyphony < 1.501,
+		"polyphony %d max, %f average\n", stats.max_polyphony, stats.avg_polyphony);
+	CHECK(stats.num_seconds == 2 && stats.per_second[0] == 6 && stats.per_second[1] == 0 && stats.peak_density == 6,
+		"wrong density\n");
+
+	/*	One JSON object on one line.	*/
+	char * text = NULL;
+	size_t size;
+	FILE * out = open_memstream(&text, &size);
+	midi_stats_write(out, MIDI_STATS_JSON, "a \"b\".mid", &stats);
+	fclose(out);
+	CHECK(!strncmp(text, "{\"file\":\"a \\\"b\\\".mid\",\"events\":7,", 32) && strchr(text, '\n') == text + size - 1,
+		"unexpected JSON: %s", text);
+	free(text);
+
+	midi_stats_free(&stats);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+
+	/*	A note on some 136 years in: the density stops at a day, with
+		everything later counted in its last second.	*/
+	unsigned char slow_mthd[] = {0x00, 0x00, 0x00, 0x01, 0x00, 0x01};
+	unsigned char slow_mtrk[] =
+	{
+		0x00, 0xFF, 0x51, 0x03, 0xF4, 0x24, 0x01,	/*	16 s per quarter, one tick per quarter	*/
+		0xFF, 0xFF, 0xFF, 0x7F, 0x90, 0x3C, 0x40,	/*	Note on 0x0FFFFFFF ticks in	*/
+		0x00, 0xFF, 0x2F, 0x00
+	};
+	unsigned char slow_file[22 + sizeof(slow_mtrk)];
+	midiFile = make_midi_file(slow_file, slow_mthd, slow_mtrk, sizeof(slow_mtrk));
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_tempo_build(&midiFile, &timeline, &tempoMap);
+	CHECK(midi_stats_compute(&timeline, &tempoMap, NULL, &stats), "computing the statistics failed\n");
+	CHECK(stats.num_seconds == MIDI_STATS_MAX_SECONDS && stats.per_second[MIDI_STATS_MAX_SECONDS - 1] == 1 &&
+		stats.duration > 4e9, "%d seconds of density over %.0f s\n", stats.num_seconds, stats.duration);
+	midi_stats_free(&stats);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	The statistics and notes of a real file add up, and the statistics are
+	the same from an arena.	*/
+static void test_stats_file(const char * filename)
 {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_tempo_build(&midiFile, &timeline, &tempoMap);
+
+	struct MIDIArena arena;
+	struct MIDIStats stats, fromArena;
+	midi_arena_init(&arena, 0);
+	midi_stats_compute(&timeline, &tempoMap, NULL, &stats);
+	midi_stats_compute(&timeline, &tempoMap, &arena, &fromArena);
+
+	uint64_t pitches = 0, durations = 0, density = 0;
+	for (int channel = 0; channel < 16; channel++)
+	{
+		for (int key = 0; key < 128; key++)
+		{
+			pitches += stats.pitch[channel][key];
+		}
+	}
+	for (int bucket = 0; bucket < MIDI_STATS_DURATION_BUCKETS; bucket++)
+	{
+		durations += stats.note_duration[bucket];
+	}
+	for (int second = 0; second < stats.num_seconds; second++)
+	{
+		density += stats.per_second[second];
+	}
+	CHECK(pitches == stats.notes && durations == stats.notes, "%s: %llu notes, %llu pitches, %llu durations\n",
+		filename, (unsigned long long) stats.notes, (unsigned long long) pitches, (unsigned long long) durations);
+	CHECK(density == stats.channel_events, "%s: density adds up to %llu\n", filename, (unsigned long long) density);
+	CHECK(stats.notes == 0 || (stats.max_polyphony >= 1 && stats.avg_polyphony >= 1.0 &&
+		stats.avg_polyphony <= stats.max_polyphony), "%s: polyphony %d max, %f average\n",
+		filename, stats.max_polyphony, stats.avg_polyphony);
+	CHECK(!memcmp(stats.pitch, fromArena.pitch, sizeof(stats.pitch)) &&
+		stats.max_polyphony == fromArena.max_polyphony && stats.duration_sum_ns == fromArena.duration_sum_ns &&
+		!memcmp(stats.per_second, fromArena.per_second, sizeof(uint32_t) * stats.num_seconds),
+		"%s: different statistics from an arena\n", filename);
+
+	/*	Every note on makes one note, inside its track, in order of start.	*/
+	struct MIDINoteTable notes;
+	midi_notes_build(&timeline, &arena, &notes);
+	int ordered = 1;
+	for (int row = 0; row < notes.num_notes; row++)
+	{
+		const struct MIDITrackEvents * events = &(timeline.tracks[notes.track[row]]);
+		ordered &= (notes.start[row] + notes.duration[row] <= events->tick[events->num_events - 1]);
+		ordered &= (row == 0 || notes.track[row] != notes.track[row - 1] || notes.start[row] >= notes.start[row - 1]);
+	}
+	CHECK((uint64_t) notes.num_notes == stats.notes && notes.num_unterminated == (int) stats.unterminated,
+		"%s: %d notes in the table, %llu counted\n", filename, notes.num_notes, (unsigned long long) stats.notes);
+	CHECK(ordered, "%s: notes out of order, or past the end of their track\n", filename);
+	midi_notes_free(&notes);
 
+	midi_stats_free(&fromArena);
+	midi_stats_free(&stats);
+	midi_arena_free(&arena);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
 }
 
+/*	Queries over random windows and filters find exactly what a scan of
+	every event finds, in time order.	*/
+static void test_query(const char * filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "[SKIP: %s] Couldn't open %s\n", __func__, filename);
+		return;
+	}
+	struct MIDIFile midiFile = map_midi_file(fd, NULL);
+	close(fd);
+
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	struct MIDIQueryIndex queryIndex;
+	midi_timeline_compile(&midiFile, &timeline, NULL);
+	midi_tempo_build(&midiFile, &timeline, &tempoMap);
+	int num_events = midi_query_build(&timeline, &tempoMap, NULL, &queryIndex);
+
+	int total = 0;
+	for (int track = 0; track < timeline.num_tracks; track++)
+	{
+		total += timeline.tracks[track].num_events;
+	}
+	CHECK(num_events == total, "%s: indexed %d of %d events\n", filename, num_events, total);
+
+	int sorted = 1;
+	for (int position = 1; position < queryIndex.num_events; position++)
+	{
+		sorted &= (queryIndex.ns[position] >= queryIndex.ns[position - 1]);
+	}
+	CHECK(sorted, "%s: the index isn't in time order\n", filename);
+
+	uint64_t end_ns = queryIndex.num_events ? queryIndex.ns[queryIndex.num_events - 1] + 1 : 1;
+	for (int round = 0; round < 200; round++)
+	{
+		struct MIDIQuery query;
+		query.from_ns = rng() % end_ns;
+		query.to_ns = query.from_ns + rng() % (end_ns / 4 + 1);
+		query.channels = (round % 4 == 0) ? MIDI_QUERY_ALL_CHANNELS : 1u << (rng() % 16);
+		query.types = (round % 3 == 0) ? MIDI_QUERY_ALL_TYPES : rng() & 0xFF;
+
+		int expected = 0;
+		for (int position = 0; position < queryIndex.num_events; position++)
+		{
+			uint8_t status = queryIndex.status[position];
+			int channel_ok = query.channels == MIDI_QUERY_ALL_CHANNELS ||
+				(status < 0xF0 && ((query.channels >> (status & 0x0F)) & 1));
+			expected += queryIndex.ns[position] >= query.from_ns && queryIndex.ns[position] < query.to_ns &&
+				channel_ok && ((query.types >> ((status >> 4) - 8)) & 1);
+		}
+
+		struct MIDIQueryCursor cursor;
+		int position, found = 0, last = -1, inside = 1;
+		midi_query_start(&queryIndex, &query, &cursor);
+		while (midi_query_next(&cursor, &position))
+		{
+			inside &= position > last && queryIndex.ns[position] >= query.from_ns &&
+				queryIndex.ns[position] < query.to_ns;
+			last = position;
+			found++;
+		}
+		CHECK(found == expected && inside, "%s: query %d found %d events, expected %d\n",
+			filename, round, found, expected);
+	}
+
+	midi_query_free(&queryIndex);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+	unmap_midi_file(&midiFile);
+}
+
+/*	An event on track 65536 must be found there, not on track 0.	*/
+static void test_query_tracks(void)
+{
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	struct MIDIQueryIndex queryIndex;
+	make_wide_timeline(&timeline);
+	midi_tempo_init(&tempoMap, 96);
+	CHECK(midi_query_build(&timeline, &tempoMap, NULL, &queryIndex) == 4, "indexed %d events\n",
+		queryIndex.num_events);
+
+	struct MIDIQuery query = {0, UINT64_MAX, MIDI_QUERY_ALL_CHANNELS, MIDI_QUERY_ALL_TYPES};
+	struct MIDIQueryCursor cursor;
+	int position, found = 0;
+	midi_query_start(&queryIndex, &query, &cursor);
+	while (midi_query_next(&cursor, &position))
+	{
+		int track = queryIndex.track[position];
+		CHECK(track == ((found < 2) ? 0 : WIDE_TRACKS - 1) && queryIndex.index[position] == found % 2 &&
+			timeline.tracks[track].data1[found % 2] == ((found < 2) ? 60 : 64),
+			"event %d found on track %d\n", found, track);
+		found++;
+	}
+	CHECK(found == 4, "found %d events\n", found);
+
+	midi_query_free(&queryIndex);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+}
+
+/*	The output thread must play track 65536, not track 0.	*/
+static void test_player_tracks(void)
+{
+	struct MIDITimeline timeline;
+	struct MIDITempoMap tempoMap;
+	make_wide_timeline(&timeline);
+	midi_tempo_init(&tempoMap, 96);
+
+	int fds[2];
+	CHECK(pipe(fds) == 0, "couldn't open a pipe\n");
+	struct MIDIScheduler scheduler;
+	struct MIDIOutput output;
+	struct MIDIPlayer player;
+	midi_sched_start(&scheduler, &tempoMap);
+	midi_output_init(&output, fds[1], 0);
+	CHECK(midi_player_start(&player, &timeline, &scheduler, &output, NULL, 0), "couldn't start\n");
+	midi_player_push(&player, 0, WIDE_TRACKS - 1, 0);
+	midi_player_push(&player, 0, WIDE_TRACKS - 1, 1);
+	midi_player_finish(&player);
+
+	const unsigned char expected[] = {0x90, 0x40, 0x64, 0x80, 0x40, 0x00};
+	unsigned char played[sizeof(expected) + 1];
+	close(fds[1]);
+	ssize_t size = read(fds[0], played, sizeof(played));
+	CHECK(size == sizeof(expected) && !memcmp(played, expected, sizeof(expected)),
+		"played %zd bytes, starting %02X %02X\n", size, played[0], played[1]);
+	close(fds[0]);
+
+	midi_player_free(&player);
+	midi_output_free(&output);
+	midi_tempo_free(&tempoMap);
+	midi_timeline_free(&timeline);
+}
+
+/*	Two files mixed, the second a quarter of a second later and moved from
+	channel 1 to 10, come out interleaved in time.	*/
+static void test_mixer(void)
+{
+	unsigned char mthd[] = {0x00, 0x00, 0x00, 0x01, 0x00, 0x60};
+	unsigned char mtrk[] =
+	{
+		0x00, 0x90, 0x3C, 0x40,			/*	Note on	*/
+		0x60, 0x80, 0x3C, 0x00,			/*	Note off at 0.5 s	*/
+		0x00, 0xFF, 0x2F, 0x00
+	};
+	unsigned char first[22 + sizeof(mtrk)], second[22 + sizeof(mtrk)];
+	struct MIDIFile files[2] =
+	{
+		make_midi_file(first, mthd, mtrk, sizeof(mtrk)),
+		make_midi_file(second, mthd, mtrk, sizeof(mtrk))
+	};
+
+	struct MIDITimeline timelines[2];
+	struct MIDITempoMap tempoMaps[2];
+	for (int file = 0; file < 2; file++)
+	{
+		midi_timeline_compile(&(files[file]), &(timelines[file]), NULL);
+		midi_tempo_build(&(files[file]), &(timelines[file]), &(tempoMaps[file]));
+	}
+
+	uint8_t channel_map[16];
+	for (int channel = 0; channel < 16; channel++)
+	{
+		channel_map[channel] = channel;
+	}
+	channel_map[0] = 9;
+
+	struct MIDIMixer mixer;
+	midi_mixer_init(&mixer, 2);
+	CHECK(midi_mixer_addStream(&mixer, &(timelines[0]), &(tempoMaps[0]), 0, NULL) == 0 &&
+		midi_mixer_addStream(&mixer, &(timelines[1]), &(tempoMaps[1]), 250000000, channel_map) == 1 &&
+		midi_mixer_addStream(&mixer, &(timelines[1]), &(tempoMaps[1]), 0, NULL) == -1,
+		"wrong streams added\n");
+
+	const struct
+	{
+		int stream, index;
+		uint64_t ns;
+	} expected[] =
+	{
+		{0, 0, 0}, {1, 0, 250000000}, {0, 1, 500000000}, {0, 2, 500000000}, {1, 1, 750000000}, {1, 2, 750000000}
+	};
+	struct MIDIOutput output;
+	midi_output_init(&output, -1, 0);
+	int stream, track, index, found = 0;
+	uint64_t ns;
+	while (midi_mixer_next(&mixer, &stream, &track, &index, &ns))
+	{
+		CHECK(found < 6 && stream == expected[found].stream && index == expected[found].index &&
+			ns == expected[found].ns, "event %d: stream %d, index %d, at %llu ns\n",
+			found, stream, index, (unsigned long long) ns);
+		if (found < 2)
+		{
+			midi_output_queueMapped(&output, &(timelines[stream].tracks[track]), index,
+				mixer.sources[stream].channel_map);
+		}
+		found++;
+	}
+	CHECK(found == 6, "mixed %d events\n", found);
+
+	const unsigned char notes[] = {0x90, 0x3C, 0x40, 0x99, 0x3C, 0x40};
+	CHECK(output.size == sizeof(notes) && !memcmp(output.buffer, notes, sizeof(notes)),
+		"the second file wasn't moved to channel 10\n");
+
+	midi_output_free(&output);
+	midi_mixer_free(&mixer);
+	for (int file = 0; file < 2; file++)
+	{
+		midi_tempo_free(&(tempoMaps[file]));
+		midi_timeline_free(&(timelines[file]));
+		unmap_midi_file(&(files[file]));
+	}
+}
+
+/*	A timed backend that records what it is given.	*/
+struct RecordedOutput
+{
+	int			writes, starts, drains, closes;
+	uint64_t	ns[4];
+	size_t		size[4];
+	uint64_t	start_ns;
+};
+
+static int record_write(struct MIDIOutput * output, const unsigned char * bytes, size_t size, uint64_t ns)
+{
+	struct RecordedOutput * record = output->backend_data;
+	if (record->writes < 4)
+	{
+		record->ns[record->writes] = ns;
+		record->size[record->writes] = size;
+	}
+	record->writes++;
+	output->bytes += size;
+	(void) bytes;
+	return 0;
+}
+
+static int record_start(struct MIDIOutput * output, uint64_t ns)
+{
+	struct RecordedOutput * record = output->backend_data;
+	record->starts++;
+	record->start_ns = ns;
+	return 0;
+}
+
+static int record_drain(struct MIDIOutput * output)
+{
+	((struct RecordedOutput *) output->backend_data)->drains++;
+	return 0;
+}
+
+static void record_close(struct MIDIOutput * output)
+{
+	((struct RecordedOutput *) output->backend_data)->closes++;
+}
+
+/*	Flushes reach a backend with the time they are due, and empty ones
+	don't reach it at all.	*/
+static void test_output_backend(void)
+{
+	const struct MIDIOutputBackend backend =
+	{
+		.name = "record",
+		.timed = 1,
+		.write = record_write,
+		.start = record_start,
+		.drain = record_drain,
+		.close = record_close
+	};
+	struct RecordedOutput record = {0};
+	struct MIDIOutput output;
+	CHECK(midi_output_initBackend(&output, &backend, &record, 0), "couldn't open the output\n");
+
+	const unsigned char chord[] = {0x90, 0x3C, 0x40, 0x90, 0x40, 0x40};
+	midi_output_start(&output, 1000);
+	midi_output_queue(&output, chord, 3);
+	midi_output_queue(&output, &chord[3], 3);
+	midi_output_flushAt(&output, 2000);
+	midi_output_flushAt(&output, 3000);
+	midi_output_queue(&output, chord, 3);
+	midi_output_flush(&output);
+	midi_output_drain(&output);
+
+	CHECK(record.starts == 1 && record.start_ns == 1000, "the clock wasn't started\n");
+	CHECK(record.writes == 2 && record.ns[0] == 2000 && record.size[0] == 6 &&
+		record.ns[1] == MIDI_OUTPUT_NOW && record.size[1] == 3, "%d writes, the first %zu bytes at %llu\n",
+		record.writes, record.size[0], (unsigned long long) record.ns[0]);
+	CHECK(output.bytes == 9 && output.events == 3, "%lu bytes, %lu events\n", output.bytes, output.events);
+
+	midi_output_free(&output);
+	CHECK(record.drains == 1 && record.closes == 1, "drained %d times, closed %d times\n",
+		record.drains, record.closes);
+}
+
+int main(int argc, char * argv[])
+{
+	test_vlq_decode();
+	test_bytes();
+	test_cursor();
+	test_chunk_index();
+	test_tempo_map();
+	test_smpte();
+	test_seek_tracks();
+	test_seek_jump();
+	test_notes();
+	test_stats();
+	test_query_tracks();
+	test_player_tracks();
+	test_mixer();
+	test_output_backend();
+	test_pool();
+	test_arena();
+	test_timeline_parallel();
+	for (int arg = 1; arg < argc; arg++)
+	{
+		test_vlq_scanTrack(argv[arg]);
+		test_merge(argv[arg]);
+		test_seek_index(argv[arg]);
+		test_player(argv[arg]);
+		test_stats_file(argv[arg]);
+		test_query(argv[arg]);
+		test_stream(argv[arg]);
+		test_cache(argv[arg]);
+	}
+
+	printf("%s: %d failure(s)\n", argv[0], failures);
+	return failures ? 1 : 0;
+}
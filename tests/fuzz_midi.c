@@ -0,0 +1,248 @@
+/*! @file
+	Fuzzing harness for everything that reads an untrusted MIDI file: the
+	chunk index, the event decoder (through the timeline and directly), the
+	tempo map and the streaming parser.
+
+	LLVMFuzzerTestOneInput is the libFuzzer entry point; with clang,
+	make fuzz LIBFUZZER=1 builds against libFuzzer. Otherwise the main()
+	below drives it: every file given is run as is, then mutated -runs=N
+	times. Either way, the build is instrumented with AddressSanitizer and
+	UBSan, so a read past the end of the input aborts with a report; the
+	input that caused it is saved to fuzz-crash.mid.
+
+	Usage: ./fuzz_midi [-runs=N] [-seed=S] file.midi [file.midi ...]
+*/
+
+#include <portable.h>
+#include <stdint.h>
+
+#include "midi_reader.h"
+#include "midi_parse.h"
+#include "midi_timeline.h"
+#include "midi_tempo.h"
+#include "midi_stream.h"
+#include "midi_arena.h"
+#include "debug.h"
+
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+static void ignore_event(void * ctx, const struct MIDIStreamEvent * event)
+{
+	(void) ctx;
+	(void) event;
+}
+
+/*	Walks every MTrk with the cursor, which must stay within the track.	*/
+static void walk_tracks(const struct MIDIFile * midiFile)
+{
+	for (int cntr = 0; cntr < midiFile->num_blocks; cntr++)
+	{
+		const struct MIDIBlock * block = &(midiFile->blockArr[cntr]);
+		if (memcmp(block->header, "MTrk", 4))
+		{
+			continue;
+		}
+
+		struct MIDIEventCursor cursor;
+		struct MIDIEvent event;
+		midi_parse_initCursor(&cursor, block->data, block->n_data_size);
+		while (midi_parse_nextEvent(&cursor, &event) > 0)
+		{
+			if (cursor.pos > cursor.end || (event.payload != NULL && event.payload + event.length > cursor.end))
+			{
+				abort();
+			}
+		}
+	}
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+	/*	A copy of exactly size bytes, so that reading one byte past the end
+		is caught.	*/
+	unsigned char * copy = malloc(size ? size : 1);
+	if (copy == NULL)
+	{
+		return 0;
+	}
+	memcpy(copy, data, size);
+
+	struct MIDIFile midiFile = {0};
+	if (index_midi_chunks(copy, size, &midiFile) > 0)
+	{
+		walk_tracks(&midiFile);
+
+		struct MIDITimeline timeline;
+		struct MIDITempoMap tempoMap;
+		if (midi_timeline_compile(&midiFile, &timeline, NULL) >= 0)
+		{
+			if (midi_tempo_build(&midiFile, &timeline, &tempoMap) > 0)
+			{
+				int hint = 0;
+				midi_tempo_tickToNs(&tempoMap, &hint, UINT32_MAX);
+				midi_tempo_free(&tempoMap);
+			}
+			midi_timeline_free(&timeline);
+		}
+
+		struct MIDIArena arena;
+		midi_arena_init(&arena, 0);
+		if (midi_timeline_compile(&midiFile, &timeline, &arena) >= 0)
+		{
+			midi_timeline_free(&timeline);
+		}
+		midi_arena_free(&arena);
+	}
+	unmap_midi_file(&midiFile);
+
+	/*	The streaming parser, in two slices split somewhere in the middle.	*/
+	struct MIDIStream stream;
+	midi_stream_init(&stream, ignore_event, NULL);
+	if (midi_stream_push(&stream, copy, size / 3) == 0)
+	{
+		midi_stream_push(&stream, copy + size / 3, size - size / 3);
+	}
+	midi_stream_finish(&stream);
+
+	free(copy);
+	return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+
+#define FUZZ_RUNS 10000
+#define FUZZ_MAX_SIZE (1 << 20)
+
+static uint32_t rng_state = 0x2545F491;
+static uint32_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+/*	Input being run, saved by crash_callback if it brings the harness down.	*/
+static const unsigned char * current_input;
+static size_t current_size;
+
+static void crash_callback(void)
+{
+	FILE * file = fopen("fuzz-crash.mid", "wb");
+	if (file != NULL)
+	{
+		fwrite(current_input, 1, current_size, file);
+		fclose(file);
+		fprintf(stderr, "Input saved to fuzz-crash.mid\n");
+	}
+}
+
+static void run_input(const unsigned char * data, size_t size)
+{
+	current_input = data;
+	current_size = size;
+	LLVMFuzzerTestOneInput(data, size);
+}
+
+/*	Applies a few random edits, of the kinds most likely to confuse a
+	parser: bit flips, boundary values, truncation and repeated spans.
+	Returns the new size.	*/
+static size_t mutate(unsigned char * data, size_t size, size_t capacity)
+{
+	static const unsigned char interesting[] = {0x00, 0x01, 0x7F, 0x80, 0x81, 0xF0, 0xF7, 0xFF};
+
+	int edits = 1 + rng() % 4;
+	for (int cntr = 0; cntr < edits && size > 0; cntr++)
+	{
+		size_t at = rng() % size;
+		switch (rng() % 5)
+		{
+			case 0:
+				data[at] ^= 1 << (rng() % 8);
+				break;
+			case 1:
+				data[at] = interesting[rng() % sizeof(interesting)];
+				break;
+			case 2:
+				/*	A chunk length or VLQ run: four bytes at once.	*/
+				for (size_t byte = at; byte < size && byte < at + 4; byte++)
+				{
+					data[byte] = interesting[rng() % sizeof(interesting)];
+				}
+				break;
+			case 3:
+				size = at + 1;
+				break;
+			case 4:
+			{
+				size_t len = 1 + rng() % 16;
+				len = (len < size - at) ? len : size - at;
+				if (size + len <= capacity)
+				{
+					memmove(&data[at + len], &data[at], size - at);
+					size += len;
+				}
+				break;
+			}
+		}
+	}
+	return size;
+}
+
+int main(int argc, char * argv[])
+{
+	long runs = FUZZ_RUNS;
+	log_level = LOG_LEVEL_NONE;
+#ifdef __SANITIZE_ADDRESS__
+	__sanitizer_set_death_callback(crash_callback);
+#endif
+
+	unsigned char * input = malloc(FUZZ_MAX_SIZE);
+	unsigned char * mutant = malloc(FUZZ_MAX_SIZE);
+	if (input == NULL || mutant == NULL)
+	{
+		fprintf(stderr, "Couldn't allocate the input buffers\n");
+		return 1;
+	}
+
+	long total = 0;
+	for (int arg = 1; arg < argc; arg++)
+	{
+		if (!strncmp("-runs=", argv[arg], 6))
+		{
+			runs = atol(&argv[arg][6]);
+			continue;
+		}
+		if (!strncmp("-seed=", argv[arg], 6))
+		{
+			rng_state = (uint32_t) strtoul(&argv[arg][6], NULL, 0) | 1;
+			continue;
+		}
+
+		FILE * file = fopen(argv[arg], "rb");
+		if (file == NULL)
+		{
+			fprintf(stderr, "Couldn't open %s\n", argv[arg]);
+			continue;
+		}
+		size_t size = fread(input, 1, FUZZ_MAX_SIZE / 2, file);
+		fclose(file);
+
+		run_input(input, size);
+		for (long run = 0; run < runs; run++)
+		{
+			memcpy(mutant, input, size);
+			run_input(mutant, mutate(mutant, size, FUZZ_MAX_SIZE));
+		}
+		total += runs + 1;
+	}
+
+	printf("%s: %ld inputs, no crashes\n", argv[0], total);
+	free(input);
+	free(mutant);
+	return 0;
+}
+
+#endif